@@ -0,0 +1,278 @@
+/**
+* Throughput benchmarks of the sampler kernels (Google Benchmark).
+*
+* Every benchmark reports items_per_second: tokens per second for the
+* table sampler, calc_f_k and full sweeps, tables per second for the dish
+* sampler and calc_dish_posterior_t. Synthetic cases are named
+* <kernel>/D/V/doc_length/topics; the Reuters cases use the corpus at
+* $MICROSCOPES_LDA_REUTERS (test/data/reuters.ldac by default) and are
+* skipped when it cannot be read.
+*
+* For machine-readable results run e.g.
+*
+*   bench_kernels --benchmark_format=json
+*   bench_kernels --benchmark_out=results.json --benchmark_out_format=json
+*/
+#include "synthetic_corpus.hpp"
+
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/corpus_io.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+using namespace microscopes;
+using namespace microscopes::lda;
+
+namespace {
+
+const float alpha = 0.5, beta = 0.1, gamma = 1.0;
+const size_t burn_in = 2;
+
+// A state that went through a few sweeps, so tables and dishes exist
+std::unique_ptr<state>
+prepared_state(const corpus &docs, size_t initial_dishes, common::rng_t &rng)
+{
+    size_t V = 0;
+    for (size_t eid = 0; eid < docs.ndocs(); ++eid)
+        for (auto w : docs.doc(eid))
+            V = std::max<size_t>(V, w + 1);
+    std::unique_ptr<state> s(new state(model_definition(docs.ndocs(), V),
+        alpha, beta, gamma, initial_dishes, docs, rng));
+    kernels::lda_crp::workspace ws;
+    for (size_t i = 0; i < burn_in; ++i)
+        kernels::lda_crp_gibbs(*s, ws, rng);
+    return s;
+}
+
+corpus
+synthetic(const benchmark::State &st)
+{
+    return bench::synthetic_corpus(bench::make_spec(
+        st.range(0), st.range(1), st.range(2), st.range(3)));
+}
+
+const corpus *
+reuters()
+{
+    static std::unique_ptr<corpus> docs;
+    static bool tried = false;
+    if (!tried) {
+        tried = true;
+        const char *path = std::getenv("MICROSCOPES_LDA_REUTERS");
+        try {
+            docs.reset(new corpus(load_ldac(path ? path : MICROSCOPES_LDA_REUTERS)));
+        } catch (const std::exception &e) {
+            std::cerr << "Reuters benchmarks skipped: " << e.what() << std::endl;
+        }
+    }
+    return docs.get();
+}
+
+void
+report(benchmark::State &st, const state &s)
+{
+    st.counters["topics"] = s.ntopics();
+}
+
+// Position of the next token, wrapping around the corpus
+struct token_cursor {
+    size_t eid = 0, i = 0;
+
+    void
+    next(const state &s)
+    {
+        if (++i < s.nterms(eid))
+            return;
+        i = 0;
+        do {
+            eid = (eid + 1) % s.nentities();
+        } while (s.nterms(eid) == 0);
+    }
+};
+
+void
+run_sampling_t(benchmark::State &st, const corpus &docs, size_t initial_dishes)
+{
+    common::rng_t rng(0);
+    auto s = prepared_state(docs, initial_dishes, rng);
+    kernels::lda_crp::workspace ws;
+    token_cursor at;
+    for (auto _ : st) {
+        kernels::lda_crp::sampling_t(*s, at.eid, at.i, ws, rng);
+        at.next(*s);
+    }
+    st.SetItemsProcessed(st.iterations());
+    report(st, *s);
+}
+
+void
+run_calc_f_k(benchmark::State &st, const corpus &docs, size_t initial_dishes)
+{
+    common::rng_t rng(0);
+    auto s = prepared_state(docs, initial_dishes, rng);
+    kernels::lda_crp::workspace ws;
+    token_cursor at;
+    for (auto _ : st) {
+        kernels::lda_crp::calc_f_k(*s, s->get_word(at.eid, at.i), ws);
+        benchmark::DoNotOptimize(ws.f_k.data());
+        at.next(*s);
+    }
+    st.SetItemsProcessed(st.iterations());
+    report(st, *s);
+}
+
+// Visits the real tables of every document in turn; sampling_k does not
+// create or delete tables, so the list stays valid
+template <typename F>
+void
+run_per_table(benchmark::State &st, const corpus &docs, size_t initial_dishes, F f)
+{
+    common::rng_t rng(0);
+    auto s = prepared_state(docs, initial_dishes, rng);
+    kernels::lda_crp::workspace ws;
+    std::vector<std::pair<size_t, size_t>> tables;
+    for (size_t eid = 0; eid < s->nentities(); ++eid)
+        for (auto t : s->tables(eid))
+            if (t != 0)
+                tables.push_back(std::make_pair(eid, t));
+    size_t next = 0;
+    for (auto _ : st) {
+        f(*s, tables[next].first, tables[next].second, ws, rng);
+        if (++next == tables.size())
+            next = 0;
+    }
+    st.SetItemsProcessed(st.iterations());
+    report(st, *s);
+}
+
+void
+run_sampling_k(benchmark::State &st, const corpus &docs, size_t initial_dishes)
+{
+    run_per_table(st, docs, initial_dishes,
+        [](state &s, size_t eid, size_t t, kernels::lda_crp::workspace &ws, common::rng_t &rng) {
+            kernels::lda_crp::sampling_k(s, eid, t, ws, rng);
+        });
+}
+
+void
+run_calc_dish_posterior_t(benchmark::State &st, const corpus &docs, size_t initial_dishes)
+{
+    run_per_table(st, docs, initial_dishes,
+        [](state &s, size_t eid, size_t t, kernels::lda_crp::workspace &ws, common::rng_t &) {
+            kernels::lda_crp::calc_dish_posterior_t(s, eid, t, ws);
+            benchmark::DoNotOptimize(ws.p_k.data());
+        });
+}
+
+void
+run_sweep(benchmark::State &st, const corpus &docs, size_t initial_dishes, size_t nthreads)
+{
+    common::rng_t rng(0);
+    auto s = prepared_state(docs, initial_dishes, rng);
+    kernels::lda_crp::workspace ws;
+    for (auto _ : st) {
+        if (nthreads > 1)
+            kernels::lda_crp_gibbs(*s, rng, nthreads);
+        else
+            kernels::lda_crp_gibbs(*s, ws, rng);
+    }
+    st.SetItemsProcessed(st.iterations() * docs.ntokens());
+    report(st, *s);
+}
+
+void
+run_block_sweep(benchmark::State &st, const corpus &docs, size_t initial_dishes,
+                size_t block_size, size_t nthreads)
+{
+    common::rng_t rng(0);
+    auto s = prepared_state(docs, initial_dishes, rng);
+    kernels::lda_crp_block::workspace ws;
+    for (auto _ : st)
+        kernels::lda_crp_block_gibbs(*s, ws, rng, block_size, nthreads);
+    st.SetItemsProcessed(st.iterations() * docs.ntokens());
+    report(st, *s);
+}
+
+// Synthetic cases: D, V, doc_length, topics; initial_dishes = topics
+void
+synthetic_args(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"D", "V", "len", "K"});
+    b->Args({500, 1000, 100, 10});
+    b->Args({500, 5000, 100, 50});
+    b->Args({2000, 10000, 200, 100});
+}
+
+#define MICROSCOPES_LDA_BENCH_KERNEL(name)                               \
+    void BM_##name(benchmark::State &st)                                 \
+    {                                                                    \
+        run_##name(st, synthetic(st), st.range(3));                      \
+    }                                                                    \
+    BENCHMARK(BM_##name)->Apply(synthetic_args);
+
+MICROSCOPES_LDA_BENCH_KERNEL(sampling_t)
+MICROSCOPES_LDA_BENCH_KERNEL(sampling_k)
+MICROSCOPES_LDA_BENCH_KERNEL(calc_f_k)
+MICROSCOPES_LDA_BENCH_KERNEL(calc_dish_posterior_t)
+
+void
+BM_lda_crp_gibbs(benchmark::State &st)
+{
+    run_sweep(st, synthetic(st), st.range(3), 1);
+}
+BENCHMARK(BM_lda_crp_gibbs)->Apply(synthetic_args)->Unit(benchmark::kMillisecond);
+
+void
+BM_lda_crp_block_gibbs(benchmark::State &st)
+{
+    run_block_sweep(st, synthetic(st), st.range(3), 256, 1);
+}
+BENCHMARK(BM_lda_crp_block_gibbs)->Apply(synthetic_args)->Unit(benchmark::kMillisecond);
+
+void
+register_reuters()
+{
+    const corpus *docs = reuters();
+    if (!docs)
+        return;
+    const size_t initial_dishes = 20;
+    benchmark::RegisterBenchmark("BM_reuters_sampling_t", [docs](benchmark::State &st) {
+        run_sampling_t(st, *docs, initial_dishes);
+    });
+    benchmark::RegisterBenchmark("BM_reuters_sampling_k", [docs](benchmark::State &st) {
+        run_sampling_k(st, *docs, initial_dishes);
+    });
+    benchmark::RegisterBenchmark("BM_reuters_calc_f_k", [docs](benchmark::State &st) {
+        run_calc_f_k(st, *docs, initial_dishes);
+    });
+    benchmark::RegisterBenchmark("BM_reuters_calc_dish_posterior_t", [docs](benchmark::State &st) {
+        run_calc_dish_posterior_t(st, *docs, initial_dishes);
+    });
+    benchmark::RegisterBenchmark("BM_reuters_lda_crp_gibbs", [docs](benchmark::State &st) {
+        run_sweep(st, *docs, initial_dishes, st.range(0));
+    })->ArgName("threads")->Arg(1)->Arg(4)->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark("BM_reuters_lda_crp_block_gibbs", [docs](benchmark::State &st) {
+        run_block_sweep(st, *docs, initial_dishes, 256, st.range(0));
+    })->ArgName("threads")->Arg(1)->Arg(4)->Unit(benchmark::kMillisecond);
+}
+
+} // namespace
+
+int
+main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    register_reuters();
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
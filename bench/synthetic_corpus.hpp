@@ -0,0 +1,77 @@
+#pragma once
+
+#include <microscopes/lda/corpus.hpp>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+namespace bench {
+
+// Shape of a synthetic corpus; see synthetic_corpus()
+struct corpus_spec {
+    size_t ndocs;
+    size_t nwords;
+    size_t doc_length; //!< mean number of words per document
+    size_t ntopics;    //!< number of topics the documents are drawn from
+    float alpha;       //!< symmetric Dirichlet prior of the document mixtures
+    float beta;        //!< symmetric Dirichlet prior of the topics
+    unsigned seed;
+};
+
+inline corpus_spec
+make_spec(size_t ndocs, size_t nwords, size_t doc_length, size_t ntopics)
+{
+    return corpus_spec{ndocs, nwords, doc_length, ntopics, 0.1f, 0.01f, 0};
+}
+
+/**
+* Documents drawn from the LDA generative process: spec.ntopics topics
+* phi_k ~ Dirichlet(beta), a mixture theta_d ~ Dirichlet(alpha) per
+* document, Poisson(doc_length) words per document (at least one), so
+* the sampler sees realistic topic structure rather than uniform noise.
+* The same spec always gives the same corpus.
+*/
+inline std::vector<std::vector<size_t>>
+synthetic_docs(const corpus_spec &spec)
+{
+    std::mt19937 gen(spec.seed);
+    auto dirichlet = [&gen](size_t n, float a) {
+        std::gamma_distribution<double> g(a, 1.0);
+        std::vector<double> p(n);
+        for (auto &x : p)
+            x = g(gen);
+        // Tiny concentrations can round every draw to 0
+        if (std::all_of(p.begin(), p.end(), [](double x) { return x == 0; }))
+            p[std::uniform_int_distribution<size_t>(0, n - 1)(gen)] = 1;
+        return p;
+    };
+
+    std::vector<std::discrete_distribution<size_t>> topics;
+    for (size_t k = 0; k < spec.ntopics; ++k) {
+        auto phi = dirichlet(spec.nwords, spec.beta);
+        topics.emplace_back(phi.begin(), phi.end());
+    }
+    std::poisson_distribution<size_t> length(spec.doc_length);
+    std::vector<std::vector<size_t>> docs(spec.ndocs);
+    for (auto &doc : docs) {
+        auto theta = dirichlet(spec.ntopics, spec.alpha);
+        std::discrete_distribution<size_t> mixture(theta.begin(), theta.end());
+        doc.resize(std::max<size_t>(1, length(gen)));
+        for (auto &w : doc)
+            w = topics[mixture(gen)](gen);
+    }
+    return docs;
+}
+
+inline corpus
+synthetic_corpus(const corpus_spec &spec)
+{
+    return corpus(synthetic_docs(spec));
+}
+
+} // namespace bench
+} // namespace lda
+} // namespace microscopes
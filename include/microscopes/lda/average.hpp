@@ -0,0 +1,129 @@
+#pragma once
+
+#include <microscopes/lda/model.hpp>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Running average of the topic-word (phi) and document-topic (theta)
+* distributions of a state over the samples of a chain, as snapshot
+* computes them, without keeping the samples.
+*
+* Call update() once per iteration: the first burnin calls are skipped
+* and after that every thin-th one is added. Topics are dish ids, in
+* increasing order; a dish's phi is averaged over the samples it was
+* active in and theta over all samples, counting zero for the samples a
+* dish was not active in. An id that is reused after its dish died keeps
+* accumulating, so the average of a topic that died and was reborn mixes
+* both.
+*
+* The sums only hold the non-zero counts of each sample: the smoothing of
+* phi is one sum per dish and the dish prior of theta one row per distinct
+* document length (documents whose length at the topics changes between
+* samples get a row of their own). With min_weight > 0, count entries
+* whose running mean falls below min_weight are dropped, trading that
+* much accuracy per entry for memory; 0 keeps the averages exact.
+*/
+class posterior_average {
+public:
+    explicit posterior_average(size_t burnin = 0, size_t thin = 1, float min_weight = 0);
+
+    inline size_t burnin() const { return burnin_; }
+
+    inline size_t thin() const { return thin_; }
+
+    inline float min_weight() const { return min_weight_; }
+
+    // Calls of update() so far
+    inline size_t nupdates() const { return nupdates_; }
+
+    // Samples in the averages
+    inline size_t nsamples() const { return nsamples_; }
+
+    // Dish ids of the topics, increasing
+    inline const std::vector<size_t> &dishes() const { return topics_; }
+
+    inline size_t ntopics() const { return topics_.size(); }
+
+    inline size_t nwords() const { return V_; }
+
+    inline size_t ndocs() const { return D_; }
+
+    /**
+    * Count one iteration of the chain, adding the state to the averages
+    * if it is past the burn-in and on the thinning interval. Returns
+    * whether it was added.
+    */
+    bool update(const state &s);
+
+    /**
+    * Add the state to the averages. All samples must have the same
+    * documents and vocabulary; reset() after adding or retiring documents.
+    */
+    void add(const state &s);
+
+    // Forget all samples and start counting iterations from zero
+    void reset();
+
+    // Count entries held in the sums, a measure of their memory
+    size_t nentries() const;
+
+    // Average phi, ntopics() x nwords(), topic major
+    void phi(float *out) const;
+
+    // Average theta, ndocs() x ntopics(), document major; rows sum to one
+    // unless min_weight dropped entries
+    void theta(float *out) const;
+
+private:
+    typedef std::vector<std::pair<size_t, double>> sparse_row;
+
+    struct entry {
+        size_t key;   //!< Word of phi, dish of theta
+        size_t since; //!< Sample the entry appeared in
+        double sum;
+    };
+
+    typedef std::vector<entry> sum_row;
+
+    // Add the sorted entries of add to sum as sample n, dropping the sums
+    // below min_weight per sample since they appeared
+    void merge(sum_row &sum, const sparse_row &add, size_t n);
+
+    size_t burnin_;
+    size_t thin_;
+    float min_weight_;
+    size_t nupdates_;
+    size_t nsamples_;
+    size_t V_;
+    size_t D_;
+    std::vector<size_t> topics_;
+
+    // By dish id
+    std::vector<sum_row> phi_;          //!< Sums of n_kv / (n_k + V beta)
+    std::vector<double> phi_smooth_;    //!< Sums of beta / (n_k + V beta)
+    std::vector<size_t> phi_samples_;   //!< Samples the dish was active in
+
+    // By document
+    std::vector<sum_row> theta_;        //!< Sums of n_jk / (n_j + alpha M / Z)
+    std::vector<size_t> length_;        //!< n_j of the row the document uses
+    std::vector<size_t> prior_row_;     //!< Index into prior_
+    std::vector<bool> own_row_;
+
+    // Sums of alpha m_k / Z / (n_j + alpha M / Z) by dish id, with M the
+    // tables at topics and Z = M + gamma; one row per n_j (or per
+    // document, see own_row_)
+    std::vector<std::vector<double>> prior_;
+    std::unordered_map<size_t, size_t> length_rows_; //!< n_j to shared row
+
+    std::vector<sparse_row> scratch_;
+    sum_row merged_;
+};
+
+} // namespace lda
+} // namespace microscopes
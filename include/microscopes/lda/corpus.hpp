@@ -0,0 +1,281 @@
+#pragma once
+
+#include <microscopes/common/assert.hpp>
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <cstdint>
+
+// Width of the stored word ids; 16 bits halves the corpus for
+// vocabularies of at most 65536 words
+#ifndef MICROSCOPES_LDA_TOKEN_BITS
+#define MICROSCOPES_LDA_TOKEN_BITS 32
+#endif
+
+namespace microscopes {
+namespace lda {
+
+#if MICROSCOPES_LDA_TOKEN_BITS == 16
+typedef uint16_t token_t;
+#elif MICROSCOPES_LDA_TOKEN_BITS == 32
+typedef uint32_t token_t;
+#else
+#error "MICROSCOPES_LDA_TOKEN_BITS must be 16 or 32"
+#endif
+
+/**
+* Documents stored in compressed sparse row form: one flat buffer holding
+* the word ids of all documents back to back, and ndocs + 1 offsets into
+* it, so document eid is tokens[offsets[eid] .. offsets[eid + 1]).
+*
+* A corpus is a cheap handle on shared, read-only storage. Copies and
+* slices (a contiguous range of documents) share the buffers, which may
+* either be owned by the corpus or by some external owner (e.g. a memory
+* mapped file) that is kept alive for as long as any handle exists.
+*/
+class corpus {
+public:
+    /**
+    * Range of the word ids of one document
+    */
+    class doc_view {
+    public:
+        typedef const token_t *const_iterator;
+
+        doc_view(const token_t *first, const token_t *last) : first_(first), last_(last) {}
+
+        inline const_iterator begin() const { return first_; }
+
+        inline const_iterator end() const { return last_; }
+
+        inline size_t size() const { return last_ - first_; }
+
+        inline size_t operator[](size_t i) const { return first_[i]; }
+
+    private:
+        const token_t *first_;
+        const token_t *last_;
+    };
+
+    // Largest word id that can be stored
+    static inline size_t
+    max_token()
+    {
+        return std::numeric_limits<token_t>::max();
+    }
+
+    corpus() : storage_(nullptr), tokens_(nullptr), offsets_(&zero_offset()), ndocs_(0) {}
+
+    // Copy a list of documents into flat storage
+    explicit corpus(const std::vector<std::vector<size_t>> &docs)
+    {
+        auto storage = std::make_shared<owned_storage>();
+        size_t ntokens = 0;
+        for (auto &doc : docs)
+            ntokens += doc.size();
+        storage->tokens.reserve(ntokens);
+        storage->offsets.reserve(docs.size() + 1);
+        storage->offsets.push_back(0);
+        for (auto &doc : docs) {
+            for (auto v : doc) {
+                MICROSCOPES_CHECK(v <= max_token(), "word id does not fit in token_t");
+                storage->tokens.push_back(v);
+            }
+            storage->offsets.push_back(storage->tokens.size());
+        }
+        adopt(storage);
+    }
+
+    /**
+    * Take over CSR arrays: offsets must hold ndocs + 1 non-decreasing
+    * entries starting at 0, ending at tokens.size().
+    */
+    corpus(std::vector<token_t> &&tokens, std::vector<size_t> &&offsets)
+    {
+        MICROSCOPES_CHECK(!offsets.empty() && offsets.front() == 0 &&
+            offsets.back() == tokens.size(), "offsets do not match tokens");
+        check_sorted(offsets.data(), offsets.size() - 1);
+        auto storage = std::make_shared<owned_storage>();
+        storage->tokens.swap(tokens);
+        storage->offsets.swap(offsets);
+        adopt(storage);
+    }
+
+    /**
+    * Copy ndocs documents out of CSR arrays: offsets must hold ndocs + 1
+    * non-decreasing entries, which are rebased to start at 0.
+    */
+    corpus(const token_t *tokens, const size_t *offsets, size_t ndocs)
+    {
+        check_sorted(offsets, ndocs);
+        auto storage = std::make_shared<owned_storage>();
+        storage->tokens.assign(tokens + offsets[0], tokens + offsets[ndocs]);
+        storage->offsets.assign(offsets, offsets + ndocs + 1);
+        for (auto &o : storage->offsets)
+            o -= offsets[0];
+        adopt(storage);
+    }
+
+    /**
+    * Wrap CSR arrays owned by someone else without copying; owner keeps
+    * them alive and valid for the lifetime of this corpus and everything
+    * that shares it.
+    */
+    corpus(std::shared_ptr<const void> owner,
+           const token_t *tokens, const size_t *offsets, size_t ndocs)
+        : owner_(owner), storage_(nullptr), tokens_(tokens), offsets_(offsets), ndocs_(ndocs) {}
+
+    // Documents [first, last), sharing this corpus' storage
+    inline corpus
+    slice(size_t first, size_t last) const
+    {
+        MICROSCOPES_DCHECK(first <= last && last <= ndocs_, "bad slice");
+        corpus ret(*this);
+        ret.offsets_ = offsets_ + first;
+        ret.ndocs_ = last - first;
+        return ret;
+    }
+
+    /**
+    * This corpus followed by the documents of docs, as a new handle.
+    * If this handle ends where its owned storage ends and there is room,
+    * the documents are written behind it in place and shared; otherwise
+    * (external storage, or storage someone else appended to) this
+    * corpus' documents are copied once into new storage with room to
+    * grow. Either way a series of appends costs O(new tokens) amortized,
+    * and other handles of the storage keep their documents.
+    */
+    corpus
+    append(const corpus &docs) const
+    {
+        if (storage_ && docs.storage_ != storage_) {
+            std::lock_guard<std::mutex> lock(storage_->append_mutex);
+            auto &s = *storage_;
+            if (offsets_ + ndocs_ + 1 == s.offsets.data() + s.offsets.size() &&
+                s.tokens.size() + docs.ntokens() <= s.tokens.capacity() &&
+                s.offsets.size() + docs.ndocs() <= s.offsets.capacity()) {
+                // Nothing moves, so readers of the existing documents
+                // are not disturbed
+                for (size_t eid = 0; eid < docs.ndocs(); ++eid) {
+                    s.tokens.insert(s.tokens.end(), docs.doc(eid).begin(), docs.doc(eid).end());
+                    s.offsets.push_back(s.tokens.size());
+                }
+                corpus ret(*this);
+                ret.ndocs_ += docs.ndocs();
+                return ret;
+            }
+        }
+        auto storage = std::make_shared<owned_storage>();
+        storage->tokens.reserve(2 * (ntokens() + docs.ntokens()));
+        storage->offsets.reserve(2 * (ndocs_ + docs.ndocs()) + 1);
+        storage->offsets.push_back(0);
+        for (const corpus *c : {this, &docs}) {
+            for (size_t eid = 0; eid < c->ndocs(); ++eid) {
+                storage->tokens.insert(storage->tokens.end(), c->doc(eid).begin(), c->doc(eid).end());
+                storage->offsets.push_back(storage->tokens.size());
+            }
+        }
+        corpus ret;
+        ret.adopt(storage);
+        return ret;
+    }
+
+    inline size_t ndocs() const { return ndocs_; }
+
+    inline size_t ntokens() const { return offsets_[ndocs_] - offsets_[0]; }
+
+    inline size_t size(size_t eid) const { return offsets_[eid + 1] - offsets_[eid]; }
+
+    // Position of the first token of doc eid among this corpus' tokens
+    inline size_t offset(size_t eid) const { return offsets_[eid] - offsets_[0]; }
+
+    inline size_t
+    word(size_t eid, size_t i) const
+    {
+        MICROSCOPES_DCHECK(eid < ndocs_ && i < size(eid), "token out of bounds");
+        return tokens_[offsets_[eid] + i];
+    }
+
+    inline doc_view
+    doc(size_t eid) const
+    {
+        return doc_view(tokens_ + offsets_[eid], tokens_ + offsets_[eid + 1]);
+    }
+
+    // Whether both handles refer to the same documents of the same storage
+    inline bool
+    shares_storage(const corpus &other) const
+    {
+        return tokens_ == other.tokens_ && offsets_ == other.offsets_ && ndocs_ == other.ndocs_;
+    }
+
+    // Largest word id in the corpus (0 when empty)
+    size_t
+    max_word() const
+    {
+        size_t ret = 0;
+        for (const token_t *p = tokens_ + offsets_[0]; p != tokens_ + offsets_[ndocs_]; ++p)
+            ret = std::max(ret, size_t(*p));
+        return ret;
+    }
+
+    /**
+    * 64-bit hash of the documents (FNV-1a over the document sizes and word
+    * ids), to check that a checkpoint saved without its corpus is restored
+    * against the same documents.
+    */
+    uint64_t
+    hash() const
+    {
+        uint64_t h = 14695981039346656037ULL;
+        auto mix = [&h](uint64_t x) { h = (h ^ x) * 1099511628211ULL; };
+        mix(ndocs_);
+        for (size_t eid = 0; eid < ndocs_; ++eid)
+            mix(size(eid));
+        for (const token_t *p = tokens_ + offsets_[0]; p != tokens_ + offsets_[ndocs_]; ++p)
+            mix(*p);
+        return h;
+    }
+
+private:
+    struct owned_storage {
+        std::vector<token_t> tokens;
+        std::vector<size_t> offsets;
+        std::mutex append_mutex; //!< see append()
+    };
+
+    static const size_t &
+    zero_offset()
+    {
+        static const size_t zero = 0;
+        return zero;
+    }
+
+    static void
+    check_sorted(const size_t *offsets, size_t ndocs)
+    {
+        for (size_t eid = 0; eid < ndocs; ++eid)
+            MICROSCOPES_CHECK(offsets[eid] <= offsets[eid + 1], "offsets are not sorted");
+    }
+
+    void
+    adopt(const std::shared_ptr<owned_storage> &storage)
+    {
+        owner_ = storage;
+        storage_ = storage.get();
+        tokens_ = storage->tokens.data();
+        offsets_ = storage->offsets.data();
+        ndocs_ = storage->offsets.size() - 1;
+    }
+
+    std::shared_ptr<const void> owner_;
+    owned_storage *storage_; //!< owner_ if this corpus owns its storage, else null
+    const token_t *tokens_;
+    const size_t *offsets_;
+    size_t ndocs_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <microscopes/lda/corpus.hpp>
+
+#include <string>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Parse an LDA-C file, i.e. one document per line of the form
+*
+*   [M] [term_1]:[count] [term_2]:[count] ... [term_M]:[count]
+*
+* into a corpus. Each term is repeated count times, in the order listed,
+* which gives the same documents as utils.docs_from_ldac. Blank lines are
+* skipped.
+*/
+extern corpus
+load_ldac(const std::string &path);
+
+/**
+* Write docs in the binary corpus format read by map_corpus:
+*
+*   char     magic[8]          "MSLDACRP"
+*   uint32_t version           1
+*   uint32_t token_bits        16 or 32, MICROSCOPES_LDA_TOKEN_BITS
+*   uint64_t ndocs
+*   uint64_t ntokens
+*   uint64_t offsets[ndocs+1]  starting at 0
+*   token_t  tokens[ntokens]
+*
+* in native byte order.
+*/
+extern void
+save_corpus(const corpus &docs, const std::string &path);
+
+/**
+* Memory map a file written by save_corpus and wrap it as a corpus without
+* copying. The mapping is read-only and shared, so processes on the same
+* host mapping the same file share its pages; it is unmapped when the last
+* corpus (or state) using it goes away.
+*/
+extern corpus
+map_corpus(const std::string &path);
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <microscopes/common/assert.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Storage layout for the dish/word count matrix.
+*
+* sparse_layout keeps one hash map per dish and only pays for non-zero
+* entries, so memory stays bounded for very large vocabularies.
+* topic_major_layout and word_major_layout keep a dense, contiguous
+* (dishes x words) array; topic major keeps all words of a dish together,
+* word major keeps all dishes of a word together (which is what calc_f_k
+* walks for every token).
+* sparse_word_major_layout keeps, for every word, a sorted list of the
+* dishes it occurs at, so samplers can visit only those (see
+* word_dishes()).
+*/
+enum count_layout {
+    sparse_layout,
+    topic_major_layout,
+    word_major_layout,
+    sparse_word_major_layout
+};
+
+/**
+* Word counts for a single doc/table pair.
+*
+* Stored as a flat vector of (word, count) pairs sorted by word, so a
+* table's words are contiguous in memory and iterating them is a linear
+* scan. Entries are dropped as soon as their count hits zero. clear() keeps
+* the capacity, which lets state recycle histograms of deleted tables
+* instead of allocating new ones.
+*
+* The same structure keyed by dish holds the per-word counts of
+* sparse_word_major_layout.
+*/
+class word_histogram {
+public:
+    typedef std::pair<size_t, size_t> entry_type;
+    typedef std::vector<entry_type>::const_iterator const_iterator;
+
+    inline const_iterator begin() const { return entries_.begin(); }
+
+    inline const_iterator end() const { return entries_.end(); }
+
+    // Number of distinct words
+    inline size_t size() const { return entries_.size(); }
+
+    inline bool empty() const { return entries_.empty(); }
+
+    inline void clear() { entries_.clear(); }
+
+    inline size_t
+    get(size_t v) const
+    {
+        auto it = find(v);
+        return (it != entries_.end() && it->first == v) ? it->second : 0;
+    }
+
+    // Add by to the count of v and return the new count
+    inline size_t
+    incr(size_t v, size_t by=1)
+    {
+        auto it = find(v);
+        if (it != entries_.end() && it->first == v)
+            return it->second += by;
+        entries_.insert(it, entry_type(v, by));
+        return by;
+    }
+
+    // Subtract by from the count of v and return the new count
+    inline size_t
+    decr(size_t v, size_t by=1)
+    {
+        auto it = find(v);
+        MICROSCOPES_DCHECK(it != entries_.end() && it->first == v, "word not at table");
+        MICROSCOPES_DCHECK(it->second >= by, "count would go negative");
+        const size_t n = it->second -= by;
+        if (n == 0)
+            entries_.erase(it);
+        return n;
+    }
+
+    // Drop the entry for v, if there is one
+    inline void
+    erase(size_t v)
+    {
+        auto it = find(v);
+        if (it != entries_.end() && it->first == v)
+            entries_.erase(it);
+    }
+
+private:
+    inline std::vector<entry_type>::iterator
+    find(size_t v)
+    {
+        return std::lower_bound(entries_.begin(), entries_.end(), entry_type(v, 0));
+    }
+
+    inline std::vector<entry_type>::const_iterator
+    find(size_t v) const
+    {
+        return std::lower_bound(entries_.begin(), entries_.end(), entry_type(v, 0));
+    }
+
+    std::vector<entry_type> entries_;
+};
+
+/**
+* Number of times each word is assigned to each dish.
+*
+* Only raw integer counts are stored; the beta smoothing offset is applied
+* by the caller on read (see state::num_words_at_dish), so resampling beta
+* never requires touching the counts.
+*/
+class dish_word_counts {
+public:
+    dish_word_counts(size_t nwords, count_layout layout)
+        : V_(nwords), K_(0), stride_(0), layout_(layout) {}
+
+    inline count_layout layout() const { return layout_; }
+
+    inline size_t nwords() const { return V_; }
+
+    // Number of dish slots currently allocated
+    inline size_t ndishes() const { return K_; }
+
+    inline size_t
+    get(size_t k, size_t v) const
+    {
+        MICROSCOPES_DCHECK(k < K_, "dish out of bounds");
+        MICROSCOPES_DCHECK(v < V_, "word out of bounds");
+        switch (layout_) {
+        case topic_major_layout:
+            return dense_[k * V_ + v];
+        case word_major_layout:
+            return dense_[v * stride_ + k];
+        case sparse_word_major_layout:
+            return by_word_[v].get(k);
+        default:
+            {
+                auto it = sparse_[k].find(v);
+                return it == sparse_[k].end() ? 0 : it->second;
+            }
+        }
+    }
+
+    // Add by to the count of word v at dish k and return the new count
+    inline size_t
+    incr(size_t k, size_t v, size_t by=1)
+    {
+        MICROSCOPES_DCHECK(k < K_, "dish out of bounds");
+        MICROSCOPES_DCHECK(v < V_, "word out of bounds");
+        switch (layout_) {
+        case topic_major_layout:
+            return dense_[k * V_ + v] += by;
+        case word_major_layout:
+            return dense_[v * stride_ + k] += by;
+        case sparse_word_major_layout:
+            return by_word_[v].incr(k, by);
+        default:
+            return sparse_[k][v] += by;
+        }
+    }
+
+    // Subtract by from the count of word v at dish k and return the new count
+    inline size_t
+    decr(size_t k, size_t v, size_t by=1)
+    {
+        MICROSCOPES_DCHECK(k < K_, "dish out of bounds");
+        MICROSCOPES_DCHECK(v < V_, "word out of bounds");
+        MICROSCOPES_DCHECK(get(k, v) >= by, "count would go negative");
+        switch (layout_) {
+        case topic_major_layout:
+            return dense_[k * V_ + v] -= by;
+        case word_major_layout:
+            return dense_[v * stride_ + k] -= by;
+        case sparse_word_major_layout:
+            return by_word_[v].decr(k, by);
+        default:
+            {
+                auto it = sparse_[k].find(v);
+                const size_t n = it->second -= by;
+                if (n == 0)
+                    sparse_[k].erase(it);
+                return n;
+            }
+        }
+    }
+
+    /**
+    * Make sure there are at least ndishes dish slots.
+    * New slots start out with all counts at zero.
+    */
+    void
+    resize(size_t ndishes)
+    {
+        if (ndishes <= K_)
+            return;
+        switch (layout_) {
+        case topic_major_layout:
+            dense_.resize(ndishes * V_, 0);
+            break;
+        case word_major_layout:
+            if (ndishes > stride_) {
+                // Grow geometrically so rows are only
+                // re-laid out O(log K) times.
+                size_t stride = std::max(ndishes, 2 * stride_);
+                std::vector<size_t> dense(V_ * stride, 0);
+                for (size_t v = 0; v < V_; ++v) {
+                    std::copy(dense_.begin() + v * stride_,
+                              dense_.begin() + v * stride_ + K_,
+                              dense.begin() + v * stride);
+                }
+                dense_.swap(dense);
+                stride_ = stride;
+            }
+            break;
+        case sparse_word_major_layout:
+            by_word_.resize(V_);
+            break;
+        default:
+            sparse_.resize(ndishes);
+        }
+        K_ = ndishes;
+    }
+
+    // Zero all counts for dish k
+    void
+    reset(size_t k)
+    {
+        MICROSCOPES_DCHECK(k < K_, "dish out of bounds");
+        switch (layout_) {
+        case topic_major_layout:
+            std::fill(dense_.begin() + k * V_, dense_.begin() + (k + 1) * V_, 0);
+            break;
+        case word_major_layout:
+            for (size_t v = 0; v < V_; ++v)
+                dense_[v * stride_ + k] = 0;
+            break;
+        case sparse_word_major_layout:
+            for (auto &h : by_word_)
+                h.erase(k);
+            break;
+        default:
+            sparse_[k].clear();
+        }
+    }
+
+    // Zero all counts for all dishes (slots are kept)
+    void
+    clear()
+    {
+        std::fill(dense_.begin(), dense_.end(), 0);
+        for (auto &m : sparse_)
+            m.clear();
+        for (auto &h : by_word_)
+            h.clear();
+    }
+
+    /**
+    * Pointer to the K contiguous dish counts of word v.
+    * Valid only for word_major_layout, and only until the next resize().
+    */
+    inline const size_t *
+    word_row(size_t v) const
+    {
+        MICROSCOPES_DCHECK(layout_ == word_major_layout, "not word major");
+        return dense_.data() + v * stride_;
+    }
+
+    /**
+    * Pointer to the V contiguous word counts of dish k.
+    * Valid only for topic_major_layout, and only until the next resize().
+    */
+    inline const size_t *
+    dish_row(size_t k) const
+    {
+        MICROSCOPES_DCHECK(layout_ == topic_major_layout, "not topic major");
+        return dense_.data() + k * V_;
+    }
+
+    /**
+    * (dish, count) pairs of word v with a non-zero count, sorted by dish.
+    * Valid only for sparse_word_major_layout.
+    */
+    inline const word_histogram &
+    word_dishes(size_t v) const
+    {
+        MICROSCOPES_DCHECK(layout_ == sparse_word_major_layout, "not sparse word major");
+        return by_word_[v];
+    }
+
+    /**
+    * Call f(k, v, count) for every non-zero count, in an order that
+    * depends on the layout. Costs O(non-zeros) for the sparse layouts and
+    * O(dishes x words) for the dense ones.
+    */
+    template <typename F>
+    void
+    for_each_count(F f) const
+    {
+        switch (layout_) {
+        case topic_major_layout:
+            for (size_t k = 0; k < K_; ++k)
+                for (size_t v = 0; v < V_; ++v)
+                    if (dense_[k * V_ + v])
+                        f(k, v, dense_[k * V_ + v]);
+            break;
+        case word_major_layout:
+            for (size_t v = 0; v < V_; ++v)
+                for (size_t k = 0; k < K_; ++k)
+                    if (dense_[v * stride_ + k])
+                        f(k, v, dense_[v * stride_ + k]);
+            break;
+        case sparse_word_major_layout:
+            for (size_t v = 0; v < by_word_.size(); ++v)
+                for (auto &e : by_word_[v])
+                    f(e.first, v, e.second);
+            break;
+        default:
+            for (size_t k = 0; k < sparse_.size(); ++k)
+                for (auto &e : sparse_[k])
+                    f(k, e.first, e.second);
+        }
+    }
+
+private:
+    size_t V_;
+    size_t K_;
+    size_t stride_;
+    count_layout layout_;
+    std::vector<size_t> dense_;
+    std::vector<std::unordered_map<size_t, size_t>> sparse_;
+    std::vector<word_histogram> by_word_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <microscopes/lda/model.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+namespace distributed {
+
+/**
+* The collective a node needs from the network: every rank contributes
+* one message and gets everybody's, indexed by rank. All ranks must call
+* all_gather the same number of times, in the same order.
+*/
+class transport {
+public:
+    virtual ~transport() {}
+
+    virtual size_t rank() const = 0;
+
+    virtual size_t size() const = 0;
+
+    virtual std::vector<std::string> all_gather(const std::string &message) = 0;
+};
+
+/**
+* Transport between threads of one process, for tests and for running
+* nodes side by side: endpoint(r) is rank r, to be used by one thread.
+*/
+class local_hub {
+public:
+    explicit local_hub(size_t size);
+
+    ~local_hub();
+
+    local_hub(const local_hub &) = delete;
+    local_hub &operator=(const local_hub &) = delete;
+
+    inline size_t size() const { return endpoints_.size(); }
+
+    transport &endpoint(size_t rank);
+
+private:
+    class endpoint_t;
+
+    std::vector<std::string> exchange(size_t rank, const std::string &message);
+
+    std::vector<std::unique_ptr<endpoint_t>> endpoints_;
+    std::mutex mutex_;
+    std::condition_variable done_;
+    std::vector<std::string> pending_;
+    std::vector<std::string> gathered_;
+    size_t arrived_;
+    size_t round_;
+};
+
+/**
+* Transport over TCP, as a star around rank 0: rank 0 listens on port and
+* the other ranks connect to host:port, retrying for up to
+* connect_timeout seconds. Messages are gathered at rank 0 and sent back
+* to everybody. Fails with an exception on any socket error.
+*/
+class tcp_transport : public transport {
+public:
+    tcp_transport(size_t rank, size_t size, const std::string &host, uint16_t port,
+                  double connect_timeout = 30);
+
+    ~tcp_transport();
+
+    tcp_transport(const tcp_transport &) = delete;
+    tcp_transport &operator=(const tcp_transport &) = delete;
+
+    size_t rank() const override { return rank_; }
+
+    size_t size() const override { return size_; }
+
+    std::vector<std::string> all_gather(const std::string &message) override;
+
+private:
+    size_t rank_;
+    size_t size_;
+    std::vector<int> peers_; //!< Socket of each rank at rank 0, of rank 0 elsewhere
+};
+
+/**
+* One machine's part of a distributed run: the documents of its shard,
+* sampled by the usual kernels on a state of its own, and a replica of
+* the global dish statistics (n_kv, n_k, m_k and the active dishes).
+*
+* Between syncs a node samples against the global statistics as of the
+* last sync plus its own changes, as in approximate distributed LDA. sync()
+* sends the node's changes since the last sync, gathers the changes of
+* all nodes and installs the new global statistics, so afterwards all
+* nodes hold the same counts, which are those of the union of the
+* shards' seatings. Changes are sent as sorted (key gap, count delta)
+* pairs in variable length integers, so a sync costs about the number of
+* counts that changed rather than the size of the tables.
+*
+* Dish ids below the floor (the global number of dish slots at the last
+* sync) are global. Dishes a node creates between syncs get provisional
+* ids above the floor; sync() numbers them in rank order, reusing the ids
+* of dishes that died everywhere first, so every node agrees on the new
+* ids without another round trip. A global dish a node stops using is not
+* reused by that node until the next sync, since other nodes may still
+* seat tables at it.
+*
+* Hyperparameters are not synchronized; run the same hyperparameter
+* kernels with the same rng on every node, or none. The scores of a
+* node's state mix its own tables with the global dish counts.
+*/
+class node {
+public:
+    /**
+    * Join the run with the state of this rank's documents. All nodes'
+    * states must have the same vocabulary and hyperparameters. Their
+    * dish ids are taken to be global to begin with (as after a random
+    * initialization from a common pool of dishes), and the first sync
+    * happens here, so all ranks must construct their nodes together.
+    */
+    node(const std::shared_ptr<state> &latent, transport &t);
+
+    node(const node &) = delete;
+    node &operator=(const node &) = delete;
+
+    inline const state &latent() const { return *latent_; }
+
+    // The state to run kernels on between syncs
+    inline state &latent() { return *latent_; }
+
+    inline size_t rank() const { return transport_.rank(); }
+
+    // Number of dish slots of the global statistics
+    inline size_t ndish_slots() const { return m_k_.size(); }
+
+    /**
+    * Exchange the changes since the last sync with all other nodes; a
+    * collective call.
+    */
+    void sync();
+
+    /**
+    * Run niters iterations of lda_crp_gibbs, syncing after every
+    * sync_every iterations and after the last one.
+    */
+    void run(common::rng_t &rng, size_t niters, size_t sync_every = 1);
+
+    inline size_t nsyncs() const { return nsyncs_; }
+
+    // Total size of the messages this node sent
+    inline size_t bytes_sent() const { return bytes_sent_; }
+
+private:
+    struct word_count {
+        uint64_t key; //!< Dish times V plus word
+        int64_t count;
+    };
+
+    void exchange(bool initial);
+
+    std::shared_ptr<state> latent_;
+    transport &transport_;
+
+    // Global statistics as of the last sync
+    std::vector<size_t> m_k_;
+    std::vector<size_t> n_k_;
+    std::vector<word_count> n_kv_; //!< Non-zero counts, sorted by key
+
+    size_t nsyncs_;
+    size_t bytes_sent_;
+};
+
+} // namespace distributed
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <microscopes/lda/distributed.hpp>
+
+#include <mpi.h>
+
+#include <limits>
+
+namespace microscopes {
+namespace lda {
+namespace distributed {
+
+/**
+* Transport over an MPI communicator (MPI_Allgather of the lengths, then
+* MPI_Allgatherv). Header only so the library does not depend on MPI;
+* programs using it compile and link with their MPI (e.g. mpicxx), after
+* MPI_Init.
+*/
+class mpi_transport : public transport {
+public:
+    explicit mpi_transport(MPI_Comm comm = MPI_COMM_WORLD) : comm_(comm)
+    {
+        int rank, size;
+        MICROSCOPES_CHECK(MPI_Comm_rank(comm_, &rank) == MPI_SUCCESS &&
+            MPI_Comm_size(comm_, &size) == MPI_SUCCESS, "bad communicator");
+        rank_ = rank;
+        size_ = size;
+    }
+
+    size_t rank() const override { return rank_; }
+
+    size_t size() const override { return size_; }
+
+    std::vector<std::string>
+    all_gather(const std::string &message) override
+    {
+        MICROSCOPES_CHECK(message.size() <= size_t(std::numeric_limits<int>::max()),
+            "message too large for MPI");
+        int len = int(message.size());
+        std::vector<int> lens(size_), offsets(size_);
+        MICROSCOPES_CHECK(MPI_Allgather(&len, 1, MPI_INT, lens.data(), 1, MPI_INT, comm_) == MPI_SUCCESS,
+            "MPI_Allgather failed");
+        size_t total = 0;
+        for (size_t r = 0; r < size_; ++r) {
+            offsets[r] = int(total);
+            total += lens[r];
+        }
+        MICROSCOPES_CHECK(total <= size_t(std::numeric_limits<int>::max()), "messages too large for MPI");
+        std::string all(total, '\0');
+        MICROSCOPES_CHECK(MPI_Allgatherv(const_cast<char *>(message.data()), len, MPI_CHAR,
+            &all[0], lens.data(), offsets.data(), MPI_CHAR, comm_) == MPI_SUCCESS,
+            "MPI_Allgatherv failed");
+        std::vector<std::string> ret(size_);
+        for (size_t r = 0; r < size_; ++r)
+            ret[r] = all.substr(offsets[r], lens[r]);
+        return ret;
+    }
+
+private:
+    MPI_Comm comm_;
+    size_t rank_;
+    size_t size_;
+};
+
+} // namespace distributed
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/snapshot.hpp>
+
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Topic inference for new documents against a snapshot of the topics of
+* a trained state.
+*
+* The snapshot keeps the topic-word distributions (phi) in a dense
+* word-major matrix, so folding in a document only touches the rows of
+* its words, and later sampling of the state does not affect the model.
+* Topics come in the order of state::word_distribution().
+*
+* Documents are folded in with the iterated pseudo-counts method of
+* Wallach et al. (2009), as state.predict did in Python: every word keeps
+* a distribution over topics, which is repeatedly set proportional to
+*
+*   phi[k][v] * (sum of the other words' weight on k + prior)
+*
+* until the total change is below tol or max_iter iterations have run.
+* The document's topic distribution is the mean over its words.
+*/
+class inference {
+public:
+    // Scratch buffers of predict(), reused across documents
+    struct workspace {
+        std::vector<size_t> words; //!< distinct known words of the document
+        std::vector<float> counts; //!< their multiplicities
+        std::vector<float> pz;     //!< words x ntopics word topic weights
+        std::vector<float> sum_pz; //!< column sums of pz, before and after an iteration
+        std::vector<float> row;    //!< unnormalized weights of one word
+    };
+
+    // Snapshot the topics of s; prior defaults to s.beta_
+    explicit inference(const state &s);
+
+    inference(const state &s, float prior);
+
+    // Share an existing snapshot, e.g. with other inference objects
+    inference(std::shared_ptr<const snapshot> snap, float prior);
+
+    inline const std::shared_ptr<const snapshot> &model() const { return snap_; }
+
+    inline size_t ntopics() const { return K_; }
+
+    inline size_t nwords() const { return V_; }
+
+    inline float prior() const { return prior_; }
+
+    // The dish id of each topic in s
+    inline const std::vector<size_t> &dishes() const { return snap_->dishes(); }
+
+    // phi of word v, one entry per topic
+    inline const float *phi_row(size_t v) const { return snap_->phi(v); }
+
+    /**
+    * Write the topic distribution of doc (ntopics() entries) to theta.
+    * Words outside the vocabulary are ignored; a document without known
+    * words gets the uniform distribution. Returns the number of
+    * iterations run.
+    */
+    size_t
+    predict(const corpus::doc_view &doc, float *theta, size_t max_iter, double tol,
+        workspace &ws) const;
+
+    /**
+    * predict() for every document of docs, into the rows of theta (ndocs x
+    * ntopics, row-major), which may be any writable memory such as a
+    * memory mapped file. Documents are handed out to nthreads threads (the
+    * calling one included) in chunks; the result does not depend on
+    * nthreads.
+    */
+    void
+    predict(const corpus &docs, float *theta, size_t max_iter, double tol,
+        size_t nthreads=1) const;
+
+    std::vector<std::vector<float>>
+    predict(const corpus &docs, size_t max_iter, double tol, size_t nthreads=1) const;
+
+    /**
+    * Held-out log-likelihood of docs: the sum over their known words of
+    * log sum_k theta[k] phi[k][w], with theta from predict(). Scoring the
+    * same words the mixture was fitted to makes this the (slightly
+    * optimistic) fold-in estimate. Threads as in the batch predict(); the
+    * result does not depend on nthreads.
+    */
+    double
+    log_likelihood(const corpus &docs, size_t max_iter, double tol, size_t nthreads=1) const;
+
+    // exp(-log_likelihood(docs) / number of known words in docs)
+    double
+    perplexity(const corpus &docs, size_t max_iter, double tol, size_t nthreads=1) const;
+
+    // Documents handed to a thread at a time by the batch predict()
+    static const size_t chunk_size = 64;
+
+private:
+    // Log-likelihood and number of known words of docs
+    std::pair<double, size_t>
+    evaluate(const corpus &docs, size_t max_iter, double tol, size_t nthreads) const;
+
+    size_t K_;
+    size_t V_;
+    float prior_;
+    std::shared_ptr<const snapshot> snap_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Count seating events and time the phases of lda_crp_gibbs; off by
+// default, in which case the counters stay zero and cost nothing
+#ifndef MICROSCOPES_LDA_INSTRUMENT
+#define MICROSCOPES_LDA_INSTRUMENT 0
+#endif
+
+namespace microscopes {
+namespace lda {
+
+// Time stamp counter where there is one, nanoseconds elsewhere
+inline uint64_t
+cycle_count()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct phase_counters {
+    uint64_t calls;
+    uint64_t cycles;      //!< see cycle_count()
+    uint64_t nanoseconds; //!< Wall clock
+};
+
+/**
+* Counters of a state, kept when built with MICROSCOPES_LDA_INSTRUMENT=1
+* (LDA_INSTRUMENT in CMake and setup.py). The table and dish phases of
+* lda_crp_gibbs are timed per sweep; the events are counted by state
+* itself, so they include the seating changes of every kernel.
+* Construction and initialization are not counted.
+*/
+struct instrumentation {
+    static const bool enabled = MICROSCOPES_LDA_INSTRUMENT != 0;
+
+    phase_counters table_phase; //!< sampling_t over all words
+    phase_counters dish_phase;  //!< sampling_k over all tables
+    uint64_t tables_created;
+    uint64_t tables_deleted;    //!< Tables that lost their last word
+    uint64_t dishes_created;
+    uint64_t dishes_deleted;    //!< Dishes that lost their last table
+
+    instrumentation() { reset(); }
+
+    inline void
+    reset()
+    {
+        table_phase = dish_phase = phase_counters();
+        tables_created = tables_deleted = 0;
+        dishes_created = dishes_deleted = 0;
+    }
+
+    inline instrumentation &
+    operator+=(const instrumentation &other)
+    {
+        auto add = [](phase_counters &to, const phase_counters &from) {
+            to.calls += from.calls;
+            to.cycles += from.cycles;
+            to.nanoseconds += from.nanoseconds;
+        };
+        add(table_phase, other.table_phase);
+        add(dish_phase, other.dish_phase);
+        tables_created += other.tables_created;
+        tables_deleted += other.tables_deleted;
+        dishes_created += other.dishes_created;
+        dishes_deleted += other.dishes_deleted;
+        return *this;
+    }
+};
+
+// Adds the time from construction to destruction to a phase
+class phase_timer {
+public:
+    explicit phase_timer(phase_counters &counters)
+        : counters_(counters),
+          cycles_(cycle_count()),
+          start_(std::chrono::steady_clock::now()) {}
+
+    ~phase_timer()
+    {
+        counters_.calls += 1;
+        counters_.cycles += cycle_count() - cycles_;
+        counters_.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_).count();
+    }
+
+    phase_timer(const phase_timer &) = delete;
+    phase_timer &operator=(const phase_timer &) = delete;
+
+private:
+    phase_counters &counters_;
+    uint64_t cycles_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace lda
+} // namespace microscopes
+
+#if MICROSCOPES_LDA_INSTRUMENT
+#define MICROSCOPES_LDA_COUNT(counter) ((counter) += 1)
+#define MICROSCOPES_LDA_TIME_PHASE(name, counters) \
+    ::microscopes::lda::phase_timer name(counters)
+#else
+#define MICROSCOPES_LDA_COUNT(counter) ((void)0)
+#define MICROSCOPES_LDA_TIME_PHASE(name, counters) ((void)0)
+#endif
@@ -1,12 +1,53 @@
 #pragma once
 
 #include <microscopes/lda/model.hpp>
+#include <microscopes/lda/vmath.hpp>
 #include <microscopes/common/macros.hpp>
 
 namespace microscopes {
 namespace kernels {
 namespace lda_crp {
 
+/**
+* Scratch buffers of the sampler, reused across tokens.
+*
+* The kernels below that take a workspace write their result into it
+* instead of returning a new vector: calc_f_k fills f_k and f_m,
+* calc_table_posterior reads f_k and fills p_t, and calc_dish_posterior_w
+* (which reads f_k) and calc_dish_posterior_t fill p_k, the latter using
+* counts and the lgamma_* buffers for its per-dish lgamma terms. Buffers
+* only grow, so once they have reached the number of dishes and tables a
+* sweep makes no allocations.
+*/
+struct workspace {
+    std::vector<float> f_k;
+    float f_m; //!< sum_k m_k[k] * f_k[k], the new table likelihood mass
+    std::vector<float> p_t;
+    std::vector<float> p_k;
+    std::vector<size_t> counts;
+    std::vector<size_t> lgamma_misses; //!< dishes whose counts are not cached
+    std::vector<float> lgamma_x;
+    std::vector<float> lgamma_acc;
+};
+
+extern void
+calc_dish_posterior_t(microscopes::lda::state &state, size_t j, size_t t, workspace &ws);
+
+extern void
+calc_dish_posterior_w(microscopes::lda::state &state, workspace &ws);
+
+extern void
+calc_f_k(microscopes::lda::state &state, size_t v, workspace &ws);
+
+extern void
+calc_table_posterior(microscopes::lda::state &state, size_t j, workspace &ws);
+
+extern void
+sampling_t(microscopes::lda::state &state, size_t j, size_t i, workspace &ws, common::rng_t &rng);
+
+extern void
+sampling_k(microscopes::lda::state &state, size_t j, size_t t, workspace &ws, common::rng_t &rng);
+
 extern std::vector<float>
 calc_dish_posterior_t(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rng);
 
@@ -29,6 +70,268 @@ sampling_k(microscopes::lda::state &state, size_t j, size_t t, common::rng_t &rn
 extern void
 lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng);
 
+// lda_crp_gibbs with caller owned scratch buffers, to keep them across sweeps
+extern void
+lda_crp_gibbs(microscopes::lda::state &state, lda_crp::workspace &ws, common::rng_t &rng);
+
+/**
+* Document-parallel approximation of lda_crp_gibbs, in the style of
+* approximate distributed LDA (Newman et al, 2009).
+*
+* Documents are split into nthreads contiguous shards of similar token
+* counts. Each shard resamples its table assignments on its own thread
+* against a private copy of the dish statistics taken at the start of the
+* sweep, using its own rng stream seeded from rng. The shards' counts are
+* merged at the end of the table phase and the dish phase then runs
+* serially. Runs are reproducible for a fixed rng seed and nthreads.
+*/
+extern void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, size_t nthreads);
+
+/**
+* lda_crp_gibbs over documents [first, last) only, against the topics of
+* all documents: a warm-up for documents just added with
+* state::add_documents, at a cost proportional to their tokens.
+*/
+extern void
+lda_crp_gibbs_range(microscopes::lda::state &state, common::rng_t &rng, size_t first, size_t last);
+
+namespace lda_crp_block {
+
+/**
+* Scratch buffers of the blocked dish phase. threads holds one
+* lda_crp::workspace per thread, also used by the table phase of
+* lda_crp_block_gibbs. Buffers only grow.
+*/
+struct workspace {
+    std::vector<std::pair<size_t, size_t>> tables; //!< (document, table) of every table of the sweep
+    std::vector<size_t> dishes;   //!< state.dishes() at the start of the block
+    std::vector<size_t> pos;      //!< Index into dishes by dish id
+    std::vector<size_t> words;    //!< Distinct words at the block's tables, increasing
+    std::vector<size_t> word_pos; //!< Index into words by word id
+    std::vector<size_t> counts;   //!< n_kv of words at dishes, words x dishes
+    std::vector<std::vector<float>> p_k; //!< Dish posterior of each table of the block
+    std::vector<lda_crp::workspace> threads;
+    std::vector<size_t> created;  //!< Dishes the block created
+    std::vector<std::pair<size_t, size_t>> replaced; //!< Dishes the block emptied while drawn, and their new dish
+};
+
+/**
+* Fill ws.p_k[b - first] for the tables b in [first, last) of ws.tables
+* with their dish posteriors, over ws.dishes, as calc_dish_posterior_t
+* after the table left its dish, all against the current state. The
+* block's words are gathered once, so n_kv is read once per word and
+* dish of the block instead of once per table and word at it, in the
+* order of its layout. Tables are split over nthreads threads.
+*/
+extern void
+calc_dish_posteriors(microscopes::lda::state &state, workspace &ws,
+                     size_t first, size_t last, size_t nthreads = 1);
+
+/**
+* The dish phase of lda_crp_gibbs over blocks of block_size tables, taken
+* in document order: the posteriors of a block are computed together
+* against the counts at the start of the block, then its draws are
+* merged into the state table by table. Within a block the tables do not
+* see each other's moves, as the shards of the document-parallel table
+* phase; block_size 1 is the exact sampler. Draws are serial with rng, so
+* results do not depend on nthreads.
+*/
+extern void
+resample_dishes(microscopes::lda::state &state, workspace &ws, common::rng_t &rng,
+                size_t block_size, size_t nthreads = 1);
+
+} // namespace lda_crp_block
+
+/**
+* lda_crp_gibbs with the blocked dish phase of lda_crp_block. With
+* nthreads > 1 the table phase is the document-parallel one and the dish
+* posteriors of each block are computed on nthreads threads.
+*/
+extern void
+lda_crp_block_gibbs(microscopes::lda::state &state, lda_crp_block::workspace &ws,
+                    common::rng_t &rng, size_t block_size, size_t nthreads = 1);
+
+extern void
+lda_crp_block_gibbs(microscopes::lda::state &state, common::rng_t &rng,
+                    size_t block_size = 256, size_t nthreads = 1);
+
+namespace lda_crp_sparse {
+
+/**
+* Bucketed form of the table posterior of lda_crp::calc_table_posterior
+* and lda_crp::calc_dish_posterior_w, in the style of SparseLDA (Yao et
+* al, 2009).
+*
+* The mass of seating word v in doc eid is split into
+*
+*   tables:      n_jt * f_{k_t}(v)                   for the doc's tables
+*   topic word:  c * m_k * n_kv / (n_k + V*beta)     for dishes with n_kv > 0
+*   smoothing:   c * beta * m_k / (n_k + V*beta)     for all dishes
+*   new dish:    c * gamma / V
+*
+* with c = alpha / (gamma + m). The smoothing sum does not depend on the
+* word and is updated incrementally as tokens move, so a draw costs time
+* proportional to the doc's tables plus the word's non-zero dishes; all
+* dishes are only visited when the (small) smoothing bucket is hit. The
+* topic word bucket only skips zero counts with sparse_word_major_layout.
+*/
+class buckets {
+public:
+    buckets() : smoothing(0), ntables(0) {}
+
+    // Recompute the cached sums from state
+    void reset(const microscopes::lda::state &state);
+
+    // Contribution of dish k to the smoothing sum (without beta)
+    static inline double
+    term(const microscopes::lda::state &state, size_t k)
+    {
+        return state.m_k[k] / double(state.num_words_at_dish(k));
+    }
+
+    double smoothing; //!< sum_k m_k / (n_k + V*beta) over existing dishes
+    size_t ntables;   //!< total number of tables
+
+    // Scratch space
+    std::vector<float> p_t;
+    std::vector<float> p_k;
+    std::vector<size_t> k_nz;
+};
+
+/**
+* Draw a seating for word v in doc eid without modifying state; the word
+* must already have been removed. Returns (table, dish): table 0 means a
+* new table at dish, and dish 0 means a new dish as well.
+*/
+extern std::pair<size_t, size_t>
+draw(const microscopes::lda::state &state, buckets &buckets,
+    size_t eid, size_t v, common::rng_t &rng);
+
+// lda_crp::sampling_t with draws from the bucketed posterior
+extern void
+sampling_t(microscopes::lda::state &state, buckets &buckets,
+    size_t eid, size_t i, common::rng_t &rng);
+
+} // namespace lda_crp_sparse
+
+/**
+* lda_crp_gibbs where the table draws go through the bucketed posterior of
+* lda_crp_sparse. Draws follow the same distribution as lda_crp_gibbs.
+*/
+extern void
+lda_crp_sparse_gibbs(microscopes::lda::state &state, common::rng_t &rng);
+
+namespace lda_crp_mh {
+
+/**
+* Walker/Vose alias table: O(n) to build, O(1) to draw from.
+*/
+class alias_table {
+public:
+    alias_table() : total_(0) {}
+
+    void build(const std::vector<float> &weights);
+
+    size_t sample(common::rng_t &rng) const;
+
+    // Sum of the weights the table was built from
+    inline float total() const { return total_; }
+
+    inline size_t size() const { return prob_.size(); }
+
+private:
+    std::vector<float> prob_;
+    std::vector<size_t> alias_;
+    float total_;
+};
+
+/**
+* Stale proposal distributions for the new-table branch of the table
+* sampler, in the style of AliasLDA (Li et al, 2014).
+*
+* The probability of opening a new table at dish k for word v is split as
+*
+*   m_k * n_kv / (n_k + V*beta)  +  beta * m_k / (n_k + V*beta)
+*
+* The first term is only non-zero for dishes the word already occurs at,
+* and is kept per word as a small sparse alias table. The second term is
+* shared by all words and kept as one alias table over all dishes, together
+* with the gamma / V mass of a new dish (stored at id 0, the same sentinel
+* the state uses). Tables are snapshots of the state at the time they were
+* built and are rebuilt after as many draws as there were dishes, so the
+* O(K) rebuild cost is amortized to O(1) per token. The error introduced by
+* staleness is removed by a Metropolis-Hastings correction in sampling_t.
+*/
+class proposal_cache {
+public:
+    /**
+    * A stale snapshot of (part of) the new-table mass over dishes.
+    */
+    struct dish_proposal {
+        dish_proposal() : uses(0), lifetime(0) {}
+
+        // Stale weight of dish k (0 if k is not in the snapshot)
+        float weight(size_t k) const;
+
+        inline size_t sample(common::rng_t &rng) const { return dishes[alias.sample(rng)]; }
+
+        inline float total() const { return alias.total(); }
+
+        std::vector<size_t> dishes; //!< sorted dish ids with non-zero weight
+        std::vector<float> weights; //!< weight of each entry of dishes
+        alias_table alias;
+        size_t uses;
+        size_t lifetime;
+    };
+
+    // Proposal for word v, rebuilt from state if it went stale
+    const dish_proposal &word(const microscopes::lda::state &state, size_t v);
+
+    // Shared proposal, rebuilt from state if it went stale
+    const dish_proposal &smoothing(const microscopes::lda::state &state);
+
+    // Forget all snapshots, e.g. after a new state was loaded
+    void clear();
+
+    // Scratch space for the table masses of one document
+    std::vector<float> p_t;
+
+    // Scratch space for the dish phase
+    lda_crp::workspace dish_workspace;
+
+private:
+    std::vector<dish_proposal> words_;
+    dish_proposal smoothing_;
+};
+
+/**
+* Resample the table of word i in doc eid with a Metropolis-Hastings step.
+*
+* Existing tables of the document are proposed with their exact mass; a new
+* table is proposed through the stale alias tables in cache. ntables is the
+* total number of tables in the restaurant franchise and is kept up to date
+* by the step, so a sweep does not have to recount it for every token.
+*/
+extern void
+sampling_t(microscopes::lda::state &state, proposal_cache &cache,
+    size_t eid, size_t i, size_t &ntables, common::rng_t &rng);
+
+} // namespace lda_crp_mh
+
+/**
+* One sweep of the Chinese restaurant franchise sampler where the table
+* draws go through lda_crp_mh::sampling_t. The per token cost grows with
+* the number of tables in the document rather than the number of dishes.
+* The dish phase is the same as in lda_crp_gibbs.
+*
+* cache must be kept alive across sweeps of the same state to amortize the
+* alias table rebuilds.
+*/
+extern void
+lda_crp_mh_gibbs(microscopes::lda::state &state,
+    lda_crp_mh::proposal_cache &cache, common::rng_t &rng);
+
 namespace lda_hyperparameters {
 
 extern void
@@ -37,6 +340,24 @@ sample_gamma(microscopes::lda::state &state, common::rng_t &rng, float a, float
 void
 sample_alpha(microscopes::lda::state &state, common::rng_t &rng, float a, float b);
 
+/**
+* Update the topic-word Dirichlet parameter beta by Minka's (2003) fixed
+* point iteration under a Gamma(a, b) prior, following
+* http://www.arbylon.net/projects/IldaGibbs.java (line 679):
+*
+*   beta <- (a - 1 + beta sum_kv [digamma(n_kv + beta) - digamma(beta)])
+*         / (b + V sum_k [digamma(n_k + V beta) - digamma(V beta)])
+*
+* Zero counts add nothing to the sums, so only the distinct non-zero
+* values of n_kv and n_k are visited, once per iteration, with
+* vmath::digamma. state.beta_ is set when the relative change drops below
+* tol; returns false, leaving beta_ alone, if that does not happen within
+* max_iter iterations.
+*/
+bool
+sample_beta(microscopes::lda::state &state, float a, float b,
+    size_t max_iter = 1000, float tol = 1e-5);
+
 } // lda_hyperparameters
 
 } // namespace kernels
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <microscopes/lda/util.hpp>
+
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Table of lgamma(n + offset) for the integers 0 <= n < size().
+*
+* The dish posterior evaluates lgamma at counts plus beta or plus V*beta,
+* which only change when beta is resampled, so the state keeps one table
+* for each offset and rebuilds it when the offset changes.
+*/
+class lgamma_cache {
+public:
+    lgamma_cache() : offset_(std::numeric_limits<float>::quiet_NaN()) {}
+
+    // Whether the table was built for offset (never true before reset)
+    inline bool valid_for(float offset) const { return offset_ == offset; }
+
+    inline float offset() const { return offset_; }
+
+    inline size_t size() const { return table_.size(); }
+
+    inline float operator[](size_t n) const { return table_[n]; }
+
+    void
+    reset(float offset, size_t size)
+    {
+        table_.resize(size);
+        for (size_t n = 0; n < size; ++n)
+            table_[n] = lda_util::log_gamma(double(n) + offset);
+        offset_ = offset;
+    }
+
+private:
+    float offset_;
+    std::vector<float> table_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -1,21 +1,37 @@
 #pragma once
-#pragma once
 
 #include <microscopes/common/util.hpp>
 #include <microscopes/common/typedefs.hpp>
 #include <microscopes/common/assert.hpp>
 #include <microscopes/lda/util.hpp>
+#include <microscopes/lda/counts.hpp>
+#include <microscopes/lda/corpus.hpp>
+#include <microscopes/lda/instrument.hpp>
+#include <microscopes/lda/slots.hpp>
+#include <microscopes/lda/window.hpp>
+#include <microscopes/lda/lgamma_cache.hpp>
 
 #include <math.h>
+#include <cmath>
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
 
 namespace microscopes {
 namespace lda {
 
 typedef std::vector<std::vector<size_t>> nested_vector;
 
+// Per-document lists of a state, see window_vector
+typedef window_vector<std::vector<size_t>> nested_window;
+
+class snapshot;
+struct seating;
+
 class model_definition {
 public:
     model_definition(size_t, size_t);
@@ -32,20 +48,23 @@ public:
     float alpha_; //!< Hyperparamter on second level Dirichlet process (\alpha_0)
     float beta_; //!< Hyperparameter of base Dirichlet distribution (over term distributions) (\beta)
     float gamma_; //!< Hyperparameter on first level Dirichlet process (\gamma)
-    nested_vector using_t; //!< Nested vector giving list of indices of
-                           //!< active tables for each document
-                           //!< table==0 means we need to create new table for word
-    std::vector<size_t> dishes_; //!< List of indices of active dishes/topics (using_k in shuyo's code)
-    const nested_vector x_ji; //!< Integer representation of documents
-    nested_vector dish_assignments_; //!< Nested vector mapping doc/table pair to topic (k_jt)
-                                //!< dish==0 means we need to create new dish
-    nested_vector n_jt; //!< Nested vector giving counts for words assigned to doc/table pairs
-    std::vector<std::vector<std::map<size_t, size_t>>> n_jtv; //!< Nested vector giving counts for doc/table/word triples
+    window_vector<slot_list> using_t; //!< Active tables of each document
+                                      //!< table==0 means we need to create new table for word
+    slot_list dishes_; //!< Active dishes/topics (using_k in shuyo's code); dish 0 always comes first
+    corpus x_ji; //!< Integer representation of documents; only add_documents and
+                 //!< retire_documents change it
+    nested_window dish_assignments_; //!< Nested vector mapping doc/table pair to topic (k_jt)
+                                     //!< dish==0 means we need to create new dish
+    nested_window n_jt; //!< Nested vector giving counts for words assigned to doc/table pairs
+    window_vector<std::vector<word_histogram>> n_jtv; //!< Word histogram for each doc/table pair. Histograms of
+                                                      //!< deleted tables are kept (empty) for reuse, so
+                                                      //!< n_jtv[eid].size() >= n_jt[eid].size()
     std::vector<size_t> m_k; //!< Number of tables assigned to each dish
-    lda_util::defaultdict<size_t, float> n_k; //!< Number of words assigned to each dish plus beta * V
-    std::vector<lda_util::defaultdict<size_t, float>> n_kv; //!< Number of times a given word is assigned to
-                                                            //!< each dish plus beta
-    nested_vector table_assignments_; //!< Nested vector giving table assignment for each doc/word pair (t_ji)
+    std::vector<size_t> n_k; //!< Number of words assigned to each dish (beta * V is added on read)
+    dish_word_counts n_kv; //!< Number of times a given word is assigned to
+                           //!< each dish (beta is added on read)
+    window_vector<uint32_t> table_assignments_; //!< Table assignment of each doc/word pair (t_ji), laid out
+                                                //!< in parallel to the tokens of x_ji
 
     template <class... Args>
     static inline std::shared_ptr<state>
@@ -59,16 +78,31 @@ private:
           float alpha,
           float beta,
           float gamma,
-          const nested_vector &docs);
+          const corpus &docs,
+          count_layout layout);
+
+    // Worker state for documents [first, last) of parent; see detach_shard()
+    state(state &parent, size_t first, size_t last);
 
 public:
+    state(const model_definition &defn,
+          float alpha,
+          float beta,
+          float gamma,
+          size_t initial_dishes,
+          const corpus &docs,
+          common::rng_t &,
+          count_layout layout=sparse_layout);
+
     state(const model_definition &defn,
           float alpha,
           float beta,
           float gamma,
           size_t initial_dishes,
           const nested_vector &docs,
-          common::rng_t &);
+          common::rng_t &rng,
+          count_layout layout=sparse_layout)
+        : state(defn, alpha, beta, gamma, initial_dishes, corpus(docs), rng, layout) {}
 
     state(const model_definition &defn,
           float alpha,
@@ -76,18 +110,29 @@ public:
           float gamma,
           const nested_vector &dish_assignments,
           const nested_vector &table_assignments,
-          const nested_vector &docs);
+          const corpus &docs,
+          count_layout layout=sparse_layout);
+
+    state(const model_definition &defn,
+          float alpha,
+          float beta,
+          float gamma,
+          const nested_vector &dish_assignments,
+          const nested_vector &table_assignments,
+          const nested_vector &docs,
+          count_layout layout=sparse_layout)
+        : state(defn, alpha, beta, gamma, dish_assignments, table_assignments, corpus(docs), layout) {}
 
     nested_vector
-    assignments();
+    assignments() const;
 
     /**
     * Returns, for each entity, a map from
     * table IDs -> (global) dish assignments
     *
     */
-    nested_vector
-    dish_assignments();
+    const nested_window &
+    dish_assignments() const;
 
     /**
     * Returns, for each entity, an assignment vector
@@ -95,24 +140,78 @@ public:
     *
     */
     nested_vector
-    table_assignments();
+    table_assignments() const;
 
-    // Not implemented
+    /**
+    * log p(t, k | alpha, gamma), the Chinese restaurant franchise
+    * probability of the current seating: a CRP(alpha) over the tables of
+    * every document and a CRP(gamma) over the dishes of all tables.
+    *
+    * Kept up to date as tables and dishes change, so this is O(1); only
+    * the sum of lgamma(alpha + n_j) is recomputed here, in O(documents),
+    * after alpha_ was changed, which is why this is not const. Meaningful
+    * when every word is seated, i.e. between sweeps.
+    */
     float
-    score_assignment() const;
+    score_assignment();
 
-    // Not implemented
+    /**
+    * log p(w | t, k, beta), the Dirichlet-multinomial likelihood of the
+    * words given their dishes. O(dishes); after beta_ was changed the
+    * word count terms are recomputed here once, in O(non-zero counts), as
+    * for score_assignment().
+    */
     float
-    score_data(common::rng_t &rng) const;
+    score_data(common::rng_t &rng);
+
+    /**
+    * Copy the current topics and document mixtures into an immutable
+    * snapshot, which readers can share while sampling goes on.
+    */
+    std::shared_ptr<const lda::snapshot>
+    snapshot() const;
+
+    // Copy the assignments into flat arrays; see seating
+    std::shared_ptr<const lda::seating>
+    seating() const;
 
     std::vector<std::map<size_t, float>>
-    word_distribution();
+    word_distribution() const;
 
     std::vector<std::vector<float>>
-    document_distribution();
+    document_distribution() const;
 
+    // perplexity() over every document, on one thread
     double
-    perplexity();
+    perplexity() const;
+
+    /**
+    * Log-likelihood of the words of the documents eids, the sum of
+    * log sum_k theta[j][k] phi[k][w] with the theta and phi of
+    * document_distribution() and word_distribution(). Computed straight
+    * from the counts: the part of theta that comes from the dish prior is
+    * summed over the dishes once per distinct word, and the rest only
+    * over the dishes of the document's tables. Documents are handed out
+    * to nthreads threads; the result does not depend on nthreads.
+    */
+    double
+    log_likelihood(const std::vector<size_t> &eids, size_t nthreads=1) const;
+
+    // exp(-log_likelihood(eids) / number of words in eids), e.g. on a
+    // sample of the documents to monitor convergence
+    double
+    perplexity(const std::vector<size_t> &eids, size_t nthreads=1) const;
+
+    /**
+    * The top_n words of every topic by relevance (Sievert and Shirley,
+    * 2014), weight log phi_kw + (1 - weight) log(phi_kw / p_w) with p_w
+    * the share of word w among the tokens, in decreasing order (ties by
+    * word id) as (word, relevance) pairs. Topics are in snapshot() order
+    * and are handed out to nthreads threads; words that do not occur in
+    * the documents rank last with -inf unless weight is 1.
+    */
+    std::vector<std::vector<std::pair<size_t, float>>>
+    term_relevance(float weight, size_t top_n, size_t nthreads=1) const;
 
     void
     leave_from_dish(size_t j, size_t t);
@@ -141,36 +240,269 @@ public:
     void
     delete_table(size_t eid, size_t tid);
 
-    inline size_t get_word(size_t eid, size_t word_index) const { return get_entity(eid)[word_index]; }
+    /**
+    * Append the documents of docs as documents nentities() onwards and
+    * return the id of the first. Their words start out unseated, as
+    * after initialization, until a sweep over them such as
+    * kernels::lda_crp_gibbs_range(first, nentities()). x_ji grows in
+    * place where it can (see corpus::append), so this costs O(new
+    * tokens) amortized.
+    */
+    size_t
+    add_documents(const corpus &docs);
+
+    /**
+    * Drop the n oldest documents: take their words off their tables and
+    * their tables off their dishes, then renumber the others, so document
+    * n becomes 0. The whole call is O(tokens of the n documents)
+    * amortized: the bookkeeping of the remaining documents stays where it
+    * is, behind an offset, and is only moved down once the retired
+    * documents outnumber them (see window_vector).
+    */
+    void
+    retire_documents(size_t n);
+
+    /**
+    * Move documents [first, last) into a new worker state.
+    *
+    * The worker owns the per-document seating (tables, table and dish
+    * assignments) of those documents, renumbered from 0, and a private
+    * copy of the dish statistics (n_kv, n_k, m_k, dishes_) as they are now.
+    * Dishes it creates get ids no smaller than this state's current
+    * number of dish slots, so they never alias a dish that another worker
+    * may still be using.
+    *
+    * The documents must be handed back with attach_shard() (followed by
+    * rebuild_dish_statistics()) before this state is used again.
+    */
+    std::unique_ptr<state>
+    detach_shard(size_t first, size_t last);
+
+    /**
+    * Move the documents of a worker created by detach_shard(first, ...)
+    * back into this state. Dishes the worker created are renumbered to
+    * fresh ids of this state. The dish statistics of this state are left
+    * stale; call rebuild_dish_statistics() once all shards are attached.
+    */
+    void
+    attach_shard(state &shard, size_t first);
 
-    inline std::vector<size_t> get_entity(size_t eid) const { return x_ji[eid]; }
+    /**
+    * Recompute m_k, n_k, n_kv, dishes_ and the running sums behind
+    * score_assignment() and score_data() from the per-document table
+    * seating in O(number of tokens).
+    */
+    void
+    rebuild_dish_statistics();
+
+    /**
+    * Take n_kv, n_k, m_k and dishes_ as they were overwritten from
+    * outside, e.g. with the global counts of a distributed run (see
+    * distributed.hpp), and recompute what is derived from them. From now
+    * on create_dish() only hands out ids >= dish_floor, and deleted dishes
+    * below it are not reused.
+    */
+    void
+    adopt_dish_statistics(size_t dish_floor);
+
+    /**
+    * Write a binary checkpoint of this state to out: hyperparameters, the
+    * count layout, the per-document table seating and the table assignment
+    * array, streamed as they are laid out in memory. Either the corpus
+    * itself or only its hash() is included; see checkpoint.cpp for the
+    * exact layout. The rng is not part of the state and is not saved.
+    */
+    void
+    save_checkpoint(std::ostream &out, bool include_corpus=true) const;
+
+    // save_checkpoint to the file at path
+    void
+    save_checkpoint(const std::string &path, bool include_corpus=true) const;
+
+    /**
+    * Restore a state written by save_checkpoint(out, true). Per-table and
+    * per-dish counts are rebuilt in one pass over the tokens instead of
+    * seating them one by one.
+    */
+    static std::shared_ptr<state>
+    load_checkpoint(std::istream &in);
+
+    /**
+    * Restore a state written by save_checkpoint(), using docs as its corpus.
+    * If the checkpoint holds a corpus it is skipped; either way docs must
+    * match the hash of the corpus the checkpoint was saved with.
+    */
+    static std::shared_ptr<state>
+    load_checkpoint(std::istream &in, const corpus &docs);
+
+    // load_checkpoint from the file at path
+    static std::shared_ptr<state>
+    load_checkpoint(const std::string &path);
+
+    static std::shared_ptr<state>
+    load_checkpoint(const std::string &path, const corpus &docs);
+
+    inline size_t get_word(size_t eid, size_t word_index) const { return x_ji.word(eid, word_index); }
+
+    inline corpus::doc_view get_entity(size_t eid) const { return x_ji.doc(eid); }
+
+    inline size_t table_assignment(size_t eid, size_t word_index) const { return table_assignments_[x_ji.offset(eid) + word_index]; }
 
     inline size_t tablesize(size_t eid, size_t tid) const { return n_jt[eid][tid]; }
 
     inline size_t dish_assignment(size_t eid, size_t tid) const { return dish_assignments_[eid][tid]; }
 
-    inline void delete_dish(size_t did) { lda_util::removeFirst(dishes_, did); }
+    // Ids below dish_floor_ may be in use elsewhere and are not reused here
+    inline void
+    delete_dish(size_t did)
+    {
+        MICROSCOPES_LDA_COUNT(counters_.dishes_deleted);
+        if (did < dish_floor_)
+            dishes_.retire(did);
+        else
+            dishes_.release(did);
+    }
 
-    inline std::vector<size_t> dishes() const { return dishes_; }
+    inline const std::vector<size_t> &dishes() const { return dishes_.ids(); }
 
-    inline size_t nentities() const { return x_ji.size(); }
+    inline size_t nentities() const { return x_ji.ndocs(); }
 
     inline size_t ntopics() const { return dishes_.size() - 1; }
 
     inline size_t nwords() const { return V; }
 
-    inline size_t nterms(size_t eid) const { return get_entity(eid).size(); }
+    inline size_t nterms(size_t eid) const { return x_ji.size(eid); }
 
     inline size_t ntables(size_t eid) const { return using_t[eid].size(); }
 
-    inline std::vector<size_t> tables(size_t eid) const { return using_t[eid]; }
+    inline const std::vector<size_t> &tables(size_t eid) const { return using_t[eid].ids(); }
+
+    // Total number of tables at real dishes (the sum of m_k[1:]), kept up to date
+    inline size_t ntables() const { return ntables_; }
+
+    // Occurrences of each word in the documents, kept up to date by
+    // add_documents() and retire_documents(); empty in shard workers
+    inline const std::vector<size_t> &term_frequency() const { return term_frequency_; }
+
+    // Counters since construction or the last reset; all zero unless
+    // built with MICROSCOPES_LDA_INSTRUMENT
+    inline const instrumentation &counters() const { return counters_; }
+
+    inline instrumentation &counters() { return counters_; }
+
+    inline void reset_counters() { counters_.reset(); }
+
+    // Number of documents by their number of tables (the new table not
+    // counted), up to the largest
+    std::vector<size_t>
+    table_count_histogram() const;
 
-    inline int ntables() const { return std::accumulate(m_k.begin()+1, m_k.end(), 0); }
+    inline float num_words_at_dish(size_t tid, size_t word_id) const { return n_kv.get(tid, word_id) + beta_; }
 
-    inline float num_words_at_dish(size_t tid, size_t word_id) const { return n_kv[tid].get(word_id); }
+    inline float num_words_at_dish(size_t tid) const { return n_k[tid] + beta_ * V; }
 
-    inline float num_words_at_dish(size_t tid) const { return n_k.get(tid); }
+    /**
+    * 1 / num_words_at_dish(k) for every dish slot k. Kept up to date as
+    * words move between dishes; recomputed here in O(K) only when beta_
+    * was changed since the last call.
+    */
+    inline const std::vector<float> &
+    dish_normalizers()
+    {
+        if (inv_n_k_beta_ != beta_ || inv_n_k_.size() != n_k.size())
+            refresh_normalizers();
+        return inv_n_k_;
+    }
+
+    // Counts below this are looked up in the lgamma caches
+    static const size_t lgamma_cache_size = 4096;
+
+    // lgamma(n + beta_), rebuilt here when beta_ was changed since the last call
+    inline const lgamma_cache &
+    lgamma_word_counts()
+    {
+        if (!lgamma_word_counts_.valid_for(beta_))
+            lgamma_word_counts_.reset(beta_, lgamma_cache_size);
+        return lgamma_word_counts_;
+    }
+
+    // lgamma(n + V * beta_), as lgamma_word_counts()
+    inline const lgamma_cache &
+    lgamma_dish_sizes()
+    {
+        if (!lgamma_dish_sizes_.valid_for(beta_ * V))
+            lgamma_dish_sizes_.reset(beta_ * V, lgamma_cache_size);
+        return lgamma_dish_sizes_;
+    }
+
+private:
+    static std::shared_ptr<state>
+    load_checkpoint(std::istream &in, const corpus *docs);
+
+    // Zero the counts of dish k, growing the dish vectors if needed
+    void
+    reset_dish(size_t k);
+
+    void
+    refresh_normalizers();
+
+    // Log-likelihood and number of words of the documents eids
+    std::pair<double, size_t>
+    evaluate(const std::vector<size_t> &eids, size_t nthreads) const;
+
+    inline void
+    update_normalizer(size_t k)
+    {
+        if (k < inv_n_k_.size())
+            inv_n_k_[k] = 1.0f / num_words_at_dish(k);
+    }
 
+    // lgamma(n + 1) - lgamma(n), with an empty table or dish counting 0
+    static inline double
+    log_step(size_t n) { return n == 0 ? 0 : std::log(double(n)); }
+
+    // Keep lgamma_m_k_ in step with m_k[k] growing or shrinking by one;
+    // called before m_k changes
+    inline void
+    score_table_added(size_t k) { if (k != 0) lgamma_m_k_ += log_step(m_k[k]); }
+
+    inline void
+    score_table_removed(size_t k) { if (k != 0) lgamma_m_k_ -= log_step(m_k[k] - 1); }
+
+    // Keep lgamma_n_kv_ in step with n_kv(k, v) having moved from
+    // from to to
+    inline void
+    score_words_moved(size_t k, size_t from, size_t to)
+    {
+        if (k == 0 || lgamma_n_kv_beta_ != beta_)
+            return;
+        // Single words, the common case, only need a log
+        if (to == from + 1)
+            lgamma_n_kv_ += std::log(double(from) + beta_);
+        else if (from == to + 1)
+            lgamma_n_kv_ -= std::log(double(to) + beta_);
+        else
+            lgamma_n_kv_ += lda_util::log_gamma(double(to) + beta_) - lda_util::log_gamma(double(from) + beta_);
+    }
+
+    // Recompute the running sums of score_assignment() from the seating
+    void
+    rebuild_scores();
+
+    size_t ntables_; //!< sum of m_k[1:]
+    double lgamma_n_jt_; //!< sum over tables of lgamma(n_jt)
+    double lgamma_m_k_; //!< sum over real dishes of lgamma(m_k)
+    double lgamma_n_kv_; //!< sum over real dishes and words of lgamma(n_kv + beta) - lgamma(beta)
+    float lgamma_n_kv_beta_; //!< beta_ lgamma_n_kv_ is up to date for (NaN if stale)
+    double lgamma_n_j_; //!< sum over documents of lgamma(alpha + n_j)
+    float lgamma_n_j_alpha_; //!< alpha_ lgamma_n_j_ was computed with
+    std::vector<float> inv_n_k_; //!< see dish_normalizers()
+    float inv_n_k_beta_; //!< beta_ that inv_n_k_ was computed with
+    lgamma_cache lgamma_word_counts_;
+    lgamma_cache lgamma_dish_sizes_;
+    size_t dish_floor_; //!< create_dish() only hands out ids >= dish_floor_ (non-zero in shard workers)
+    std::vector<size_t> term_frequency_; //!< see term_frequency()
+    instrumentation counters_; //!< see counters()
 };
 
 }
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/average.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+enum kernel_t {
+    crf_kernel,          //!< lda_crp_gibbs, or its parallel version with nthreads > 1
+    crf_sparse_kernel,   //!< lda_crp_sparse_gibbs
+    crf_alias_kernel,    //!< lda_crp_mh_gibbs
+    crf_block_kernel,    //!< lda_crp_block_gibbs
+    base_dp_hp_kernel,   //!< lda_hyperparameters::sample_gamma
+    second_dp_hp_kernel, //!< lda_hyperparameters::sample_alpha
+    vocab_hp_kernel,     //!< lda_hyperparameters::sample_beta
+};
+
+// kernel_config::niters when none is given: 10 repetitions of
+// sample_gamma and sample_alpha, at most 1000 iterations of sample_beta
+inline size_t
+default_niters(kernel_t kernel)
+{
+    return kernel == vocab_hp_kernel ? 1000 : 10;
+}
+
+/**
+* One step of a runner's schedule. hp1 and hp2 are the shape and rate of
+* the Gamma prior of the hyperparameter kernels; niters is how often
+* sample_gamma and sample_alpha are repeated per iteration, and the
+* iteration limit of sample_beta (0 for default_niters(kernel)). nthreads
+* only applies to crf_kernel and crf_block_kernel, block_size only to the
+* latter.
+*/
+struct kernel_config {
+    kernel_config(kernel_t kernel = crf_kernel, float hp1 = 5, float hp2 = 0.1,
+                  size_t niters = 0, size_t nthreads = 1, size_t block_size = 256)
+        : kernel(kernel), hp1(hp1), hp2(hp2),
+          niters(niters ? niters : default_niters(kernel)), nthreads(nthreads),
+          block_size(block_size) {}
+
+    kernel_t kernel;
+    float hp1;
+    float hp2;
+    size_t niters;
+    size_t nthreads;
+    size_t block_size;
+};
+
+// The kernel named as in runner.py ("crf", "direct_base_dp_hp", ...)
+extern kernel_t
+kernel_from_name(const std::string &name);
+
+/**
+* Runs a fixed schedule of kernels on one state for a number of
+* iterations, without going back to the caller between kernels.
+*
+* Every monitor_every iterations the runner records the training
+* perplexity (if enabled with trace_perplexity) and calls the monitor,
+* which may stop the run by returning false; every checkpoint_every
+* iterations it saves the state to a file. A posterior_average can be
+* fed after every iteration. Runners of different states are
+* independent and may run concurrently, each with its own rng.
+*/
+class runner {
+public:
+    // Called with the number of iterations run so far; false stops the run
+    typedef std::function<bool(size_t, const state &)> monitor_fn;
+
+    runner(const std::shared_ptr<state> &latent,
+           const std::vector<kernel_config> &schedule);
+
+    inline const std::vector<kernel_config> &schedule() const { return schedule_; }
+
+    inline const state &latent() const { return *latent_; }
+
+    // Iterations run by all calls of run() so far
+    inline size_t iteration() const { return iteration_; }
+
+    /**
+    * Run niters iterations of the schedule, or fewer if the monitor stops
+    * the run, and return the number of iterations run. Fails if
+    * sample_beta does not converge.
+    */
+    size_t run(common::rng_t &rng, size_t niters);
+
+    // Call f every `every` iterations (0 turns the monitor off)
+    void set_monitor(size_t every, const monitor_fn &f);
+
+    // set_monitor for C callers; ctx is passed through to f
+    void set_monitor(size_t every, bool (*f)(void *ctx, size_t iteration), void *ctx);
+
+    // Record the training perplexity at every monitor call
+    void trace_perplexity(bool enabled, size_t nthreads = 1);
+
+    // (iteration, state::perplexity) pairs recorded so far
+    inline const std::vector<std::pair<size_t, double>> &
+    perplexity_trace() const { return perplexity_trace_; }
+
+    /**
+    * Save the state to path every `every` iterations (0 turns this off),
+    * as state::save_checkpoint. The file is written next to path and
+    * renamed over it, so path always holds a complete checkpoint.
+    */
+    void set_checkpoint(size_t every, const std::string &path, bool include_corpus = true);
+
+    /**
+    * Call average->update() after every iteration, so it sees the chain
+    * past its burn-in at its thinning interval (nullptr turns this off).
+    */
+    void set_average(const std::shared_ptr<posterior_average> &average);
+
+    inline const std::shared_ptr<posterior_average> &average() const { return average_; }
+
+private:
+    void step(const kernel_config &config, common::rng_t &rng);
+
+    std::shared_ptr<state> latent_;
+    std::vector<kernel_config> schedule_;
+    kernels::lda_crp_mh::proposal_cache proposal_cache_;
+    kernels::lda_crp_block::workspace block_workspace_;
+    size_t iteration_;
+
+    size_t monitor_every_;
+    monitor_fn monitor_;
+    bool trace_perplexity_;
+    size_t perplexity_nthreads_;
+    std::vector<std::pair<size_t, double>> perplexity_trace_;
+
+    size_t checkpoint_every_;
+    std::string checkpoint_path_;
+    bool checkpoint_corpus_;
+
+    std::shared_ptr<posterior_average> average_;
+};
+
+/**
+* State of one chain, as reported by multi_runner for cross-chain
+* convergence checks.
+*/
+struct chain_diagnostics {
+    size_t iteration;  //!< Iterations the chain has run
+    size_t ntopics;    //!< Dishes other than the new dish
+    size_t ntables;
+    double perplexity; //!< Training perplexity, state::perplexity
+    float alpha;
+    float beta;
+    float gamma;
+};
+
+/**
+* Runs independent chains, one state and runner each, on a pool of
+* threads. States initialized from the same corpus share its documents
+* (a corpus is a handle), so the chains only add their own assignments
+* and counts; shares_corpus() tells whether that is the case.
+*/
+class multi_runner {
+public:
+    multi_runner(const std::vector<std::shared_ptr<state>> &latents,
+                 const std::vector<kernel_config> &schedule);
+
+    multi_runner(const multi_runner &) = delete;
+    multi_runner &operator=(const multi_runner &) = delete;
+
+    inline size_t nchains() const { return runners_.size(); }
+
+    inline runner &chain(size_t i) { return *runners_[i]; }
+
+    inline const runner &chain(size_t i) const { return *runners_[i]; }
+
+    // Whether all chains use the same corpus storage
+    bool shares_corpus() const;
+
+    /**
+    * Run niters iterations of every chain, chain i with rngs[i], on
+    * nthreads threads (0 means one per chain). Results do not depend on
+    * nthreads. Errors of any chain are raised once all threads are done.
+    */
+    void run(std::vector<common::rng_t> &rngs, size_t niters, size_t nthreads = 0);
+
+    /**
+    * Record chain_diagnostics of every chain every `every` iterations (0
+    * turns this off), computing perplexities on perplexity_nthreads
+    * threads per chain. Replaces the chains' monitors.
+    */
+    void set_trace(size_t every, size_t perplexity_nthreads = 1);
+
+    // Diagnostics recorded for chain i so far
+    inline const std::vector<chain_diagnostics> &
+    trace(size_t i) const { return traces_[i]; }
+
+    // Diagnostics of every chain as it is now
+    std::vector<chain_diagnostics> diagnostics(size_t perplexity_nthreads = 1) const;
+
+    /**
+    * Gelman and Rubin's potential scale reduction factor (R-hat) of a
+    * scalar, from one equally long sequence of draws per chain. Values
+    * close to 1 indicate the chains have mixed; needs at least two chains
+    * of two draws.
+    */
+    static double
+    potential_scale_reduction(const std::vector<std::vector<double>> &draws);
+
+private:
+    std::vector<std::unique_ptr<runner>> runners_;
+    std::vector<std::vector<chain_diagnostics>> traces_;
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <microscopes/common/assert.hpp>
+
+#include <vector>
+#include <limits>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Allocator for dish or table ids with O(1) acquire and release.
+*
+* The active ids are kept in a dense list for iteration, in no particular
+* order except that the first id ever acquired (0, the new dish/new table
+* sentinel) stays at position 0 for as long as it is active. Released ids
+* go on a free list and are handed out again, most recently released
+* first, before any new id is used.
+*/
+class slot_list {
+public:
+    typedef std::vector<size_t>::const_iterator const_iterator;
+
+    inline const_iterator begin() const { return ids_.begin(); }
+
+    inline const_iterator end() const { return ids_.end(); }
+
+    // Number of active ids
+    inline size_t size() const { return ids_.size(); }
+
+    inline bool empty() const { return ids_.empty(); }
+
+    inline size_t operator[](size_t i) const { return ids_[i]; }
+
+    // The dense list of active ids
+    inline const std::vector<size_t> &ids() const { return ids_; }
+
+    // Ids that are free for reuse, the next one to be handed out last
+    inline const std::vector<size_t> &free_ids() const { return free_; }
+
+    // One more than the largest id ever handed out
+    inline size_t nslots() const { return pos_.size(); }
+
+    inline bool
+    contains(size_t id) const
+    {
+        return id < pos_.size() && active_[id];
+    }
+
+    // Activate and return a free id, or a new one if there is none
+    inline size_t
+    acquire()
+    {
+        size_t id;
+        if (free_.empty()) {
+            id = pos_.size();
+            pos_.push_back(npos());
+            active_.push_back(false);
+        } else {
+            id = free_.back();
+            free_.pop_back();
+        }
+        activate(id);
+        return id;
+    }
+
+    /**
+    * Activate the given id, which must not be active. Ids between the old
+    * nslots() and id become free.
+    */
+    inline void
+    acquire(size_t id)
+    {
+        MICROSCOPES_DCHECK(!contains(id), "id is already active");
+        while (pos_.size() <= id) {
+            pos_.push_back(free_.size());
+            active_.push_back(false);
+            free_.push_back(pos_.size() - 1);
+        }
+        if (pos_[id] != npos()) {
+            // Unlink from the free list
+            const size_t last = free_.back();
+            free_[pos_[id]] = last;
+            pos_[last] = pos_[id];
+            free_.pop_back();
+        }
+        activate(id);
+    }
+
+    // Deactivate id and put it on the free list
+    inline void
+    release(size_t id)
+    {
+        MICROSCOPES_DCHECK(contains(id), "id is not active");
+        MICROSCOPES_DCHECK(pos_[id] != 0 || ids_.size() == 1, "releasing the sentinel");
+        const size_t last = ids_.back();
+        ids_[pos_[id]] = last;
+        pos_[last] = pos_[id];
+        ids_.pop_back();
+        active_[id] = false;
+        pos_[id] = free_.size();
+        free_.push_back(id);
+    }
+
+    // Deactivate id without putting it on the free list, so it is not
+    // handed out again (as after forget_free())
+    inline void
+    retire(size_t id)
+    {
+        release(id);
+        free_.pop_back();
+        pos_[id] = npos();
+    }
+
+    /**
+    * Replace the contents with the given active ids (in iteration order)
+    * and free ids (the next one to be handed out last), all below nslots.
+    * Ids in neither list are not handed out, as after forget_free().
+    */
+    void
+    assign(const std::vector<size_t> &ids, const std::vector<size_t> &free, size_t nslots)
+    {
+        ids_.clear();
+        free_.clear();
+        pos_.assign(nslots, npos());
+        active_.assign(nslots, false);
+        for (auto id : ids) {
+            MICROSCOPES_CHECK(id < nslots && !active_[id], "bad active id");
+            activate(id);
+        }
+        for (auto id : free) {
+            MICROSCOPES_CHECK(id < nslots && pos_[id] == npos(), "bad free id");
+            pos_[id] = free_.size();
+            free_.push_back(id);
+        }
+    }
+
+    /**
+    * Drop all free ids and make room for ids below n without handing them
+    * out, so acquire() only returns ids >= max(nslots(), n) from now on.
+    */
+    inline void
+    forget_free(size_t n)
+    {
+        for (auto id : free_)
+            pos_[id] = npos();
+        free_.clear();
+        while (pos_.size() < n) {
+            pos_.push_back(npos());
+            active_.push_back(false);
+        }
+    }
+
+private:
+    static inline size_t npos() { return std::numeric_limits<size_t>::max(); }
+
+    inline void
+    activate(size_t id)
+    {
+        pos_[id] = ids_.size();
+        active_[id] = true;
+        ids_.push_back(id);
+    }
+
+    std::vector<size_t> ids_;   //!< active ids
+    std::vector<size_t> free_;  //!< free ids (a stack)
+    std::vector<size_t> pos_;   //!< position of each id in ids_ or free_ (npos() if in neither)
+    std::vector<bool> active_;  //!< whether each id is in ids_
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <microscopes/lda/model.hpp>
+
+#include <cstdint>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* Immutable, dense copy of the topic-word (phi) and document-topic (theta)
+* distributions of a state, taken by state::snapshot().
+*
+* Readers, e.g. inference threads, share a snapshot through a
+* shared_ptr<const snapshot> and never see the live state, so sampling
+* goes on without locks while they run. Topics are the state's dishes
+* other than the new dish 0, in dishes() order.
+*
+* phi is stored word-major, so the topic weights of a word are
+* contiguous, and theta document-major. Rows of both start on a cache
+* line (their strides are padded to a multiple of 16 floats).
+*/
+class snapshot {
+public:
+    // Floats per cache line; row strides are a multiple of it
+    static const size_t row_align = 16;
+
+    explicit snapshot(const state &s);
+
+    ~snapshot();
+
+    snapshot(const snapshot &) = delete;
+    snapshot &operator=(const snapshot &) = delete;
+
+    inline size_t ntopics() const { return K_; }
+
+    inline size_t nwords() const { return V_; }
+
+    inline size_t ndocs() const { return D_; }
+
+    // Dish id in the state of each topic
+    inline const std::vector<size_t> &dishes() const { return dishes_; }
+
+    // Floats between consecutive rows of phi() and theta()
+    inline size_t phi_stride() const { return phi_stride_; }
+
+    inline size_t theta_stride() const { return theta_stride_; }
+
+    // Probability of word v under each topic (ntopics() entries)
+    inline const float *phi(size_t v) const { return phi_ + v * phi_stride_; }
+
+    // Distribution over topics of document eid (ntopics() entries)
+    inline const float *theta(size_t eid) const { return theta_ + eid * theta_stride_; }
+
+    /**
+    * Weight of the new dish in document eid, which theta() leaves out:
+    * the document's distribution over all dishes, dish 0 included, is
+    * new_dish(eid) for dish 0 and (1 - new_dish(eid)) * theta(eid) for the
+    * topics.
+    */
+    inline float new_dish(size_t eid) const { return new_dish_[eid]; }
+
+    float alpha_;
+    float beta_;
+    float gamma_;
+
+private:
+    size_t K_;
+    size_t V_;
+    size_t D_;
+    size_t phi_stride_;
+    size_t theta_stride_;
+    std::vector<size_t> dishes_;
+    std::vector<float> new_dish_;
+    float *phi_;   //!< V x phi_stride_, cache line aligned
+    float *theta_; //!< D x theta_stride_, cache line aligned
+};
+
+/**
+* Flat copy of the assignments of a state, taken by state::seating(), in
+* arrays that can be handed out as they are (e.g. as NumPy buffers)
+* instead of as nested containers. The tokens of document eid are
+* [token_offsets[eid], token_offsets[eid + 1]) of tables and dishes, its
+* table slots [table_offsets[eid], table_offsets[eid + 1]) of
+* table_dishes. Slots of deleted tables keep the dish they last had, as
+* in state::dish_assignments().
+*/
+struct seating {
+    explicit seating(const state &s);
+
+    std::vector<uint64_t> token_offsets; //!< ndocs + 1
+    std::vector<uint32_t> tables;        //!< Table of each token (t_ji)
+    std::vector<uint32_t> dishes;        //!< Dish of each token (k_jt of its table)
+    std::vector<uint64_t> table_offsets; //!< ndocs + 1
+    std::vector<uint32_t> table_dishes;  //!< Dish of each table slot (k_jt)
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -1,11 +1,22 @@
 #pragma once
 
 #include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include <set>
 
 namespace lda_util {
 
+    // lgamma without std::lgamma's write to the global signgam, so chains
+    // on several threads (see runner.hpp) can score at the same time
+    inline double
+    log_gamma(double x){
+        int sign;
+        return lgamma_r(x, &sign);
+    }
+
     inline bool
     valid_probability_vector(const std::vector<float> &p){
         float sum = 0;
@@ -70,6 +81,34 @@ namespace lda_util {
         vec /= vec.sum();
     }
 
+    /**
+    * Call f(thread, first, last) for the ranges [first, last) of chunk
+    * items that make up [0, n). Chunks are handed out to nthreads threads,
+    * the calling one included, numbered 0 to nthreads - 1; f must be safe
+    * to call concurrently for different threads.
+    */
+    template<typename F>
+    void
+    parallel_chunks(size_t n, size_t chunk, size_t nthreads, F f){
+        const size_t nchunks = (n + chunk - 1) / chunk;
+        nthreads = std::max<size_t>(1, std::min(nthreads, nchunks));
+        std::atomic<size_t> next(0);
+        auto work = [&](size_t thread){
+            for(;;){
+                const size_t first = next.fetch_add(chunk);
+                if(first >= n)
+                    break;
+                f(thread, first, std::min(n, first + chunk));
+            }
+        };
+        std::vector<std::thread> workers;
+        for(size_t p = 1; p < nthreads; ++p)
+            workers.push_back(std::thread(work, p));
+        work(0);
+        for(auto &w: workers)
+            w.join();
+    }
+
     template<class T, class J>
     class defaultdict{
         J default_value;
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <microscopes/common/assert.hpp>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace microscopes {
+namespace lda {
+
+/**
+* A vector whose first elements can be dropped in amortized O(1) each,
+* for the per-document and per-token bookkeeping of a sliding window of
+* documents (see state::retire_documents).
+*
+* Dropped elements stay in place, behind an offset, until they outnumber
+* the live ones; only then are the live elements moved to the front, so
+* each element is moved at most once per time the window has turned over.
+* Otherwise it behaves like the vector of its live elements. Dropping
+* invalidates references and iterators as erasing would.
+*/
+template <typename T>
+class window_vector {
+public:
+    typedef T value_type;
+    typedef typename std::vector<T>::iterator iterator;
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    window_vector() : first_(0) {}
+
+    explicit window_vector(size_t n, const T &x = T()) : items_(n, x), first_(0) {}
+
+    template <typename It>
+    window_vector(It first, It last) : items_(first, last), first_(0) {}
+
+    inline size_t size() const { return items_.size() - first_; }
+
+    inline bool empty() const { return size() == 0; }
+
+    inline T &operator[](size_t i) { return items_[first_ + i]; }
+
+    inline const T &operator[](size_t i) const { return items_[first_ + i]; }
+
+    inline T *data() { return items_.data() + first_; }
+
+    inline const T *data() const { return items_.data() + first_; }
+
+    inline iterator begin() { return items_.begin() + first_; }
+
+    inline iterator end() { return items_.end(); }
+
+    inline const_iterator begin() const { return items_.begin() + first_; }
+
+    inline const_iterator end() const { return items_.end(); }
+
+    inline T &back() { return items_.back(); }
+
+    inline const T &back() const { return items_.back(); }
+
+    inline void push_back(const T &x) { items_.push_back(x); }
+
+    inline void push_back(T &&x) { items_.push_back(std::move(x)); }
+
+    inline void resize(size_t n) { items_.resize(first_ + n); }
+
+    inline void resize(size_t n, const T &x) { items_.resize(first_ + n, x); }
+
+    inline void
+    clear()
+    {
+        items_.clear();
+        first_ = 0;
+    }
+
+    inline void
+    swap(window_vector &other)
+    {
+        items_.swap(other.items_);
+        std::swap(first_, other.first_);
+    }
+
+    // Drop the first n elements
+    void
+    drop_front(size_t n)
+    {
+        MICROSCOPES_DCHECK(n <= size(), "dropping more elements than there are");
+        first_ += n;
+        if (first_ > size()) {
+            items_.erase(items_.begin(), items_.begin() + first_);
+            first_ = 0;
+        }
+    }
+
+    // A copy of the live elements
+    inline operator std::vector<T>() const { return std::vector<T>(begin(), end()); }
+
+    inline bool
+    operator==(const window_vector &other) const
+    {
+        return size() == other.size() && std::equal(begin(), end(), other.begin());
+    }
+
+    inline bool operator!=(const window_vector &other) const { return !(*this == other); }
+
+private:
+    std::vector<T> items_;
+    size_t first_; //!< Number of dropped elements at the front of items_
+};
+
+} // namespace lda
+} // namespace microscopes
@@ -1,7 +1,19 @@
+from libc.stddef cimport size_t
 from _model_h cimport state
 from microscopes.common._random_fwd_h cimport rng_t
 
+cdef extern from "microscopes/lda/kernels.hpp" namespace "microscopes::kernels::lda_crp_mh":
+    cdef cppclass proposal_cache:
+        proposal_cache()
+        void clear()
+
 cdef extern from "microscopes/lda/kernels.hpp":
     void lda_crp_gibbs  "microscopes::kernels::lda_crp_gibbs" (state &, rng_t &)
+    void lda_crp_gibbs_parallel  "microscopes::kernels::lda_crp_gibbs" (state &, rng_t &, size_t)
+    void lda_crp_gibbs_range  "microscopes::kernels::lda_crp_gibbs_range" (state &, rng_t &, size_t, size_t) except +
     void sample_gamma  "microscopes::kernels::lda_hyperparameters::sample_gamma" (state &, rng_t &, float, float)
-    void sample_alpha  "microscopes::kernels::lda_hyperparameters::sample_alpha" (state &, rng_t &, float, float)
\ No newline at end of file
+    void sample_alpha  "microscopes::kernels::lda_hyperparameters::sample_alpha" (state &, rng_t &, float, float)
+    bint sample_beta  "microscopes::kernels::lda_hyperparameters::sample_beta" (state &, float, float, size_t)
+    void lda_crp_sparse_gibbs  "microscopes::kernels::lda_crp_sparse_gibbs" (state &, rng_t &)
+    void lda_crp_mh_gibbs  "microscopes::kernels::lda_crp_mh_gibbs" (state &, proposal_cache &, rng_t &)
+    void lda_crp_block_gibbs  "microscopes::kernels::lda_crp_block_gibbs" (state &, rng_t &, size_t, size_t) except +
@@ -1,18 +1,56 @@
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
+from libcpp.utility cimport pair
 from libc.stddef cimport size_t
 
 from microscopes.common._rng cimport rng
 from microscopes.lda._model_h cimport (
     state as c_state,
+    corpus as c_corpus,
+    snapshot as c_snapshot,
+    seating as c_seating,
+    posterior_average as c_posterior_average,
+    inference as c_inference,
+    instrumentation as c_instrumentation,
+    phase_counters as c_phase_counters,
+    instrumentation_enabled as c_instrumentation_enabled,
+    token_t,
+    load_ldac as c_load_ldac,
+    save_corpus as c_save_corpus,
+    map_corpus as c_map_corpus,
     initialize as c_initialize,
     initialize_explicit as c_initialize_explicit,
+    load_checkpoint as c_load_checkpoint,
+    load_checkpoint_with_corpus as c_load_checkpoint_with_corpus,
+    count_layout,
+    sparse_layout,
+    topic_major_layout,
+    word_major_layout,
+    sparse_word_major_layout,
 )
 from microscopes._shared_ptr_h cimport shared_ptr
 from microscopes.lda.definition cimport model_definition
 
 
+cdef class corpus:
+    cdef shared_ptr[c_corpus] _thisptr
+
+
+cdef class snapshot:
+    cdef shared_ptr[const c_snapshot] _thisptr
+    cdef _vocab
+
+
+cdef class seating:
+    cdef shared_ptr[const c_seating] _thisptr
+
+
+cdef class inference:
+    cdef shared_ptr[c_inference] _thisptr
+    cdef _word_ids
+
+
 cdef class state:
     """The underlying state of a Hierarchial Dirichlet Process LDA
 
@@ -22,4 +60,9 @@ cdef class state:
     cdef shared_ptr[c_state] _thisptr
     cdef model_definition _defn
     cdef _vocab
-    cdef vector[vector[size_t]] _data
+    cdef corpus _data
+
+
+cdef class posterior_average:
+    cdef shared_ptr[c_posterior_average] _thisptr
+    cdef state _latent
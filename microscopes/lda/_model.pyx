@@ -1,4 +1,6 @@
 # cython: embedsignature=True
+from cpython.buffer cimport PyBUF_FORMAT, PyBUF_ND, PyBUF_STRIDES, PyBUF_WRITABLE
+
 import itertools
 import numpy as np
 import warnings
@@ -6,7 +8,6 @@ import warnings
 from microscopes.common import validator
 from copy import deepcopy
 from itertools import chain
-from collections import Counter
 
 from microscopes.lda import utils
 from microscopes.io.schema_pb2 import LdaModelState
@@ -25,6 +26,203 @@ def deprecated(func):
 
 DEFAULT_INITIAL_DISH_HINT = 10
 
+_COUNT_LAYOUTS = {
+    'sparse': sparse_layout,
+    'topic_major': topic_major_layout,
+    'word_major': word_major_layout,
+    'sparse_word_major': sparse_word_major_layout,
+}
+
+# numpy dtype of the word ids stored by corpus (see LDA_TOKEN_BITS)
+_TOKEN_DTYPE = np.uint16 if sizeof(token_t) == 2 else np.uint32
+
+
+cdef dict _phase_dict(const c_phase_counters &p):
+    return {'calls': p.calls,
+            'cycles': p.cycles,
+            'seconds': p.nanoseconds * 1e-9}
+
+
+cdef class _buffer:
+    """Read-only buffer over memory owned by C++, which `_owner` keeps
+    alive; `_view` wraps it in a NumPy array without copying.
+    """
+    cdef object _owner
+    cdef void *_data
+    cdef bytes _format
+    cdef Py_ssize_t _itemsize
+    cdef int _ndim
+    cdef Py_ssize_t _shape[2]
+    cdef Py_ssize_t _strides[2]
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        cdef Py_ssize_t n = self._itemsize
+        cdef int i
+        contiguous = True
+        for i in reversed(range(self._ndim)):
+            if self._strides[i] != n:
+                contiguous = False
+            n *= self._shape[i]
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("buffer is read-only")
+        if not contiguous and (flags & PyBUF_STRIDES) != PyBUF_STRIDES:
+            raise BufferError("buffer is not contiguous")
+        buffer.buf = self._data
+        buffer.obj = self
+        buffer.len = n
+        buffer.readonly = 1
+        buffer.itemsize = self._itemsize
+        buffer.format = NULL
+        if flags & PyBUF_FORMAT:
+            buffer.format = self._format
+        buffer.ndim = self._ndim
+        buffer.shape = NULL
+        if (flags & PyBUF_ND) == PyBUF_ND:
+            buffer.shape = self._shape
+        buffer.strides = NULL
+        if (flags & PyBUF_STRIDES) == PyBUF_STRIDES:
+            buffer.strides = self._strides
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+
+cdef _view(owner, const void *data, dtype, shape, strides=None):
+    """Read-only array of `dtype` over `data`, which `owner` keeps alive.
+    `strides` are in bytes; by default the array is C contiguous.
+    """
+    dtype = np.dtype(dtype)
+    if 0 in shape:
+        return np.empty(shape, dtype=dtype)
+    cdef _buffer b = _buffer.__new__(_buffer)
+    cdef Py_ssize_t step = dtype.itemsize
+    cdef int i
+    b._owner = owner
+    b._data = <void *>data
+    b._format = dtype.char
+    b._itemsize = dtype.itemsize
+    b._ndim = len(shape)
+    for i in reversed(range(b._ndim)):
+        b._shape[i] = shape[i]
+        b._strides[i] = step if strides is None else strides[i]
+        step *= shape[i]
+    return np.asarray(b)
+
+
+
+cdef class corpus:
+    """Documents stored as one flat array of word ids plus document offsets
+    (compressed sparse row form) on the C++ side, instead of one Python list
+    per document.
+
+    Construct from a list of lists of word ids, or with `corpus_from_arrays`
+    to skip the lists altogether. Indexing and iteration give documents as
+    lists of word ids.
+    """
+    def __cinit__(self, docs=None):
+        cdef vector[vector[size_t]] c_docs
+        if docs is None:
+            self._thisptr.reset(new c_corpus())
+        else:
+            c_docs = docs
+            self._thisptr.reset(new c_corpus(c_docs))
+
+    def __len__(self):
+        return self._thisptr.get().ndocs()
+
+    def __getitem__(self, size_t eid):
+        cdef c_corpus *c = self._thisptr.get()
+        if eid >= c.ndocs():
+            raise IndexError("document index out of range")
+        return [c.word(eid, i) for i in xrange(c.size(eid))]
+
+    def __iter__(self):
+        for eid in xrange(len(self)):
+            yield self[eid]
+
+    def ntokens(self):
+        """Total number of words in all documents
+        """
+        return self._thisptr.get().ntokens()
+
+    def max_word(self):
+        """Largest word id in the corpus
+        """
+        return self._thisptr.get().max_word()
+
+
+def corpus_from_arrays(tokens, offsets):
+    """Build a `corpus` straight from CSR arrays, without Python lists.
+
+    Parameters
+    ----------
+    tokens : word ids of all documents back to back (any integer array-like)
+    offsets : document boundaries; document i is
+        tokens[offsets[i]:offsets[i + 1]], so there is one more offset than
+        there are documents
+    """
+    raw_tokens = np.asarray(tokens)
+    if raw_tokens.size and (raw_tokens.min() < 0 or
+                            raw_tokens.max() > np.iinfo(_TOKEN_DTYPE).max):
+        raise ValueError("word ids must fit in {}".format(
+            np.dtype(_TOKEN_DTYPE).name))
+    raw_offsets = np.asarray(offsets, dtype=np.int64)
+    if raw_offsets.ndim != 1 or raw_offsets.size < 1 or \
+            np.any(np.diff(raw_offsets) < 0) or raw_offsets[0] < 0 or \
+            raw_offsets[-1] > raw_tokens.size:
+        raise ValueError("offsets must be non-decreasing indices into tokens")
+
+    token_array = np.ascontiguousarray(raw_tokens, dtype=_TOKEN_DTYPE)
+    offset_array = np.ascontiguousarray(raw_offsets, dtype=np.uintp)
+    cdef token_t[::1] token_view = token_array
+    cdef size_t[::1] offset_view = offset_array
+    cdef const token_t *token_ptr = NULL
+    if token_view.shape[0]:
+        token_ptr = &token_view[0]
+
+    cdef corpus ret = corpus()
+    ret._thisptr.reset(new c_corpus(
+        token_ptr, &offset_view[0], offset_view.shape[0] - 1))
+    return ret
+
+
+def load_ldac(path):
+    """Parse an LDA-C file straight into a `corpus`.
+
+    Gives the same documents as `utils.docs_from_ldac`, without building
+    Python lists along the way.
+
+    Parameters
+    ----------
+    path : name of the LDA-C file
+    """
+    cdef corpus ret = corpus()
+    ret._thisptr.reset(new c_corpus(c_load_ldac(path)))
+    return ret
+
+
+def save_corpus(corpus docs, path):
+    """Write `docs` to a binary corpus file, to be opened with `map_corpus`.
+
+    The file holds word ids of the width the extension was built with
+    (LDA_TOKEN_BITS) in native byte order.
+    """
+    c_save_corpus(docs._thisptr.get()[0], path)
+
+
+def map_corpus(path):
+    """Memory map a binary corpus file written by `save_corpus`.
+
+    The tokens are not copied: the corpus, and any state initialized from
+    it, read them from the read-only mapping, whose pages are shared by all
+    processes on the host that map the same file.
+    """
+    cdef corpus ret = corpus()
+    ret._thisptr.reset(new c_corpus(c_map_corpus(path)))
+    return ret
+
 
 cdef class state:
     """The underlying state of an HDP-LDA
@@ -35,27 +233,55 @@ cdef class state:
     This class is not meant to be sub-classed.
     """
     def __cinit__(self, model_definition defn,
-                  vector[vector[size_t]] data,
+                  data,
                   vocab, **kwargs):
         # Save and validate model definition
         self._defn = defn
+        if 'checkpoint' in kwargs:
+            # Restore from a binary checkpoint (see load_checkpoint)
+            validator.validate_kwargs(kwargs, ('checkpoint',))
+            if data is None:
+                self._thisptr = c_load_checkpoint(kwargs['checkpoint'])
+            else:
+                if not isinstance(data, corpus):
+                    data = corpus(data)
+                self._thisptr = c_load_checkpoint_with_corpus(
+                    kwargs['checkpoint'], (<corpus>data)._thisptr.get()[0])
+            if self._thisptr.get().nentities() != defn.n or \
+                    self._thisptr.get().nwords() != defn.v:
+                raise ValueError("checkpoint does not match model definition")
+            self._data = corpus()
+            self._data._thisptr.reset(new c_corpus(self._thisptr.get().x_ji))
+            if vocab is None:
+                vocab = {i: i for i in xrange(defn.v)}
+            validator.validate_len(vocab, defn.v, "vocab_lookup")
+            self._vocab = vocab
+            return
+
         self._vocab = vocab
+        if not isinstance(data, corpus):
+            data = corpus(data)
         self._data = data
         validator.validate_len(data, defn.n, "data")
 
-        for doc in data:
-            for word in doc:
-                if word >= defn.v:
-                    raise ValueError("Word index out of bounds.")
+        if data.ntokens() and data.max_word() >= defn.v:
+            raise ValueError("Word index out of bounds.")
 
         # Validate kwargs
         valid_kwargs = ('r', 'dish_hps', 'vocab_hp',
                         'initial_dishes',
                         'topic_assignments',
                         'dish_assignments',
-                        'table_assignments',)
+                        'table_assignments',
+                        'count_layout',)
         validator.validate_kwargs(kwargs, valid_kwargs)
 
+        layout_name = kwargs.get('count_layout', 'sparse')
+        if layout_name not in _COUNT_LAYOUTS:
+            raise ValueError("count_layout must be one of {}".format(
+                sorted(_COUNT_LAYOUTS.keys())))
+        cdef count_layout layout = _COUNT_LAYOUTS[layout_name]
+
         # Save and validate hyperparameters
         dish_hps = kwargs.get('dish_hps', None)
         if dish_hps is None:
@@ -75,8 +301,9 @@ cdef class state:
                 beta=vocab_hp,
                 gamma=dish_hps['gamma'],
                 initial_dishes=dishes_and_tables['initial_dishes'],
-                docs=data,
-                rng=(<rng> kwargs['r']  )._thisptr[0])
+                docs=self._data._thisptr.get()[0],
+                rng=(<rng> kwargs['r']  )._thisptr[0],
+                layout=layout)
         elif "table_assignments" in dishes_and_tables \
                 and "dish_assignments" in dishes_and_tables:
 
@@ -87,7 +314,8 @@ cdef class state:
                 gamma=dish_hps['gamma'],
                 dish_assignments=dishes_and_tables['dish_assignments'],
                 table_assignments=dishes_and_tables['table_assignments'],
-                docs=data)
+                docs=self._data._thisptr.get()[0],
+                layout=layout)
         else:
             raise NotImplementedError(("Specify either: (1) initial_dishes or"
                 "(2) table_assignments and dish_assignments."))
@@ -104,8 +332,84 @@ cdef class state:
         def __get__(self): return self._thisptr.get().beta_
         def __set__(self, beta): self._thisptr.get().beta_ = beta
 
-    def perplexity(self):
-        return self._thisptr.get().perplexity()
+    def perplexity(self, eids=None, nthreads=1):
+        """Perplexity of the training documents under the current state.
+
+        Computed from the counts, so it is cheap enough to log every
+        iteration. Pass document indices as `eids` to evaluate a sample
+        of the documents, and `nthreads` to spread them over threads; for
+        held-out documents use `inference.perplexity`.
+        """
+        cdef vector[size_t] c_eids = self._eids(eids)
+        cdef size_t c_nthreads = _nthreads(nthreads)
+        cdef double p
+        with nogil:
+            p = self._thisptr.get().perplexity(c_eids, c_nthreads)
+        return p
+
+    def log_likelihood(self, eids=None, nthreads=1):
+        """Log-likelihood of the words of the documents `eids` (all
+        documents by default), as used by `perplexity`.
+        """
+        cdef vector[size_t] c_eids = self._eids(eids)
+        cdef size_t c_nthreads = _nthreads(nthreads)
+        cdef double ll
+        with nogil:
+            ll = self._thisptr.get().log_likelihood(c_eids, c_nthreads)
+        return ll
+
+    def _eids(self, eids):
+        if eids is None:
+            return range(self.nentities())
+        return list(eids)
+
+    def score_assignment(self):
+        """log p(table and dish assignments | alpha, gamma) under the
+        Chinese restaurant franchise; maintained by the sampler, so reading
+        it is cheap enough to monitor mixing every iteration.
+        """
+        return self._thisptr.get().score_assignment()
+
+    def score_data(self, rng r=None):
+        """log p(words | assignments, beta), the Dirichlet-multinomial
+        likelihood of the words given their topics. `r` is not used.
+        """
+        if r is None:
+            r = rng()
+        return self._thisptr.get().score_data(r._thisptr[0])
+
+    def snapshot(self):
+        """Immutable copy of the current topics and document mixtures.
+
+        See `snapshot`; the state can go on sampling while it is read.
+        """
+        return snapshot(self)
+
+    def seating(self):
+        """Flat copy of the assignments as NumPy arrays; see `seating`"""
+        return seating(self)
+
+    def topic_term_matrix(self):
+        """Dense float32 array of shape (ntopics(), nwords()), the
+        distribution over word ids of each topic (phi), in the topic order
+        of `word_distribution_by_topic()`. A read-only view of a
+        `snapshot`, which it keeps alive.
+        """
+        return self.snapshot().topic_word()
+
+    def document_topic_matrix(self):
+        """Dense float32 array of shape (nentities(), ntopics()), the
+        distribution over topics of each document (theta), as
+        `topic_distribution_by_document()`; a read-only view of a
+        `snapshot`.
+        """
+        return self.snapshot().document_topic()
+
+    def posterior_average(self, burnin=0, thin=1, min_weight=0):
+        """Running average of the topics and document mixtures of this
+        state over a chain; see `posterior_average`.
+        """
+        return posterior_average(self, burnin, thin, min_weight)
 
     def nentities(self):
         """Get number of entities/documents in model.
@@ -173,12 +477,8 @@ cdef class state:
 
         Commonly called Theta in the probablistic topic modeling literature.
         """
-        doc_distribution = self._thisptr.get()[0].document_distribution()
-        # Remove dummy topic
-        distributions = [topic_distribution[1:] for topic_distribution in doc_distribution]
-        # Normalize
-        distributions = [[i/sum(d) for i in d] for d in distributions]
-        return distributions
+        # The snapshot already leaves out the dummy topic and renormalizes
+        return self.snapshot().document_topic().tolist()
 
     @deprecated
     def word_distribution(self, rng r=None):
@@ -193,19 +493,44 @@ cdef class state:
 
         Commoly called Phi in the probablistic topic modeling literature.
         """
-        num_distribution_by_topic = self._thisptr.get()[0].word_distribution()
-        # C++ returns a list of maps from integer representation of terms to
-        # probabilities. Return the Python user a list of maps from the original
-        # words (hashable objects) to probabilities.
-        word_distribution_by_topic = []
-        for num_dist in num_distribution_by_topic:
-            word_dist = {}
-            for num, prob in num_dist.iteritems():
-                word = self._vocab[num]
-                word_dist[word] = prob
-            word_distribution_by_topic.append(word_dist)
-        return word_distribution_by_topic
+        # Map the integer representation of terms back to the original
+        # words (hashable objects)
+        words = [self._vocab[num] for num in xrange(self.nwords())]
+        return [dict(zip(words, topic.tolist()))
+                for topic in self.snapshot().topic_word()]
+
+
+    def add_documents(self, data):
+        """Append documents to the live state and return their ids.
+
+        `data` is a list of documents of words in the vocabulary, or a
+        `corpus` of word ids. The new words are not seated until a sweep
+        over them, e.g. `kernels.lda_crp_gibbs_range(s, r, ids[0],
+        s.nentities())`, which only costs as much as the new documents.
+        """
+        if not isinstance(data, corpus):
+            word_ids = {word: num for num, word in self._vocab.iteritems()}
+            for doc in data:
+                for word in doc:
+                    if word not in word_ids:
+                        raise ValueError("Word {} is not in the vocabulary".format(word))
+            data = corpus([[word_ids[word] for word in doc] for doc in data])
+        cdef size_t first = self._thisptr.get().add_documents((<corpus>data)._thisptr.get()[0])
+        self._documents_changed()
+        return range(first, self.nentities())
+
+    def retire_documents(self, n):
+        """Drop the `n` oldest documents, taking their words out of the
+        counts, and renumber the others from 0, e.g. to keep a sliding
+        window over a stream of documents.
+        """
+        self._thisptr.get().retire_documents(n)
+        self._documents_changed()
 
+    def _documents_changed(self):
+        self._data = corpus()
+        self._data._thisptr.reset(new c_corpus(self._thisptr.get().x_ji))
+        self._defn = model_definition(self._thisptr.get().nentities(), self._defn.v)
 
     def serialize(self):
         """Serialize state object as a string
@@ -228,6 +553,17 @@ cdef class state:
         proto_lda.vocab.extend([word for _, word in sorted(self._vocab.items())])
         return proto_lda.SerializeToString()
 
+    def save_checkpoint(self, path, include_corpus=True):
+        """Write a binary checkpoint of the state to the file at `path`
+
+        The assignments and hyperparameters are streamed straight from
+        the C++ state, without going through Python lists. With
+        `include_corpus=False` only a hash of the documents is written, and
+        the same documents have to be passed to `load_checkpoint`. The
+        vocabulary is not saved.
+        """
+        self._thisptr.get().save_checkpoint(path, include_corpus)
+
     def _can_serialize(self):
         return all(isinstance(word, str) for word in self._vocab.values())
 
@@ -246,19 +582,18 @@ cdef class state:
         """
         sorted_num_vocab = sorted(self._vocab.keys())
 
-        topic_term_distribution = []
-        for topic in self.word_distribution_by_topic():
-            t = [topic[self._vocab[word_id]]
-                 for word_id in sorted_num_vocab]
-            topic_term_distribution.append(t)
+        snap = self.snapshot()
+        # Columns are word ids, which run over sorted_num_vocab; both are
+        # views of the snapshot rather than copies
+        topic_term_distribution = snap.topic_word()
+        doc_topic_distribution = snap.document_topic()
 
-        doc_topic_distribution = self.topic_distribution_by_document()
-
-        doc_lengths = [len(doc) for doc in self._data]
+        cdef c_state *c = self._thisptr.get()
+        doc_lengths = [c.nterms(eid) for eid in xrange(c.nentities())]
         vocab = [self._vocab[k] for k in sorted_num_vocab]
 
-        ctr = self._corpus_term_id_frequency()
-        term_frequency = [ctr[num] for num in sorted_num_vocab]
+        tf = self.term_frequency()
+        term_frequency = [tf[num] for num in sorted_num_vocab]
 
         return {'topic_term_dists': topic_term_distribution,
                 'doc_topic_dists': doc_topic_distribution,
@@ -266,46 +601,65 @@ cdef class state:
                 'vocab': vocab,
                 'term_frequency': term_frequency}
 
-    def _corpus_term_id_frequency(self):
-        flatten = lambda l: list(itertools.chain.from_iterable(l))
-        ctr = Counter(flatten(self._data))
-        return ctr
-
-    def _corpus_term_frequency(self):
-        flatten = lambda l: list(itertools.chain.from_iterable(l))
-        flat_data = flatten(self._data)
-        flat_vocab = [self._vocab[tid] for tid in flat_data]
-        ctr = Counter(flat_vocab)
-        return ctr
-
-    def term_relevance_by_topic(self, weight=0.5):
-        """For each topic, get terms sorted by relevance.
-
-        Relevance metric is defined by Sievert and Shirley (2004).
-        It is a weighted average of the log probability of a word
-        occurring in a topic and the log lift of assigning the word
-        to the topic.
+    def term_frequency(self):
+        """Occurrences of each word id in the documents, as an int array;
+        counted once in C++ and kept up to date by `add_documents` and
+        `retire_documents`.
         """
-        phi = self.word_distribution_by_topic()
-        ctf = self._corpus_term_frequency()
-        relevance_by_topic = []
-        for word_dist in phi:
-            term_relevance = []
-            for term, phi_kw in word_dist.iteritems():
-                p_w = ctf[term]
-                rel = self._relevance_for_word(phi_kw, p_w, weight)
-                term_relevance.append((term, rel))
-            term_relevance_s = sorted(term_relevance, key=lambda r: r[1], reverse=True)
-            relevance_by_topic.append(term_relevance_s)
-        return relevance_by_topic
-
-    def _relevance_for_word(self, phi_kw, p_w, weight=0.5):
-        """Defined in LDAvis: A method for visualizing and interpreting topics (2014)
-        by Sievert and Shirley
+        return np.array(self._thisptr.get().term_frequency(), dtype=np.int64)
+
+    def instrumentation(self):
+        """Counters of the sampler since the state was created or
+        `reset_instrumentation` was called, as a dict of numbers for
+        export to a metrics system:
+
+        * `enabled`: whether the extensions were built with
+          LDA_INSTRUMENT; the counters below are all zero otherwise
+        * `table_phase`, `dish_phase`: `calls`, `cycles` and `seconds`
+          spent by the crf kernel seating words at tables and tables at
+          dishes
+        * `tables_created`, `tables_deleted`, `dishes_created`,
+          `dishes_deleted`: seating events of all kernels
+        * `table_count_histogram`: number of documents by number of
+          tables, always available
         """
-        return weight * np.log(phi_kw) + \
-            (1 - weight) * np.log(phi_kw / p_w)
+        cdef c_instrumentation c = self._thisptr.get().counters()
+        return {'enabled': c_instrumentation_enabled,
+                'table_phase': _phase_dict(c.table_phase),
+                'dish_phase': _phase_dict(c.dish_phase),
+                'tables_created': c.tables_created,
+                'tables_deleted': c.tables_deleted,
+                'dishes_created': c.dishes_created,
+                'dishes_deleted': c.dishes_deleted,
+                'table_count_histogram': list(self._thisptr.get().table_count_histogram())}
+
+    def reset_instrumentation(self):
+        """Zero the counters of `instrumentation`"""
+        self._thisptr.get().reset_counters()
+
+    def term_relevance_by_topic(self, weight=0.5, top_n=None, nthreads=1):
+        """For each topic, get terms sorted by relevance.
 
+        Relevance metric is defined by Sievert and Shirley (2014):
+        `weight * log(phi_kw) + (1 - weight) * log(phi_kw / p_w)`, a
+        weighted average of the log probability of a word occurring in a
+        topic and the log lift of assigning the word to the topic, with
+        `p_w` the share of the word among the corpus tokens. Returns one
+        list of `(term, relevance)` pairs per topic, the `top_n` most
+        relevant terms (all by default), computed in C++ with a partial
+        sort per topic on `nthreads` threads.
+        """
+        if not 0 <= weight <= 1:
+            raise ValueError("weight must be between 0 and 1")
+        cdef size_t c_top_n = self.nwords() if top_n is None else top_n
+        cdef size_t c_nthreads = _nthreads(nthreads)
+        cdef float c_weight = weight
+        cdef vector[vector[pair[size_t, float]]] rel
+        with nogil:
+            rel = self._thisptr.get().term_relevance(c_weight, c_top_n, c_nthreads)
+        # Converted to lists of (word id, relevance) tuples
+        by_topic = rel
+        return [[(self._vocab[w], r) for w, r in topic] for topic in by_topic]
 
     def predict(self, data, prng=None, max_iter=20, tol=1e-16):
         """Predict topic distributions for documents
@@ -315,6 +669,10 @@ cdef class state:
 
         cf. https://github.com/ariddell/lda/blob/055f12ed76ac33c43e26b22060e0c6435487eeb7/lda/lda.py#L180-L210
 
+        Snapshots the current topics into an `inference` object and folds
+        the documents in on the C++ side. To score many batches against the
+        same topics, create the `inference` object once instead.
+
         Parameters
         ----------
         data : document or list of documents
@@ -326,25 +684,274 @@ cdef class state:
         -------
         list of topic distributions for each input document
         """
-        if not isinstance(data[0], list):
+        theta = inference(self).predict(data, max_iter, tol).astype(np.float64)
+        theta /= theta.sum(axis=1)[:, np.newaxis]
+        return theta.tolist()
+
+cdef class snapshot:
+    """Immutable copy of the topics and document mixtures of a `state`.
+
+    Taken by `state.snapshot()`. The copy lives in C++ and is shared by
+    the `inference` objects made from it, so any number of readers can
+    use it while the state goes on sampling. Topics are in the order of
+    `state.word_distribution_by_topic()`.
+    """
+    def __cinit__(self, state s):
+        self._thisptr = s._thisptr.get().take_snapshot()
+        self._vocab = s._vocab
+
+    def ntopics(self):
+        return self._thisptr.get().ntopics()
+
+    def nwords(self):
+        return self._thisptr.get().nwords()
+
+    def ndocs(self):
+        return self._thisptr.get().ndocs()
+
+    @property
+    def beta(self):
+        return self._thisptr.get().beta_
+
+    def topic_word(self):
+        """float32 array of shape (ntopics(), nwords()): the distribution
+        over word ids of each topic (phi). A read-only view of the
+        snapshot's memory (phi is stored word major, so the array is not C
+        contiguous); it keeps the snapshot alive.
+        """
+        cdef const c_snapshot *c = self._thisptr.get()
+        return _view(self, c.phi(0), np.float32, (c.ntopics(), c.nwords()),
+                     (sizeof(float), c.phi_stride() * sizeof(float)))
+
+    def document_topic(self):
+        """float32 array of shape (ndocs(), ntopics()): the distribution
+        over topics of each training document (theta). A read-only view of
+        the snapshot's memory, whose rows are padded to a cache line.
+        """
+        cdef const c_snapshot *c = self._thisptr.get()
+        return _view(self, c.theta(0), np.float32, (c.ndocs(), c.ntopics()),
+                     (c.theta_stride() * sizeof(float), sizeof(float)))
+
+
+cdef class seating:
+    """Flat copy of the assignments of a `state`, taken by
+    `state.seating()`, as read-only NumPy arrays over C++ memory.
+
+    The words of document `eid` are `token_offsets()[eid]` up to
+    `token_offsets()[eid + 1]` of `tables()` and `dishes()`, its table
+    slots `table_offsets()[eid]` up to `table_offsets()[eid + 1]` of
+    `table_dishes()`; these are the flat forms of `table_assignments()`,
+    `assignments()` and `dish_assignments()`.
+    """
+    def __cinit__(self, state s):
+        self._thisptr = s._thisptr.get().take_seating()
+
+    def token_offsets(self):
+        cdef c_seating *c = <c_seating *>self._thisptr.get()
+        return _view(self, c.token_offsets.data(), np.uint64, (c.token_offsets.size(),))
+
+    def tables(self):
+        """Table of each word"""
+        cdef c_seating *c = <c_seating *>self._thisptr.get()
+        return _view(self, c.tables.data(), np.uint32, (c.tables.size(),))
+
+    def dishes(self):
+        """Dish (topic) of each word"""
+        cdef c_seating *c = <c_seating *>self._thisptr.get()
+        return _view(self, c.dishes.data(), np.uint32, (c.dishes.size(),))
+
+    def table_offsets(self):
+        cdef c_seating *c = <c_seating *>self._thisptr.get()
+        return _view(self, c.table_offsets.data(), np.uint64, (c.table_offsets.size(),))
+
+    def table_dishes(self):
+        """Dish of each table slot; deleted tables keep their last dish"""
+        cdef c_seating *c = <c_seating *>self._thisptr.get()
+        return _view(self, c.table_dishes.data(), np.uint32, (c.table_dishes.size(),))
+
+
+cdef class posterior_average:
+    """Running average of the topics and document mixtures of a `state`
+    over the samples of a chain, kept in C++ without storing the samples.
+
+    Call `update()` once per iteration (or hand the object to
+    `runner.set_average`): the first `burnin` calls are skipped and after
+    that every `thin`-th state is added. Topics are dish ids, in
+    increasing order (`dishes()`). With `min_weight > 0` counts whose
+    running mean falls below it are dropped, so every averaged value is
+    off by less than `min_weight` and memory stays bounded.
+    """
+    def __cinit__(self, state s, size_t burnin=0, size_t thin=1, float min_weight=0):
+        if thin < 1:
+            raise ValueError("thin must be positive")
+        if min_weight < 0:
+            raise ValueError("min_weight must be non-negative")
+        self._latent = s
+        self._thisptr.reset(new c_posterior_average(burnin, thin, min_weight))
+
+    def update(self):
+        """Count one iteration of the state; returns whether it was added"""
+        return self._thisptr.get().update(self._latent._thisptr.get()[0])
+
+    def add(self):
+        """Add the state as it is now, whatever the burn-in and thinning"""
+        self._thisptr.get().add(self._latent._thisptr.get()[0])
+
+    def reset(self):
+        """Forget all samples, e.g. after adding or retiring documents"""
+        self._thisptr.get().reset()
+
+    def nupdates(self):
+        return self._thisptr.get().nupdates()
+
+    def nsamples(self):
+        return self._thisptr.get().nsamples()
+
+    def nentries(self):
+        """Count entries held in the running sums"""
+        return self._thisptr.get().nentries()
+
+    def dishes(self):
+        return list(self._thisptr.get().dishes())
+
+    def topic_word(self):
+        """float32 array of shape (ntopics, nwords): the average
+        distribution over word ids of each topic (phi).
+        """
+        cdef c_posterior_average *c = self._thisptr.get()
+        out = np.zeros((c.ntopics(), c.nwords()), dtype=np.float32)
+        cdef float[:, ::1] view = out
+        if out.size:
+            c.phi(&view[0, 0])
+        return out
+
+    def document_topic(self):
+        """float32 array of shape (ndocs, ntopics): the average
+        distribution over topics of each document (theta).
+        """
+        cdef c_posterior_average *c = self._thisptr.get()
+        out = np.zeros((c.ndocs(), c.ntopics()), dtype=np.float32)
+        cdef float[:, ::1] view = out
+        if out.size:
+            c.theta(&view[0, 0])
+        return out
+
+
+cdef class inference:
+    """Topic inference for new documents against the topics of a `state`.
+
+    The topics come from a `snapshot`, so the object keeps working (and
+    gives the same answers) while the state goes on sampling. Topics are
+    in the order of `state.word_distribution_by_topic()`.
+
+    Parameters
+    ----------
+    s : state or snapshot
+        Passing a snapshot shares its topics instead of copying them again.
+    prior : float, optional
+        Pseudo-count added to every topic of a document; defaults to the
+        state's beta, as used by `state.predict`.
+    """
+    def __cinit__(self, s, prior=None):
+        cdef snapshot snap = s if isinstance(s, snapshot) else snapshot(s)
+        if prior is None:
+            prior = snap.beta
+        self._thisptr.reset(new c_inference(snap._thisptr, prior))
+        self._word_ids = {word: num for num, word in snap._vocab.iteritems()}
+
+    def ntopics(self):
+        return self._thisptr.get().ntopics()
+
+    def nwords(self):
+        return self._thisptr.get().nwords()
+
+    @property
+    def prior(self):
+        return self._thisptr.get().prior()
+
+    def predict(self, data, max_iter=20, tol=1e-16, out=None, nthreads=1):
+        """Topic distributions of documents, by the iterated
+        pseudo-counts method of Wallach et al. (2009).
+
+        For bulk scoring, pass the documents as a `corpus` (e.g. from
+        `map_corpus`), several threads, and an `out` buffer such as an
+        `np.memmap`; no Python object is created per document then.
+
+        Parameters
+        ----------
+        data : a document (list of words), a list of documents, or a
+            `corpus` of word ids. Words that are not in the vocabulary
+            are ignored.
+        max_iter : int, optional
+            Maximum number of iterations.
+        tol : double, optional
+            Stop once the total change of the word topic weights in an
+            iteration is below tol.
+        out : array, optional
+            C-contiguous float32 array of shape (number of documents,
+            ntopics()) to write the result into.
+        nthreads : int, optional
+            Number of threads to spread the documents over; the result
+            does not depend on it.
+
+        Returns
+        -------
+        float32 array of shape (number of documents, ntopics()), `out` if
+        it was given
+        """
+        cdef corpus docs = self._as_corpus(data)
+        shape = (len(docs), self.ntopics())
+        if out is None:
+            out = np.empty(shape, dtype=np.float32)
+        elif out.shape != shape or out.dtype != np.float32 or \
+                not out.flags.c_contiguous:
+            raise ValueError(
+                "out must be a C-contiguous float32 array of shape {}".format(shape))
+        cdef float[:, ::1] theta_view = out
+        cdef size_t c_max_iter = max_iter
+        cdef double c_tol = tol
+        cdef size_t c_nthreads = _nthreads(nthreads)
+        if out.size:
+            with nogil:
+                self._thisptr.get().predict(
+                    docs._thisptr.get()[0], &theta_view[0, 0],
+                    c_max_iter, c_tol, c_nthreads)
+        return out
+
+    def perplexity(self, data, max_iter=20, tol=1e-16, nthreads=1):
+        """Held-out perplexity of documents: exp of minus the mean log
+        probability of their known words under the topic distributions
+        `predict` gives them (the fold-in estimate).
+
+        Parameters are as for `predict`.
+        """
+        cdef corpus docs = self._as_corpus(data)
+        cdef size_t c_max_iter = max_iter
+        cdef double c_tol = tol
+        cdef size_t c_nthreads = _nthreads(nthreads)
+        cdef double p
+        with nogil:
+            p = self._thisptr.get().perplexity(
+                docs._thisptr.get()[0], c_max_iter, c_tol, c_nthreads)
+        return p
+
+    def _as_corpus(self, data):
+        if isinstance(data, corpus):
+            return data
+        if len(data) and not isinstance(data[0], list):
             data = [data]
-        return [self._predict_single(doc, max_iter, tol) for doc in data]
-
-    def _predict_single(self, doc, max_iter, tol):
-        PZS = np.zeros((len(doc), self.ntopics()))
-        word_dist = self.word_distribution_by_topic()
-        for iteration in range(max_iter + 1): # +1 is for initialization
-            PZS_new = [[d[word] for d in word_dist]
-                        for word in doc]
-            PZS_new = np.array(PZS_new)
-            PZS_new *= (PZS.sum(axis=0) - PZS + self.beta)
-            PZS_new /= PZS_new.sum(axis=1)[:, np.newaxis] # vector to single column matrix
-            PZS = PZS_new
-            if np.abs(PZS_new - PZS).sum() < tol:
-                break
-        theta_doc = PZS.sum(axis=0) / PZS.sum()
-        assert theta_doc.shape == (self.ntopics(),)
-        return theta_doc.tolist()
+        word_ids = self._word_ids
+        docs = [[word_ids[word] for word in doc if word in word_ids]
+                for doc in data]
+        offsets = np.cumsum([0] + [len(doc) for doc in docs])
+        return corpus_from_arrays(list(itertools.chain.from_iterable(docs)), offsets)
+
+
+def _nthreads(nthreads):
+    if nthreads < 1:
+        raise ValueError("nthreads must be positive")
+    return nthreads
+
 
 def _get_dishes_and_tables(kwargs, data):
     """Extract parameters from kwargs
@@ -392,7 +999,9 @@ def initialize(model_definition defn, data, r=None, **kwargs):
     Parameters
     ----------
     defn : model definition object
-    data : a list of list of serializable objects (i.e. 'documents')
+    data : a list of list of serializable objects (i.e. 'documents'), or a
+        `corpus` of word ids (e.g. from `corpus_from_arrays`), in which case
+        `vocab_lookup` defaults to the identity
     r : random state (required if specifying initial_dishes
     initial_dishes: maximum number of dishes (topics) for random state initialization (default: 10)
     vocab_hp : parameter on symmetric Dirichlet prior over topic distributions ("beta") (default: 0.5)
@@ -405,6 +1014,11 @@ def initialize(model_definition defn, data, r=None, **kwargs):
         unique tables for each document to dish indices. Thus
         `len(dish_assignments[i]) == max(table_assignments[i]) + 1`
     vocab_lookup : dict mapping word index values (in data) to actual terms
+    count_layout : storage for the topic-word counts; one of 'sparse'
+        (default, memory proportional to the non-zero counts), 'topic_major'
+        or 'word_major' (dense V x K arrays, much faster sampling for
+        moderately sized vocabularies), or 'sparse_word_major' (sparse,
+        indexed by word, the layout `lda_crp_sparse_gibbs` is fastest with)
 
     Example table and dish assignments:
 
@@ -417,7 +1031,12 @@ def initialize(model_definition defn, data, r=None, **kwargs):
     """
     if r is not None:
         kwargs['r'] = r
-    if 'vocab_lookup' in kwargs:
+    if isinstance(data, corpus):
+        vocab_lookup = kwargs.pop('vocab_lookup', None)
+        if vocab_lookup is None:
+            vocab_lookup = {i: i for i in xrange(defn.v)}
+        numeric_docs = data
+    elif 'vocab_lookup' in kwargs:
         vocab_lookup = kwargs['vocab_lookup']
         del kwargs['vocab_lookup']
         if not all(isinstance(word, (int, long)) for doc in data for word in doc):
@@ -428,6 +1047,18 @@ def initialize(model_definition defn, data, r=None, **kwargs):
     validator.validate_len(vocab_lookup, defn.v, "vocab_lookup")
     return state(defn=defn, data=numeric_docs, vocab=vocab_lookup, **kwargs)
 
+def initialize_chains(model_definition defn, data, rngs, **kwargs):
+    """Initialize one state per random state in `rngs`, for independent
+    chains (see `runner.multi_runner`). The documents are converted to a
+    `corpus` once and shared by all states instead of being copied into
+    each of them. Takes the same keyword arguments as `initialize`.
+    """
+    if not isinstance(data, corpus):
+        if 'vocab_lookup' not in kwargs:
+            data, kwargs['vocab_lookup'] = _initialize_data(data)
+        data = corpus(data)
+    return [initialize(defn, data, r, **dict(kwargs)) for r in rngs]
+
 def _initialize_data(docs):
     """Convert docs (list of list of hashable items) to list of list of
     positive integers and a map from the integers back to the terms
@@ -455,7 +1086,7 @@ def deserialize(model_definition defn, bytes):
     m = LdaModelState()
     m.ParseFromString(bytes)
     to_row_major = utils.row_major_form_to_ragged_array
-    docs = to_row_major(m.docs, m.doc_index)
+    docs = corpus_from_arrays(m.docs, list(m.doc_index) + [len(m.docs)])
     table_assignments = to_row_major(m.table_assignment, m.table_assignment_index)
     dish_assignments = to_row_major(m.dish_assignment, m.dish_assignment_index)
     alpha = m.alpha
@@ -470,5 +1101,20 @@ def deserialize(model_definition defn, bytes):
     return s
 
 
+def load_checkpoint(model_definition defn, path, data=None, vocab_lookup=None):
+    """Restore a state written by `state.save_checkpoint`.
+
+    Parameters
+    ----------
+    defn : model definition
+    path : name of the checkpoint file
+    data : documents the checkpoint was saved with, as a `corpus` or a list
+        of lists of word ids; required if the checkpoint was saved without
+        its corpus
+    vocab_lookup : dict mapping word ids to words (default identity)
+    """
+    return state(defn=defn, data=data, vocab=vocab_lookup, checkpoint=path)
+
+
 def _reconstruct_state(defn, bytes):
     return deserialize(defn, bytes)
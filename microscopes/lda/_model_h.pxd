@@ -1,12 +1,84 @@
+from libcpp cimport bool
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libc.stddef cimport size_t
+from libc.stdint cimport uint32_t, uint64_t
 from libcpp.string cimport string
+from libcpp.utility cimport pair
 
 from microscopes._shared_ptr_h cimport shared_ptr
 from microscopes.common._random_fwd_h cimport rng_t
 
 
+cdef extern from "microscopes/lda/counts.hpp" namespace "microscopes::lda":
+    cdef enum count_layout:
+        sparse_layout
+        topic_major_layout
+        word_major_layout
+        sparse_word_major_layout
+
+
+cdef extern from "microscopes/lda/corpus.hpp" namespace "microscopes::lda":
+    ctypedef unsigned int token_t
+
+    cdef cppclass corpus:
+        corpus()
+        corpus(const corpus &)
+        corpus(const vector[vector[size_t]] &) except +
+        corpus(const token_t *, const size_t *, size_t) except +
+        size_t ndocs()
+        size_t ntokens()
+        size_t size(size_t)
+        size_t word(size_t, size_t)
+        size_t max_word()
+
+
+cdef extern from "microscopes/lda/corpus_io.hpp" namespace "microscopes::lda":
+    corpus load_ldac(const string &) except +
+    void save_corpus(const corpus &, const string &) except +
+    corpus map_corpus(const string &) except +
+
+
+cdef extern from "microscopes/lda/snapshot.hpp" namespace "microscopes::lda":
+    cdef cppclass snapshot:
+        float alpha_
+        float beta_
+        float gamma_
+        size_t ntopics() const
+        size_t nwords() const
+        size_t ndocs() const
+        const vector[size_t] & dishes() const
+        const float * phi(size_t) const
+        const float * theta(size_t) const
+        float new_dish(size_t) const
+        size_t phi_stride() const
+        size_t theta_stride() const
+
+    cdef cppclass seating:
+        vector[uint64_t] token_offsets
+        vector[uint32_t] tables
+        vector[uint32_t] dishes
+        vector[uint64_t] table_offsets
+        vector[uint32_t] table_dishes
+
+
+cdef extern from "microscopes/lda/instrument.hpp" namespace "microscopes::lda":
+    cdef cppclass phase_counters:
+        uint64_t calls
+        uint64_t cycles
+        uint64_t nanoseconds
+
+    cdef cppclass instrumentation:
+        phase_counters table_phase
+        phase_counters dish_phase
+        uint64_t tables_created
+        uint64_t tables_deleted
+        uint64_t dishes_created
+        uint64_t dishes_deleted
+
+    bool instrumentation_enabled "microscopes::lda::instrumentation::enabled"
+
+
 cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda":
     cdef cppclass model_definition:
         model_definition(size_t, size_t) except +
@@ -15,7 +87,17 @@ cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda":
         float gamma_
         float alpha_
         float beta_
+        const corpus x_ji
         double perplexity()
+        double perplexity(const vector[size_t] &, size_t) nogil except +
+        double log_likelihood(const vector[size_t] &, size_t) nogil except +
+        vector[vector[pair[size_t, float]]] term_relevance(float, size_t, size_t) nogil except +
+        const vector[size_t] & term_frequency()
+        const instrumentation & counters()
+        void reset_counters()
+        vector[size_t] table_count_histogram()
+        shared_ptr[const snapshot] take_snapshot "snapshot"() except +
+        shared_ptr[const seating] take_seating "seating"() except +
         size_t nentities()
         size_t ntopics()
         size_t nwords()
@@ -24,25 +106,50 @@ cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda":
         float num_words_at_dish(size_t, size_t)
 
         string serialize() except +
+        void save_checkpoint(const string &path, bool include_corpus) except +
         vector[vector[size_t]] assignments()
         vector[vector[size_t]] dish_assignments()
         vector[vector[size_t]] table_assignments()
-        vector[size_t] tables(size_t eid)
+        const vector[size_t] & tables(size_t eid)
         vector[vector[float]] document_distribution()
         vector[map[size_t, float]] word_distribution()
-        vector[size_t] dishes()
+        const vector[size_t] & dishes()
 
         float score_assignment()
         float score_data(rng_t &)
 
+        size_t add_documents(const corpus &) except +
+        void retire_documents(size_t) except +
+
+
+cdef extern from "microscopes/lda/average.hpp" namespace "microscopes::lda":
+    cdef cppclass posterior_average:
+        posterior_average(size_t, size_t, float) except +
+        size_t burnin()
+        size_t thin()
+        float min_weight()
+        size_t nupdates()
+        size_t nsamples()
+        const vector[size_t] & dishes()
+        size_t ntopics()
+        size_t nwords()
+        size_t ndocs()
+        bool update(const state &) except +
+        void add(const state &) except +
+        void reset()
+        size_t nentries()
+        void phi(float *)
+        void theta(float *)
+
 
 cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda::state":
     shared_ptr[state] \
     initialize(const model_definition &defn,
         float alpha, float beta, float gamma,
         size_t initial_dishes,
-        vector[vector[size_t]] &docs,
-        rng_t & rng) except +
+        const corpus &docs,
+        rng_t & rng,
+        count_layout layout) except +
 
     shared_ptr[state] \
     initialize_explicit "microscopes::lda::state::initialize" (
@@ -50,4 +157,25 @@ cdef extern from "microscopes/lda/model.hpp" namespace "microscopes::lda::state"
         float alpha, float beta, float gamma,
         const vector[vector[size_t]] &dish_assignments,
         const vector[vector[size_t]] &table_assignments,
-        vector[vector[size_t]] &docs) except +
\ No newline at end of file
+        const corpus &docs,
+        count_layout layout) except +
+
+    shared_ptr[state] load_checkpoint(const string &path) except +
+
+    shared_ptr[state] \
+    load_checkpoint_with_corpus "microscopes::lda::state::load_checkpoint" (
+        const string &path, const corpus &docs) except +
+
+
+cdef extern from "microscopes/lda/inference.hpp" namespace "microscopes::lda":
+    cdef cppclass inference:
+        inference(const state &) except +
+        inference(const state &, float) except +
+        inference(shared_ptr[const snapshot], float) except +
+        size_t ntopics()
+        size_t nwords()
+        float prior()
+        const vector[size_t] & dishes()
+        void predict(const corpus &, float *, size_t, double, size_t) nogil except +
+        double perplexity(const corpus &, size_t, double, size_t) nogil except +
+        double log_likelihood(const corpus &, size_t, double, size_t) nogil except +
@@ -0,0 +1,16 @@
+from microscopes.lda._runner_h cimport runner as c_runner
+from microscopes.lda._runner_h cimport multi_runner as c_multi_runner
+from microscopes.lda._model cimport state, posterior_average
+
+
+cdef class runner:
+    cdef c_runner *_thisptr
+    cdef state _latent
+    cdef _monitor
+    cdef _monitor_error
+    cdef posterior_average _average
+
+
+cdef class multi_runner:
+    cdef c_multi_runner *_thisptr
+    cdef list _latents
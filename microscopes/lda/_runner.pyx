@@ -0,0 +1,215 @@
+# cython: embedsignature=True
+
+import sys
+
+from libcpp cimport bool
+from libcpp.vector cimport vector
+from libc.stddef cimport size_t
+
+from microscopes.common._rng cimport rng
+from microscopes.common._random_fwd_h cimport rng_t
+from microscopes.lda._runner_h cimport (
+    kernel_config,
+    kernel_from_name,
+    default_niters,
+    chain_diagnostics,
+    potential_scale_reduction as c_potential_scale_reduction,
+)
+from microscopes.lda._model_h cimport state as c_state
+from microscopes.lda._model_h cimport posterior_average as c_posterior_average
+from microscopes._shared_ptr_h cimport shared_ptr
+
+cdef bool _call_monitor(void *ctx, size_t iteration) with gil:
+    cdef runner self = <runner>ctx
+    try:
+        if self._monitor(iteration) is False:
+            return False
+        return True
+    except BaseException:
+        # Raised again by run() once the C++ loop has stopped
+        self._monitor_error = sys.exc_info()
+        return False
+
+
+cdef vector[kernel_config] _schedule(kernels) except *:
+    cdef vector[kernel_config] schedule
+    cdef kernel_config c
+    for name, config in kernels:
+        c.kernel = kernel_from_name(name)
+        c.hp1 = config.get('hp1', 5)
+        c.hp2 = config.get('hp2', 0.1)
+        niters = config.get('niters', default_niters(c.kernel))
+        nthreads = config.get('nthreads', 1)
+        block_size = config.get('block_size', 256)
+        if niters < 1:
+            raise ValueError("niters must be positive")
+        if nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        if block_size < 1:
+            raise ValueError("block_size must be positive")
+        c.niters = niters
+        c.nthreads = nthreads
+        c.block_size = block_size
+        schedule.push_back(c)
+    return schedule
+
+
+cdef _diagnostics(const chain_diagnostics &d):
+    return {'iteration': d.iteration, 'ntopics': d.ntopics,
+            'ntables': d.ntables, 'perplexity': d.perplexity,
+            'alpha': d.alpha, 'beta': d.beta, 'gamma': d.gamma}
+
+
+cdef class runner:
+    """Runs a schedule of kernels on a state in C++, without the GIL.
+
+    `kernels` is a list of `(name, config)` pairs as built by
+    `microscopes.lda.runner.runner`. The config keys are `hp1` and `hp2`
+    for the hyperparameter kernels, `nthreads` for `crf` and `crf_block`,
+    `block_size` for `crf_block`, and `niters`,
+    the number of times `direct_base_dp_hp` and `direct_second_dp_hp` are
+    repeated per iteration (10) or the iteration limit of
+    `direct_vocab_hp` (1000).
+
+    Runners of different states may run concurrently in Python threads,
+    each with its own rng. The state must not be used by other threads
+    while `run` is in progress; monitors may read it.
+    """
+    def __cinit__(self, state latent, kernels):
+        cdef vector[kernel_config] schedule = _schedule(kernels)
+        self._latent = latent
+        self._thisptr = new c_runner(latent._thisptr, schedule)
+
+    def __dealloc__(self):
+        del self._thisptr
+
+    property iteration:
+        """Iterations run by all calls of `run` so far"""
+        def __get__(self): return self._thisptr.iteration()
+
+    def run(self, rng r, size_t niters):
+        """Run `niters` iterations of the schedule and return the number of
+        iterations run, which is smaller if the monitor stopped the run.
+        Exceptions raised by the monitor are raised here.
+        """
+        cdef size_t done
+        self._monitor_error = None
+        with nogil:
+            done = self._thisptr.run(r._thisptr[0], niters)
+        if self._monitor_error is not None:
+            t, v, tb = self._monitor_error
+            self._monitor_error = None
+            raise t, v, tb
+        return done
+
+    def set_monitor(self, f, size_t every=1):
+        """Call `f(iteration)` every `every` iterations, holding the GIL;
+        the run stops when it returns False. `f=None` removes the monitor.
+        """
+        self._monitor = f
+        if f is None or every == 0:
+            self._thisptr.set_monitor(0, NULL, NULL)
+        else:
+            self._thisptr.set_monitor(every, _call_monitor, <void *>self)
+
+    def trace_perplexity(self, enabled=True, nthreads=1):
+        """Record the training perplexity before each monitor call"""
+        if nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        self._thisptr.trace_perplexity(enabled, nthreads)
+
+    def perplexity_trace(self):
+        """List of the `(iteration, perplexity)` pairs recorded so far"""
+        return [(p.first, p.second) for p in self._thisptr.perplexity_trace()]
+
+    def set_checkpoint(self, path, size_t every, include_corpus=True):
+        """Save a checkpoint of the state to `path` every `every`
+        iterations, as `state.save_checkpoint`; `every=0` stops saving.
+        """
+        self._thisptr.set_checkpoint(every, path, include_corpus)
+
+    def set_average(self, posterior_average average):
+        """Update `average`, a `posterior_average` of this runner's state,
+        after every iteration; `average=None` stops updating.
+        """
+        cdef shared_ptr[c_posterior_average] none
+        if average is None:
+            self._thisptr.set_average(none)
+        elif average._latent is not self._latent:
+            raise ValueError("average is of another state")
+        else:
+            self._thisptr.set_average(average._thisptr)
+        self._average = average
+
+
+cdef class multi_runner:
+    """Runs independent chains, one `state` each, on several threads in
+    C++ with the same kernel schedule (see `runner`). States initialized
+    from one `corpus` share its documents.
+    """
+    def __cinit__(self, latents, kernels):
+        cdef vector[kernel_config] schedule = _schedule(kernels)
+        cdef vector[shared_ptr[c_state]] c_latents
+        cdef state latent
+        for latent in latents:
+            c_latents.push_back(latent._thisptr)
+        self._latents = list(latents)
+        self._thisptr = new c_multi_runner(c_latents, schedule)
+
+    def __dealloc__(self):
+        del self._thisptr
+
+    def nchains(self):
+        return self._thisptr.nchains()
+
+    def shares_corpus(self):
+        """Whether all chains use the same corpus storage"""
+        return self._thisptr.shares_corpus()
+
+    def run(self, rngs, size_t niters, size_t nthreads=0):
+        """Run `niters` iterations of every chain, chain i with `rngs[i]`,
+        on `nthreads` threads (0: one per chain)
+        """
+        if len(rngs) != self._thisptr.nchains():
+            raise ValueError("need one rng per chain")
+        cdef vector[rng_t] c_rngs
+        cdef rng r
+        for r in rngs:
+            c_rngs.push_back(r._thisptr[0])
+        try:
+            with nogil:
+                self._thisptr.run(c_rngs, niters, nthreads)
+        finally:
+            for i, r in enumerate(rngs):
+                r._thisptr[0] = c_rngs[i]
+
+    def set_trace(self, size_t every, size_t perplexity_nthreads=1):
+        """Record `diagnostics` of every chain every `every` iterations"""
+        if perplexity_nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        self._thisptr.set_trace(every, perplexity_nthreads)
+
+    def trace(self, size_t i):
+        """Diagnostics recorded for chain `i` so far"""
+        if i >= self._thisptr.nchains():
+            raise IndexError("no chain {}".format(i))
+        return [_diagnostics(d) for d in self._thisptr.trace(i)]
+
+    def diagnostics(self, size_t perplexity_nthreads=1):
+        """One dict per chain with its iteration, ntopics, ntables,
+        training perplexity and hyperparameters
+        """
+        cdef vector[chain_diagnostics] ds
+        if perplexity_nthreads < 1:
+            raise ValueError("nthreads must be positive")
+        with nogil:
+            ds = self._thisptr.diagnostics(perplexity_nthreads)
+        return [_diagnostics(d) for d in ds]
+
+
+def potential_scale_reduction(draws):
+    """Gelman and Rubin's R-hat of a scalar from one equally long list of
+    draws per chain (at least two chains of two draws)
+    """
+    cdef vector[vector[double]] c_draws = draws
+    return c_potential_scale_reduction(c_draws)
@@ -0,0 +1,65 @@
+from libcpp cimport bool
+from libcpp.vector cimport vector
+from libcpp.string cimport string
+from libcpp.utility cimport pair
+from libc.stddef cimport size_t
+
+from microscopes._shared_ptr_h cimport shared_ptr
+from microscopes.common._random_fwd_h cimport rng_t
+from microscopes.lda._model_h cimport state, posterior_average
+
+ctypedef bool (*monitor_fn)(void *, size_t)
+
+cdef extern from "microscopes/lda/runner.hpp" namespace "microscopes::lda":
+    cdef enum kernel_t:
+        crf_kernel
+        crf_sparse_kernel
+        crf_alias_kernel
+        crf_block_kernel
+        base_dp_hp_kernel
+        second_dp_hp_kernel
+        vocab_hp_kernel
+
+    cdef cppclass kernel_config:
+        kernel_config()
+        kernel_t kernel
+        float hp1
+        float hp2
+        size_t niters
+        size_t nthreads
+        size_t block_size
+
+    kernel_t kernel_from_name(const string &) except +
+    size_t default_niters(kernel_t)
+
+    cdef cppclass runner:
+        runner(const shared_ptr[state] &, const vector[kernel_config] &) except +
+        size_t iteration()
+        size_t run(rng_t &, size_t) nogil except +
+        void set_monitor(size_t, monitor_fn, void *)
+        void trace_perplexity(bool, size_t) except +
+        const vector[pair[size_t, double]] & perplexity_trace()
+        void set_checkpoint(size_t, const string &, bool) except +
+        void set_average(const shared_ptr[posterior_average] &)
+
+    cdef cppclass chain_diagnostics:
+        size_t iteration
+        size_t ntopics
+        size_t ntables
+        double perplexity
+        float alpha
+        float beta
+        float gamma
+
+    cdef cppclass multi_runner:
+        multi_runner(const vector[shared_ptr[state]] &, const vector[kernel_config] &) except +
+        size_t nchains()
+        bool shares_corpus()
+        void run(vector[rng_t] &, size_t, size_t) nogil except +
+        void set_trace(size_t, size_t) except +
+        const vector[chain_diagnostics] & trace(size_t)
+        vector[chain_diagnostics] diagnostics(size_t) nogil except +
+
+
+cdef extern from "microscopes/lda/runner.hpp" namespace "microscopes::lda::multi_runner":
+    double potential_scale_reduction(const vector[vector[double]] &) except +
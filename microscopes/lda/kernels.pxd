@@ -1,5 +1,16 @@
 from microscopes.lda._kernels_h cimport lda_crp_gibbs as c_lda_crp_gibbs
+from microscopes.lda._kernels_h cimport lda_crp_gibbs_parallel as c_lda_crp_gibbs_parallel
+from microscopes.lda._kernels_h cimport lda_crp_gibbs_range as c_lda_crp_gibbs_range
+from microscopes.lda._kernels_h cimport lda_crp_sparse_gibbs as c_lda_crp_sparse_gibbs
+from microscopes.lda._kernels_h cimport lda_crp_mh_gibbs as c_lda_crp_mh_gibbs
+from microscopes.lda._kernels_h cimport lda_crp_block_gibbs as c_lda_crp_block_gibbs
+from microscopes.lda._kernels_h cimport proposal_cache as c_proposal_cache
 from microscopes.lda._kernels_h cimport sample_gamma as c_sample_gamma
 from microscopes.lda._kernels_h cimport sample_alpha as c_sample_alpha
+from microscopes.lda._kernels_h cimport sample_beta as c_sample_beta
 from microscopes.common._rng cimport rng
-from microscopes.lda._model cimport state
\ No newline at end of file
+from microscopes.lda._model cimport state
+
+
+cdef class proposal_cache:
+    cdef c_proposal_cache *_thisptr
@@ -1,15 +1,83 @@
 # cython: embedsignature=True
 
-from scipy.special import digamma
-
-def lda_crp_gibbs(state s, rng r):
+def lda_crp_gibbs(state s, rng r, int nthreads=1):
     """Gibbs transition kernel for LDA state object. Modifies
     state object in place.
 
     Implementation of "Posterior sampling in the Chinese restaurant
         franchise" as described in Teh et al (2005).
+
+    With `nthreads` > 1 the table assignments of disjoint sets of documents
+    are resampled in parallel against per-thread copies of the topic counts,
+    which are merged at the end of the sweep (approximate distributed LDA,
+    Newman et al (2009)). Results are reproducible for a fixed seed and
+    number of threads.
+    """
+    if nthreads < 1:
+        raise ValueError("nthreads must be positive")
+    if nthreads == 1:
+        c_lda_crp_gibbs(s._thisptr.get()[0], r._thisptr[0])
+    else:
+        c_lda_crp_gibbs_parallel(s._thisptr.get()[0], r._thisptr[0], nthreads)
+
+def lda_crp_gibbs_range(state s, rng r, size_t first, size_t last):
+    """`lda_crp_gibbs` over documents `first` to `last - 1` only, against
+    the topics of all documents: a warm-up for documents just added with
+    `state.add_documents`, at a cost proportional to their size.
+    """
+    c_lda_crp_gibbs_range(s._thisptr.get()[0], r._thisptr[0], first, last)
+
+def lda_crp_sparse_gibbs(state s, rng r):
+    """Variant of `lda_crp_gibbs` that draws tables from the same posterior
+    split into buckets, as in SparseLDA (Yao et al (2009)). The cost per word
+    is proportional to the number of topics the word occurs in, provided the
+    state was initialized with `count_layout='sparse_word_major'`. Modifies
+    state object in place.
+    """
+    c_lda_crp_sparse_gibbs(s._thisptr.get()[0], r._thisptr[0])
+
+cdef class proposal_cache:
+    """Alias tables used by `lda_crp_mh_gibbs` to propose new tables.
+
+    Keep one cache per state alive across iterations; the tables are rebuilt
+    lazily once they have been used as many times as there are topics.
     """
-    c_lda_crp_gibbs(s._thisptr.get()[0], r._thisptr[0])
+    def __cinit__(self):
+        self._thisptr = new c_proposal_cache()
+
+    def __dealloc__(self):
+        del self._thisptr
+
+    def clear(self):
+        """Drop all tables, e.g. before reusing the cache with a new state"""
+        self._thisptr.clear()
+
+def lda_crp_mh_gibbs(state s, proposal_cache cache, rng r):
+    """Metropolis-Hastings variant of `lda_crp_gibbs`. Modifies state object
+    in place.
+
+    New tables are proposed from stale per-word alias tables and corrected
+    with a Metropolis-Hastings step, as in AliasLDA (Li et al (2014)), so the
+    cost per word no longer grows with the number of topics. The dish
+    resampling step is the same as in `lda_crp_gibbs`.
+    """
+    c_lda_crp_mh_gibbs(s._thisptr.get()[0], cache._thisptr[0], r._thisptr[0])
+
+def lda_crp_block_gibbs(state s, rng r, size_t block_size=256, int nthreads=1):
+    """Variant of `lda_crp_gibbs` that resamples the dish assignments in
+    blocks of `block_size` tables. Each block's dish posteriors are computed
+    together against the counts as of the start of the block, gathering the
+    topic counts of the block's words once, and the draws are then merged
+    one by one; `block_size=1` is the exact sampler. With `nthreads` > 1 the
+    table sweep is the document-parallel one of `lda_crp_gibbs` and the
+    posteriors of a block are computed in parallel. Modifies state object
+    in place.
+    """
+    if nthreads < 1:
+        raise ValueError("nthreads must be positive")
+    if block_size < 1:
+        raise ValueError("block_size must be positive")
+    c_lda_crp_block_gibbs(s._thisptr.get()[0], r._thisptr[0], block_size, nthreads)
 
 def sample_gamma(state s, rng r, float a, float b, niters=10):
     """Sample Dirichlet process disperson parameter gamma according to
@@ -28,29 +96,13 @@ def sample_alpha(state s, rng r, float a, float b, int niters=10):
         c_sample_alpha(s._thisptr.get()[0], r._thisptr[0], a, b)
 
 def sample_beta(state s, rng r, float a, float b, int num_iterations=1000):
-    """Blindly follow Heinrich's methodology:
-    http://www.arbylon.net/projects/IldaGibbs.java (line 679)
-    """
-    i = 0
-    alpha = s.beta
-    alpha0 = 0
-    prec = 1 ** -5
-    for _ in range(num_iterations):
-        summk = 0
-        summ = 0
-        for tid in s.active_topics():
-            summ += digamma(s.n_k(tid))
-            for word_id in range(s.nwords()):
-                summk += digamma(s.n_kv(tid, word_id))
-        summ -= s.ntopics() * digamma(s.nwords() * alpha)
-        summk -= s.ntopics() * s.nwords() * digamma(alpha)
-
-        alpha = (a - 1 + alpha * summk) / (b + s.nwords() * summ)
-        if abs(alpha - alpha0) < prec:
-            break
-        else:
-            alpha0 = alpha
-
-        if i == num_iterations - 1:
-            raise Exception("sample_beta did not converge.")
-    s.beta = alpha
+    """Update the Dirichlet parameter beta of the topic-word distributions
+    by the fixed point iteration of Minka (2003) under a Gamma(a, b) prior,
+    following Heinrich: http://www.arbylon.net/projects/IldaGibbs.java
+    (line 679). Only the non-zero word counts are visited. The update is
+    deterministic; `r` is accepted for symmetry with the other kernels.
+    """
+    if num_iterations < 1:
+        raise ValueError("num_iterations must be positive")
+    if not c_sample_beta(s._thisptr.get()[0], a, b, num_iterations):
+        raise Exception("sample_beta did not converge.")
@@ -1,5 +1,15 @@
 from microscopes.lda._model import (
     state,
     initialize,
-    deserialize
+    initialize_chains,
+    deserialize,
+    load_checkpoint,
+    corpus,
+    inference,
+    snapshot,
+    posterior_average,
+    corpus_from_arrays,
+    load_ldac,
+    save_corpus,
+    map_corpus
 )
\ No newline at end of file
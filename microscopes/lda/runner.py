@@ -4,8 +4,11 @@
 from microscopes.common import validator
 from microscopes.common.rng import rng
 from microscopes.lda.definition import model_definition
-from microscopes.lda.kernels import lda_crp_gibbs
-from microscopes.lda.kernels import sample_gamma, sample_alpha, sample_beta
+from microscopes.lda import _runner
+from microscopes.lda._runner import potential_scale_reduction
+
+_KERNELS = ('crf', 'crf_sparse', 'crf_alias', 'crf_block',
+            'direct_base_dp_hp', 'direct_second_dp_hp', 'direct_vocab_hp')
 
 
 def _validate_definition(defn):
@@ -14,7 +17,7 @@ def _validate_definition(defn):
     return defn
 
 
-def crf_kernel_config(defn):
+def crf_kernel_config(defn, nthreads=1):
     """Creates a default kernel configuration for sampling the dish assignment
     using the "Posterior sampling in the Chinese restaurant franchise" Gibbs
     sampler from Teh et al (2005)
@@ -22,8 +25,54 @@ def crf_kernel_config(defn):
     Parameters
     ----------
     defn : LDA model definition
+    nthreads : number of threads for the document-parallel table sweep
+    """
+    if nthreads == 1:
+        return ['crf']
+    return [('crf', {'nthreads': nthreads})]
+
+
+def crf_sparse_kernel_config(defn):
+    """Creates a kernel configuration for sampling the table assignments
+    from the bucketed posterior of SparseLDA (Yao et al (2009)). Draws follow
+    the same distribution as `crf_kernel_config`; use it together with
+    `count_layout='sparse_word_major'`.
+
+    Parameters
+    ----------
+    defn : LDA model definition
+    """
+    return ['crf_sparse']
+
+
+def crf_alias_kernel_config(defn):
+    """Creates a kernel configuration for sampling the table assignments
+    with stale alias tables and a Metropolis-Hastings correction, as in
+    AliasLDA (Li et al (2014)). The per word cost does not grow with the
+    number of topics, which pays off once there are many of them.
+
+    Parameters
+    ----------
+    defn : LDA model definition
+    """
+    return ['crf_alias']
+
+
+def crf_block_kernel_config(defn, block_size=256, nthreads=1):
+    """Creates a kernel configuration for `crf_kernel_config` with the
+    dish assignments resampled in blocks of `block_size` tables. The dish
+    posteriors of a block are computed together against the counts as of
+    the start of the block, on `nthreads` threads, and the draws are then
+    merged one by one. Tables of a block do not see each other's moves, so
+    this approximates the sampler; `block_size=1` is exact.
+
+    Parameters
+    ----------
+    defn : LDA model definition
+    block_size : number of tables per block
+    nthreads : number of threads for the table sweep and the dish posteriors
     """
-    return ['crf']
+    return [('crf_block', {'block_size': block_size, 'nthreads': nthreads})]
 
 
 def base_dp_hp_kernel_config(defn, hp1=5, hp2=.1):
@@ -66,14 +115,29 @@ def direct_vocab_hp_kernel_config(defn, hp1=5, hp2=0.1):
     ----------
     defn : LDA model definition
     """
+    return [('direct_vocab_hp', {'hp1': hp1, 'hp2': hp2})]
 
-    raise NotImplementedError('direct_vocab_hp not yet implemented')
-    return ['direct_vocab_hp']
+
+def _parse_kernel_config(kernel_config):
+    parsed = []
+    for kernel in kernel_config:
+        if hasattr(kernel, '__iter__'):
+            name, config = kernel
+        else:
+            name, config = kernel, {}
+        validator.validate_dict_like(config)
+        if name not in _KERNELS:
+            raise ValueError("Bad kernel specification {}".format(name))
+        parsed.append((name, config))
+    return parsed
 
 
 class runner(object):
     """The LDA runner
 
+    The iterations run in C++ without the GIL, so runners of different
+    states can be used from several Python threads at once.
+
     Parameters
     ----------
     defn : ``model_definition``: The structural definition.
@@ -85,26 +149,21 @@ class runner(object):
         the particular kernel. In the former case where `y` is omitted, then
         the defaults parameters for each kernel are used.
         Possible values of `x` are:
-        {'crp', 'direct_base_dp_hp', 'direct_second_dp_hp', 'direct_vocab_hp'}
+        {'crf', 'crf_sparse', 'crf_alias', 'crf_block', 'direct_base_dp_hp', 'direct_second_dp_hp', 'direct_vocab_hp'}
+        The hyperparameter kernels also take `niters`, the number of updates
+        per iteration (10; the iteration limit of 'direct_vocab_hp', 1000).
     """
 
     def __init__(self, defn, view, latent, kernel_config=('crf', )):
         self._defn = defn
         self._view = view
         self._latent = latent
-        self._kernel_config = []
-
-        for kernel in kernel_config:
-            if hasattr(kernel, '__iter__'):
-                name, config = kernel
-            else:
-                name, config = kernel, {}
-            validator.validate_dict_like(config)
-            self._kernel_config.append((name, config))
-
+        self._kernel_config = _parse_kernel_config(kernel_config)
+        self._impl = _runner.runner(latent, self._kernel_config)
 
     def run(self, r, niters=10000):
-        """Run the lda kernel for `niters`, in a single thread.
+        """Run the lda kernels for `niters` iterations, or until the monitor
+        returns False. Returns the number of iterations run.
 
         Parameters
         ----------
@@ -114,16 +173,114 @@ class runner(object):
         """
         validator.validate_type(r, rng, param_name='r')
         validator.validate_positive(niters, param_name='niters')
+        return self._impl.run(r, niters)
+
+    def set_monitor(self, f, every=1):
+        """Call `f(iteration)` every `every` iterations; returning False
+        stops the run. Use `f=None` to remove the monitor.
+        """
+        self._impl.set_monitor(f, every)
 
-        for _ in xrange(niters):
-            for name, config in self._kernel_config:
-                if name == 'crf':
-                    lda_crp_gibbs(self._latent, r)
-                elif name == 'direct_base_dp_hp':
-                    sample_gamma(self._latent, r, config['hp1'], config['hp2'])
-                elif name == 'direct_second_dp_hp':
-                    sample_alpha(self._latent, r, config['hp1'], config['hp2'])
-                elif name == 'direct_vocab_hp':
-                    raise NotImplementedError('direct_vocab_hp not yet implemented')
-                else:
-                    raise ValueError("Bad kernel specification {}".format(name))
+    def trace_perplexity(self, enabled=True, nthreads=1):
+        """Record the training perplexity every time the monitor is due
+        (set a monitor, e.g. `lambda it: True`, to choose the cadence).
+        """
+        self._impl.trace_perplexity(enabled, nthreads)
+
+    def perplexity_trace(self):
+        """The `(iteration, perplexity)` pairs recorded so far"""
+        return self._impl.perplexity_trace()
+
+    def set_checkpoint(self, path, every, include_corpus=True):
+        """Save the state to `path` every `every` iterations (see
+        `state.save_checkpoint`); `every=0` stops saving.
+        """
+        validator.validate_nonnegative(every, param_name='every')
+        self._impl.set_checkpoint(path, every, include_corpus)
+
+    def set_average(self, average):
+        """Update `average` (from `latent.posterior_average()`) after every
+        iteration; `average=None` stops updating.
+        """
+        self._impl.set_average(average)
+
+    @property
+    def iteration(self):
+        """Iterations run so far"""
+        return self._impl.iteration
+
+
+class multi_runner(object):
+    """Runs several independent chains on separate threads
+
+    Every chain runs the same kernel schedule on its own state; use
+    `model.initialize_chains` to create states that share one corpus.
+    A chain advances exactly as it would with its own `runner` and rng,
+    whatever the number of threads.
+
+    Parameters
+    ----------
+    defn : ``model_definition``: The structural definition.
+    view :  A list of list of serializable objects (the 'documents')
+    latents : list of ``state``, one per chain
+    kernel_config : list, as for `runner`
+    """
+
+    def __init__(self, defn, view, latents, kernel_config=('crf', )):
+        if not latents:
+            raise ValueError("need at least one chain")
+        self._defn = defn
+        self._view = view
+        self._latents = list(latents)
+        self._kernel_config = _parse_kernel_config(kernel_config)
+        self._impl = _runner.multi_runner(self._latents, self._kernel_config)
+
+    def nchains(self):
+        return len(self._latents)
+
+    def chain(self, i):
+        """The state of chain `i`"""
+        return self._latents[i]
+
+    def shares_corpus(self):
+        """Whether all chains use the same corpus storage"""
+        return self._impl.shares_corpus()
+
+    def run(self, rngs, niters=10000, nthreads=0):
+        """Run every chain for `niters` iterations, chain i with `rngs[i]`,
+        on `nthreads` threads (default: one per chain)
+
+        Parameters
+        ----------
+        rngs : list of random states, one per chain
+        niters : int
+        nthreads : int
+        """
+        for r in rngs:
+            validator.validate_type(r, rng, param_name='rngs')
+        validator.validate_positive(niters, param_name='niters')
+        validator.validate_nonnegative(nthreads, param_name='nthreads')
+        self._impl.run(rngs, niters, nthreads)
+
+    def set_trace(self, every, perplexity_nthreads=1):
+        """Record the diagnostics of every chain every `every` iterations"""
+        validator.validate_nonnegative(every, param_name='every')
+        self._impl.set_trace(every, perplexity_nthreads)
+
+    def trace(self, i):
+        """List of the diagnostics recorded for chain `i`"""
+        return self._impl.trace(i)
+
+    def diagnostics(self, perplexity_nthreads=1):
+        """Per chain dict of `iteration`, `ntopics`, `ntables`,
+        `perplexity` (training), `alpha`, `beta` and `gamma`
+        """
+        return self._impl.diagnostics(perplexity_nthreads)
+
+    def potential_scale_reduction(self, key='perplexity', burnin=0):
+        """Gelman-Rubin R-hat of a traced diagnostic across the chains,
+        dropping the first `burnin` trace entries of each chain
+        """
+        draws = [[d[key] for d in self.trace(i)[burnin:]]
+                 for i in xrange(self.nchains())]
+        return potential_scale_reduction(draws)
@@ -55,6 +55,9 @@ def docs_from_ldac(stream):
     Returns
     -------
     docs: variadic array of N entites
+
+    See also `model.load_ldac`, which parses a file directly into a corpus
+    and is much faster for large files.
     """
     n_entities = 0
     docs = []
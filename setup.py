@@ -21,6 +21,7 @@ from subprocess import Popen, PIPE
 CYTHON_MODULES = ['microscopes.lda._model',
                   'microscopes.lda.definition',
                   'microscopes.lda.kernels',
+                  'microscopes.lda._runner',
                   ]
 
 LIBRARY_DEPENDENCIES = ["microscopes_common", "microscopes_lda",
@@ -200,6 +201,13 @@ def build_extra_compile_args():
         ])
     if is_debug_build():
         extra_compile_args.append('-DDEBUG_MODE')
+    # must match the LDA_TOKEN_BITS the C++ library was configured with
+    extra_compile_args.append(
+        '-DMICROSCOPES_LDA_TOKEN_BITS={}'.format(
+            os.environ.get('LDA_TOKEN_BITS', '32')))
+    # as must LDA_INSTRUMENT
+    if os.environ.get('LDA_INSTRUMENT', '0') not in ('', '0'):
+        extra_compile_args.append('-DMICROSCOPES_LDA_INSTRUMENT=1')
 
     return extra_compile_args
 
@@ -0,0 +1,228 @@
+#include <microscopes/lda/average.hpp>
+
+#include <algorithm>
+
+microscopes::lda::posterior_average::posterior_average(size_t burnin, size_t thin, float min_weight)
+    : burnin_(burnin), thin_(thin), min_weight_(min_weight)
+{
+    MICROSCOPES_CHECK(thin_ > 0, "thin must be positive");
+    MICROSCOPES_CHECK(min_weight_ >= 0, "min_weight must be non-negative");
+    reset();
+}
+
+void
+microscopes::lda::posterior_average::reset()
+{
+    nupdates_ = 0;
+    nsamples_ = 0;
+    V_ = 0;
+    D_ = 0;
+    topics_.clear();
+    phi_.clear();
+    phi_smooth_.clear();
+    phi_samples_.clear();
+    theta_.clear();
+    length_.clear();
+    prior_row_.clear();
+    own_row_.clear();
+    prior_.clear();
+    length_rows_.clear();
+}
+
+bool
+microscopes::lda::posterior_average::update(const state &s)
+{
+    ++nupdates_;
+    if (nupdates_ <= burnin_ || (nupdates_ - burnin_) % thin_ != 0)
+        return false;
+    add(s);
+    return true;
+}
+
+void
+microscopes::lda::posterior_average::merge(sum_row &sum, const sparse_row &add, size_t n)
+{
+    merged_.clear();
+    auto keep = [&](const entry &e) {
+        if (e.sum >= double(min_weight_) * (n - e.since + 1))
+            merged_.push_back(e);
+    };
+    auto it = sum.begin();
+    for (auto &e : add) {
+        for (; it != sum.end() && it->key < e.first; ++it)
+            keep(*it);
+        if (it != sum.end() && it->key == e.first) {
+            keep(entry {e.first, it->since, it->sum + e.second});
+            ++it;
+        } else {
+            keep(entry {e.first, n, e.second});
+        }
+    }
+    for (; it != sum.end(); ++it)
+        keep(*it);
+    sum.swap(merged_);
+}
+
+void
+microscopes::lda::posterior_average::add(const state &s)
+{
+    if (nsamples_ == 0) {
+        V_ = s.nwords();
+        D_ = s.nentities();
+        theta_.resize(D_);
+        length_.resize(D_);
+        prior_row_.resize(D_);
+        own_row_.assign(D_, false);
+    }
+    MICROSCOPES_CHECK(s.nwords() == V_ && s.nentities() == D_,
+        "documents or vocabulary changed since the first sample");
+    ++nsamples_;
+
+    const size_t nslots = s.dishes_.nslots();
+    if (phi_.size() < nslots) {
+        phi_.resize(nslots);
+        phi_smooth_.resize(nslots, 0);
+        phi_samples_.resize(nslots, 0);
+    }
+    for (auto k : s.dishes())
+        if (k != 0 && !std::binary_search(topics_.begin(), topics_.end(), k))
+            topics_.insert(std::lower_bound(topics_.begin(), topics_.end(), k), k);
+
+    // phi: the non-zero counts of each dish, sorted by word
+    scratch_.resize(nslots);
+    for (auto &row : scratch_)
+        row.clear();
+    s.n_kv.for_each_count([&](size_t k, size_t v, size_t count) {
+        if (k != 0 && s.dishes_.contains(k))
+            scratch_[k].emplace_back(v, count);
+    });
+    for (auto k : s.dishes()) {
+        if (k == 0)
+            continue;
+        const double inv = 1.0 / s.num_words_at_dish(k);
+        auto &row = scratch_[k];
+        std::sort(row.begin(), row.end());
+        for (auto &e : row)
+            e.second *= inv;
+        const size_t n = ++phi_samples_[k];
+        phi_smooth_[k] += s.beta_ * inv;
+        merge(phi_[k], row, n);
+    }
+
+    // theta: the tables of each document at the topics, and the dish prior
+    double M = 0;
+    for (auto k : s.dishes())
+        if (k != 0)
+            M += s.m_k[k];
+    const double a = s.alpha_ / (M + s.gamma_);
+    const double b = a * M;
+    auto add_prior = [&](std::vector<double> &row, size_t length) {
+        if (length + b == 0)
+            return;
+        if (row.size() < nslots)
+            row.resize(nslots, 0);
+        const double w = a / (length + b);
+        for (auto k : s.dishes())
+            if (k != 0)
+                row[k] += w * s.m_k[k];
+    };
+
+    sparse_row tables;
+    for (size_t eid = 0; eid < D_; ++eid) {
+        tables.clear();
+        size_t length = 0;
+        for (auto t : s.using_t[eid]) {
+            const size_t k = s.dish_assignment(eid, t);
+            // Tables at dish 0 only come from the explicit constructor
+            if (t == 0 || k == 0)
+                continue;
+            length += s.tablesize(eid, t);
+            tables.emplace_back(k, s.tablesize(eid, t));
+        }
+        std::sort(tables.begin(), tables.end());
+        size_t out = 0;
+        for (size_t i = 0; i < tables.size(); ++i) {
+            if (out > 0 && tables[out - 1].first == tables[i].first)
+                tables[out - 1].second += tables[i].second;
+            else
+                tables[out++] = tables[i];
+        }
+        tables.resize(out);
+        if (length + b > 0) {
+            const double inv = 1.0 / (length + b);
+            for (auto &e : tables)
+                e.second *= inv;
+        }
+        merge(theta_[eid], tables, nsamples_);
+
+        if (nsamples_ == 1 || (!own_row_[eid] && length != length_[eid])) {
+            if (nsamples_ == 1) {
+                auto it = length_rows_.find(length);
+                if (it == length_rows_.end()) {
+                    it = length_rows_.emplace(length, prior_.size()).first;
+                    prior_.emplace_back();
+                }
+                prior_row_[eid] = it->second;
+            } else {
+                // Take the samples so far along to a row of its own
+                prior_.push_back(prior_[prior_row_[eid]]);
+                prior_row_[eid] = prior_.size() - 1;
+                own_row_[eid] = true;
+            }
+            length_[eid] = length;
+        }
+        if (own_row_[eid]) {
+            length_[eid] = length;
+            add_prior(prior_[prior_row_[eid]], length);
+        }
+    }
+    for (auto &e : length_rows_)
+        add_prior(prior_[e.second], e.first);
+}
+
+size_t
+microscopes::lda::posterior_average::nentries() const
+{
+    size_t n = 0;
+    for (auto &row : phi_)
+        n += row.size();
+    for (auto &row : theta_)
+        n += row.size();
+    for (auto &row : prior_)
+        n += row.size();
+    return n;
+}
+
+void
+microscopes::lda::posterior_average::phi(float *out) const
+{
+    for (size_t i = 0; i < topics_.size(); ++i) {
+        const size_t k = topics_[i];
+        const double n = phi_samples_[k];
+        float *row = out + i * V_;
+        std::fill(row, row + V_, float(phi_smooth_[k] / n));
+        for (auto &e : phi_[k])
+            row[e.key] = (phi_smooth_[k] + e.sum) / n;
+    }
+}
+
+void
+microscopes::lda::posterior_average::theta(float *out) const
+{
+    const size_t K = topics_.size();
+    std::vector<size_t> pos(phi_.size(), 0);
+    for (size_t i = 0; i < K; ++i)
+        pos[topics_[i]] = i;
+    const double n = nsamples_;
+    std::vector<double> p(K);
+    for (size_t eid = 0; eid < D_; ++eid) {
+        const auto &prior = prior_[prior_row_[eid]];
+        float *row = out + eid * K;
+        for (size_t i = 0; i < K; ++i)
+            p[i] = topics_[i] < prior.size() ? prior[topics_[i]] : 0;
+        for (auto &e : theta_[eid])
+            p[pos[e.key]] += e.sum;
+        for (size_t i = 0; i < K; ++i)
+            row[i] = p[i] / n;
+    }
+}
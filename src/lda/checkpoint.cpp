@@ -0,0 +1,286 @@
+#include <microscopes/lda/model.hpp>
+
+#include <cstring>
+#include <fstream>
+
+/**
+* Checkpoint layout (version 2, native byte order):
+*
+*   header             see checkpoint_header below
+*   if has_corpus:
+*     uint64_t offsets[ndocs+1]
+*     token_t  tokens[ntokens]
+*   uint32_t dish_slots, nactive, nfree
+*   uint32_t dishes[nactive], free_dishes[nfree]
+*   for each document:
+*     uint32_t nslots, ntables, nfree
+*     uint32_t tables[ntables], free_tables[nfree]
+*     uint32_t table0_size, table0_nwords
+*     uint32_t dish_assignments[nslots]
+*     uint32_t (word, count)[table0_nwords]
+*   uint32_t table_assignments[ntokens]
+*
+* Dish and table lists are stored in slot_list order, free lists included,
+* so a restored chain draws exactly like the original. Table 0 is the only
+* table whose counts can not be recovered from the table assignments (words
+* are only counted at it by the explicit constructor), so its counts are
+* stored as they are.
+*/
+namespace {
+
+const char checkpoint_magic[8] = {'M', 'S', 'L', 'D', 'A', 'C', 'K', 'P'};
+const uint32_t checkpoint_version = 2;
+const uint32_t has_corpus = 1;
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t layout;
+    uint32_t token_bits;
+    float alpha;
+    float beta;
+    float gamma;
+    uint32_t ndishes;
+    uint64_t V;
+    uint64_t ndocs;
+    uint64_t ntokens;
+    uint64_t corpus_hash;
+};
+
+static_assert(sizeof(checkpoint_header) == 72, "checkpoint header must not be padded");
+
+template <typename T>
+inline void
+write_pod(std::ostream &out, const T &x)
+{
+    out.write(reinterpret_cast<const char *>(&x), sizeof(T));
+}
+
+template <typename T>
+inline void
+write_array(std::ostream &out, const T *x, size_t n)
+{
+    out.write(reinterpret_cast<const char *>(x), n * sizeof(T));
+}
+
+inline void
+write_slots(std::ostream &out, const microscopes::lda::slot_list &slots, std::vector<uint32_t> &buf)
+{
+    buf.assign(slots.begin(), slots.end());
+    buf.insert(buf.end(), slots.free_ids().begin(), slots.free_ids().end());
+    write_array(out, buf.data(), buf.size());
+}
+
+template <typename T>
+inline void
+read_array(std::istream &in, T *x, size_t n)
+{
+    in.read(reinterpret_cast<char *>(x), n * sizeof(T));
+    MICROSCOPES_CHECK(in.good() || (n == 0 && !in.bad()), "truncated checkpoint");
+}
+
+template <typename T>
+inline T
+read_pod(std::istream &in)
+{
+    T x;
+    read_array(in, &x, 1);
+    return x;
+}
+
+// Read the nactive, nfree header and lists written by write_slots
+inline void
+read_slots(std::istream &in, microscopes::lda::slot_list &slots, size_t nslots)
+{
+    const auto nactive = read_pod<uint32_t>(in);
+    const auto nfree = read_pod<uint32_t>(in);
+    MICROSCOPES_CHECK(nactive + size_t(nfree) <= nslots, "bad slot counts");
+    std::vector<uint32_t> buf(nactive + nfree);
+    read_array(in, buf.data(), buf.size());
+    slots.assign(std::vector<size_t>(buf.begin(), buf.begin() + nactive),
+                 std::vector<size_t>(buf.begin() + nactive, buf.end()), nslots);
+}
+
+} // namespace
+
+void
+microscopes::lda::state::save_checkpoint(std::ostream &out, bool include_corpus) const
+{
+    checkpoint_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, checkpoint_magic, sizeof(checkpoint_magic));
+    header.version = checkpoint_version;
+    header.flags = include_corpus ? has_corpus : 0;
+    header.layout = n_kv.layout();
+    header.token_bits = MICROSCOPES_LDA_TOKEN_BITS;
+    header.alpha = alpha_;
+    header.beta = beta_;
+    header.gamma = gamma_;
+    header.ndishes = m_k.size();
+    header.V = V;
+    header.ndocs = nentities();
+    header.ntokens = x_ji.ntokens();
+    header.corpus_hash = x_ji.hash();
+    write_pod(out, header);
+
+    if (include_corpus) {
+        for (size_t eid = 0; eid <= nentities(); ++eid)
+            write_pod<uint64_t>(out, eid < nentities() ? x_ji.offset(eid) : x_ji.ntokens());
+        for (size_t eid = 0; eid < nentities(); ++eid)
+            write_array(out, get_entity(eid).begin(), nterms(eid));
+    }
+
+    std::vector<uint32_t> buf;
+    write_pod<uint32_t>(out, dishes_.nslots());
+    write_pod<uint32_t>(out, dishes_.size());
+    write_pod<uint32_t>(out, dishes_.free_ids().size());
+    write_slots(out, dishes_, buf);
+
+    for (size_t eid = 0; eid < nentities(); ++eid) {
+        const auto &k_j = dish_assignments_[eid];
+        const auto &table0 = n_jtv[eid][0];
+        MICROSCOPES_DCHECK(using_t[eid].nslots() == k_j.size(), "table slots out of sync");
+        write_pod<uint32_t>(out, k_j.size());
+        write_pod<uint32_t>(out, using_t[eid].size());
+        write_pod<uint32_t>(out, using_t[eid].free_ids().size());
+        write_slots(out, using_t[eid], buf);
+        write_pod<uint32_t>(out, n_jt[eid][0]);
+        write_pod<uint32_t>(out, table0.size());
+        buf.assign(k_j.begin(), k_j.end());
+        for (auto &kv : table0) {
+            buf.push_back(kv.first);
+            buf.push_back(kv.second);
+        }
+        write_array(out, buf.data(), buf.size());
+    }
+    write_array(out, table_assignments_.data(), table_assignments_.size());
+    MICROSCOPES_CHECK(out.good(), "could not write checkpoint");
+}
+
+void
+microscopes::lda::state::save_checkpoint(const std::string &path, bool include_corpus) const
+{
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    MICROSCOPES_CHECK(out.good(), "could not open checkpoint file for writing");
+    save_checkpoint(out, include_corpus);
+    out.close();
+    MICROSCOPES_CHECK(!out.fail(), "could not write checkpoint file");
+}
+
+std::shared_ptr<microscopes::lda::state>
+microscopes::lda::state::load_checkpoint(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    MICROSCOPES_CHECK(in.good(), "could not open checkpoint file");
+    return load_checkpoint(in, nullptr);
+}
+
+std::shared_ptr<microscopes::lda::state>
+microscopes::lda::state::load_checkpoint(const std::string &path, const corpus &docs)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    MICROSCOPES_CHECK(in.good(), "could not open checkpoint file");
+    return load_checkpoint(in, &docs);
+}
+
+std::shared_ptr<microscopes::lda::state>
+microscopes::lda::state::load_checkpoint(std::istream &in)
+{
+    return load_checkpoint(in, nullptr);
+}
+
+std::shared_ptr<microscopes::lda::state>
+microscopes::lda::state::load_checkpoint(std::istream &in, const corpus &docs)
+{
+    return load_checkpoint(in, &docs);
+}
+
+std::shared_ptr<microscopes::lda::state>
+microscopes::lda::state::load_checkpoint(std::istream &in, const corpus *docs)
+{
+    const auto header = read_pod<checkpoint_header>(in);
+    MICROSCOPES_CHECK(std::memcmp(header.magic, checkpoint_magic, sizeof(checkpoint_magic)) == 0,
+        "not a checkpoint");
+    MICROSCOPES_CHECK(header.version == checkpoint_version, "unsupported checkpoint version");
+    MICROSCOPES_CHECK(header.token_bits == MICROSCOPES_LDA_TOKEN_BITS,
+        "checkpoint was written with a different token width");
+    MICROSCOPES_CHECK(header.layout <= sparse_word_major_layout, "bad count layout");
+
+    corpus stored;
+    if (header.flags & has_corpus) {
+        if (docs) {
+            in.ignore((header.ndocs + 1) * sizeof(uint64_t) + header.ntokens * sizeof(token_t));
+        } else {
+            std::vector<size_t> offsets(header.ndocs + 1);
+            std::vector<token_t> tokens(header.ntokens);
+            read_array(in, offsets.data(), offsets.size());
+            read_array(in, tokens.data(), tokens.size());
+            stored = corpus(std::move(tokens), std::move(offsets));
+            docs = &stored;
+        }
+    }
+    MICROSCOPES_CHECK(docs, "checkpoint does not include its corpus");
+    MICROSCOPES_CHECK(docs->ndocs() == header.ndocs && docs->ntokens() == header.ntokens &&
+        docs->hash() == header.corpus_hash, "corpus does not match the checkpoint");
+
+    std::shared_ptr<state> s(new state(model_definition(header.ndocs, header.V),
+        header.alpha, header.beta, header.gamma, *docs, count_layout(header.layout)));
+    // Keep the number of dish slots, so the kernels see the same vectors
+    s->m_k.resize(std::max<size_t>(header.ndishes, 1), 0);
+    read_slots(in, s->dishes_, read_pod<uint32_t>(in));
+    MICROSCOPES_CHECK(s->dishes_.size() > 0 && s->dishes_[0] == 0 &&
+        s->dishes_.nslots() <= s->m_k.size(), "bad dish list");
+
+    std::vector<uint32_t> buf;
+    for (size_t eid = 0; eid < s->nentities(); ++eid) {
+        s->create_entity(eid);
+        const auto nslots = read_pod<uint32_t>(in);
+        s->dish_assignments_[eid].resize(nslots);
+        read_slots(in, s->using_t[eid], nslots);
+        const auto table0_size = read_pod<uint32_t>(in);
+        const auto table0_nwords = read_pod<uint32_t>(in);
+        MICROSCOPES_CHECK(s->using_t[eid].size() > 0 && s->using_t[eid][0] == 0,
+            "bad table list");
+        buf.resize(nslots + 2 * table0_nwords);
+        read_array(in, buf.data(), buf.size());
+        std::copy(buf.begin(), buf.begin() + nslots, s->dish_assignments_[eid].begin());
+        for (auto t : s->using_t[eid]) {
+            MICROSCOPES_CHECK(s->dishes_.contains(s->dish_assignments_[eid][t]),
+                "table served a deleted dish");
+        }
+        s->n_jt[eid].assign(nslots, 0);
+        s->n_jtv[eid].resize(nslots);
+        s->n_jt[eid][0] = table0_size;
+        size_t table0_count = 0;
+        for (size_t i = 0; i < table0_nwords; ++i) {
+            const size_t v = buf[nslots + 2 * i];
+            MICROSCOPES_CHECK(v < s->V, "word out of bounds");
+            s->n_jtv[eid][0].incr(v, buf[nslots + 2 * i + 1]);
+            table0_count += buf[nslots + 2 * i + 1];
+        }
+        MICROSCOPES_CHECK(table0_count == table0_size, "table 0 counts do not add up");
+    }
+
+    // Words at table 0 are not seated (see remove_table), the others are
+    // counted at their table
+    read_array(in, s->table_assignments_.data(), s->table_assignments_.size());
+    for (size_t eid = 0; eid < s->nentities(); ++eid) {
+        const size_t nslots = s->n_jt[eid].size();
+        const uint32_t *t_j = s->table_assignments_.data() + docs->offset(eid);
+        for (size_t i = 0; i < s->nterms(eid); ++i) {
+            const size_t t = t_j[i];
+            if (t == 0)
+                continue;
+            MICROSCOPES_CHECK(t < nslots, "table assignment out of bounds");
+            s->n_jt[eid][t] += 1;
+            s->n_jtv[eid][t].incr(s->get_word(eid, i));
+        }
+        for (size_t t = 1; t < nslots; ++t) {
+            MICROSCOPES_CHECK(s->n_jt[eid][t] == 0 || s->using_t[eid].contains(t),
+                "word seated at a deleted table");
+        }
+    }
+    s->rebuild_dish_statistics();
+    return s;
+}
@@ -0,0 +1,188 @@
+#include <microscopes/lda/corpus_io.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char corpus_magic[8] = {'M', 'S', 'L', 'D', 'A', 'C', 'R', 'P'};
+const uint32_t corpus_version = 1;
+
+struct corpus_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t token_bits;
+    uint64_t ndocs;
+    uint64_t ntokens;
+};
+
+static_assert(sizeof(corpus_header) == 32, "corpus header must not be padded");
+static_assert(sizeof(size_t) == sizeof(uint64_t),
+    "offsets are mapped in place as size_t");
+
+/**
+* A read-only mapping of a whole file, unmapped on destruction
+*/
+class mapped_file {
+public:
+    mapped_file(const std::string &path, int flags)
+        : addr_(nullptr), size_(0)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        MICROSCOPES_CHECK(fd >= 0, "could not open corpus file");
+        struct stat st;
+        const bool ok = ::fstat(fd, &st) == 0;
+        size_ = ok ? st.st_size : 0;
+        if (ok && size_) {
+            addr_ = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+            if (addr_ == MAP_FAILED)
+                addr_ = nullptr;
+        }
+        ::close(fd);
+        MICROSCOPES_CHECK(ok && (addr_ || !size_), "could not map corpus file");
+    }
+
+    ~mapped_file()
+    {
+        if (addr_)
+            ::munmap(addr_, size_);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    inline const char *data() const { return static_cast<const char *>(addr_); }
+
+    inline size_t size() const { return size_; }
+
+    inline void
+    advise(int advice) const
+    {
+        if (addr_)
+            ::madvise(addr_, size_, advice);
+    }
+
+private:
+    void *addr_;
+    size_t size_;
+};
+
+inline bool
+is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parse an unsigned integer no larger than max at p, which must hold at
+// least one digit
+inline size_t
+parse_uint(const char *&p, const char *end, size_t max = std::numeric_limits<size_t>::max())
+{
+    MICROSCOPES_CHECK(p != end && *p >= '0' && *p <= '9', "malformed LDA-C line");
+    size_t ret = 0;
+    for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+        const size_t digit = *p - '0';
+        MICROSCOPES_CHECK(ret <= (max - digit) / 10, "malformed LDA-C line");
+        ret = ret * 10 + digit;
+    }
+    return ret;
+}
+
+} // namespace
+
+microscopes::lda::corpus
+microscopes::lda::load_ldac(const std::string &path)
+{
+    mapped_file file(path, MAP_PRIVATE);
+    file.advise(MADV_SEQUENTIAL);
+
+    std::vector<token_t> tokens;
+    std::vector<size_t> offsets(1, 0);
+    const char *p = file.data();
+    const char *end = p + file.size();
+    while (p != end) {
+        while (p != end && is_blank(*p))
+            ++p;
+        if (p == end)
+            break;
+        if (*p == '\n') {
+            ++p;
+            continue;
+        }
+        const size_t nterms = parse_uint(p, end);
+        for (size_t n = 0; n < nterms; ++n) {
+            while (p != end && is_blank(*p))
+                ++p;
+            const size_t v = parse_uint(p, end, corpus::max_token());
+            MICROSCOPES_CHECK(p != end && *p == ':', "malformed LDA-C term");
+            ++p;
+            const size_t count = parse_uint(p, end);
+            tokens.insert(tokens.end(), count, token_t(v));
+        }
+        while (p != end && is_blank(*p))
+            ++p;
+        MICROSCOPES_CHECK(p == end || *p == '\n', "LDA-C line has more terms than its count");
+        offsets.push_back(tokens.size());
+    }
+    return corpus(std::move(tokens), std::move(offsets));
+}
+
+void
+microscopes::lda::save_corpus(const corpus &docs, const std::string &path)
+{
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    MICROSCOPES_CHECK(out.good(), "could not open corpus file for writing");
+
+    corpus_header header;
+    std::memcpy(header.magic, corpus_magic, sizeof(corpus_magic));
+    header.version = corpus_version;
+    header.token_bits = MICROSCOPES_LDA_TOKEN_BITS;
+    header.ndocs = docs.ndocs();
+    header.ntokens = docs.ntokens();
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    for (size_t eid = 0; eid <= docs.ndocs(); ++eid) {
+        const uint64_t offset = eid < docs.ndocs() ? docs.offset(eid) : docs.ntokens();
+        out.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    }
+    for (size_t eid = 0; eid < docs.ndocs(); ++eid) {
+        const auto doc = docs.doc(eid);
+        out.write(reinterpret_cast<const char *>(doc.begin()), doc.size() * sizeof(token_t));
+    }
+    out.close();
+    MICROSCOPES_CHECK(!out.fail(), "could not write corpus file");
+}
+
+microscopes::lda::corpus
+microscopes::lda::map_corpus(const std::string &path)
+{
+    auto file = std::make_shared<mapped_file>(path, MAP_SHARED);
+    MICROSCOPES_CHECK(file->size() >= sizeof(corpus_header), "corpus file too short");
+
+    corpus_header header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    MICROSCOPES_CHECK(std::memcmp(header.magic, corpus_magic, sizeof(corpus_magic)) == 0,
+        "not a corpus file");
+    MICROSCOPES_CHECK(header.version == corpus_version, "unsupported corpus file version");
+    MICROSCOPES_CHECK(header.token_bits == MICROSCOPES_LDA_TOKEN_BITS,
+        "corpus file was written with a different token width");
+    MICROSCOPES_CHECK(header.ndocs < file->size() / sizeof(uint64_t) &&
+        header.ntokens <= file->size() / sizeof(token_t) &&
+        sizeof(header) + (header.ndocs + 1) * sizeof(uint64_t) +
+            header.ntokens * sizeof(token_t) == file->size(),
+        "corpus file size does not match its header");
+
+    const size_t *offsets = reinterpret_cast<const size_t *>(file->data() + sizeof(header));
+    const token_t *tokens = reinterpret_cast<const token_t *>(offsets + header.ndocs + 1);
+    MICROSCOPES_CHECK(offsets[0] == 0 && offsets[header.ndocs] == header.ntokens,
+        "corpus offsets do not match its header");
+    for (size_t eid = 0; eid < header.ndocs; ++eid)
+        MICROSCOPES_CHECK(offsets[eid] <= offsets[eid + 1], "corpus offsets are not sorted");
+    return corpus(file, tokens, offsets, header.ndocs);
+}
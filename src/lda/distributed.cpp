@@ -0,0 +1,605 @@
+#include <microscopes/lda/distributed.hpp>
+#include <microscopes/lda/kernels.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+// Unsigned LEB128 varints, with signed values zigzag encoded
+class encoder {
+public:
+    void
+    put(uint64_t x)
+    {
+        while (x >= 0x80) {
+            out_.push_back(char(x | 0x80));
+            x >>= 7;
+        }
+        out_.push_back(char(x));
+    }
+
+    void put_signed(int64_t x) { put((uint64_t(x) << 1) ^ uint64_t(x >> 63)); }
+
+    inline std::string &str() { return out_; }
+
+private:
+    std::string out_;
+};
+
+class decoder {
+public:
+    explicit decoder(const std::string &in) : in_(in), pos_(0) {}
+
+    uint64_t
+    get()
+    {
+        uint64_t x = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            MICROSCOPES_CHECK(pos_ < in_.size() && shift < 64, "truncated sync message");
+            const uint8_t b = in_[pos_++];
+            x |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return x;
+        }
+    }
+
+    int64_t
+    get_signed()
+    {
+        const uint64_t x = get();
+        return int64_t(x >> 1) ^ -int64_t(x & 1);
+    }
+
+    inline bool done() const { return pos_ == in_.size(); }
+
+private:
+    const std::string &in_;
+    size_t pos_;
+};
+
+// (key, delta) pairs with strictly increasing keys, as key gaps
+template <typename T>
+void
+put_deltas(encoder &e, const std::vector<std::pair<uint64_t, T>> &deltas)
+{
+    e.put(deltas.size());
+    uint64_t last = 0;
+    for (auto &d : deltas) {
+        e.put(d.first - last);
+        e.put_signed(d.second);
+        last = d.first;
+    }
+}
+
+std::vector<std::pair<uint64_t, int64_t>>
+get_deltas(decoder &d)
+{
+    std::vector<std::pair<uint64_t, int64_t>> ret(d.get());
+    uint64_t key = 0;
+    for (auto &p : ret) {
+        key += d.get();
+        p.first = key;
+        p.second = d.get_signed();
+    }
+    return ret;
+}
+
+std::vector<std::pair<uint64_t, int64_t>>
+dense_deltas(const std::vector<int64_t> &now, const std::vector<size_t> &before)
+{
+    std::vector<std::pair<uint64_t, int64_t>> ret;
+    for (size_t k = 0; k < std::max(now.size(), before.size()); ++k) {
+        const int64_t d = (k < now.size() ? now[k] : 0) - (k < before.size() ? int64_t(before[k]) : 0);
+        if (d)
+            ret.emplace_back(k, d);
+    }
+    return ret;
+}
+
+// What a node sent in one sync, dish ids still as the sender numbered them
+struct message {
+    size_t nslots;
+    std::vector<size_t> provisional;
+    std::vector<std::pair<uint64_t, int64_t>> m_k, n_k, n_kv;
+};
+
+message
+parse(const std::string &in)
+{
+    decoder d(in);
+    message m;
+    m.nslots = d.get();
+    m.provisional.resize(d.get());
+    size_t k = 0;
+    for (auto &p : m.provisional)
+        p = k += d.get();
+    m.m_k = get_deltas(d);
+    m.n_k = get_deltas(d);
+    m.n_kv = get_deltas(d);
+    MICROSCOPES_CHECK(d.done(), "trailing bytes in sync message");
+    return m;
+}
+
+void
+add_delta(std::vector<size_t> &counts, size_t k, int64_t d)
+{
+    if (k >= counts.size())
+        counts.resize(k + 1, 0);
+    MICROSCOPES_CHECK(d >= 0 || counts[k] >= size_t(-d), "dish count would go negative");
+    counts[k] += d;
+}
+
+void
+check_socket(bool ok, const char *what)
+{
+    MICROSCOPES_CHECK(ok, std::string(what) + ": " + std::strerror(errno));
+}
+
+// Closes its socket unless release()d, so a throwing constructor leaks none
+class socket_fd {
+public:
+    explicit socket_fd(int fd = -1) : fd_(fd) {}
+
+    ~socket_fd() { reset(); }
+
+    socket_fd(socket_fd &&other) noexcept : fd_(other.release()) {}
+
+    socket_fd &
+    operator=(socket_fd &&other) noexcept
+    {
+        reset(other.release());
+        return *this;
+    }
+
+    socket_fd(const socket_fd &) = delete;
+    socket_fd &operator=(const socket_fd &) = delete;
+
+    inline int get() const { return fd_; }
+
+    inline int
+    release()
+    {
+        const int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+
+    inline void
+    reset(int fd = -1)
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = fd;
+    }
+
+private:
+    int fd_;
+};
+
+void
+send_all(int fd, const char *p, size_t n)
+{
+    while (n) {
+        const ssize_t r = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        check_socket(r > 0, "send failed");
+        p += r;
+        n -= r;
+    }
+}
+
+void
+recv_all(int fd, char *p, size_t n)
+{
+    while (n) {
+        const ssize_t r = ::recv(fd, p, n, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        MICROSCOPES_CHECK(r != 0, "connection closed by peer");
+        check_socket(r > 0, "recv failed");
+        p += r;
+        n -= r;
+    }
+}
+
+// Frames are a little endian 64 bit length followed by the bytes
+void
+send_frame(int fd, const std::string &s)
+{
+    char len[8];
+    for (size_t i = 0; i < 8; ++i)
+        len[i] = char(uint64_t(s.size()) >> (8 * i));
+    send_all(fd, len, 8);
+    send_all(fd, s.data(), s.size());
+}
+
+std::string
+recv_frame(int fd)
+{
+    unsigned char len[8];
+    recv_all(fd, reinterpret_cast<char *>(len), 8);
+    uint64_t n = 0;
+    for (size_t i = 0; i < 8; ++i)
+        n |= uint64_t(len[i]) << (8 * i);
+    std::string s(n, '\0');
+    recv_all(fd, &s[0], n);
+    return s;
+}
+
+void
+set_nodelay(int fd)
+{
+    int one = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+} // namespace
+
+class microscopes::lda::distributed::local_hub::endpoint_t : public transport {
+public:
+    endpoint_t(local_hub &hub, size_t rank) : hub_(hub), rank_(rank) {}
+
+    size_t rank() const override { return rank_; }
+
+    size_t size() const override { return hub_.size(); }
+
+    std::vector<std::string>
+    all_gather(const std::string &message) override
+    {
+        return hub_.exchange(rank_, message);
+    }
+
+private:
+    local_hub &hub_;
+    size_t rank_;
+};
+
+microscopes::lda::distributed::local_hub::local_hub(size_t size)
+    : pending_(size), arrived_(0), round_(0)
+{
+    MICROSCOPES_CHECK(size > 0, "a hub needs at least one rank");
+    for (size_t r = 0; r < size; ++r)
+        endpoints_.emplace_back(new endpoint_t(*this, r));
+}
+
+microscopes::lda::distributed::local_hub::~local_hub() {}
+
+microscopes::lda::distributed::transport &
+microscopes::lda::distributed::local_hub::endpoint(size_t rank)
+{
+    MICROSCOPES_CHECK(rank < size(), "rank out of range");
+    return *endpoints_[rank];
+}
+
+std::vector<std::string>
+microscopes::lda::distributed::local_hub::exchange(size_t rank, const std::string &message)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_[rank] = message;
+    if (++arrived_ == size()) {
+        // Nobody can complete the next round before everybody has taken
+        // their copy of this one, so gathered_ stays put until then
+        gathered_.swap(pending_);
+        pending_.assign(size(), std::string());
+        arrived_ = 0;
+        ++round_;
+        done_.notify_all();
+        return gathered_;
+    }
+    const size_t round = round_;
+    done_.wait(lock, [&] { return round_ != round; });
+    return gathered_;
+}
+
+microscopes::lda::distributed::tcp_transport::tcp_transport(size_t rank, size_t size,
+        const std::string &host, uint16_t port, double connect_timeout)
+    : rank_(rank), size_(size)
+{
+    MICROSCOPES_CHECK(rank < size, "rank out of range");
+    if (rank == 0) {
+        peers_.assign(size, -1);
+        if (size == 1)
+            return;
+        socket_fd listener(::socket(AF_INET, SOCK_STREAM, 0));
+        check_socket(listener.get() >= 0, "socket failed");
+        int one = 1;
+        ::setsockopt(listener.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        check_socket(::bind(listener.get(), reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 &&
+            ::listen(listener.get(), int(size)) == 0, "could not listen");
+        // peers_ only takes the sockets once every rank has said hello
+        std::vector<socket_fd> peers(size);
+        for (size_t i = 1; i < size; ++i) {
+            socket_fd fd(::accept(listener.get(), nullptr, nullptr));
+            check_socket(fd.get() >= 0, "accept failed");
+            set_nodelay(fd.get());
+            const std::string hello = recv_frame(fd.get());
+            decoder d(hello);
+            const size_t r = d.get();
+            MICROSCOPES_CHECK(r > 0 && r < size && peers[r].get() < 0, "bad rank from peer");
+            peers[r] = std::move(fd);
+        }
+        for (size_t r = 1; r < size; ++r)
+            peers_[r] = peers[r].release();
+        return;
+    }
+
+    addrinfo hints, *found = nullptr;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    MICROSCOPES_CHECK(::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) == 0,
+        "could not resolve " + host);
+    const auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration<double>(connect_timeout);
+    socket_fd fd;
+    for (;;) {
+        fd.reset(::socket(found->ai_family, found->ai_socktype, found->ai_protocol));
+        if (fd.get() < 0)
+            ::freeaddrinfo(found);
+        check_socket(fd.get() >= 0, "socket failed");
+        if (::connect(fd.get(), found->ai_addr, found->ai_addrlen) == 0)
+            break;
+        const int err = errno;
+        fd.reset();
+        if (std::chrono::steady_clock::now() > deadline) {
+            ::freeaddrinfo(found);
+            errno = err;
+            check_socket(false, "could not connect to rank 0");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    ::freeaddrinfo(found);
+    set_nodelay(fd.get());
+    encoder hello;
+    hello.put(rank);
+    send_frame(fd.get(), hello.str());
+    peers_.assign(1, fd.release());
+}
+
+microscopes::lda::distributed::tcp_transport::~tcp_transport()
+{
+    for (auto fd : peers_)
+        if (fd >= 0)
+            ::close(fd);
+}
+
+std::vector<std::string>
+microscopes::lda::distributed::tcp_transport::all_gather(const std::string &message)
+{
+    std::vector<std::string> ret(size_);
+    if (rank_ == 0) {
+        ret[0] = message;
+        for (size_t r = 1; r < size_; ++r)
+            ret[r] = recv_frame(peers_[r]);
+        for (size_t r = 1; r < size_; ++r)
+            for (auto &m : ret)
+                send_frame(peers_[r], m);
+    } else {
+        send_frame(peers_[0], message);
+        for (auto &m : ret)
+            m = recv_frame(peers_[0]);
+    }
+    return ret;
+}
+
+microscopes::lda::distributed::node::node(const std::shared_ptr<state> &latent, transport &t)
+    : latent_(latent), transport_(t), nsyncs_(0), bytes_sent_(0)
+{
+    MICROSCOPES_CHECK(latent_.get() != nullptr, "node needs a state");
+    exchange(true);
+}
+
+void
+microscopes::lda::distributed::node::sync()
+{
+    exchange(false);
+}
+
+void
+microscopes::lda::distributed::node::run(common::rng_t &rng, size_t niters, size_t sync_every)
+{
+    MICROSCOPES_CHECK(sync_every > 0, "sync_every must be positive");
+    for (size_t i = 1; i <= niters; ++i) {
+        kernels::lda_crp_gibbs(*latent_, rng);
+        if (i % sync_every == 0 || i == niters)
+            sync();
+    }
+}
+
+void
+microscopes::lda::distributed::node::exchange(bool initial)
+{
+    state &s = *latent_;
+    const size_t V = s.nwords();
+    // Local dish ids below floor are global; initially all of them are
+    const size_t floor = initial ? s.dishes_.nslots() : m_k_.size();
+
+    // This node's counts, zero for dishes it does not use
+    std::vector<int64_t> m(s.dishes_.nslots(), 0), n(s.dishes_.nslots(), 0);
+    std::vector<size_t> provisional;
+    for (auto k : s.dishes_) {
+        m[k] = s.m_k[k];
+        n[k] = s.n_k[k];
+        if (k >= floor)
+            provisional.push_back(k);
+    }
+    std::sort(provisional.begin(), provisional.end());
+    std::vector<std::pair<uint64_t, int64_t>> n_kv;
+    s.n_kv.for_each_count([&](size_t k, size_t v, size_t c) {
+        if (s.dishes_.contains(k))
+            n_kv.emplace_back(uint64_t(k) * V + v, int64_t(c));
+    });
+    std::sort(n_kv.begin(), n_kv.end());
+
+    encoder e;
+    e.put(floor);
+    e.put(provisional.size());
+    size_t last = 0;
+    for (auto k : provisional) {
+        e.put(k - last);
+        last = k;
+    }
+    put_deltas(e, dense_deltas(m, m_k_));
+    put_deltas(e, dense_deltas(n, n_k_));
+    // Merge the counts with the last global ones into their differences
+    std::vector<std::pair<uint64_t, int64_t>> d_kv;
+    auto now = n_kv.begin();
+    auto before = n_kv_.begin();
+    while (now != n_kv.end() || before != n_kv_.end()) {
+        if (before == n_kv_.end() || (now != n_kv.end() && now->first < before->key)) {
+            d_kv.push_back(*now++);
+        } else if (now == n_kv.end() || before->key < now->first) {
+            d_kv.emplace_back(before->key, -before->count);
+            ++before;
+        } else {
+            if (now->second != before->count)
+                d_kv.emplace_back(now->first, now->second - before->count);
+            ++now;
+            ++before;
+        }
+    }
+    put_deltas(e, d_kv);
+    bytes_sent_ += e.str().size();
+
+    std::vector<message> messages;
+    for (auto &in : transport_.all_gather(e.str()))
+        messages.push_back(parse(in));
+    MICROSCOPES_CHECK(messages.size() == transport_.size(), "transport lost messages");
+
+    // Everything from here on is done identically on every node. First
+    // the changes to dishes that were global at the last sync
+    size_t nslots = floor;
+    for (auto &msg : messages) {
+        if (initial)
+            nslots = std::max(nslots, msg.nslots);
+        else
+            MICROSCOPES_CHECK(msg.nslots == floor, "nodes are out of sync");
+    }
+    std::vector<size_t> new_m(m_k_), new_n(n_k_);
+    new_m.resize(nslots, 0);
+    new_n.resize(nslots, 0);
+    for (auto &msg : messages) {
+        for (auto &d : msg.m_k)
+            if (initial || d.first < floor)
+                add_delta(new_m, d.first, d.second);
+        for (auto &d : msg.n_k)
+            if (initial || d.first < floor)
+                add_delta(new_n, d.first, d.second);
+    }
+
+    // Then number the new dishes, in rank order, with the ids of dishes that
+    // died everywhere first
+    std::vector<size_t> dead;
+    for (size_t k = nslots; k-- > 1;)
+        if (new_m[k] == 0) {
+            MICROSCOPES_CHECK(new_n[k] == 0, "words at a dish without tables");
+            dead.push_back(k);
+        }
+    std::vector<std::unordered_map<size_t, size_t>> ids(messages.size());
+    for (size_t r = 0; r < messages.size(); ++r) {
+        for (auto k : messages[r].provisional) {
+            MICROSCOPES_CHECK(k >= floor, "provisional dish below the floor");
+            size_t id;
+            if (dead.empty()) {
+                id = nslots++;
+            } else {
+                id = dead.back();
+                dead.pop_back();
+            }
+            ids[r][k] = id;
+        }
+    }
+    auto global_id = [&](size_t r, size_t k) -> size_t {
+        if (initial || k < floor)
+            return k;
+        auto it = ids[r].find(k);
+        MICROSCOPES_CHECK(it != ids[r].end(), "counts of an unknown dish");
+        return it->second;
+    };
+    new_m.resize(nslots, 0);
+    new_n.resize(nslots, 0);
+    std::vector<word_count> merged(n_kv_);
+    for (size_t r = 0; r < messages.size(); ++r) {
+        for (auto &d : messages[r].m_k)
+            if (!initial && d.first >= floor)
+                add_delta(new_m, global_id(r, d.first), d.second);
+        for (auto &d : messages[r].n_k)
+            if (!initial && d.first >= floor)
+                add_delta(new_n, global_id(r, d.first), d.second);
+        for (auto &d : messages[r].n_kv)
+            merged.push_back({global_id(r, d.first / V) * V + d.first % V, d.second});
+    }
+    std::stable_sort(merged.begin(), merged.end(),
+        [](const word_count &a, const word_count &b) { return a.key < b.key; });
+    size_t j = 0;
+    for (size_t i = 0; i < merged.size();) {
+        word_count w = merged[i];
+        while (++i < merged.size() && merged[i].key == w.key)
+            w.count += merged[i].count;
+        MICROSCOPES_CHECK(w.count >= 0, "word count would go negative");
+        if (w.count)
+            merged[j++] = w;
+    }
+    merged.resize(j);
+
+    // Install the global statistics in this node's state, renumbering its
+    // provisional dishes and keeping the order of the others
+    const size_t me = transport_.rank();
+    for (size_t eid = 0; eid < s.nentities(); ++eid) {
+        auto &k_j = s.dish_assignments_[eid];
+        for (size_t t = 0; t < k_j.size(); ++t) {
+            if (initial || k_j[t] < floor)
+                continue;
+            auto it = ids[me].find(k_j[t]);
+            if (it != ids[me].end()) {
+                k_j[t] = it->second;
+            } else {
+                MICROSCOPES_DCHECK(!s.using_t[eid].contains(t), "table at an unknown dish");
+                k_j[t] = 0;
+            }
+        }
+    }
+    std::vector<size_t> active;
+    std::vector<bool> seen(nslots, false);
+    for (auto k : s.dishes_) {
+        // A recycled id may also be a dead dish this node still had
+        const size_t id = global_id(me, k);
+        if ((id == 0 || new_m[id] > 0) && !seen[id]) {
+            active.push_back(id);
+            seen[id] = true;
+        }
+    }
+    for (size_t k = 1; k < nslots; ++k)
+        if (new_m[k] > 0 && !seen[k])
+            active.push_back(k);
+    s.dishes_.assign(active, {}, nslots);
+    s.m_k = new_m;
+    s.n_k = new_n;
+    s.n_kv.resize(nslots);
+    s.n_kv.clear();
+    for (auto &w : merged)
+        s.n_kv.incr(w.key / V, w.key % V, w.count);
+    s.adopt_dish_statistics(nslots);
+
+    m_k_.swap(new_m);
+    n_k_.swap(new_n);
+    n_kv_.swap(merged);
+    ++nsyncs_;
+}
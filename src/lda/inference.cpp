@@ -0,0 +1,168 @@
+#include <microscopes/lda/inference.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+microscopes::lda::inference::inference(const state &s)
+    : inference(s.snapshot(), s.beta_) {}
+
+microscopes::lda::inference::inference(const state &s, float prior)
+    : inference(s.snapshot(), prior) {}
+
+microscopes::lda::inference::inference(std::shared_ptr<const snapshot> snap, float prior)
+    : K_(snap->ntopics()), V_(snap->nwords()), prior_(prior), snap_(std::move(snap))
+{
+    MICROSCOPES_CHECK(prior > 0, "prior must be positive");
+}
+
+size_t
+microscopes::lda::inference::predict(const corpus::doc_view &doc, float *theta,
+    size_t max_iter, double tol, workspace &ws) const
+{
+    const size_t K = K_;
+
+    // Occurrences of the same word always have the same weights, so each
+    // distinct word is updated once and counted with its multiplicity
+    ws.words.clear();
+    for (auto v : doc)
+        if (v < V_)
+            ws.words.push_back(v);
+    const size_t n = ws.words.size();
+    if (n == 0 || K == 0) {
+        for (size_t k = 0; k < K; ++k)
+            theta[k] = 1.0f / K;
+        return 0;
+    }
+    std::sort(ws.words.begin(), ws.words.end());
+    ws.counts.clear();
+    size_t nunique = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0 && ws.words[i] == ws.words[nunique - 1]) {
+            ws.counts.back() += 1;
+        } else {
+            ws.words[nunique++] = ws.words[i];
+            ws.counts.push_back(1);
+        }
+    }
+
+    typedef Eigen::Map<Eigen::VectorXf> vec;
+    typedef Eigen::Map<const Eigen::VectorXf> const_vec;
+    ws.pz.resize(nunique * K);
+    ws.sum_pz.assign(2 * K, 0);
+    ws.row.resize(K);
+    float *sum_pz = ws.sum_pz.data();
+    float *sum_new = sum_pz + K;
+
+    // Starting from no weight at all, each word's distribution is its
+    // normalized phi row
+    for (size_t i = 0; i < nunique; ++i) {
+        vec p(&ws.pz[i * K], K);
+        p = const_vec(phi_row(ws.words[i]), K);
+        p *= 1.0f / p.sum();
+        vec(sum_pz, K) += ws.counts[i] * p;
+    }
+
+    size_t iter = 0;
+    vec row(ws.row.data(), K);
+    while (iter < max_iter) {
+        ++iter;
+        double delta = 0;
+        vec sum_old(sum_pz, K), sum(sum_new, K);
+        sum.setZero();
+        for (size_t i = 0; i < nunique; ++i) {
+            vec p(&ws.pz[i * K], K);
+            row = const_vec(phi_row(ws.words[i]), K).array() * ((sum_old - p).array() + prior_);
+            row *= 1.0f / row.sum();
+            delta += ws.counts[i] * (row - p).cwiseAbs().sum();
+            p = row;
+            sum += ws.counts[i] * row;
+        }
+        std::swap(sum_pz, sum_new);
+        if (delta < tol)
+            break;
+    }
+
+    for (size_t k = 0; k < K; ++k)
+        theta[k] = sum_pz[k] / n;
+    return iter;
+}
+
+void
+microscopes::lda::inference::predict(const corpus &docs, float *theta,
+    size_t max_iter, double tol, size_t nthreads) const
+{
+    std::vector<workspace> ws(std::max<size_t>(nthreads, 1));
+    lda_util::parallel_chunks(docs.ndocs(), chunk_size, nthreads,
+        [&](size_t thread, size_t first, size_t last) {
+            for (size_t eid = first; eid < last; ++eid)
+                predict(docs.doc(eid), theta + eid * K_, max_iter, tol, ws[thread]);
+        });
+}
+
+std::vector<std::vector<float>>
+microscopes::lda::inference::predict(const corpus &docs, size_t max_iter, double tol,
+    size_t nthreads) const
+{
+    std::vector<float> flat(docs.ndocs() * K_);
+    predict(docs, flat.data(), max_iter, tol, nthreads);
+    std::vector<std::vector<float>> theta;
+    theta.reserve(docs.ndocs());
+    for (size_t eid = 0; eid < docs.ndocs(); ++eid)
+        theta.emplace_back(flat.begin() + eid * K_, flat.begin() + (eid + 1) * K_);
+    return theta;
+}
+
+std::pair<double, size_t>
+microscopes::lda::inference::evaluate(const corpus &docs, size_t max_iter, double tol,
+    size_t nthreads) const
+{
+    MICROSCOPES_CHECK(K_ > 0, "no topics to evaluate against");
+    typedef Eigen::Map<const Eigen::VectorXf> const_vec;
+    const size_t nchunks = (docs.ndocs() + chunk_size - 1) / chunk_size;
+    std::vector<double> partial(nchunks, 0);
+    std::vector<size_t> ntokens(nchunks, 0);
+    std::vector<workspace> ws(std::max<size_t>(nthreads, 1));
+    std::vector<std::vector<float>> theta(ws.size(), std::vector<float>(K_));
+    lda_util::parallel_chunks(docs.ndocs(), chunk_size, nthreads,
+        [&](size_t thread, size_t first, size_t last) {
+            workspace &w = ws[thread];
+            const const_vec th(theta[thread].data(), K_);
+            double sum = 0;
+            size_t n = 0;
+            for (size_t eid = first; eid < last; ++eid) {
+                predict(docs.doc(eid), theta[thread].data(), max_iter, tol, w);
+                // predict() leaves the distinct known words and their
+                // multiplicities in the workspace
+                for (size_t i = 0; i < w.counts.size(); ++i) {
+                    sum += w.counts[i] * std::log(double(th.dot(const_vec(phi_row(w.words[i]), K_))));
+                    n += w.counts[i];
+                }
+            }
+            partial[first / chunk_size] = sum;
+            ntokens[first / chunk_size] = n;
+        });
+    // Summed in document order, so the result does not depend on nthreads
+    double log_likelihood = 0;
+    size_t n = 0;
+    for (size_t c = 0; c < nchunks; ++c) {
+        log_likelihood += partial[c];
+        n += ntokens[c];
+    }
+    return std::make_pair(log_likelihood, n);
+}
+
+double
+microscopes::lda::inference::log_likelihood(const corpus &docs, size_t max_iter, double tol,
+    size_t nthreads) const
+{
+    return evaluate(docs, max_iter, tol, nthreads).first;
+}
+
+double
+microscopes::lda::inference::perplexity(const corpus &docs, size_t max_iter, double tol,
+    size_t nthreads) const
+{
+    const auto ll = evaluate(docs, max_iter, tol, nthreads);
+    MICROSCOPES_CHECK(ll.second > 0, "no known words to evaluate");
+    return std::exp(-ll.first / ll.second);
+}
@@ -1,101 +1,189 @@
 #include <microscopes/lda/kernels.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+
 namespace microscopes {
 namespace kernels {
 namespace lda_crp {
 
-std::vector<float>
-calc_dish_posterior_t(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
-    std::vector<float> log_p_k(state.dishes_.size());
+/**
+* log_p_k[i] += sign * (lgamma(c + d) - lgamma(c)) for the K dishes, with
+* c = counts[i] + cache.offset(), from the cache where it covers c + d and
+* with the vectorized lgamma for the remaining dishes
+*/
+static void
+add_lgamma_ratio(float *log_p_k, const size_t *counts, size_t K,
+    const microscopes::lda::lgamma_cache &cache, size_t d, float sign, workspace &ws)
+{
+    ws.lgamma_misses.clear();
+    ws.lgamma_x.clear();
+    for (size_t i = 0; i < K; i++) {
+        const size_t c = counts[i];
+        if (c + d < cache.size()) {
+            log_p_k[i] += sign * (cache[c + d] - cache[c]);
+        } else {
+            ws.lgamma_misses.push_back(i);
+            ws.lgamma_x.push_back(c + cache.offset());
+        }
+    }
+    const size_t nmisses = ws.lgamma_misses.size();
+    if (nmisses == 0)
+        return;
+    ws.lgamma_acc.assign(nmisses, 0);
+    microscopes::lda::vmath::add_lgamma_ratio(
+        ws.lgamma_acc.data(), ws.lgamma_x.data(), d, sign, nmisses);
+    for (size_t j = 0; j < nmisses; j++)
+        log_p_k[ws.lgamma_misses[j]] += ws.lgamma_acc[j];
+}
 
+void
+calc_dish_posterior_t(microscopes::lda::state &state, size_t eid, size_t t, workspace &ws) {
+    namespace vmath = microscopes::lda::vmath;
+    const size_t K = state.dishes_.size();
+    auto &log_p_k = ws.p_k;
+    auto &n_k = ws.counts;
+    log_p_k.resize(K);
+    n_k.resize(K);
+
+    // The lgamma terms are those of integer counts plus V*beta or beta.
+    // k_old is 0 if leave_from_dish deleted the table's dish, whose words
+    // are not counted at the new dish
     auto k_old = state.dish_assignment(eid, t);
     auto n_jt_val = state.n_jt[eid][t];
-    for (size_t i = 0; i < state.dishes_.size(); i++) {
+    for (size_t i = 0; i < K; i++) {
         auto k = state.dishes_[i];
-        float n_k_val = state.n_k.get(k); // V*beta when k == i == 0
-        if (k == k_old) n_k_val -= n_jt_val;
-        log_p_k[i] = distributions::fast_log(i == 0 ? state.gamma_ : state.m_k[k]);
-        log_p_k[i] += distributions::fast_lgamma(n_k_val);
-        log_p_k[i] -= distributions::fast_lgamma(n_k_val + n_jt_val);
+        n_k[i] = state.n_k[k]; // 0 when k == i == 0
+        if (k == k_old && k != 0) n_k[i] -= n_jt_val;
+        log_p_k[i] = i == 0 ? state.gamma_ : state.m_k[k];
     }
+    vmath::log(log_p_k.data(), log_p_k.data(), K);
+    add_lgamma_ratio(log_p_k.data(), n_k.data(), K, state.lgamma_dish_sizes(), n_jt_val, -1, ws);
 
+    const auto &lgamma_n_kw = state.lgamma_word_counts();
     for (auto &kv : state.n_jtv[eid][t]) {
         auto w = kv.first; // w is word index
         auto n_jtw = kv.second; // n_jtw is # of times word w appears at table t in doc eid.
-        if (n_jtw == 0) continue; // if word w isn't at table t, continue. log_pk wouldn't change.
 
-        for (size_t i = 0; i < state.dishes_.size(); i++) {
-            float n_kw;
-            n_kw = state.n_kv[state.dishes_[i]].get(w); // beta when k == i == 0
-            if (state.dishes_[i] == state.dish_assignment(eid, t)) n_kw -= n_jtw;
-            log_p_k[i] += distributions::fast_lgamma(n_kw + n_jtw);
-            log_p_k[i] -= distributions::fast_lgamma(n_kw);
+        for (size_t i = 0; i < K; i++) {
+            n_k[i] = state.n_kv.get(state.dishes_[i], w); // 0 when k == i == 0
+            if (state.dishes_[i] == k_old && k_old != 0) n_k[i] -= n_jtw;
         }
+        add_lgamma_ratio(log_p_k.data(), n_k.data(), K, lgamma_n_kw, n_jtw, 1, ws);
     }
 
-    std::vector<float> p_k;
-    p_k.reserve(state.dishes_.size());
+    // Exponentiated in place
     float max_value = *std::max_element(log_p_k.begin(), log_p_k.end());
-    for (auto log_p_k_value : log_p_k) {
-        p_k.push_back(exp(log_p_k_value - max_value));
+    for (auto &p : log_p_k) {
+        p -= max_value;
     }
-    lda_util::normalize(p_k);
-    return p_k;
+    vmath::exp(log_p_k.data(), log_p_k.data(), K);
+    lda_util::normalize(log_p_k);
 }
 
 std::vector<float>
-calc_dish_posterior_w(microscopes::lda::state &state, const std::vector<float> &f_k, common::rng_t &rng){
-    Eigen::VectorXf p_k(state.dishes_.size());
+calc_dish_posterior_t(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
+    workspace ws;
+    calc_dish_posterior_t(state, eid, t, ws);
+    return std::move(ws.p_k);
+}
+
+void
+calc_dish_posterior_w(microscopes::lda::state &state, workspace &ws) {
+    ws.p_k.resize(state.dishes_.size());
+    Eigen::Map<Eigen::VectorXf> p_k(ws.p_k.data(), ws.p_k.size());
     for (size_t i = 0; i < state.dishes_.size(); ++i) {
-        p_k(i) = state.m_k[state.dishes_[i]] * f_k[state.dishes_[i]];
+        p_k(i) = state.m_k[state.dishes_[i]] * ws.f_k[state.dishes_[i]];
     }
     p_k(0) = state.gamma_ / state.V;
     p_k /= p_k.sum();
-    return std::vector<float>(p_k.data(), p_k.data() + p_k.size());
 }
 
 std::vector<float>
-calc_f_k(microscopes::lda::state &state, size_t v, common::rng_t &rng) {
-    Eigen::VectorXf f_k(state.n_kv.size());
+calc_dish_posterior_w(microscopes::lda::state &state, const std::vector<float> &f_k, common::rng_t &rng){
+    workspace ws;
+    ws.f_k = f_k;
+    calc_dish_posterior_w(state, ws);
+    return std::move(ws.p_k);
+}
 
-    f_k(0) = 0;
-    for (size_t k = 1; k < state.n_kv.size(); k++)
-    {
-        f_k(k) = state.n_kv[k].get(v) / state.n_k.get(k);
-    }
+void
+calc_f_k(microscopes::lda::state &state, size_t v, workspace &ws) {
+    const size_t K = state.n_kv.ndishes();
+    ws.f_k.resize(K);
+    auto &f_k = ws.f_k;
+    const float *inv_n_k = state.dish_normalizers().data();
+    const size_t *m_k = state.m_k.data();
 
-    return std::vector<float>(f_k.data(), f_k.data() + f_k.size());
+    // The dot product with m_k is taken in the same pass
+    float f_m = 0;
+    f_k[0] = 0;
+    if (state.n_kv.layout() == microscopes::lda::word_major_layout) {
+        // All dish counts of word v are contiguous
+        const size_t *n_v = state.n_kv.word_row(v);
+        for (size_t k = 1; k < K; k++)
+        {
+            f_k[k] = (n_v[k] + state.beta_) * inv_n_k[k];
+            f_m += m_k[k] * f_k[k];
+        }
+    } else {
+        for (size_t k = 1; k < K; k++)
+        {
+            f_k[k] = state.num_words_at_dish(k, v) * inv_n_k[k];
+            f_m += m_k[k] * f_k[k];
+        }
+    }
+    ws.f_m = f_m;
 }
 
 std::vector<float>
-calc_table_posterior(microscopes::lda::state &state, size_t eid, std::vector<float> &f_k, common::rng_t &rng) {
-    std::vector<size_t> using_table = state.using_t[eid];
-    Eigen::VectorXf p_t(using_table.size());
+calc_f_k(microscopes::lda::state &state, size_t v, common::rng_t &rng) {
+    workspace ws;
+    calc_f_k(state, v, ws);
+    return std::move(ws.f_k);
+}
+
+void
+calc_table_posterior(microscopes::lda::state &state, size_t eid, workspace &ws) {
+    const auto &using_table = state.using_t[eid];
+    ws.p_t.resize(using_table.size());
+    Eigen::Map<Eigen::VectorXf> p_t(ws.p_t.data(), ws.p_t.size());
 
     for (size_t i = 1; i < using_table.size(); i++) {
         auto p = using_table[i];
-        p_t(i) = state.n_jt[eid][p] * f_k[state.dish_assignment(eid, p)];
+        p_t(i) = state.n_jt[eid][p] * ws.f_k[state.dish_assignment(eid, p)];
     }
-    Eigen::Map<Eigen::VectorXf> eigen_f_k(f_k.data(), f_k.size());
-    Eigen::Map<Eigen::Matrix<size_t, Eigen::Dynamic, 1>> eigen_m_k(state.m_k.data(), state.m_k.size());
-    float p_x_ji = state.gamma_ / state.V + eigen_f_k.dot(eigen_m_k.cast<float>());
+    float p_x_ji = state.gamma_ / state.V + ws.f_m;
     p_t(0) = p_x_ji * state.alpha_ / (state.gamma_ + state.ntables());
     p_t /= p_t.sum();
-    return std::vector<float>(p_t.data(), p_t.data() + p_t.size());
+}
+
+std::vector<float>
+calc_table_posterior(microscopes::lda::state &state, size_t eid, std::vector<float> &f_k, common::rng_t &rng) {
+    workspace ws;
+    ws.f_k.swap(f_k);
+    Eigen::Map<Eigen::VectorXf> eigen_f_k(ws.f_k.data(), ws.f_k.size());
+    Eigen::Map<Eigen::Matrix<size_t, Eigen::Dynamic, 1>> eigen_m_k(state.m_k.data(), state.m_k.size());
+    ws.f_m = eigen_f_k.dot(eigen_m_k.cast<float>());
+    calc_table_posterior(state, eid, ws);
+    f_k.swap(ws.f_k);
+    return std::move(ws.p_t);
 }
 
 void
-sampling_t(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng) {
+sampling_t(microscopes::lda::state &state, size_t eid, size_t i, workspace &ws, common::rng_t &rng) {
     state.remove_table(eid, i);
     size_t v = state.get_word(eid, i);
-    std::vector<float> f_k = calc_f_k(state, v, rng);
-    std::vector<float> p_t = calc_table_posterior(state, eid, f_k, rng);
+    calc_f_k(state, v, ws);
+    calc_table_posterior(state, eid, ws);
 
-    size_t t_new = state.using_t[eid][common::util::sample_discrete(p_t, rng)];
+    size_t t_new = state.using_t[eid][common::util::sample_discrete(ws.p_t, rng)];
     if (t_new == 0)
     {
-        auto p_k = calc_dish_posterior_w(state, f_k, rng);
-        size_t k_new = state.dishes_[common::util::sample_discrete(p_k, rng)];
+        calc_dish_posterior_w(state, ws);
+        size_t k_new = state.dishes_[common::util::sample_discrete(ws.p_k, rng)];
         if (k_new == 0) k_new = state.create_dish();
         t_new = state.create_table(eid, k_new);
     }
@@ -103,31 +191,692 @@ sampling_t(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &
 }
 
 void
-sampling_k(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
+sampling_t(microscopes::lda::state &state, size_t eid, size_t i, common::rng_t &rng) {
+    workspace ws;
+    sampling_t(state, eid, i, ws, rng);
+}
+
+void
+sampling_k(microscopes::lda::state &state, size_t eid, size_t t, workspace &ws, common::rng_t &rng) {
     state.leave_from_dish(eid, t);
-    auto p_k = calc_dish_posterior_t(state, eid, t, rng);
-    size_t k_new = state.dishes_[common::util::sample_discrete(p_k, rng)];
+    calc_dish_posterior_t(state, eid, t, ws);
+    size_t k_new = state.dishes_[common::util::sample_discrete(ws.p_k, rng)];
     if (k_new == 0) k_new = state.create_dish();
     state.seat_at_dish(eid, t, k_new);
 }
 
+void
+sampling_k(microscopes::lda::state &state, size_t eid, size_t t, common::rng_t &rng) {
+    workspace ws;
+    sampling_k(state, eid, t, ws, rng);
+}
+
 } // namespace lda_crp
 
+static void
+table_phase(microscopes::lda::state &state, lda_crp::workspace &ws, common::rng_t &rng,
+            size_t first, size_t last)
+{
+    for (size_t eid = first; eid < last; ++eid) {
+        for (size_t i = 0; i < state.nterms(eid); ++i) {
+            lda_crp::sampling_t(state, eid, i, ws, rng);
+        }
+    }
+}
+
+static void
+dish_phase(microscopes::lda::state &state, lda_crp::workspace &ws, common::rng_t &rng,
+           size_t first, size_t last)
+{
+    for (size_t eid = first; eid < last; ++eid) {
+        for (auto t : state.using_t[eid]) {
+            if (t != 0) {
+                lda_crp::sampling_k(state, eid, t, ws, rng);
+            }
+        }
+    }
+}
+
+void
+lda_crp_gibbs(microscopes::lda::state &state, lda_crp::workspace &ws, common::rng_t &rng)
+{
+    {
+        MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().table_phase);
+        table_phase(state, ws, rng, 0, state.nentities());
+    }
+    MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().dish_phase);
+    dish_phase(state, ws, rng, 0, state.nentities());
+}
+
 void
 lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng)
 {
+    lda_crp::workspace ws;
+    lda_crp_gibbs(state, ws, rng);
+}
+
+/**
+* The table phase of lda_crp_gibbs on contiguous shards of the documents,
+* nthreads > 1 of them; see the document-parallel lda_crp_gibbs. Each
+* shard uses one of workspaces, which is grown to nthreads.
+*/
+static void
+parallel_table_phase(microscopes::lda::state &state, std::vector<lda_crp::workspace> &workspaces,
+                     common::rng_t &rng, size_t nthreads)
+{
+    // Contiguous shards with roughly the same number of tokens
+    size_t ntokens = 0;
+    for (size_t eid = 0; eid < state.nentities(); ++eid)
+        ntokens += state.nterms(eid);
+    std::vector<size_t> bounds(1, 0);
+    size_t seen = 0;
+    for (size_t eid = 0; eid < state.nentities(); ++eid) {
+        seen += state.nterms(eid);
+        if (bounds.size() < nthreads && seen * nthreads >= ntokens * bounds.size())
+            bounds.push_back(eid + 1);
+    }
+    bounds.push_back(state.nentities());
+
+    // One rng stream per shard, seeded from the caller's stream so the
+    // sweep is reproducible for a fixed number of threads
+    const size_t nshards = bounds.size() - 1;
+    std::vector<common::rng_t> rngs;
+    if (workspaces.size() < nshards)
+        workspaces.resize(nshards);
+    std::vector<std::unique_ptr<microscopes::lda::state>> shards;
+    for (size_t p = 0; p < nshards; ++p) {
+        rngs.push_back(common::rng_t(rng()));
+        shards.push_back(state.detach_shard(bounds[p], bounds[p + 1]));
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t p = 0; p < nshards; ++p) {
+        workers.push_back(std::thread(
+            [&shards, &workspaces, &rngs, p]() {
+                table_phase(*shards[p], workspaces[p], rngs[p], 0, shards[p]->nentities());
+            }));
+    }
+    for (auto &w : workers)
+        w.join();
+
+    for (size_t p = 0; p < nshards; ++p)
+        state.attach_shard(*shards[p], bounds[p]);
+    state.rebuild_dish_statistics();
+}
+
+void
+lda_crp_gibbs(microscopes::lda::state &state, common::rng_t &rng, size_t nthreads)
+{
+    nthreads = std::min(nthreads, state.nentities());
+    if (nthreads <= 1) {
+        lda_crp_gibbs(state, rng);
+        return;
+    }
+
+    // The table phase is timed from the shards' detach to their attach,
+    // the merge included
+    std::vector<lda_crp::workspace> workspaces;
+    {
+        MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().table_phase);
+        parallel_table_phase(state, workspaces, rng, nthreads);
+    }
+
+    // Tables from every shard now compete for the same dishes, so the
+    // dish phase runs on the merged state
+    MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().dish_phase);
+    dish_phase(state, workspaces[0], rng, 0, state.nentities());
+}
+
+void
+lda_crp_gibbs_range(microscopes::lda::state &state, common::rng_t &rng, size_t first, size_t last)
+{
+    MICROSCOPES_CHECK(first <= last && last <= state.nentities(), "bad document range");
+    lda_crp::workspace ws;
+    {
+        MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().table_phase);
+        table_phase(state, ws, rng, first, last);
+    }
+    MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().dish_phase);
+    dish_phase(state, ws, rng, first, last);
+}
+
+namespace lda_crp_block {
+
+void
+calc_dish_posteriors(microscopes::lda::state &state, workspace &ws,
+                     size_t first, size_t last, size_t nthreads)
+{
+    namespace vmath = microscopes::lda::vmath;
+    MICROSCOPES_DCHECK(first <= last && last <= ws.tables.size(), "bad block bounds");
+    const size_t K = state.dishes_.size();
+    const size_t npos = std::numeric_limits<size_t>::max();
+    ws.dishes = state.dishes();
+    ws.pos.resize(state.dishes_.nslots());
+    for (size_t i = 0; i < K; ++i)
+        ws.pos[ws.dishes[i]] = i;
+
+    // The distinct words of the block, and their counts at every dish in
+    // one word major matrix, read from n_kv in its own order
+    if (ws.word_pos.size() < state.nwords())
+        ws.word_pos.resize(state.nwords(), npos);
+    ws.words.clear();
+    for (size_t b = first; b < last; ++b) {
+        for (auto &kv : state.n_jtv[ws.tables[b].first][ws.tables[b].second]) {
+            if (ws.word_pos[kv.first] == npos) {
+                ws.word_pos[kv.first] = 0;
+                ws.words.push_back(kv.first);
+            }
+        }
+    }
+    std::sort(ws.words.begin(), ws.words.end());
+    const size_t W = ws.words.size();
+    for (size_t j = 0; j < W; ++j)
+        ws.word_pos[ws.words[j]] = j;
+    ws.counts.resize(W * K);
+    if (state.n_kv.layout() == microscopes::lda::topic_major_layout) {
+        for (size_t i = 0; i < K; ++i)
+            for (size_t j = 0; j < W; ++j)
+                ws.counts[j * K + i] = state.n_kv.get(ws.dishes[i], ws.words[j]);
+    } else {
+        for (size_t j = 0; j < W; ++j)
+            for (size_t i = 0; i < K; ++i)
+                ws.counts[j * K + i] = state.n_kv.get(ws.dishes[i], ws.words[j]);
+    }
+
+    // Brought up to date here, the tables' threads only read them
+    const auto &lgamma_dish_sizes = state.lgamma_dish_sizes();
+    const auto &lgamma_n_kw = state.lgamma_word_counts();
+    if (ws.p_k.size() < last - first)
+        ws.p_k.resize(last - first);
+    if (ws.threads.size() < nthreads)
+        ws.threads.resize(nthreads);
+
+    // As calc_dish_posterior_t after leave_from_dish: the table's own
+    // dish loses the table and its words, and gets probability 0 if the
+    // table was its last one
+    lda_util::parallel_chunks(last - first, 16, nthreads,
+        [&](size_t thread, size_t chunk_first, size_t chunk_last) {
+            auto &tws = ws.threads[thread];
+            auto &n_k = tws.counts;
+            n_k.resize(K);
+            for (size_t b = first + chunk_first; b < first + chunk_last; ++b) {
+                const size_t eid = ws.tables[b].first, t = ws.tables[b].second;
+                auto &log_p_k = ws.p_k[b - first];
+                log_p_k.resize(K);
+                const size_t k_old = state.dish_assignment(eid, t);
+                const size_t i_old = k_old != 0 ? ws.pos[k_old] : K;
+                const size_t n_jt_val = state.n_jt[eid][t];
+                for (size_t i = 0; i < K; i++) {
+                    auto k = ws.dishes[i];
+                    n_k[i] = state.n_k[k];
+                    log_p_k[i] = i == 0 ? state.gamma_ : state.m_k[k];
+                }
+                bool emptied = false;
+                if (i_old < K) {
+                    n_k[i_old] -= n_jt_val;
+                    log_p_k[i_old] -= 1;
+                    emptied = log_p_k[i_old] == 0;
+                    if (emptied)
+                        log_p_k[i_old] = 1; // Keeps the log finite
+                }
+                vmath::log(log_p_k.data(), log_p_k.data(), K);
+                add_lgamma_ratio(log_p_k.data(), n_k.data(), K, lgamma_dish_sizes, n_jt_val, -1, tws);
+
+                for (auto &kv : state.n_jtv[eid][t]) {
+                    const size_t *c = &ws.counts[ws.word_pos[kv.first] * K];
+                    std::copy(c, c + K, n_k.begin());
+                    if (i_old < K)
+                        n_k[i_old] -= kv.second;
+                    add_lgamma_ratio(log_p_k.data(), n_k.data(), K, lgamma_n_kw, kv.second, 1, tws);
+                }
+
+                // Exponentiated in place, leaving an emptied dish out of
+                // the maximum and setting it to 0 afterwards
+                if (emptied)
+                    log_p_k[i_old] = -std::numeric_limits<float>::infinity();
+                const float max_value = *std::max_element(log_p_k.begin(), log_p_k.end());
+                for (auto &p : log_p_k)
+                    p -= max_value;
+                if (emptied)
+                    log_p_k[i_old] = 0;
+                vmath::exp(log_p_k.data(), log_p_k.data(), K);
+                if (emptied)
+                    log_p_k[i_old] = 0;
+                lda_util::normalize(log_p_k);
+            }
+        });
+
+    for (auto w : ws.words)
+        ws.word_pos[w] = npos;
+}
+
+void
+resample_dishes(microscopes::lda::state &state, workspace &ws, common::rng_t &rng,
+                size_t block_size, size_t nthreads)
+{
+    MICROSCOPES_CHECK(block_size > 0, "block_size must be positive");
+    MICROSCOPES_CHECK(nthreads > 0, "nthreads must be positive");
+    ws.tables.clear();
+    for (size_t eid = 0; eid < state.nentities(); ++eid)
+        for (auto t : state.using_t[eid])
+            if (t != 0)
+                ws.tables.emplace_back(eid, t);
+
+    for (size_t first = 0; first < ws.tables.size(); first += block_size) {
+        const size_t last = std::min(ws.tables.size(), first + block_size);
+        calc_dish_posteriors(state, ws, first, last, nthreads);
+
+        // The block's moves are merged one by one. A dish the block
+        // emptied before a later table of the block drew it is replaced by
+        // a new dish, shared by all the tables that drew it
+        ws.created.clear();
+        ws.replaced.clear();
+        for (size_t b = first; b < last; ++b) {
+            const size_t eid = ws.tables[b].first, t = ws.tables[b].second;
+            size_t k_new = ws.dishes[common::util::sample_discrete(ws.p_k[b - first], rng)];
+            state.leave_from_dish(eid, t);
+            if (k_new != 0 && (!state.dishes_.contains(k_new) ||
+                    std::find(ws.created.begin(), ws.created.end(), k_new) != ws.created.end())) {
+                auto it = std::find_if(ws.replaced.begin(), ws.replaced.end(),
+                    [k_new](const std::pair<size_t, size_t> &r) { return r.first == k_new; });
+                if (it != ws.replaced.end()) {
+                    k_new = it->second;
+                } else {
+                    const size_t k_old = k_new;
+                    k_new = state.create_dish();
+                    ws.created.push_back(k_new);
+                    ws.replaced.emplace_back(k_old, k_new);
+                }
+            } else if (k_new == 0) {
+                k_new = state.create_dish();
+                ws.created.push_back(k_new);
+            }
+            state.seat_at_dish(eid, t, k_new);
+        }
+    }
+}
+
+} // namespace lda_crp_block
+
+void
+lda_crp_block_gibbs(microscopes::lda::state &state, lda_crp_block::workspace &ws,
+                    common::rng_t &rng, size_t block_size, size_t nthreads)
+{
+    MICROSCOPES_CHECK(nthreads > 0, "nthreads must be positive");
+    if (ws.threads.empty())
+        ws.threads.resize(1);
+    {
+        MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().table_phase);
+        if (std::min(nthreads, state.nentities()) > 1)
+            parallel_table_phase(state, ws.threads, rng, std::min(nthreads, state.nentities()));
+        else
+            table_phase(state, ws.threads[0], rng, 0, state.nentities());
+    }
+    MICROSCOPES_LDA_TIME_PHASE(timer, state.counters().dish_phase);
+    lda_crp_block::resample_dishes(state, ws, rng, block_size, nthreads);
+}
+
+void
+lda_crp_block_gibbs(microscopes::lda::state &state, common::rng_t &rng,
+                    size_t block_size, size_t nthreads)
+{
+    lda_crp_block::workspace ws;
+    lda_crp_block_gibbs(state, ws, rng, block_size, nthreads);
+}
+
+namespace lda_crp_sparse {
+
+void
+buckets::reset(const microscopes::lda::state &state)
+{
+    smoothing = 0;
+    for (auto k : state.dishes_) {
+        if (k != 0)
+            smoothing += term(state, k);
+    }
+    ntables = state.ntables();
+}
+
+std::pair<size_t, size_t>
+draw(const microscopes::lda::state &state, buckets &buckets,
+    size_t eid, size_t v, common::rng_t &rng)
+{
+    // Tables bucket
+    const auto &tables = state.using_t[eid];
+    auto &p_t = buckets.p_t;
+    p_t.resize(tables.size());
+    float table_mass = 0;
+    for (size_t p = 1; p < tables.size(); ++p) {
+        auto t = tables[p];
+        auto k = state.dish_assignment(eid, t);
+        table_mass += state.n_jt[eid][t] * state.num_words_at_dish(k, v) / state.num_words_at_dish(k);
+        p_t[p] = table_mass;
+    }
+
+    // Topic word bucket, over the dishes word v occurs at
+    auto &p_k = buckets.p_k;
+    auto &k_nz = buckets.k_nz;
+    p_k.clear();
+    k_nz.clear();
+    float topic_word_mass = 0;
+    if (state.n_kv.layout() == microscopes::lda::sparse_word_major_layout) {
+        for (auto &kv : state.n_kv.word_dishes(v)) {
+            topic_word_mass += state.m_k[kv.first] * kv.second / state.num_words_at_dish(kv.first);
+            k_nz.push_back(kv.first);
+            p_k.push_back(topic_word_mass);
+        }
+    } else {
+        for (auto k : state.dishes_) {
+            size_t n_kv = k == 0 ? 0 : state.n_kv.get(k, v);
+            if (n_kv == 0)
+                continue;
+            topic_word_mass += state.m_k[k] * n_kv / state.num_words_at_dish(k);
+            k_nz.push_back(k);
+            p_k.push_back(topic_word_mass);
+        }
+    }
+    const float smoothing_mass = state.beta_ * buckets.smoothing;
+    const float new_dish_mass = state.gamma_ / state.V;
+
+    const float coef = state.alpha_ / (state.gamma_ + buckets.ntables);
+    float u = distributions::sample_unif01(rng) *
+        (table_mass + coef * (topic_word_mass + smoothing_mass + new_dish_mass));
+    if (u < table_mass && tables.size() > 1) {
+        auto it = std::upper_bound(p_t.begin() + 1, p_t.begin() + tables.size(), u);
+        size_t p = std::min(size_t(it - p_t.begin()), tables.size() - 1);
+        return std::make_pair(tables[p], state.dish_assignment(eid, tables[p]));
+    }
+
+    u = (u - table_mass) / coef;
+    if (u < topic_word_mass && !k_nz.empty()) {
+        auto it = std::upper_bound(p_k.begin(), p_k.end(), u);
+        return std::make_pair(size_t(0), k_nz[std::min(size_t(it - p_k.begin()), k_nz.size() - 1)]);
+    }
+    u -= topic_word_mass;
+    if (u < smoothing_mass) {
+        // Rarely hit for small beta, so a linear walk is fine
+        size_t last = 0;
+        float acc = 0;
+        for (auto k : state.dishes_) {
+            if (k == 0 || state.m_k[k] == 0)
+                continue;
+            last = k;
+            acc += state.beta_ * buckets::term(state, k);
+            if (u < acc)
+                return std::make_pair(size_t(0), k);
+        }
+        // Only reached through rounding in the cached sum
+        if (last != 0)
+            return std::make_pair(size_t(0), last);
+    }
+    return std::make_pair(size_t(0), size_t(0));
+}
+
+void
+sampling_t(microscopes::lda::state &state, buckets &buckets,
+    size_t eid, size_t i, common::rng_t &rng)
+{
+    const size_t t_old = state.table_assignment(eid, i);
+    if (t_old != 0) {
+        const size_t k_old = state.dish_assignment(eid, t_old);
+        const size_t before = state.ntables(eid);
+        buckets.smoothing -= buckets::term(state, k_old);
+        state.remove_table(eid, i);
+        buckets.smoothing += buckets::term(state, k_old);
+        if (state.ntables(eid) != before)
+            buckets.ntables--;
+    }
+
+    const size_t v = state.get_word(eid, i);
+    auto seat = draw(state, buckets, eid, v, rng);
+    size_t t_new = seat.first, k_new = seat.second;
+    if (t_new == 0 && k_new == 0)
+        k_new = state.create_dish();
+    buckets.smoothing -= buckets::term(state, k_new);
+    if (t_new == 0) {
+        t_new = state.create_table(eid, k_new);
+        buckets.ntables++;
+    }
+    state.add_table(eid, t_new, i);
+    buckets.smoothing += buckets::term(state, k_new);
+}
+
+} // namespace lda_crp_sparse
+
+void
+lda_crp_sparse_gibbs(microscopes::lda::state &state, common::rng_t &rng)
+{
+    lda_crp_sparse::buckets buckets;
+    // Rebuilt once per sweep, which also stops rounding errors in the
+    // incremental updates from piling up
+    buckets.reset(state);
     for (size_t eid = 0; eid < state.nentities(); ++eid) {
         for (size_t i = 0; i < state.nterms(eid); ++i) {
-            lda_crp::sampling_t(state, eid, i, rng);
+            lda_crp_sparse::sampling_t(state, buckets, eid, i, rng);
         }
     }
+    MICROSCOPES_DCHECK(buckets.ntables == size_t(state.ntables()), "table count drifted");
+    lda_crp::workspace ws;
+    dish_phase(state, ws, rng, 0, state.nentities());
+}
+
+namespace lda_crp_mh {
+
+void
+alias_table::build(const std::vector<float> &weights)
+{
+    const size_t n = weights.size();
+    total_ = 0;
+    for (auto w : weights)
+        total_ += w;
+    prob_.resize(n);
+    alias_.resize(n);
+    if (n == 0)
+        return;
+
+    // Vose's method: pair every under-full bucket with an over-full one
+    std::vector<size_t> small, large;
+    for (size_t i = 0; i < n; ++i) {
+        prob_[i] = weights[i] * n / total_;
+        alias_[i] = i;
+        if (prob_[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        size_t s = small.back();
+        small.pop_back();
+        size_t l = large.back();
+        alias_[s] = l;
+        prob_[l] -= 1 - prob_[s];
+        if (prob_[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left over is only off by rounding
+    for (auto i : large)
+        prob_[i] = 1;
+    for (auto i : small)
+        prob_[i] = 1;
+}
+
+size_t
+alias_table::sample(common::rng_t &rng) const
+{
+    MICROSCOPES_DCHECK(!prob_.empty(), "sampling from an empty alias table");
+    size_t i = std::min(
+        size_t(distributions::sample_unif01(rng) * prob_.size()),
+        prob_.size() - 1);
+    return distributions::sample_unif01(rng) < prob_[i] ? i : alias_[i];
+}
+
+float
+proposal_cache::dish_proposal::weight(size_t k) const
+{
+    auto it = std::lower_bound(dishes.begin(), dishes.end(), k);
+    if (it == dishes.end() || *it != k)
+        return 0;
+    return weights[it - dishes.begin()];
+}
+
+const proposal_cache::dish_proposal &
+proposal_cache::word(const microscopes::lda::state &state, size_t v)
+{
+    if (words_.size() < state.nwords())
+        words_.resize(state.nwords());
+    auto &p = words_[v];
+    if (p.uses >= p.lifetime) {
+        p.dishes.clear();
+        p.weights.clear();
+        for (auto k : state.dishes_) {
+            if (k != 0 && state.n_kv.get(k, v) > 0)
+                p.dishes.push_back(k);
+        }
+        // dishes_ is not sorted; weight() looks dishes up by bisection
+        std::sort(p.dishes.begin(), p.dishes.end());
+        for (auto k : p.dishes)
+            p.weights.push_back(state.m_k[k] * state.n_kv.get(k, v) / state.num_words_at_dish(k));
+        p.alias.build(p.weights);
+        p.uses = 0;
+        p.lifetime = state.dishes_.size();
+    }
+    p.uses++;
+    return p;
+}
+
+const proposal_cache::dish_proposal &
+proposal_cache::smoothing(const microscopes::lda::state &state)
+{
+    auto &p = smoothing_;
+    if (p.uses >= p.lifetime) {
+        p.dishes.clear();
+        p.weights.clear();
+        p.dishes.assign(state.dishes_.begin(), state.dishes_.end());
+        std::sort(p.dishes.begin(), p.dishes.end());
+        for (auto k : p.dishes) {
+            p.weights.push_back(k == 0 ?
+                state.gamma_ / state.V :
+                state.beta_ * state.m_k[k] / state.num_words_at_dish(k));
+        }
+        p.alias.build(p.weights);
+        p.uses = 0;
+        p.lifetime = state.dishes_.size();
+    }
+    p.uses++;
+    return p;
+}
+
+void
+proposal_cache::clear()
+{
+    words_.clear();
+    smoothing_ = dish_proposal();
+}
+
+// Ratio of the exact to the proposed mass of opening a new table for word
+// v at dish k (or at a new dish when k == 0). The alpha / (gamma + m)
+// factor is shared by both and cancels.
+static inline float
+new_table_ratio(const microscopes::lda::state &state,
+    const proposal_cache::dish_proposal &word,
+    const proposal_cache::dish_proposal &smoothing,
+    size_t v, size_t k)
+{
+    const float q = word.weight(k) + smoothing.weight(k);
+    if (q <= 0)
+        return std::numeric_limits<float>::infinity();
+    if (k == 0)
+        return state.gamma_ / state.V / q;
+    return state.m_k[k] * state.num_words_at_dish(k, v) / state.num_words_at_dish(k) / q;
+}
+
+void
+sampling_t(microscopes::lda::state &state, proposal_cache &cache,
+    size_t eid, size_t i, size_t &ntables, common::rng_t &rng)
+{
+    const size_t t_old = state.table_assignment(eid, i);
+    if (t_old == 0) {
+        // The word was never seated, so there is no current state for the
+        // chain to stay at; draw it exactly instead
+        const size_t before = state.ntables(eid);
+        lda_crp::sampling_t(state, eid, i, rng);
+        ntables += state.ntables(eid) - before;
+        return;
+    }
+
+    const size_t k_old = state.dish_assignment(eid, t_old);
+    const size_t before = state.ntables(eid);
+    state.remove_table(eid, i);
+    const bool table_kept = state.ntables(eid) == before;
+    if (!table_kept)
+        ntables--;
+    const size_t v = state.get_word(eid, i);
+
+    // Existing tables are proposed with their exact mass
+    const auto &tables = state.using_t[eid];
+    cache.p_t.resize(tables.size());
+    float table_mass = 0;
+    for (size_t p = 1; p < tables.size(); ++p) {
+        auto t = tables[p];
+        auto k = state.dish_assignment(eid, t);
+        table_mass += state.n_jt[eid][t] * state.num_words_at_dish(k, v) / state.num_words_at_dish(k);
+        cache.p_t[p] = table_mass;
+    }
+
+    const auto &word = cache.word(state, v);
+    const auto &smoothing = cache.smoothing(state);
+    const float coef = state.alpha_ / (state.gamma_ + ntables);
+    const float word_mass = coef * word.total();
+    const float u = distributions::sample_unif01(rng) *
+        (table_mass + word_mass + coef * smoothing.total());
+
+    // Propose; t_new == 0 stands for a new table at dish k_new
+    size_t t_new = 0, k_new = 0;
+    float r_new = 1;
+    if (u < table_mass && tables.size() > 1) {
+        auto it = std::upper_bound(cache.p_t.begin() + 1, cache.p_t.begin() + tables.size(), u);
+        t_new = tables[std::min(size_t(it - cache.p_t.begin()), tables.size() - 1)];
+    } else {
+        k_new = (u < table_mass + word_mass && word.total() > 0) ?
+            word.sample(rng) : smoothing.sample(rng);
+        r_new = new_table_ratio(state, word, smoothing, v, k_new);
+    }
+
+    // Metropolis-Hastings correction against the current seating
+    float r_old = 1;
+    const size_t k_back = state.m_k[k_old] > 0 ? k_old : 0;
+    if (!table_kept)
+        r_old = new_table_ratio(state, word, smoothing, v, k_back);
+    if (r_new < r_old && !(distributions::sample_unif01(rng) * r_old < r_new)) {
+        t_new = table_kept ? t_old : 0;
+        k_new = k_back;
+    }
+
+    if (t_new == 0) {
+        if (k_new == 0)
+            k_new = state.create_dish();
+        t_new = state.create_table(eid, k_new);
+        ntables++;
+    }
+    state.add_table(eid, t_new, i);
+}
+
+} // namespace lda_crp_mh
+
+void
+lda_crp_mh_gibbs(microscopes::lda::state &state,
+    lda_crp_mh::proposal_cache &cache, common::rng_t &rng)
+{
+    size_t ntables = state.ntables();
     for (size_t eid = 0; eid < state.nentities(); ++eid) {
-        for (auto t : state.using_t[eid]) {
-            if (t != 0) {
-                lda_crp::sampling_k(state, eid, t, rng);
-            }
+        for (size_t i = 0; i < state.nterms(eid); ++i) {
+            lda_crp_mh::sampling_t(state, cache, eid, i, ntables, rng);
         }
     }
+    MICROSCOPES_DCHECK(ntables == size_t(state.ntables()), "table count drifted");
+    dish_phase(state, cache.dish_workspace, rng, 0, state.nentities());
 }
 
 namespace lda_hyperparameters {
@@ -158,6 +907,86 @@ sample_alpha(microscopes::lda::state &state, common::rng_t &rng, float a, float
     state.alpha_ = distributions::sample_gamma(rng, shape, scale);
 }
 
+namespace {
+
+// Distinct non-zero values of counts and how often each occurs
+struct count_histogram {
+    std::vector<float> values;
+    std::vector<double> weights;
+    double total = 0;
+
+    void
+    assign(const std::vector<size_t> &hist)
+    {
+        for (size_t c = 1; c < hist.size(); ++c) {
+            if (hist[c] == 0)
+                continue;
+            values.push_back(c);
+            weights.push_back(hist[c]);
+            total += hist[c];
+        }
+    }
+
+    // sum over counts c of digamma(c + x) - digamma(x)
+    double
+    digamma_sum(float x, std::vector<float> &buf) const
+    {
+        buf.resize(values.size() + 1);
+        for (size_t i = 0; i < values.size(); ++i)
+            buf[i] = values[i] + x;
+        buf[values.size()] = x;
+        microscopes::lda::vmath::digamma(buf.data(), buf.data(), buf.size());
+        double sum = 0;
+        for (size_t i = 0; i < values.size(); ++i)
+            sum += weights[i] * buf[i];
+        return sum - total * buf[values.size()];
+    }
+};
+
+} // namespace
+
+bool
+sample_beta(microscopes::lda::state &state, float a, float b, size_t max_iter, float tol)
+{
+    std::vector<size_t> dish_hist;
+    for (auto k: state.dishes_) {
+        if (k == 0)
+            continue;
+        const size_t n = state.n_k[k];
+        if (n >= dish_hist.size())
+            dish_hist.resize(n + 1, 0);
+        dish_hist[n]++;
+    }
+    // No word count exceeds the largest dish
+    std::vector<size_t> word_hist(dish_hist.size(), 0);
+    // Released dish slots keep stale counts until they are reused
+    state.n_kv.for_each_count([&](size_t k, size_t, size_t c) {
+        if (k != 0 && state.dishes_.contains(k))
+            word_hist[c]++;
+    });
+    count_histogram words, dishes;
+    words.assign(word_hist);
+    dishes.assign(dish_hist);
+
+    const double V = state.nwords();
+    std::vector<float> buf;
+    float beta = state.beta_;
+    for (size_t iter = 0; iter < max_iter; ++iter) {
+        const double summk = words.digamma_sum(beta, buf);
+        const double summ = dishes.digamma_sum(V * beta, buf);
+        const float next = (a - 1 + beta * summk) / (b + V * summ);
+        if (!(next > 0) || !std::isfinite(next))
+            return false;
+        const bool converged = std::abs(next - beta) < tol * beta;
+        beta = next;
+        if (converged) {
+            state.beta_ = beta;
+            return true;
+        }
+    }
+    return false;
+}
+
 } // lda_hyperparameters
 
 
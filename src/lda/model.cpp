@@ -1,5 +1,26 @@
 #include <microscopes/lda/model.hpp>
+#include <microscopes/lda/snapshot.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+
+void
+count_terms(std::vector<size_t> &tf, const microscopes::lda::corpus &docs, bool remove = false)
+{
+    for (size_t eid = 0; eid < docs.ndocs(); ++eid) {
+        for (auto v : docs.doc(eid)) {
+            if (remove)
+                --tf[v];
+            else
+                ++tf[v];
+        }
+    }
+}
+
+} // namespace
 
 microscopes::lda::model_definition::model_definition(size_t n, size_t v)
     : n_(n), v_(v)
@@ -12,15 +33,74 @@ microscopes::lda::state::state(const model_definition &defn,
       float alpha,
       float beta,
       float gamma,
-      const microscopes::lda::nested_vector &docs)
+      const microscopes::lda::corpus &docs,
+      count_layout layout)
     : V(defn.v()),
       alpha_(alpha),
       beta_(beta),
       gamma_(gamma),
       x_ji(docs),
-      n_k(lda_util::defaultdict<size_t, float>(beta * defn.v()))
+      n_kv(defn.v(), layout),
+      table_assignments_(docs.ntokens(), 0),
+      ntables_(0),
+      lgamma_n_jt_(0),
+      lgamma_m_k_(0),
+      lgamma_n_kv_(0),
+      lgamma_n_kv_beta_(std::numeric_limits<float>::quiet_NaN()),
+      lgamma_n_j_(0),
+      lgamma_n_j_alpha_(std::numeric_limits<float>::quiet_NaN()),
+      inv_n_k_beta_(std::numeric_limits<float>::quiet_NaN()),
+      dish_floor_(0),
+      term_frequency_(defn.v(), 0)
       {
-        // This page intentionally left blank
+        MICROSCOPES_CHECK(V <= corpus::max_token() + 1, "vocabulary too large for token_t");
+        MICROSCOPES_CHECK(x_ji.ntokens() == 0 || x_ji.max_word() < V, "word out of bounds");
+        count_terms(term_frequency_, x_ji);
+}
+
+microscopes::lda::state::state(state &parent, size_t first, size_t last)
+    : V(parent.V),
+      alpha_(parent.alpha_),
+      beta_(parent.beta_),
+      gamma_(parent.gamma_),
+      dishes_(parent.dishes_),
+      x_ji(parent.x_ji.slice(first, last)),
+      m_k(parent.m_k),
+      n_k(parent.n_k),
+      n_kv(parent.n_kv),
+      table_assignments_(
+          parent.table_assignments_.begin() + parent.x_ji.offset(first),
+          parent.table_assignments_.begin() + parent.x_ji.offset(last)),
+      ntables_(parent.ntables_),
+      // The parent rebuilds its scores when the shard is attached
+      lgamma_n_jt_(0),
+      lgamma_m_k_(0),
+      lgamma_n_kv_(0),
+      lgamma_n_kv_beta_(std::numeric_limits<float>::quiet_NaN()),
+      lgamma_n_j_(0),
+      lgamma_n_j_alpha_(std::numeric_limits<float>::quiet_NaN()),
+      inv_n_k_(parent.inv_n_k_),
+      inv_n_k_beta_(parent.inv_n_k_beta_),
+      dish_floor_(parent.m_k.size())
+{
+    // Dishes created here must not alias dish ids the parent (or another
+    // shard) may hand out
+    dishes_.forget_free(dish_floor_);
+    // Per-document seating is moved, not copied; the parent gets it
+    // back in attach_shard()
+    auto take = [first, last](nested_window &from, nested_window &to) {
+        to.resize(last - first);
+        for (size_t eid = first; eid < last; ++eid)
+            to[eid - first].swap(from[eid]);
+    };
+    using_t.resize(last - first);
+    for (size_t eid = first; eid < last; ++eid)
+        using_t[eid - first] = std::move(parent.using_t[eid]);
+    take(parent.dish_assignments_, dish_assignments_);
+    take(parent.n_jt, n_jt);
+    n_jtv.resize(last - first);
+    for (size_t eid = first; eid < last; ++eid)
+        n_jtv[eid - first].swap(parent.n_jtv[eid]);
 }
 
 microscopes::lda::state::state(const model_definition &defn,
@@ -28,9 +108,10 @@ microscopes::lda::state::state(const model_definition &defn,
       float beta,
       float gamma,
       size_t initial_dishes,
-      const microscopes::lda::nested_vector &docs,
-      common::rng_t &rng)
-    : state(defn, alpha, beta, gamma, docs) {
+      const microscopes::lda::corpus &docs,
+      common::rng_t &rng,
+      count_layout layout)
+    : state(defn, alpha, beta, gamma, docs, layout) {
 
     auto dish_pool = microscopes::common::util::range(initial_dishes);
 
@@ -39,11 +120,12 @@ microscopes::lda::state::state(const model_definition &defn,
         create_entity(eid);
 
         auto did = common::util::sample_choice(dish_pool, rng);
-        if (did > dishes_.back()){
+        if (did >= dishes_.nslots()){
             did = create_dish();
         }
         create_table(eid, did);
     }
+    counters_.reset();
 }
 
 microscopes::lda::state::state(const model_definition &defn,
@@ -52,8 +134,9 @@ microscopes::lda::state::state(const model_definition &defn,
       float gamma,
       const microscopes::lda::nested_vector &dish_assignments,
       const microscopes::lda::nested_vector &table_assignments,
-      const microscopes::lda::nested_vector &docs)
-    : state(defn, alpha, beta, gamma, docs) {
+      const microscopes::lda::corpus &docs,
+      count_layout layout)
+    : state(defn, alpha, beta, gamma, docs, layout) {
         // Explicit initialization constructor for state used for
         // deserialization and testing
         // table_assignment maps words to tables (and should be the same
@@ -73,31 +156,49 @@ microscopes::lda::state::state(const model_definition &defn,
                 create_table(eid, did);
             }
             // Assign words to tables.
+            MICROSCOPES_CHECK(table_assignments[eid].size() == nterms(eid),
+                "table_assignments does not match the document");
             for(size_t word_index = 0; word_index < table_assignments[eid].size(); word_index++){
                 auto tid  = table_assignments[eid][word_index];
                 add_table(eid, tid, word_index);
             }
         }
+        counters_.reset();
 }
 
 void
 microscopes::lda::state::create_entity(size_t eid){
-    using_t.push_back(std::vector<size_t>());
+    using_t.push_back(slot_list());
     n_jt.push_back(std::vector<size_t>());
     dish_assignments_.push_back(std::vector<size_t>());
-    table_assignments_.push_back(std::vector<size_t>(nterms(eid), 0));
-    n_jtv.push_back(std::vector< std::map<size_t, size_t>>());
+    n_jtv.push_back(std::vector<word_histogram>());
+}
+
+std::vector<size_t>
+microscopes::lda::state::table_count_histogram() const
+{
+    std::vector<size_t> histogram;
+    for (auto &tables : using_t) {
+        size_t n = 0;
+        for (auto t : tables)
+            if (t != 0)
+                ++n;
+        if (n >= histogram.size())
+            histogram.resize(n + 1, 0);
+        histogram[n] += 1;
+    }
+    return histogram;
 }
 
 microscopes::lda::nested_vector
-microscopes::lda::state::assignments() {
+microscopes::lda::state::assignments() const {
     microscopes::lda::nested_vector ret;
     ret.resize(nentities());
 
     for (size_t eid = 0; eid < nentities(); eid++) {
-        ret[eid].resize(table_assignments_[eid].size());
-        for (size_t did = 0; did < table_assignments_[eid].size(); did++) {
-            auto table = table_assignments_[eid][did];
+        ret[eid].resize(nterms(eid));
+        for (size_t did = 0; did < nterms(eid); did++) {
+            auto table = table_assignment(eid, did);
             ret[eid][did] = dish_assignments_[eid][table];
         }
     }
@@ -110,8 +211,8 @@ microscopes::lda::state::assignments() {
 * table IDs -> (global) dish assignments
 *
 */
-microscopes::lda::nested_vector
-microscopes::lda::state::dish_assignments() {
+const microscopes::lda::nested_window &
+microscopes::lda::state::dish_assignments() const {
     return dish_assignments_;
 }
 
@@ -121,103 +222,209 @@ microscopes::lda::state::dish_assignments() {
 *
 */
 microscopes::lda::nested_vector
-microscopes::lda::state::table_assignments() {
-    return table_assignments_;
+microscopes::lda::state::table_assignments() const {
+    microscopes::lda::nested_vector ret(nentities());
+    for (size_t eid = 0; eid < nentities(); eid++) {
+        auto first = table_assignments_.begin() + x_ji.offset(eid);
+        ret[eid].assign(first, first + nterms(eid));
+    }
+    return ret;
 }
 
 float
-microscopes::lda::state::score_assignment() const
+microscopes::lda::state::score_assignment()
 {
-    return 0;
+    if (lgamma_n_j_alpha_ != alpha_) {
+        lgamma_n_j_ = 0;
+        for (size_t eid = 0; eid < nentities(); ++eid)
+            lgamma_n_j_ += lda_util::log_gamma(double(nterms(eid)) + alpha_);
+        lgamma_n_j_alpha_ = alpha_;
+    }
+    const double M = ntables_;
+    const double K = ntopics();
+    // prod_j alpha^T_j Gamma(alpha) / Gamma(alpha + n_j) prod_t Gamma(n_jt)
+    double score = M * std::log(alpha_) + nentities() * lda_util::log_gamma(alpha_)
+        - lgamma_n_j_ + lgamma_n_jt_;
+    // gamma^K Gamma(gamma) / Gamma(gamma + M) prod_k Gamma(m_k)
+    score += K * std::log(gamma_) + lda_util::log_gamma(gamma_) - lda_util::log_gamma(gamma_ + M)
+        + lgamma_m_k_;
+    return score;
 }
 
 float
-microscopes::lda::state::score_data(common::rng_t &rng) const
+microscopes::lda::state::score_data(common::rng_t &rng)
 {
-    return 0;
+    if (lgamma_n_kv_beta_ != beta_) {
+        const double lgamma_beta = lda_util::log_gamma(beta_);
+        double sum = 0;
+        // Released dish slots keep stale counts until they are reused
+        n_kv.for_each_count([&](size_t k, size_t, size_t c) {
+            if (k != 0 && dishes_.contains(k))
+                sum += lda_util::log_gamma(double(c) + beta_) - lgamma_beta;
+        });
+        lgamma_n_kv_ = sum;
+        lgamma_n_kv_beta_ = beta_;
+    }
+    // prod_k Gamma(V beta) / Gamma(V beta + n_k) prod_v Gamma(n_kv + beta) / Gamma(beta)
+    const double Vbeta = double(V) * beta_;
+    const double lgamma_Vbeta = lda_util::log_gamma(Vbeta);
+    double score = lgamma_n_kv_;
+    for (auto k : dishes_)
+        if (k != 0)
+            score += lgamma_Vbeta - lda_util::log_gamma(Vbeta + n_k[k]);
+    return score;
 }
 
 
 std::vector<std::map<size_t, float>>
-microscopes::lda::state::word_distribution() {
+microscopes::lda::state::word_distribution() const {
     // Distribution over words for each topic
-    std::vector<std::map<size_t, float>> vec;
-    vec.reserve(dishes_.size());
-    for (auto k : dishes_) {
-        if (k == 0) continue;
-        vec.push_back(std::map<size_t, float>());
-        for (size_t v = 0; v < V; ++v) {
-            vec.back()[v] = n_kv[k].get(v) / n_k.get(k);
-        }
+    const auto snap = snapshot();
+    std::vector<std::map<size_t, float>> vec(snap->ntopics());
+    for (size_t v = 0; v < V; ++v) {
+        const float *phi = snap->phi(v);
+        for (size_t i = 0; i < vec.size(); ++i)
+            vec[i][v] = phi[i];
     }
     return vec;
 }
 
 std::vector<std::vector<float>>
-microscopes::lda::state::document_distribution  () {
-    // Distribution over topics for each document
-    std::vector<std::vector<float>> theta;
-    theta.reserve(dish_assignments_.size());
-    std::vector<float> am_k(m_k.begin(), m_k.end());
-    am_k[0] = gamma_;
-    double sum_am_dishes_ = 0;
-    for (auto k : dishes_) {
-        sum_am_dishes_ += am_k[k];
-    }
-    for (size_t i = 0; i < am_k.size(); ++i) {
-        am_k[i] *= alpha_ / sum_am_dishes_;
-    }
-
-    for (size_t j = 0; j < dish_assignments_.size(); j++) {
-        std::vector<size_t> &n_jt_ = n_jt[j];
-        std::vector<float> p_jk = am_k;
-        for (auto t : using_t[j]) {
-            if (t == 0) continue;
-            size_t k = dish_assignments_[j][t];
-            p_jk[k] += n_jt_[t];
-        }
-        p_jk = lda_util::selectByIndex(p_jk, dishes_);
-        lda_util::normalize<float>(p_jk);
-        theta.push_back(p_jk);
+microscopes::lda::state::document_distribution() const {
+    // Distribution over topics for each document, new dish first
+    const auto snap = snapshot();
+    const size_t K = snap->ntopics();
+    std::vector<std::vector<float>> theta(nentities(), std::vector<float>(K + 1));
+    for (size_t eid = 0; eid < nentities(); ++eid) {
+        const float p0 = snap->new_dish(eid);
+        const float *row = snap->theta(eid);
+        theta[eid][0] = p0;
+        for (size_t i = 0; i < K; ++i)
+            theta[eid][i + 1] = (1 - p0) * row[i];
     }
     return theta;
 }
 
 double
-microscopes::lda::state::perplexity() {
-    std::vector<std::map<size_t, float>> phi = word_distribution();
-    std::vector<std::vector<float>> theta = document_distribution();
-    phi.insert(phi.begin(), std::map<size_t, float>());
-    double log_likelihood = 0;
-    size_t N = 0;
-    for (size_t eid = 0; eid < nentities(); eid++) {
-        for (auto &v : get_entity(eid)) {
-            double word_prob = 0;
-            for (size_t did = 0; did < dishes_.size(); did++) {
-                MICROSCOPES_DCHECK(theta[eid].size() == dishes_.size(), "theta[eid] wrong");
-                // Probability that topic of word occurs in document
-                // times probability word occurs in topic
-                word_prob += theta[eid][did] * phi[did][v];
-            }
-            log_likelihood -= distributions::fast_log(word_prob);
-        }
-        N += nterms(eid);
-    }
+microscopes::lda::state::perplexity() const {
+    std::vector<size_t> eids(nentities());
+    for (size_t eid = 0; eid < eids.size(); ++eid)
+        eids[eid] = eid;
+    return perplexity(eids);
+}
+
+double
+microscopes::lda::state::log_likelihood(const std::vector<size_t> &eids, size_t nthreads) const {
+    return evaluate(eids, nthreads).first;
+}
 
-    return exp(log_likelihood / N);
+double
+microscopes::lda::state::perplexity(const std::vector<size_t> &eids, size_t nthreads) const {
+    const auto ll = evaluate(eids, nthreads);
+    MICROSCOPES_CHECK(ll.second > 0, "no words to evaluate");
+    return std::exp(-ll.first / ll.second);
 }
 
 
 // private:
 
+std::pair<double, size_t>
+microscopes::lda::state::evaluate(const std::vector<size_t> &eids, size_t nthreads) const {
+    static const size_t chunk = 64;
+
+    // theta[j][k] phi[k][w] = (n_jk + scale * m_k) * (n_kw + beta) / (n_k + V beta)
+    // over (seated n_j + alpha), as in snapshot; the new dish has no words
+    double sum_m_k = gamma_;
+    for (auto k : dishes_)
+        sum_m_k += m_k[k];
+    const double scale = alpha_ / sum_m_k;
+    std::vector<double> inv(n_k.size(), 0);
+    std::vector<double> prior_weight(n_k.size(), 0);
+    double prior_beta = 0;
+    for (auto k : dishes_) {
+        if (k == 0)
+            continue;
+        inv[k] = 1.0 / num_words_at_dish(k);
+        prior_weight[k] = scale * m_k[k] * inv[k];
+        prior_beta += prior_weight[k] * beta_;
+    }
+    for (auto eid : eids)
+        MICROSCOPES_CHECK(eid < nentities(), "document id out of range");
+
+    // The prior part, sum_k scale * m_k * phi[k][w], of every word; one
+    // pass over the non-zero counts
+    std::vector<double> prior(V, prior_beta);
+    n_kv.for_each_count([&](size_t k, size_t v, size_t c) {
+        prior[v] += prior_weight[k] * c;
+    });
+
+    const size_t nchunks = (eids.size() + chunk - 1) / chunk;
+    std::vector<double> partial(nchunks, 0);
+    std::vector<size_t> ntokens(nchunks, 0);
+    lda_util::parallel_chunks(eids.size(), chunk, nthreads,
+        [&](size_t, size_t first, size_t last) {
+            // (dish, n_jk / (n_k + V beta)) of the document's tables
+            std::vector<std::pair<size_t, double>> doc_dishes;
+            double sum = 0;
+            size_t n = 0;
+            for (size_t i = first; i < last; ++i) {
+                const size_t eid = eids[i];
+                doc_dishes.clear();
+                // Words at table 0 are not seated; those at tables of
+                // dish 0 (explicit constructor only) are, but belong to no
+                // topic
+                size_t seated = 0;
+                for (auto t : using_t[eid]) {
+                    if (t == 0)
+                        continue;
+                    seated += n_jt[eid][t];
+                    const size_t k = dish_assignments_[eid][t];
+                    if (k == 0)
+                        continue;
+                    auto it = std::find_if(doc_dishes.begin(), doc_dishes.end(),
+                        [k](const std::pair<size_t, double> &e) { return e.first == k; });
+                    if (it == doc_dishes.end())
+                        it = doc_dishes.insert(doc_dishes.end(), std::make_pair(k, 0.0));
+                    it->second += n_jt[eid][t];
+                }
+                for (auto &e : doc_dishes)
+                    e.second *= inv[e.first];
+                const double norm = 1.0 / (seated + alpha_);
+                for (auto v : get_entity(eid)) {
+                    double p = prior[v];
+                    for (auto &e : doc_dishes)
+                        p += e.second * (n_kv.get(e.first, v) + beta_);
+                    sum += std::log(p * norm);
+                }
+                n += nterms(eid);
+            }
+            partial[first / chunk] = sum;
+            ntokens[first / chunk] = n;
+        });
+    // Summed in document order, so the result does not depend on nthreads
+    double log_likelihood = 0;
+    size_t n = 0;
+    for (size_t c = 0; c < nchunks; ++c) {
+        log_likelihood += partial[c];
+        n += ntokens[c];
+    }
+    return std::make_pair(log_likelihood, n);
+}
+
 void
 microscopes::lda::state::leave_from_dish(size_t j, size_t t) {
     size_t k = dish_assignments_[j][t];
     MICROSCOPES_DCHECK(k > 0, "k < = 0");
     MICROSCOPES_DCHECK(m_k[k] > 0, "m_k[k] <= 0");
+    score_table_removed(k);
     m_k[k] -= 1; // one less table for topic k
+    ntables_ -= 1;
     if (m_k[k] == 0) // destroy table
     {
+        // The table's words stay behind in the released slot
+        if (lgamma_n_kv_beta_ == beta_)
+            for (auto &kv : n_jtv[j][t])
+                score_words_moved(k, kv.second, 0);
         delete_dish(k);
         dish_assignments_[j][t] = 0;
     }
@@ -225,29 +432,36 @@ microscopes::lda::state::leave_from_dish(size_t j, size_t t) {
 
 void
 microscopes::lda::state::seat_at_dish(size_t j, size_t t, size_t k_new) {
+    score_table_added(k_new);
     m_k[k_new] += 1;
+    if (k_new != 0)
+        ntables_ += 1;
 
     size_t k_old = dish_assignments_[j][t];
     if (k_new != k_old)
     {
         MICROSCOPES_DCHECK(k_new != 0, "k_new is 0");
         dish_assignments_[j][t] = k_new;
-        float n_jt_val = n_jt[j][t];
+        size_t n_jt_val = n_jt[j][t];
 
         if (k_old != 0)
         {
-            n_k.decr(k_old, n_jt_val);
+            n_k[k_old] -= n_jt_val;
+            update_normalizer(k_old);
         }
-        n_k.incr(k_new, n_jt_val);
-        for (auto kv : n_jtv[j][t]) {
+        n_k[k_new] += n_jt_val;
+        update_normalizer(k_new);
+        for (auto &kv : n_jtv[j][t]) {
             auto v = kv.first;
             auto n = kv.second;
             MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
             if (k_old != 0)
             {
-                n_kv[k_old].decr(v, n);
+                const size_t c = n_kv.decr(k_old, v, n);
+                score_words_moved(k_old, c + n, c);
             }
-            n_kv[k_new].incr(v, n);
+            const size_t c = n_kv.incr(k_new, v, n);
+            score_words_moved(k_new, c - n, c);
         }
     }
 }
@@ -255,81 +469,85 @@ microscopes::lda::state::seat_at_dish(size_t j, size_t t, size_t k_new) {
 
 void
 microscopes::lda::state::add_table(size_t eid, size_t tid, size_t word_index) {
-    table_assignments_[eid][word_index] = tid;
+    table_assignments_[x_ji.offset(eid) + word_index] = tid;
+    lgamma_n_jt_ += log_step(n_jt[eid][tid]);
     n_jt[eid][tid] += 1;
 
     size_t k_new = dish_assignments_[eid][tid];
-    n_k.incr(k_new, 1);
+    n_k[k_new] += 1;
+    update_normalizer(k_new);
 
     size_t v = get_word(eid, word_index);
     MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
-    n_kv[k_new].incr(v, 1);
-    n_jtv[eid][tid][v] += 1;
+    const size_t c = n_kv.incr(k_new, v);
+    score_words_moved(k_new, c - 1, c);
+    n_jtv[eid][tid].incr(v);
 }
 
 void
 microscopes::lda::state::create_dish(size_t k_new){
-    while(k_new >= m_k.size())
-    {
-        m_k.push_back(0);
-        n_kv.push_back(lda_util::defaultdict<size_t, float>(beta_));
-    }
-    if(dishes_.size() > k_new)
-        dishes_.insert(dishes_.begin() + k_new, k_new);
-    else
-        dishes_.push_back(k_new);
-    n_k.set(k_new, beta_ * V);
-    n_kv[k_new] = lda_util::defaultdict<size_t, float>(beta_);
-    m_k[k_new] = 0;
+    MICROSCOPES_LDA_COUNT(counters_.dishes_created);
+    dishes_.acquire(k_new);
+    reset_dish(k_new);
 }
 
 size_t
 microscopes::lda::state::create_dish() {
-    size_t k_new = dishes_.size();
-    for (size_t i = 0; i < dishes_.size(); ++i)
-    {
-        if (i != dishes_[i])
-        {
-            k_new = i;
-            break;
-        }
-    }
-    create_dish(k_new);
+    // Shard workers only get ids >= dish_floor_ (see the shard constructor)
+    size_t k_new = dishes_.acquire();
+    MICROSCOPES_LDA_COUNT(counters_.dishes_created);
+    reset_dish(k_new);
     return k_new;
+}
 
+void
+microscopes::lda::state::reset_dish(size_t k){
+    while(k >= m_k.size())
+    {
+        m_k.push_back(0);
+        n_k.push_back(0);
+    }
+    n_kv.resize(m_k.size());
+    if (k != 0) {
+        ntables_ -= m_k[k];
+        if (m_k[k] > 0)
+            lgamma_m_k_ -= lda_util::log_gamma(double(m_k[k]));
+    }
+    n_k[k] = 0;
+    n_kv.reset(k);
+    m_k[k] = 0;
+    if (inv_n_k_.size() < n_k.size())
+        inv_n_k_.resize(n_k.size());
+    update_normalizer(k);
 }
 
 size_t
 microscopes::lda::state::create_table(size_t eid, size_t k_new)
 {
-    size_t t_new = using_t[eid].size();
-    for (size_t i = 0; i < using_t[eid].size(); ++i)
-    {
-        if (i != using_t[eid][i])
-        {
-            t_new = i;
-            break;
-        }
-    }
-    if (t_new == using_t[eid].size())
+    size_t t_new = using_t[eid].acquire();
+    MICROSCOPES_LDA_COUNT(counters_.tables_created);
+    while (t_new >= n_jt[eid].size())
     {
         n_jt[eid].push_back(0);
         dish_assignments_[eid].push_back(0);
-
-        n_jtv[eid].push_back(std::map<size_t, size_t>());
+        // Recycle the histogram of a previously pruned table if there is one
+        if (n_jtv[eid].size() < n_jt[eid].size())
+            n_jtv[eid].push_back(word_histogram());
     }
-    using_t[eid].insert(using_t[eid].begin() + t_new, t_new);
+    MICROSCOPES_DCHECK(n_jtv[eid][t_new].empty(), "reused table is not empty");
     n_jt[eid][t_new] = 0;
     dish_assignments_[eid][t_new] = k_new;
     if (k_new != 0){
+        score_table_added(k_new);
         m_k[k_new] += 1;
+        ntables_ += 1;
     }
     return t_new;
 }
 
 void
 microscopes::lda::state::remove_table(size_t eid, size_t word_index) {
-    size_t tid = table_assignments_[eid][word_index];
+    size_t tid = table_assignment(eid, word_index);
     if (tid > 0)
     {
         size_t k = dish_assignments_[eid][tid];
@@ -337,10 +555,13 @@ microscopes::lda::state::remove_table(size_t eid, size_t word_index) {
         // decrease counters
         size_t v = get_word(eid, word_index);
         MICROSCOPES_DCHECK(v < nwords(), "Word out of bounds");
-        n_kv[k].decr(v, 1);
-        n_k.decr(k, 1);
+        const size_t c = n_kv.decr(k, v);
+        score_words_moved(k, c + 1, c);
+        n_k[k] -= 1;
+        update_normalizer(k);
         n_jt[eid][tid] -= 1;
-        n_jtv[eid][tid][v] -= 1;
+        lgamma_n_jt_ -= log_step(n_jt[eid][tid]);
+        n_jtv[eid][tid].decr(v);
 
         if (n_jt[eid][tid] == 0)
         {
@@ -351,26 +572,175 @@ microscopes::lda::state::remove_table(size_t eid, size_t word_index) {
 
 void
 microscopes::lda::state::delete_table(size_t eid, size_t tid) {
+    MICROSCOPES_LDA_COUNT(counters_.tables_deleted);
     size_t k = dish_assignments_[eid][tid];
-    lda_util::removeFirst(using_t[eid], tid);
+    using_t[eid].release(tid);
+    score_table_removed(k);
     m_k[k] -= 1;
+    if (k != 0)
+        ntables_ -= 1;
     MICROSCOPES_DCHECK(m_k[k] >= 0, "m_k[k] < 0");
     if (m_k[k] == 0)
     {
         delete_dish(k);
     }
 
-    // Prune dish assignment vector
+    // The slot stays allocated until create_table() reuses it
     dish_assignments_[eid][tid] = 0;
-    while(dish_assignments_[eid].empty() == false)
-   {
-        if(dish_assignments_[eid].back() == 0){
-            dish_assignments_[eid].pop_back();
-            n_jt[eid].pop_back();
-            n_jtv[eid].pop_back();
+}
+
+size_t
+microscopes::lda::state::add_documents(const corpus &docs)
+{
+    MICROSCOPES_CHECK(docs.ntokens() == 0 || docs.max_word() < V, "word out of bounds");
+    const size_t first = nentities();
+    x_ji = x_ji.append(docs);
+    count_terms(term_frequency_, docs);
+    table_assignments_.resize(x_ji.ntokens(), 0);
+    for (size_t eid = first; eid < nentities(); ++eid) {
+        create_entity(eid);
+        // Table 0 without a dish; the first sweep seats the words
+        create_table(eid, 0);
+    }
+    lgamma_n_j_alpha_ = std::numeric_limits<float>::quiet_NaN();
+    return first;
+}
+
+void
+microscopes::lda::state::retire_documents(size_t n)
+{
+    MICROSCOPES_CHECK(n <= nentities(), "retiring more documents than there are");
+    for (size_t eid = 0; eid < n; ++eid) {
+        for (size_t i = 0; i < nterms(eid); ++i)
+            remove_table(eid, i);
+        // Only table 0 is left, at the dish it was initialized with (if any)
+        MICROSCOPES_DCHECK(using_t[eid].size() == 1 && using_t[eid][0] == 0, "tables left behind");
+        if (dish_assignments_[eid][0] != 0)
+            delete_table(eid, 0);
+    }
+    // Dropped in amortized O(1) per document and token; see window_vector
+    using_t.drop_front(n);
+    dish_assignments_.drop_front(n);
+    n_jt.drop_front(n);
+    n_jtv.drop_front(n);
+    table_assignments_.drop_front(x_ji.offset(n));
+    count_terms(term_frequency_, x_ji.slice(0, n), true);
+    x_ji = x_ji.slice(n, nentities());
+    lgamma_n_j_alpha_ = std::numeric_limits<float>::quiet_NaN();
+}
+
+std::unique_ptr<microscopes::lda::state>
+microscopes::lda::state::detach_shard(size_t first, size_t last)
+{
+    MICROSCOPES_DCHECK(first <= last && last <= nentities(), "bad shard bounds");
+    return std::unique_ptr<state>(new state(*this, first, last));
+}
+
+void
+microscopes::lda::state::attach_shard(state &shard, size_t first)
+{
+    MICROSCOPES_DCHECK(first + shard.nentities() <= nentities(), "bad shard bounds");
+    // Dishes created by the shard become fresh dishes here, numbered in
+    // the order the shard lists them. They take ids that were free here
+    // when the shards were detached first, which no shard can still use,
+    // so the number of slots follows the number of dishes
+    std::map<size_t, size_t> fresh;
+    for (auto k : shard.dishes_) {
+        if (k >= shard.dish_floor_)
+            fresh[k] = dishes_.acquire();
+    }
+    for (size_t i = 0; i < shard.nentities(); ++i) {
+        auto &k_j = shard.dish_assignments_[i];
+        for (auto t : shard.using_t[i]) {
+            if (k_j[t] >= shard.dish_floor_)
+                k_j[t] = fresh.at(k_j[t]);
         }
-        else break;
-   }
+        std::swap(using_t[first + i], shard.using_t[i]);
+        dish_assignments_[first + i].swap(k_j);
+        n_jt[first + i].swap(shard.n_jt[i]);
+        n_jtv[first + i].swap(shard.n_jtv[i]);
+    }
+    std::copy(shard.table_assignments_.begin(), shard.table_assignments_.end(),
+              table_assignments_.begin() + x_ji.offset(first));
+    counters_ += shard.counters_;
+}
 
+void
+microscopes::lda::state::rebuild_dish_statistics()
+{
+    size_t K = m_k.size();
+    for (size_t eid = 0; eid < nentities(); ++eid)
+        for (auto t : using_t[eid])
+            K = std::max(K, dish_assignments_[eid][t] + 1);
+
+    m_k.assign(K, 0);
+    n_k.assign(K, 0);
+    n_kv.resize(K);
+    n_kv.clear();
+    for (size_t eid = 0; eid < nentities(); ++eid) {
+        for (auto t : using_t[eid]) {
+            size_t k = dish_assignments_[eid][t];
+            // Same bookkeeping as create_table/add_table
+            if (k != 0)
+                m_k[k] += 1;
+            n_k[k] += n_jt[eid][t];
+            for (auto &kv : n_jtv[eid][t])
+                n_kv.incr(k, kv.first, kv.second);
+        }
+    }
+
+    // Dishes still in use keep their place in dishes_ so that a rebuild
+    // does not reorder the sampler's draws
+    MICROSCOPES_DCHECK(!dishes_.empty() && dishes_[0] == 0, "dish 0 is not first");
+    std::vector<size_t> unused;
+    for (auto k : dishes_)
+        if (k != 0 && m_k[k] == 0)
+            unused.push_back(k);
+    for (auto k : unused)
+        dishes_.release(k);
+    for (size_t k = 1; k < K; ++k)
+        if (m_k[k] > 0 && !dishes_.contains(k))
+            dishes_.acquire(k);
+
+    ntables_ = std::accumulate(m_k.begin() + 1, m_k.end(), size_t(0));
+    refresh_normalizers();
+    rebuild_scores();
+}
+
+void
+microscopes::lda::state::adopt_dish_statistics(size_t dish_floor)
+{
+    MICROSCOPES_DCHECK(!dishes_.empty() && dishes_[0] == 0, "dish 0 is not first");
+    MICROSCOPES_DCHECK(n_k.size() == m_k.size() && n_kv.ndishes() >= m_k.size(),
+        "dish statistics have different sizes");
+    dish_floor_ = dish_floor;
+    dishes_.forget_free(dish_floor_);
+    ntables_ = std::accumulate(m_k.begin() + 1, m_k.end(), size_t(0));
+    refresh_normalizers();
+    rebuild_scores();
+}
+
+void
+microscopes::lda::state::rebuild_scores()
+{
+    lgamma_n_jt_ = 0;
+    for (size_t eid = 0; eid < nentities(); ++eid)
+        for (auto t : using_t[eid])
+            if (n_jt[eid][t] > 0)
+                lgamma_n_jt_ += lda_util::log_gamma(double(n_jt[eid][t]));
+    lgamma_m_k_ = 0;
+    for (size_t k = 1; k < m_k.size(); ++k)
+        if (m_k[k] > 0)
+            lgamma_m_k_ += lda_util::log_gamma(double(m_k[k]));
+    // Recomputed by the next score_data()
+    lgamma_n_kv_beta_ = std::numeric_limits<float>::quiet_NaN();
 }
 
+void
+microscopes::lda::state::refresh_normalizers()
+{
+    inv_n_k_.resize(n_k.size());
+    for (size_t k = 0; k < n_k.size(); ++k)
+        inv_n_k_[k] = 1.0f / num_words_at_dish(k);
+    inv_n_k_beta_ = beta_;
+}
@@ -0,0 +1,269 @@
+#include <microscopes/lda/runner.hpp>
+#include <microscopes/lda/util.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <limits>
+#include <numeric>
+
+namespace {
+
+microscopes::lda::chain_diagnostics
+diagnose(const microscopes::lda::state &s, size_t iteration, size_t nthreads)
+{
+    std::vector<size_t> eids(s.nentities());
+    std::iota(eids.begin(), eids.end(), 0);
+    microscopes::lda::chain_diagnostics d;
+    d.iteration = iteration;
+    d.ntopics = s.ntopics();
+    d.ntables = s.ntables();
+    d.perplexity = s.perplexity(eids, nthreads);
+    d.alpha = s.alpha_;
+    d.beta = s.beta_;
+    d.gamma = s.gamma_;
+    return d;
+}
+
+} // namespace
+
+microscopes::lda::kernel_t
+microscopes::lda::kernel_from_name(const std::string &name)
+{
+    if (name == "crf")
+        return crf_kernel;
+    if (name == "crf_sparse")
+        return crf_sparse_kernel;
+    if (name == "crf_alias")
+        return crf_alias_kernel;
+    if (name == "crf_block")
+        return crf_block_kernel;
+    if (name == "direct_base_dp_hp")
+        return base_dp_hp_kernel;
+    if (name == "direct_second_dp_hp")
+        return second_dp_hp_kernel;
+    MICROSCOPES_CHECK(name == "direct_vocab_hp", "unknown kernel");
+    return vocab_hp_kernel;
+}
+
+microscopes::lda::runner::runner(const std::shared_ptr<state> &latent,
+        const std::vector<kernel_config> &schedule)
+    : latent_(latent), schedule_(schedule), iteration_(0),
+      monitor_every_(0), trace_perplexity_(false), perplexity_nthreads_(1),
+      checkpoint_every_(0), checkpoint_corpus_(true)
+{
+    MICROSCOPES_CHECK(latent_.get() != nullptr, "runner needs a state");
+    for (auto &config : schedule_) {
+        MICROSCOPES_CHECK(config.nthreads > 0, "nthreads must be positive");
+        MICROSCOPES_CHECK(config.niters > 0, "niters must be positive");
+    }
+}
+
+void
+microscopes::lda::runner::set_monitor(size_t every, const monitor_fn &f)
+{
+    monitor_every_ = every;
+    monitor_ = f;
+}
+
+void
+microscopes::lda::runner::set_monitor(size_t every,
+    bool (*f)(void *ctx, size_t iteration), void *ctx)
+{
+    if (f == nullptr) {
+        set_monitor(every, monitor_fn());
+        return;
+    }
+    set_monitor(every, [f, ctx](size_t iteration, const state &) { return f(ctx, iteration); });
+}
+
+void
+microscopes::lda::runner::trace_perplexity(bool enabled, size_t nthreads)
+{
+    MICROSCOPES_CHECK(nthreads > 0, "nthreads must be positive");
+    trace_perplexity_ = enabled;
+    perplexity_nthreads_ = nthreads;
+}
+
+void
+microscopes::lda::runner::set_checkpoint(size_t every, const std::string &path, bool include_corpus)
+{
+    MICROSCOPES_CHECK(every == 0 || !path.empty(), "checkpoint path is empty");
+    checkpoint_every_ = every;
+    checkpoint_path_ = path;
+    checkpoint_corpus_ = include_corpus;
+}
+
+void
+microscopes::lda::runner::set_average(const std::shared_ptr<posterior_average> &average)
+{
+    average_ = average;
+}
+
+void
+microscopes::lda::runner::step(const kernel_config &config, common::rng_t &rng)
+{
+    using namespace microscopes::kernels;
+    state &s = *latent_;
+    switch (config.kernel) {
+    case crf_kernel:
+        if (config.nthreads == 1)
+            lda_crp_gibbs(s, rng);
+        else
+            lda_crp_gibbs(s, rng, config.nthreads);
+        break;
+    case crf_sparse_kernel:
+        lda_crp_sparse_gibbs(s, rng);
+        break;
+    case crf_alias_kernel:
+        lda_crp_mh_gibbs(s, proposal_cache_, rng);
+        break;
+    case crf_block_kernel:
+        lda_crp_block_gibbs(s, block_workspace_, rng, config.block_size, config.nthreads);
+        break;
+    case base_dp_hp_kernel:
+        for (size_t i = 0; i < config.niters; ++i)
+            lda_hyperparameters::sample_gamma(s, rng, config.hp1, config.hp2);
+        break;
+    case second_dp_hp_kernel:
+        for (size_t i = 0; i < config.niters; ++i)
+            lda_hyperparameters::sample_alpha(s, rng, config.hp1, config.hp2);
+        break;
+    case vocab_hp_kernel:
+        MICROSCOPES_CHECK(
+            lda_hyperparameters::sample_beta(s, config.hp1, config.hp2, config.niters),
+            "sample_beta did not converge");
+        break;
+    }
+}
+
+size_t
+microscopes::lda::runner::run(common::rng_t &rng, size_t niters)
+{
+    std::vector<size_t> eids;
+    if (trace_perplexity_) {
+        eids.resize(latent_->nentities());
+        std::iota(eids.begin(), eids.end(), 0);
+    }
+    for (size_t i = 0; i < niters; ++i) {
+        for (auto &config : schedule_)
+            step(config, rng);
+        ++iteration_;
+        if (average_)
+            average_->update(*latent_);
+
+        if (checkpoint_every_ && iteration_ % checkpoint_every_ == 0) {
+            const std::string tmp = checkpoint_path_ + ".tmp";
+            latent_->save_checkpoint(tmp, checkpoint_corpus_);
+            MICROSCOPES_CHECK(std::rename(tmp.c_str(), checkpoint_path_.c_str()) == 0,
+                "could not move checkpoint into place");
+        }
+        if (monitor_every_ && iteration_ % monitor_every_ == 0) {
+            if (trace_perplexity_)
+                perplexity_trace_.emplace_back(iteration_,
+                    latent_->perplexity(eids, perplexity_nthreads_));
+            if (monitor_ && !monitor_(iteration_, *latent_))
+                return i + 1;
+        }
+    }
+    return niters;
+}
+
+microscopes::lda::multi_runner::multi_runner(
+        const std::vector<std::shared_ptr<state>> &latents,
+        const std::vector<kernel_config> &schedule)
+    : traces_(latents.size())
+{
+    MICROSCOPES_CHECK(!latents.empty(), "multi_runner needs at least one chain");
+    for (auto &latent : latents) {
+        MICROSCOPES_CHECK(latent.get() != nullptr, "runner needs a state");
+        MICROSCOPES_CHECK(latent->nentities() == latents[0]->nentities() &&
+            latent->nwords() == latents[0]->nwords(), "chains are of different models");
+        for (auto &other : latents)
+            MICROSCOPES_CHECK(&other == &latent || other != latent, "chains share a state");
+        runners_.emplace_back(new runner(latent, schedule));
+    }
+}
+
+bool
+microscopes::lda::multi_runner::shares_corpus() const
+{
+    const corpus &first = runners_[0]->latent().x_ji;
+    for (auto &r : runners_)
+        if (!r->latent().x_ji.shares_storage(first))
+            return false;
+    return true;
+}
+
+void
+microscopes::lda::multi_runner::run(std::vector<common::rng_t> &rngs, size_t niters, size_t nthreads)
+{
+    MICROSCOPES_CHECK(rngs.size() == nchains(), "need one rng per chain");
+    if (nthreads == 0)
+        nthreads = nchains();
+    std::vector<std::exception_ptr> errors(nchains());
+    lda_util::parallel_chunks(nchains(), 1, nthreads, [&](size_t, size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            try {
+                runners_[i]->run(rngs[i], niters);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    });
+    for (auto &e : errors)
+        if (e)
+            std::rethrow_exception(e);
+}
+
+void
+microscopes::lda::multi_runner::set_trace(size_t every, size_t perplexity_nthreads)
+{
+    MICROSCOPES_CHECK(perplexity_nthreads > 0, "nthreads must be positive");
+    for (size_t i = 0; i < nchains(); ++i) {
+        auto &trace = traces_[i];
+        runners_[i]->set_monitor(every, [&trace, perplexity_nthreads](size_t iteration, const state &s) {
+            trace.push_back(diagnose(s, iteration, perplexity_nthreads));
+            return true;
+        });
+    }
+}
+
+std::vector<microscopes::lda::chain_diagnostics>
+microscopes::lda::multi_runner::diagnostics(size_t perplexity_nthreads) const
+{
+    std::vector<chain_diagnostics> ret;
+    for (auto &r : runners_)
+        ret.push_back(diagnose(r->latent(), r->iteration(), perplexity_nthreads));
+    return ret;
+}
+
+double
+microscopes::lda::multi_runner::potential_scale_reduction(
+    const std::vector<std::vector<double>> &draws)
+{
+    const size_t m = draws.size();
+    MICROSCOPES_CHECK(m >= 2, "need at least two chains");
+    const size_t n = draws[0].size();
+    MICROSCOPES_CHECK(n >= 2, "need at least two draws per chain");
+    std::vector<double> means(m);
+    double W = 0;
+    for (size_t j = 0; j < m; ++j) {
+        MICROSCOPES_CHECK(draws[j].size() == n, "chains have different lengths");
+        means[j] = std::accumulate(draws[j].begin(), draws[j].end(), 0.0) / n;
+        double ss = 0;
+        for (auto x : draws[j])
+            ss += (x - means[j]) * (x - means[j]);
+        W += ss / (n - 1);
+    }
+    W /= m;
+    const double mean = std::accumulate(means.begin(), means.end(), 0.0) / m;
+    double B = 0;
+    for (auto x : means)
+        B += (x - mean) * (x - mean);
+    B *= double(n) / (m - 1);
+    if (W == 0)
+        return B == 0 ? 1 : std::numeric_limits<double>::infinity();
+    const double var = (n - 1) * W / n + B / n;
+    return std::sqrt(var / W);
+}
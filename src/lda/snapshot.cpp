@@ -0,0 +1,177 @@
+#include <microscopes/lda/snapshot.hpp>
+#include <microscopes/lda/util.hpp>
+#include <microscopes/lda/vmath.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <new>
+
+namespace {
+
+inline size_t
+padded(size_t n)
+{
+    const size_t a = microscopes::lda::snapshot::row_align;
+    return (n + a - 1) / a * a;
+}
+
+float *
+aligned_floats(size_t n)
+{
+    void *p = nullptr;
+    if (::posix_memalign(&p, microscopes::lda::snapshot::row_align * sizeof(float),
+            std::max<size_t>(n, 1) * sizeof(float)) != 0)
+        throw std::bad_alloc();
+    return static_cast<float *>(p);
+}
+
+} // namespace
+
+microscopes::lda::snapshot::snapshot(const state &s)
+    : alpha_(s.alpha_), beta_(s.beta_), gamma_(s.gamma_),
+      V_(s.nwords()), D_(s.nentities()), phi_(nullptr), theta_(nullptr)
+{
+    for (auto k : s.dishes())
+        if (k != 0)
+            dishes_.push_back(k);
+    K_ = dishes_.size();
+    phi_stride_ = padded(K_);
+    theta_stride_ = padded(K_);
+    phi_ = aligned_floats(V_ * phi_stride_);
+    theta_ = aligned_floats(D_ * theta_stride_);
+    new_dish_.resize(D_);
+
+    for (size_t v = 0; v < V_; ++v) {
+        float *row = phi_ + v * phi_stride_;
+        std::fill(row, row + phi_stride_, 0.0f);
+    }
+    for (size_t i = 0; i < K_; ++i) {
+        const size_t k = dishes_[i];
+        const float n_k = s.num_words_at_dish(k);
+        for (size_t v = 0; v < V_; ++v)
+            phi_[v * phi_stride_ + i] = s.num_words_at_dish(k, v) / n_k;
+    }
+
+    // The prior weight of a dish in a document is alpha times its share
+    // of the tables (gamma for the new dish)
+    double sum_m_k = s.gamma_;
+    for (auto k : dishes_)
+        sum_m_k += s.m_k[k];
+    const double scale = s.alpha_ / sum_m_k;
+    std::vector<size_t> pos(s.m_k.size(), 0);
+    for (size_t i = 0; i < K_; ++i)
+        pos[dishes_[i]] = i + 1;
+
+    std::vector<double> p_jk(K_ + 1);
+    for (size_t eid = 0; eid < D_; ++eid) {
+        p_jk[0] = s.gamma_ * scale;
+        for (size_t i = 0; i < K_; ++i)
+            p_jk[i + 1] = s.m_k[dishes_[i]] * scale;
+        for (auto t : s.using_t[eid]) {
+            if (t == 0)
+                continue;
+            // Tables at dish 0 only come from the explicit constructor
+            p_jk[pos[s.dish_assignment(eid, t)]] += s.tablesize(eid, t);
+        }
+        double total = 0;
+        for (auto p : p_jk)
+            total += p;
+        float *row = theta_ + eid * theta_stride_;
+        std::fill(row, row + theta_stride_, 0.0f);
+        const double topics = total - p_jk[0];
+        for (size_t i = 0; i < K_; ++i)
+            row[i] = p_jk[i + 1] / topics;
+        new_dish_[eid] = p_jk[0] / total;
+    }
+}
+
+microscopes::lda::snapshot::~snapshot()
+{
+    std::free(phi_);
+    std::free(theta_);
+}
+
+std::shared_ptr<const microscopes::lda::snapshot>
+microscopes::lda::state::snapshot() const
+{
+    return std::make_shared<const lda::snapshot>(*this);
+}
+
+microscopes::lda::seating::seating(const state &s)
+{
+    const size_t D = s.nentities();
+    token_offsets.reserve(D + 1);
+    table_offsets.reserve(D + 1);
+    tables.assign(s.table_assignments_.begin(), s.table_assignments_.end());
+    dishes.resize(tables.size());
+    token_offsets.push_back(0);
+    table_offsets.push_back(0);
+    for (size_t eid = 0; eid < D; ++eid) {
+        const auto &k_jt = s.dish_assignments_[eid];
+        const size_t first = s.x_ji.offset(eid), last = first + s.nterms(eid);
+        for (size_t i = first; i < last; ++i)
+            dishes[i] = k_jt[tables[i]];
+        token_offsets.push_back(last);
+        table_dishes.insert(table_dishes.end(), k_jt.begin(), k_jt.end());
+        table_offsets.push_back(table_dishes.size());
+    }
+}
+
+std::shared_ptr<const microscopes::lda::seating>
+microscopes::lda::state::seating() const
+{
+    return std::make_shared<const lda::seating>(*this);
+}
+
+std::vector<std::vector<std::pair<size_t, float>>>
+microscopes::lda::state::term_relevance(float weight, size_t top_n, size_t nthreads) const
+{
+    MICROSCOPES_CHECK(weight >= 0 && weight <= 1, "weight must be between 0 and 1");
+    MICROSCOPES_CHECK(nthreads > 0, "nthreads must be positive");
+    const auto snap = snapshot();
+    const size_t K = snap->ntopics();
+    top_n = std::min(top_n, V);
+
+    // relevance = log phi_kw - lift_w, lift_w = (1 - weight) log p_w (+inf
+    // for words not in the documents)
+    const double ntokens = x_ji.ntokens();
+    std::vector<float> lift(V, 0);
+    if (weight < 1) {
+        for (size_t v = 0; v < V; ++v)
+            lift[v] = term_frequency_[v] ?
+                (1 - weight) * std::log(term_frequency_[v] / ntokens) :
+                std::numeric_limits<float>::infinity();
+    }
+
+    std::vector<std::vector<std::pair<size_t, float>>> ret(K);
+    // A block of topics shares each word's row of phi
+    lda_util::parallel_chunks(K, snapshot::row_align, nthreads, [&](size_t, size_t first, size_t last) {
+        const size_t n = last - first;
+        std::vector<float> logs(n);
+        // Topic-major relevance of the block, then one topic at a time
+        // through a single sort buffer
+        std::vector<float> rel(n * V);
+        for (size_t v = 0; v < V; ++v) {
+            vmath::log(logs.data(), snap->phi(v) + first, n);
+            for (size_t i = 0; i < n; ++i)
+                rel[i * V + v] = logs[i] - lift[v];
+        }
+        std::vector<std::pair<float, size_t>> r(V);
+        for (size_t i = 0; i < n; ++i) {
+            const float *row = rel.data() + i * V;
+            for (size_t v = 0; v < V; ++v)
+                r[v] = std::make_pair(row[v], v);
+            std::partial_sort(r.begin(), r.begin() + top_n, r.end(),
+                [](const std::pair<float, size_t> &a, const std::pair<float, size_t> &b) {
+                    return a.first > b.first || (a.first == b.first && a.second < b.second);
+                });
+            auto &out = ret[first + i];
+            out.reserve(top_n);
+            for (size_t j = 0; j < top_n; ++j)
+                out.emplace_back(r[j].second, r[j].first);
+        }
+    });
+    return ret;
+}
@@ -0,0 +1,370 @@
+#include <microscopes/lda/vmath.hpp>
+
+#include <cstdint>
+#include <cstring>
+
+/**
+* The kernels are written once with GCC vector extensions for a vector of
+* B bytes and instantiated inside functions carrying a target attribute,
+* so the compiler emits AVX2 or AVX-512 code for them without the rest of
+* the library being built for those instruction sets. Everything called
+* from a target function must be inlined into it (hence always_inline).
+*
+* log and exp follow the single precision cephes routines. lgamma uses the
+* Stirling series at z >= 6 after shifting arguments below 8 up by 6:
+*
+*   lgamma(x) = lgamma(x + 6) - log(x (x+1) ... (x+5))
+*
+* digamma uses its asymptotic series at z >= 6 after the same shift:
+*
+*   digamma(x) = digamma(x + 6) - 1/x - 1/(x+1) - ... - 1/(x+5)
+*
+* The rounding in exp relies on the absence of -ffast-math.
+*/
+#if defined(__GNUC__) && !defined(__clang__)
+// The helpers return vectors wider than the default target supports, but
+// they are always inlined into a target function and never called
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MICROSCOPES_LDA_VMATH_X86 1
+#endif
+
+#define VMATH_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+template <int B>
+struct kernels {
+    typedef float V __attribute__((vector_size(B)));
+    typedef int32_t I __attribute__((vector_size(B)));
+    static const size_t W = B / sizeof(float);
+
+    static VMATH_INLINE V
+    splat(float x)
+    {
+        V v = {};
+        return v + x;
+    }
+
+    static VMATH_INLINE V
+    select(const I &mask, const V &a, const V &b)
+    {
+        return (V)(((I)a & mask) | ((I)b & ~mask));
+    }
+
+    static VMATH_INLINE V
+    load(const float *p)
+    {
+        V v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static VMATH_INLINE void
+    store(float *p, const V &v)
+    {
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    // The last n < W lanes, padded with ones
+    static VMATH_INLINE V
+    load_partial(const float *p, size_t n)
+    {
+        float buf[W];
+        for (size_t i = 0; i < W; ++i)
+            buf[i] = i < n ? p[i] : 1.0f;
+        return load(buf);
+    }
+
+    static VMATH_INLINE void
+    store_partial(float *p, const V &v, size_t n)
+    {
+        float buf[W];
+        store(buf, v);
+        for (size_t i = 0; i < n; ++i)
+            p[i] = buf[i];
+    }
+
+    static VMATH_INLINE V
+    vlog(const V &x)
+    {
+        const I bits = (I)x;
+        // The biased exponent as a float, exactly: 2^23 + e - (2^23 + 127)
+        V e = (V)((bits >> 23) | 0x4b000000) - splat(8388608.0f + 127.0f);
+        V m = (V)((bits & 0x007fffff) | 0x3f800000);
+        const I big = m > splat(1.41421356f);
+        m = select(big, m * 0.5f, m);
+        e = select(big, e + 1.0f, e);
+
+        const V f = m - 1.0f;
+        const V z = f * f;
+        V y = splat(7.0376836292e-2f);
+        y = y * f - 1.1514610310e-1f;
+        y = y * f + 1.1676998740e-1f;
+        y = y * f - 1.2420140846e-1f;
+        y = y * f + 1.4249322787e-1f;
+        y = y * f - 1.6668057665e-1f;
+        y = y * f + 2.0000714765e-1f;
+        y = y * f - 2.4999993993e-1f;
+        y = y * f + 3.3333331174e-1f;
+        y = y * f * z;
+        y = y - 2.12194440e-4f * e;
+        y = y - 0.5f * z;
+        return f + y + 0.693359375f * e;
+    }
+
+    static VMATH_INLINE V
+    vexp(const V &arg)
+    {
+        const I underflow = arg < splat(-87.0f);
+        V x = select(arg > splat(88.0f), splat(88.0f), arg);
+        x = select(underflow, splat(-87.0f), x);
+
+        // Round x / log(2) to the nearest integer n
+        const V magic = splat(12582912.0f);
+        const V t = x * 1.44269504088896341f + magic;
+        const V n = t - magic;
+        x = x - n * 0.693359375f;
+        x = x + n * 2.12194440e-4f;
+
+        V y = splat(1.9875691500e-4f);
+        y = y * x + 1.3981999507e-3f;
+        y = y * x + 8.3334519073e-3f;
+        y = y * x + 4.1665795894e-2f;
+        y = y * x + 1.6666665459e-1f;
+        y = y * x + 5.0000001201e-1f;
+        y = y * x * x + x + 1.0f;
+
+        const V pow2n = (V)(((I)t - (I)magic + 127) << 23);
+        return select(underflow, splat(0.0f), y * pow2n);
+    }
+
+    static VMATH_INLINE V
+    vlgamma(const V &x)
+    {
+        const I small = x < splat(8.0f);
+        const V z = select(small, x + 6.0f, x);
+        const V p = x * (x + 1.0f) * (x + 2.0f) * (x + 3.0f) * (x + 4.0f) * (x + 5.0f);
+        // Lanes that are not shifted may overflow p; log(1) = 0
+        const V shift = vlog(select(small, p, splat(1.0f)));
+
+        const V r = splat(1.0f) / z;
+        const V r2 = r * r;
+        V series = splat(1.0f / 1260);
+        series = splat(1.0f / 360) - r2 * series;
+        series = splat(1.0f / 12) - r2 * series;
+        return (z - 0.5f) * vlog(z) - z + 0.91893853320467274f + r * series - shift;
+    }
+
+    static VMATH_INLINE V
+    vdigamma(const V &x)
+    {
+        const I small = x < splat(6.0f);
+        const V z = select(small, x + 6.0f, x);
+        const V shift = splat(1.0f) / x + splat(1.0f) / (x + 1.0f) + splat(1.0f) / (x + 2.0f)
+            + splat(1.0f) / (x + 3.0f) + splat(1.0f) / (x + 4.0f) + splat(1.0f) / (x + 5.0f);
+
+        const V r = splat(1.0f) / z;
+        const V r2 = r * r;
+        V series = splat(1.0f / 252);
+        series = splat(1.0f / 120) - r2 * series;
+        series = splat(1.0f / 12) - r2 * series;
+        return vlog(z) - 0.5f * r - r2 * series - select(small, shift, splat(0.0f));
+    }
+
+    template <V (*f)(const V &)>
+    static VMATH_INLINE void
+    map(float *out, const float *x, size_t n)
+    {
+        size_t i = 0;
+        for (; i + W <= n; i += W)
+            store(out + i, f(load(x + i)));
+        if (i < n)
+            store_partial(out + i, f(load_partial(x + i, n - i)), n - i);
+    }
+
+    static VMATH_INLINE void
+    log(float *out, const float *x, size_t n)
+    {
+        map<vlog>(out, x, n);
+    }
+
+    static VMATH_INLINE void
+    exp(float *out, const float *x, size_t n)
+    {
+        map<vexp>(out, x, n);
+    }
+
+    static VMATH_INLINE void
+    lgamma(float *out, const float *x, size_t n)
+    {
+        map<vlgamma>(out, x, n);
+    }
+
+    static VMATH_INLINE void
+    digamma(float *out, const float *x, size_t n)
+    {
+        map<vdigamma>(out, x, n);
+    }
+
+    static VMATH_INLINE void
+    add_lgamma_ratio(float *acc, const float *x, float d, float sign, size_t n)
+    {
+        size_t i = 0;
+        for (; i + W <= n; i += W) {
+            const V v = load(x + i);
+            store(acc + i, load(acc + i) + sign * (vlgamma(v + d) - vlgamma(v)));
+        }
+        if (i < n) {
+            const V v = load_partial(x + i, n - i);
+            const V a = load_partial(acc + i, n - i);
+            store_partial(acc + i, a + sign * (vlgamma(v + d) - vlgamma(v)), n - i);
+        }
+    }
+};
+
+struct dispatch_table {
+    void (*log)(float *, const float *, size_t);
+    void (*exp)(float *, const float *, size_t);
+    void (*lgamma)(float *, const float *, size_t);
+    void (*digamma)(float *, const float *, size_t);
+    void (*add_lgamma_ratio)(float *, const float *, float, float, size_t);
+};
+
+#define MICROSCOPES_LDA_VMATH_ISA(name, bytes, target)                                \
+    target void name##_log(float *out, const float *x, size_t n)                      \
+    { kernels<bytes>::log(out, x, n); }                                               \
+    target void name##_exp(float *out, const float *x, size_t n)                      \
+    { kernels<bytes>::exp(out, x, n); }                                               \
+    target void name##_lgamma(float *out, const float *x, size_t n)                   \
+    { kernels<bytes>::lgamma(out, x, n); }                                            \
+    target void name##_digamma(float *out, const float *x, size_t n)                  \
+    { kernels<bytes>::digamma(out, x, n); }                                           \
+    target void name##_add_lgamma_ratio(float *acc, const float *x, float d,          \
+        float sign, size_t n)                                                         \
+    { kernels<bytes>::add_lgamma_ratio(acc, x, d, sign, n); }                         \
+    const dispatch_table name##_table = {                                             \
+        name##_log, name##_exp, name##_lgamma, name##_digamma, name##_add_lgamma_ratio};
+
+MICROSCOPES_LDA_VMATH_ISA(generic, 16, )
+#ifdef MICROSCOPES_LDA_VMATH_X86
+MICROSCOPES_LDA_VMATH_ISA(avx2, 32, __attribute__((target("avx2,fma"))))
+MICROSCOPES_LDA_VMATH_ISA(avx512, 64, __attribute__((target("avx512f"))))
+#endif
+
+const dispatch_table *
+table_for(microscopes::lda::vmath::isa_t isa)
+{
+    using namespace microscopes::lda::vmath;
+    switch (isa) {
+#ifdef MICROSCOPES_LDA_VMATH_X86
+    case isa_avx512:
+        return &avx512_table;
+    case isa_avx2:
+        return &avx2_table;
+#endif
+    default:
+        return &generic_table;
+    }
+}
+
+microscopes::lda::vmath::isa_t
+detect_isa()
+{
+    using namespace microscopes::lda::vmath;
+#ifdef MICROSCOPES_LDA_VMATH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return isa_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return isa_avx2;
+#endif
+    return isa_generic;
+}
+
+struct dispatch {
+    dispatch() : best(detect_isa()), active(best), table(table_for(best)) {}
+
+    microscopes::lda::vmath::isa_t best;
+    microscopes::lda::vmath::isa_t active;
+    const dispatch_table *table;
+};
+
+inline dispatch &
+get_dispatch()
+{
+    static dispatch d;
+    return d;
+}
+
+} // namespace
+
+microscopes::lda::vmath::isa_t
+microscopes::lda::vmath::best_isa()
+{
+    return get_dispatch().best;
+}
+
+microscopes::lda::vmath::isa_t
+microscopes::lda::vmath::active_isa()
+{
+    return get_dispatch().active;
+}
+
+microscopes::lda::vmath::isa_t
+microscopes::lda::vmath::set_isa(isa_t isa)
+{
+    auto &d = get_dispatch();
+    d.active = isa <= d.best ? isa : d.best;
+    d.table = table_for(d.active);
+    return d.active;
+}
+
+const char *
+microscopes::lda::vmath::isa_name(isa_t isa)
+{
+    switch (isa) {
+    case isa_avx512:
+        return "avx512f";
+    case isa_avx2:
+        return "avx2";
+    default:
+#ifdef __SSE4_1__
+        return "sse4.1";
+#else
+        return "generic";
+#endif
+    }
+}
+
+void
+microscopes::lda::vmath::log(float *out, const float *x, size_t n)
+{
+    get_dispatch().table->log(out, x, n);
+}
+
+void
+microscopes::lda::vmath::exp(float *out, const float *x, size_t n)
+{
+    get_dispatch().table->exp(out, x, n);
+}
+
+void
+microscopes::lda::vmath::lgamma(float *out, const float *x, size_t n)
+{
+    get_dispatch().table->lgamma(out, x, n);
+}
+
+void
+microscopes::lda::vmath::digamma(float *out, const float *x, size_t n)
+{
+    get_dispatch().table->digamma(out, x, n);
+}
+
+void
+microscopes::lda::vmath::add_lgamma_ratio(float *acc, const float *x, float d, float sign, size_t n)
+{
+    get_dispatch().table->add_lgamma_ratio(acc, x, d, sign, n);
+}
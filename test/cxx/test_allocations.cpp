@@ -0,0 +1,107 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+// Count every heap allocation made by the process
+static size_t nallocs = 0;
+
+void *
+operator new(size_t n)
+{
+    nallocs++;
+    void *p = std::malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+static void
+test_posterior_kernels(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, lda::word_major_layout);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    microscopes::kernels::lda_crp::workspace ws;
+    size_t allocs = 0;
+    for(unsigned pass = 0; pass < 2; ++pass){
+        // The first pass sizes the buffers, the second must not allocate
+        const size_t before = nallocs;
+        for(size_t eid = 0; eid < state.nentities(); ++eid){
+            for(size_t i = 0; i < state.nterms(eid); ++i){
+                microscopes::kernels::lda_crp::calc_f_k(state, state.get_word(eid, i), ws);
+                microscopes::kernels::lda_crp::calc_table_posterior(state, eid, ws);
+                microscopes::kernels::lda_crp::calc_dish_posterior_w(state, ws);
+            }
+            for(auto t: state.using_t[eid]){
+                if(t != 0){
+                    microscopes::kernels::lda_crp::calc_dish_posterior_t(state, eid, t, ws);
+                }
+            }
+        }
+        allocs = nallocs - before;
+    }
+    MICROSCOPES_CHECK(allocs == 0, "posterior kernels allocated");
+}
+
+static void
+test_steady_state_sweep(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, lda::word_major_layout);
+    microscopes::kernels::lda_crp::workspace ws;
+    size_t ntokens = 0;
+    for(size_t eid = 0; eid < state.nentities(); ++eid){
+        ntokens += state.nterms(eid);
+    }
+
+    // Let the number of tables and dishes, and with them all buffers,
+    // settle first
+    for(unsigned i = 0; i < 100; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, ws, r);
+    }
+
+    // The sampler itself does not allocate any more. The only allocations
+    // left come from state containers growing past their previous high
+    // water mark (a table seeing more distinct words than any table in its
+    // slot before), which gets rarer the longer the chain runs.
+    const size_t nsweeps = 10;
+    const size_t before = nallocs;
+    for(unsigned i = 0; i < nsweeps; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, ws, r);
+    }
+    const size_t allocs = nallocs - before;
+    std::cout << "allocations in " << nsweeps << " sweeps of "
+              << ntokens << " tokens: " << allocs << std::endl;
+    MICROSCOPES_CHECK(allocs * 100 < nsweeps * ntokens, "steady state sweep allocates per token");
+}
+
+int main(void){
+    test_posterior_kernels();
+    std::cout << "test_posterior_kernels passed" << std::endl;
+    test_steady_state_sweep();
+    std::cout << "test_steady_state_sweep passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static void
+check_same_state(const lda::state &s1, const lda::state &s2){
+    MICROSCOPES_CHECK(s1.alpha_ == s2.alpha_ && s1.beta_ == s2.beta_ && s1.gamma_ == s2.gamma_,
+        "hyperparameters differ");
+    MICROSCOPES_CHECK(s1.n_kv.layout() == s2.n_kv.layout(), "layouts differ");
+    MICROSCOPES_CHECK(s1.table_assignments() == s2.table_assignments(), "table assignments differ");
+    MICROSCOPES_CHECK(s1.dish_assignments() == s2.dish_assignments(), "dish assignments differ");
+    for(size_t eid = 0; eid < s1.nentities(); ++eid){
+        MICROSCOPES_CHECK(s1.tables(eid) == s2.tables(eid), "tables differ");
+        MICROSCOPES_CHECK(s1.using_t[eid].free_ids() == s2.using_t[eid].free_ids(), "free tables differ");
+    }
+    MICROSCOPES_CHECK(s1.n_jt == s2.n_jt, "table sizes differ");
+    MICROSCOPES_CHECK(s1.dishes() == s2.dishes(), "dishes differ");
+    MICROSCOPES_CHECK(s1.dishes_.free_ids() == s2.dishes_.free_ids(), "free dishes differ");
+    MICROSCOPES_CHECK(s1.m_k.size() == s2.m_k.size(), "number of dish slots differs");
+    // Counts of deleted dishes are stale until the slot is reused
+    for(auto k: s1.dishes_){
+        MICROSCOPES_CHECK(s1.m_k[k] == s2.m_k[k], "m_k differs");
+        MICROSCOPES_CHECK(k == 0 || s1.n_k[k] == s2.n_k[k], "n_k differs");
+        for(size_t v = 0; v < s1.nwords(); ++v){
+            MICROSCOPES_CHECK(s1.n_kv.get(k, v) == s2.n_kv.get(k, v), "n_kv differs");
+        }
+    }
+}
+
+static void
+test_roundtrip(lda::count_layout layout){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state s1(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(s1, r);
+    }
+
+    std::stringstream with_corpus, without_corpus;
+    s1.save_checkpoint(with_corpus);
+    s1.save_checkpoint(without_corpus, false);
+    MICROSCOPES_CHECK(without_corpus.str().size() < with_corpus.str().size(),
+        "corpus was written anyway");
+
+    auto s2 = lda::state::load_checkpoint(with_corpus);
+    auto s3 = lda::state::load_checkpoint(without_corpus, lda::corpus(docs));
+    check_same_state(s1, *s2);
+    check_same_state(s1, *s3);
+
+    // A restored chain continues exactly like the original
+    rng_t r1(7), r2(7);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(s1, r1);
+        microscopes::kernels::lda_crp_gibbs(*s2, r2);
+    }
+    check_same_state(s1, *s2);
+}
+
+static void
+test_explicit_roundtrip(){
+    // Words seated at table 0 by the explicit constructor are kept
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4}, {0,1,5,6}};
+    size_t V = 7;
+    lda::model_definition defn(3, V);
+    std::vector<std::vector<size_t>> table_assignments = {{1, 0, 1, 2}, {1, 1, 1}, {3, 3, 3, 1}};
+    std::vector<std::vector<size_t>> dish_assignments = {{0, 1, 2}, {0, 3}, {0, 1, 2, 1}};
+    lda::state s1(defn, 0.5, 0.1, 0.5, dish_assignments, table_assignments, docs);
+    std::stringstream out;
+    s1.save_checkpoint(out);
+    auto s2 = lda::state::load_checkpoint(out);
+    check_same_state(s1, *s2);
+}
+
+template <typename F>
+static bool
+throws(F f)
+{
+    try {
+        f();
+    } catch (const std::exception &) {
+        return true;
+    }
+    return false;
+}
+
+static void
+test_corrupt_ids(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4}, {0,1,5,6}};
+    lda::model_definition defn(3, 7);
+    std::vector<std::vector<size_t>> table_assignments = {{1, 0, 1, 2}, {1, 1, 1}, {3, 3, 3, 1}};
+    // Dishes 2 and 3 are never created
+    std::vector<std::vector<size_t>> dish_assignments = {{0, 1, 4}, {0, 4}, {0, 1, 4, 1}};
+    lda::state s(defn, 0.5, 0.1, 0.5, dish_assignments, table_assignments, docs);
+    std::stringstream out;
+    s.save_checkpoint(out, false);
+    const std::string good = out.str();
+    // Dish and table lists, then doc 0's table list and table 0 counts
+    const size_t dish_assignments_pos = 72 + 4 * (3 + s.dishes_.size() + s.dishes_.free_ids().size()) +
+        4 * (3 + s.using_t[0].size() + s.using_t[0].free_ids().size()) + 8;
+
+    auto loads_with = [&](size_t pos, uint32_t x) {
+        std::string bytes = good;
+        std::memcpy(&bytes[pos], &x, sizeof(x));
+        std::stringstream in(bytes);
+        return !throws([&]{ lda::state::load_checkpoint(in, lda::corpus(docs)); });
+    };
+    MICROSCOPES_CHECK(loads_with(dish_assignments_pos + 4, 4), "rejected a valid dish");
+    MICROSCOPES_CHECK(!loads_with(dish_assignments_pos + 4, 2), "accepted a deleted dish");
+    MICROSCOPES_CHECK(!loads_with(dish_assignments_pos + 4, 1000), "accepted a dish beyond ndishes");
+    MICROSCOPES_CHECK(!loads_with(dish_assignments_pos - 12, 1000), "accepted a table beyond nslots");
+    MICROSCOPES_CHECK(!loads_with(dish_assignments_pos - 8, 5), "accepted wrong table 0 counts");
+}
+
+int main(void){
+    for(auto layout: {lda::sparse_layout, lda::topic_major_layout,
+                      lda::word_major_layout, lda::sparse_word_major_layout}){
+        test_roundtrip(layout);
+    }
+    std::cout << "test_roundtrip passed" << std::endl;
+    test_explicit_roundtrip();
+    std::cout << "test_explicit_roundtrip passed" << std::endl;
+    test_corrupt_ids();
+    std::cout << "test_corrupt_ids passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,220 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/corpus.hpp>
+#include <microscopes/lda/corpus_io.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static void
+test_layout(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {}, {0,1,4}, {6}};
+    lda::corpus c(docs);
+    MICROSCOPES_CHECK(c.ndocs() == 4, "wrong number of docs");
+    MICROSCOPES_CHECK(c.ntokens() == 8, "wrong number of tokens");
+    MICROSCOPES_CHECK(c.max_word() == 6, "wrong max word");
+    size_t offset = 0;
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        MICROSCOPES_CHECK(c.size(eid) == docs[eid].size(), "wrong doc size");
+        MICROSCOPES_CHECK(c.offset(eid) == offset, "wrong doc offset");
+        auto doc = c.doc(eid);
+        MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[eid], "wrong doc");
+        for(size_t i = 0; i < docs[eid].size(); ++i){
+            MICROSCOPES_CHECK(c.word(eid, i) == docs[eid][i], "wrong word");
+        }
+        offset += docs[eid].size();
+    }
+
+    // Slices share storage and are renumbered from 0
+    lda::corpus s = c.slice(2, 4);
+    MICROSCOPES_CHECK(s.ndocs() == 2 && s.ntokens() == 4, "wrong slice size");
+    MICROSCOPES_CHECK(s.offset(1) == 3, "wrong slice offset");
+    MICROSCOPES_CHECK(s.word(0, 2) == 4 && s.word(1, 0) == 6, "wrong slice words");
+    MICROSCOPES_CHECK(s.doc(0).begin() == c.doc(2).begin(), "slice copied the tokens");
+}
+
+static void
+test_external_buffers(){
+    auto tokens = std::make_shared<std::vector<lda::token_t>>(
+        std::vector<lda::token_t>{9, 0, 1, 2, 3, 0, 1, 4});
+    std::vector<size_t> offsets {1, 5, 8};
+    lda::corpus c(tokens, tokens->data(), offsets.data(), 2);
+    MICROSCOPES_CHECK(c.ndocs() == 2 && c.ntokens() == 7, "wrong wrapped size");
+    MICROSCOPES_CHECK(c.offset(1) == 4, "wrong wrapped offset");
+    MICROSCOPES_CHECK(c.doc(0).begin() == tokens->data() + 1, "wrapped buffer was copied");
+
+    // Copying out of external arrays rebases the offsets
+    lda::corpus copied(tokens->data(), offsets.data(), 2);
+    MICROSCOPES_CHECK(copied.ntokens() == 7 && copied.offset(1) == 4, "wrong copied layout");
+    MICROSCOPES_CHECK(copied.word(1, 2) == 4, "wrong copied word");
+}
+
+template <typename F>
+static bool
+throws(F f)
+{
+    try {
+        f();
+    } catch (const std::exception &) {
+        return true;
+    }
+    return false;
+}
+
+static void
+test_bad_offsets(){
+    const std::vector<lda::token_t> tokens {0, 1, 2, 3};
+    auto owned = [&](std::vector<size_t> offsets) {
+        lda::corpus(std::vector<lda::token_t>(tokens), std::move(offsets));
+    };
+    MICROSCOPES_CHECK(throws([&]{ owned({}); }), "accepted no offsets");
+    MICROSCOPES_CHECK(throws([&]{ owned({1, 4}); }), "accepted offsets not starting at 0");
+    MICROSCOPES_CHECK(throws([&]{ owned({0, 3}); }), "accepted offsets short of the tokens");
+    MICROSCOPES_CHECK(throws([&]{ owned({0, 3, 2, 4}); }), "accepted unsorted offsets");
+    owned({0, 2, 2, 4});
+
+    const std::vector<size_t> unsorted {1, 3, 0};
+    MICROSCOPES_CHECK(throws([&]{ lda::corpus(tokens.data(), unsorted.data(), 2); }),
+        "copied unsorted offsets");
+}
+
+static lda::corpus
+docs_of(const std::vector< std::vector<size_t>> &docs){
+    return lda::corpus(docs);
+}
+
+static void
+test_append(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {}, {0,1,4}, {6}};
+    const lda::corpus c(docs);
+    // The first append copies into storage with room to grow ...
+    lda::corpus a = c.append(docs_of({{5, 5}}));
+    MICROSCOPES_CHECK(c.ndocs() == 4 && a.ndocs() == 5 && a.ntokens() == 10, "wrong appended size");
+    MICROSCOPES_CHECK(a.word(4, 1) == 5 && a.word(2, 2) == 4, "wrong appended words");
+    // ... which later appends fill in place
+    lda::corpus b = a.append(docs_of({{1}, {2, 3}}));
+    MICROSCOPES_CHECK(b.ndocs() == 7 && b.doc(0).begin() == a.doc(0).begin(), "append did not grow in place");
+    MICROSCOPES_CHECK(a.ndocs() == 5 && b.word(6, 1) == 3, "append changed the old handle");
+    // a no longer ends where the storage does, so it copies
+    lda::corpus d = a.append(docs_of({{4}}));
+    MICROSCOPES_CHECK(d.doc(0).begin() != a.doc(0).begin() && d.word(5, 0) == 4, "wrong copied append");
+    MICROSCOPES_CHECK(b.word(5, 0) == 1, "append overwrote another handle");
+    // Slices that end with the storage grow in place too
+    lda::corpus tail = b.slice(3, 7).append(docs_of({{0}}));
+    MICROSCOPES_CHECK(tail.ndocs() == 5 && tail.doc(0).begin() == b.doc(3).begin(), "slice copied");
+    MICROSCOPES_CHECK(tail.word(4, 0) == 0 && tail.offset(4) == 6, "wrong slice append");
+}
+
+static void
+test_state_from_corpus(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r1(42), r2(42);
+    lda::state s1(defn, 0.5, 0.1, 0.5, 3, docs, r1);
+    lda::state s2(defn, 0.5, 0.1, 0.5, 3, lda::corpus(docs), r2);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(s1, r1);
+        microscopes::kernels::lda_crp_gibbs(s2, r2);
+    }
+    MICROSCOPES_CHECK(s1.table_assignments() == s2.table_assignments(), "corpus state diverged");
+    MICROSCOPES_CHECK(s1.dish_assignments() == s2.dish_assignments(), "corpus state diverged");
+    for(size_t eid = 0; eid < s1.nentities(); ++eid){
+        MICROSCOPES_CHECK(s1.table_assignments()[eid].size() == docs[eid].size(), "wrong table assignment shape");
+    }
+}
+
+static void
+test_load_ldac(){
+    const char *path = "test_corpus.ldac";
+    {
+        std::ofstream out(path);
+        out << "2 1:1 0:2\n\n3 2:1 0:3 1:1\r\n0\n1 4:2";
+    }
+    lda::corpus c = lda::load_ldac(path);
+    std::remove(path);
+    std::vector< std::vector<size_t>> docs {{1, 0, 0}, {2, 0, 0, 0, 1}, {}, {4, 4}};
+    MICROSCOPES_CHECK(c.ndocs() == docs.size(), "wrong number of docs");
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        auto doc = c.doc(eid);
+        MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[eid], "wrong doc");
+    }
+
+    // Values that do not fit are rejected like malformed ones
+    auto rejects = [path](const std::string &line) {
+        {
+            std::ofstream out(path);
+            out << line;
+        }
+        const bool ret = throws([path]{ lda::load_ldac(path); });
+        std::remove(path);
+        return ret;
+    };
+    MICROSCOPES_CHECK(rejects("1 0:18446744073709551617\n"), "accepted an overflowing count");
+    MICROSCOPES_CHECK(rejects("18446744073709551616 0:1\n"), "accepted an overflowing term count");
+    if (lda::corpus::max_token() < std::numeric_limits<size_t>::max()) {
+        MICROSCOPES_CHECK(rejects("1 " + std::to_string(lda::corpus::max_token() + 1) + ":1\n"),
+            "accepted a word id beyond token_t");
+    }
+    MICROSCOPES_CHECK(!rejects("1 " + std::to_string(lda::corpus::max_token()) + ":1\n"),
+        "rejected the largest word id");
+}
+
+static void
+test_map_corpus(){
+    const char *path = "test_corpus.bin";
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    // Saving a slice must write it renumbered from 0
+    lda::save_corpus(lda::corpus(docs).slice(1, docs.size()), path);
+    docs.erase(docs.begin());
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r1(42), r2(42);
+    lda::state s1(defn, 0.5, 0.1, 0.5, 3, docs, r1);
+    {
+        lda::corpus mapped = lda::map_corpus(path);
+        MICROSCOPES_CHECK(mapped.ndocs() == docs.size(), "wrong number of mapped docs");
+        for(size_t eid = 0; eid < docs.size(); ++eid){
+            auto doc = mapped.doc(eid);
+            MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[eid], "wrong mapped doc");
+        }
+        lda::state s2(defn, 0.5, 0.1, 0.5, 3, mapped, r2);
+        // The state keeps the mapping alive after the last other handle is gone
+        mapped = lda::corpus();
+        for(unsigned i = 0; i < 5; ++i){
+            microscopes::kernels::lda_crp_gibbs(s1, r1);
+            microscopes::kernels::lda_crp_gibbs(s2, r2);
+        }
+        MICROSCOPES_CHECK(s1.table_assignments() == s2.table_assignments(), "mapped state diverged");
+        MICROSCOPES_CHECK(s1.dish_assignments() == s2.dish_assignments(), "mapped state diverged");
+    }
+    std::remove(path);
+}
+
+int main(void){
+    test_layout();
+    std::cout << "test_layout passed" << std::endl;
+    test_external_buffers();
+    std::cout << "test_external_buffers passed" << std::endl;
+    test_bad_offsets();
+    std::cout << "test_bad_offsets passed" << std::endl;
+    test_append();
+    std::cout << "test_append passed" << std::endl;
+    test_state_from_corpus();
+    std::cout << "test_state_from_corpus passed" << std::endl;
+    test_load_ldac();
+    std::cout << "test_load_ldac passed" << std::endl;
+    test_map_corpus();
+    std::cout << "test_map_corpus passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,235 @@
+#include <microscopes/lda/distributed.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <thread>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+using namespace microscopes::lda;
+
+static const size_t V = 5;
+static const size_t NODES = 3;
+
+// Documents [first, last) of random_docs for each rank
+static std::shared_ptr<state>
+make_shard(size_t rank, rng_t &r, count_layout layout){
+    const corpus docs = corpus(data::random_docs);
+    const size_t n = docs.ndocs();
+    const corpus shard = docs.slice(rank * n / NODES, (rank + 1) * n / NODES);
+    model_definition defn(shard.ndocs(), V);
+    return state::initialize(defn, 0.5, 0.1, 0.5, 3, shard, r, layout);
+}
+
+// Run every rank's node on a thread of its own
+template <typename F>
+static void
+on_all_ranks(F f){
+    std::vector<std::thread> threads;
+    for(size_t rank = 0; rank < NODES; ++rank){
+        threads.emplace_back(f, rank);
+    }
+    for(auto &t: threads){
+        t.join();
+    }
+}
+
+// After a sync every node holds the dish statistics of all shards' tables
+static void
+check_global(const std::vector<std::shared_ptr<state>> &states){
+    std::vector<size_t> m_k, n_k;
+    std::map<std::pair<size_t, size_t>, size_t> n_kv;
+    for(auto &s: states){
+        for(size_t eid = 0; eid < s->nentities(); ++eid){
+            for(auto t: s->using_t[eid]){
+                const size_t k = s->dish_assignment(eid, t);
+                MICROSCOPES_CHECK(s->dishes_.contains(k), "table at an inactive dish");
+                if(k >= m_k.size()){
+                    m_k.resize(k + 1, 0);
+                    n_k.resize(k + 1, 0);
+                }
+                if(k != 0){
+                    m_k[k] += 1;
+                }
+                n_k[k] += s->n_jt[eid][t];
+                for(auto &kv: s->n_jtv[eid][t]){
+                    n_kv[std::make_pair(k, kv.first)] += kv.second;
+                }
+            }
+        }
+    }
+    for(auto &s: states){
+        MICROSCOPES_CHECK(s->m_k.size() == states[0]->m_k.size(), "nodes have different dish slots");
+        std::vector<size_t> active(s->dishes().begin(), s->dishes().end());
+        std::sort(active.begin(), active.end());
+        std::vector<size_t> expected {0};
+        for(size_t k = 1; k < s->m_k.size(); ++k){
+            const size_t want = k < m_k.size() ? m_k[k] : 0;
+            MICROSCOPES_CHECK(s->m_k[k] == want, "wrong global table count");
+            MICROSCOPES_CHECK(s->n_k[k] == (k < n_k.size() ? n_k[k] : 0), "wrong global word count");
+            if(want > 0){
+                expected.push_back(k);
+            }
+        }
+        MICROSCOPES_CHECK(m_k.size() <= s->m_k.size(), "dish beyond the global slots");
+        MICROSCOPES_CHECK(active == expected, "wrong active dishes");
+        MICROSCOPES_CHECK(s->ntables() == std::accumulate(m_k.begin(), m_k.end(), size_t(0)),
+            "wrong table total");
+        s->n_kv.for_each_count([&](size_t k, size_t v, size_t c){
+            MICROSCOPES_CHECK(n_kv[std::make_pair(k, v)] == c, "wrong global word count of a dish");
+        });
+        for(auto &kv: n_kv){
+            MICROSCOPES_CHECK(s->n_kv.get(kv.first.first, kv.first.second) == kv.second,
+                "missing global word count of a dish");
+        }
+    }
+}
+
+typedef std::function<std::unique_ptr<distributed::transport>(size_t)> transport_factory;
+
+// Assignments of every node after nsyncs syncs, sync_every iterations apart
+static std::vector<std::vector<std::vector<size_t>>>
+run_nodes(const transport_factory &make, count_layout layout, size_t nsyncs, size_t sync_every){
+    std::vector<std::shared_ptr<state>> states(NODES);
+    std::vector<std::unique_ptr<distributed::node>> nodes(NODES);
+    std::vector<rng_t> rngs;
+    for(size_t rank = 0; rank < NODES; ++rank){
+        rngs.emplace_back(31 + rank);
+        states[rank] = make_shard(rank, rngs[rank], layout);
+    }
+    std::vector<std::unique_ptr<distributed::transport>> transports(NODES);
+    on_all_ranks([&](size_t rank){
+        transports[rank] = make(rank);
+        nodes[rank].reset(new distributed::node(states[rank], *transports[rank]));
+    });
+    check_global(states);
+    for(size_t i = 0; i < nsyncs; ++i){
+        on_all_ranks([&](size_t rank){
+            nodes[rank]->run(rngs[rank], sync_every, sync_every);
+        });
+        check_global(states);
+    }
+
+    // Nothing changed, so nothing but the header is sent
+    std::vector<size_t> sent(NODES);
+    on_all_ranks([&](size_t rank){
+        sent[rank] = nodes[rank]->bytes_sent();
+        nodes[rank]->sync();
+    });
+    for(size_t rank = 0; rank < NODES; ++rank){
+        MICROSCOPES_CHECK(nodes[rank]->bytes_sent() - sent[rank] <= 6, "unchanged counts were sent");
+        MICROSCOPES_CHECK(nodes[rank]->nsyncs() == nsyncs + 2, "wrong number of syncs");
+    }
+    check_global(states);
+
+    std::vector<std::vector<std::vector<size_t>>> ret;
+    for(auto &s: states){
+        ret.push_back(s->dish_assignments());
+        ret.push_back(s->table_assignments());
+    }
+    return ret;
+}
+
+// A hub's endpoint, which the hub owns
+struct borrowed_transport : distributed::transport {
+    explicit borrowed_transport(distributed::transport &t) : t(t) {}
+    size_t rank() const override { return t.rank(); }
+    size_t size() const override { return t.size(); }
+    std::vector<std::string> all_gather(const std::string &m) override { return t.all_gather(m); }
+    distributed::transport &t;
+};
+
+static transport_factory
+hub_endpoints(distributed::local_hub &hub){
+    return [&hub](size_t rank){
+        return std::unique_ptr<distributed::transport>(new borrowed_transport(hub.endpoint(rank)));
+    };
+}
+
+static void
+test_local_hub(){
+    for(auto layout: {sparse_layout, topic_major_layout, word_major_layout, sparse_word_major_layout}){
+        for(size_t sync_every: {1, 3}){
+            distributed::local_hub hub(NODES);
+            run_nodes(hub_endpoints(hub), layout, 8, sync_every);
+        }
+    }
+}
+
+static uint16_t
+free_port(){
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    MICROSCOPES_CHECK(bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0, "bind failed");
+    socklen_t len = sizeof(addr);
+    getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+// The transport does not change the draws
+static void
+test_tcp(){
+    distributed::local_hub hub(NODES);
+    auto local = run_nodes(hub_endpoints(hub), sparse_layout, 5, 2);
+    const uint16_t port = free_port();
+    auto tcp = run_nodes([&](size_t rank){
+        return std::unique_ptr<distributed::transport>(
+            new distributed::tcp_transport(rank, NODES, "127.0.0.1", port));
+    }, sparse_layout, 5, 2);
+    MICROSCOPES_CHECK(local == tcp, "transports disagree");
+}
+
+static size_t
+open_fds(){
+    size_t n = 0;
+    for(int fd = 0; fd < 1024; ++fd)
+        if(fcntl(fd, F_GETFD) != -1)
+            ++n;
+    return n;
+}
+
+// Rank 0 refuses a peer with a rank beyond the run's size and closes the
+// listener and the sockets it had already accepted
+static void
+test_tcp_bad_rank(){
+    const uint16_t port = free_port();
+    const size_t before = open_fds();
+    std::thread peers([port]{
+        distributed::tcp_transport good(1, 3, "127.0.0.1", port);
+        distributed::tcp_transport bad(7, 8, "127.0.0.1", port);
+    });
+    bool threw = false;
+    try {
+        distributed::tcp_transport root(0, 3, "127.0.0.1", port);
+    } catch (const std::exception &) {
+        threw = true;
+    }
+    peers.join();
+    MICROSCOPES_CHECK(threw, "accepted a peer with a bad rank");
+    MICROSCOPES_CHECK(open_fds() == before, "sockets leaked");
+}
+
+int main(void){
+    test_local_hub();
+    std::cout << "test_local_hub passed" << std::endl;
+    test_tcp();
+    std::cout << "test_tcp passed" << std::endl;
+    test_tcp_bad_rank();
+    std::cout << "test_tcp_bad_rank passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include <microscopes/lda/distributed_mpi.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <iostream>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+using namespace microscopes::lda;
+
+static const size_t V = 5;
+
+// Each rank samples its part of random_docs; afterwards the global table
+// and word counts of every rank are the sums over all ranks' tables
+int main(int argc, char **argv){
+    MPI_Init(&argc, &argv);
+    distributed::mpi_transport transport;
+    const size_t rank = transport.rank(), size = transport.size();
+
+    const corpus docs = corpus(data::random_docs);
+    const corpus shard = docs.slice(rank * docs.ndocs() / size, (rank + 1) * docs.ndocs() / size);
+    rng_t r(17 + rank);
+    model_definition defn(shard.ndocs(), V);
+    auto latent = state::initialize(defn, 0.5, 0.1, 0.5, 3, shard, r, sparse_layout);
+    distributed::node node(latent, transport);
+    node.run(r, 20, 2);
+
+    const size_t K = node.ndish_slots();
+    std::vector<unsigned long long> own(2 * K, 0), sum(2 * K, 0);
+    for(size_t eid = 0; eid < latent->nentities(); ++eid){
+        for(auto t: latent->using_t[eid]){
+            const size_t k = latent->dish_assignment(eid, t);
+            MICROSCOPES_CHECK(k < K, "dish beyond the global slots");
+            own[k] += k != 0;
+            own[K + k] += latent->n_jt[eid][t];
+        }
+    }
+    MPI_Allreduce(own.data(), sum.data(), int(2 * K), MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    for(size_t k = 1; k < K; ++k){
+        MICROSCOPES_CHECK(latent->m_k[k] == sum[k], "wrong global table count");
+        MICROSCOPES_CHECK(latent->n_k[k] == sum[K + k], "wrong global word count");
+        MICROSCOPES_CHECK(latent->dishes_.contains(k) == (sum[k] > 0), "wrong active dishes");
+    }
+    if(rank == 0){
+        std::cout << "test_distributed_mpi passed on " << size << " ranks, "
+                  << latent->ntopics() << " topics" << std::endl;
+    }
+    MPI_Finalize();
+    return 0;
+}
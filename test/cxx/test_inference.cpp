@@ -0,0 +1,146 @@
+#include <microscopes/lda/inference.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+// The iterated pseudo-counts method written out over word_distribution()
+static std::vector<double>
+reference_predict(lda::state &state, const std::vector<size_t> &doc, float prior, size_t max_iter){
+    auto phi = state.word_distribution();
+    const size_t K = phi.size(), n = doc.size();
+    std::vector<std::vector<double>> pz(n, std::vector<double>(K, 0));
+    for(size_t iter = 0; iter <= max_iter; ++iter){
+        std::vector<double> sum(K, 0);
+        for(auto &row: pz)
+            for(size_t k = 0; k < K; ++k)
+                sum[k] += row[k];
+        auto next = pz;
+        for(size_t i = 0; i < n; ++i){
+            double total = 0;
+            for(size_t k = 0; k < K; ++k){
+                next[i][k] = phi[k][doc[i]] * (sum[k] - pz[i][k] + prior);
+                total += next[i][k];
+            }
+            for(auto &p: next[i])
+                p /= total;
+        }
+        pz = next;
+    }
+    std::vector<double> theta(K, 0);
+    for(auto &row: pz)
+        for(size_t k = 0; k < K; ++k)
+            theta[k] += row[k] / n;
+    return theta;
+}
+
+static void
+test_predict(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    lda::inference model(state);
+    MICROSCOPES_CHECK(model.ntopics() == state.ntopics(), "wrong number of topics");
+    MICROSCOPES_CHECK(model.prior() == state.beta_, "prior is not beta");
+    auto phi = state.word_distribution();
+    for(size_t k = 0; k < model.ntopics(); ++k){
+        for(size_t v = 0; v < V; ++v){
+            MICROSCOPES_CHECK(model.phi_row(v)[k] == phi[k][v], "phi differs from word_distribution");
+        }
+    }
+
+    // The frozen model does not follow the state
+    lda::state trained = state;
+    microscopes::kernels::lda_crp_gibbs(state, r);
+
+    std::vector< std::vector<size_t>> test_docs {{0, 1, 1, 2}, {4}, {3, 3, 3, 0, 2, 1, 4, 4}};
+    const lda::corpus test_corpus(test_docs);
+    for(size_t max_iter: {0, 1, 5, 20}){
+        auto theta = model.predict(test_corpus, max_iter, 0);
+        MICROSCOPES_CHECK(theta.size() == test_docs.size(), "wrong number of thetas");
+        for(size_t eid = 0; eid < test_docs.size(); ++eid){
+            auto expected = reference_predict(trained, test_docs[eid], model.prior(), max_iter);
+            MICROSCOPES_CHECK(theta[eid].size() == expected.size(), "wrong theta size");
+            for(size_t k = 0; k < expected.size(); ++k){
+                MICROSCOPES_CHECK(std::abs(theta[eid][k] - expected[k]) < 1e-5, "theta differs from the reference");
+            }
+        }
+    }
+
+    // Converged documents stop early
+    lda::inference::workspace ws;
+    std::vector<float> theta(model.ntopics());
+    size_t iters = model.predict(test_corpus.doc(2), theta.data(), 1000, 1e-4, ws);
+    MICROSCOPES_CHECK(iters > 0 && iters < 1000, "did not stop at tol");
+}
+
+static void
+test_unknown_words(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    lda::inference model(state, 0.5);
+
+    // Words beyond the vocabulary are ignored, and without any known word
+    // the distribution is uniform
+    auto theta = model.predict(lda::corpus({{0, 7, 2}, {0, 2}, {9}, {}}), 20, 1e-8);
+    for(size_t k = 0; k < model.ntopics(); ++k){
+        MICROSCOPES_CHECK(theta[0][k] == theta[1][k], "unknown word changed theta");
+        MICROSCOPES_CHECK(std::abs(theta[2][k] - 1.0 / model.ntopics()) < 1e-6, "theta is not uniform");
+        MICROSCOPES_CHECK(theta[2][k] == theta[3][k], "empty document differs");
+    }
+}
+
+static void
+test_batch_predict(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    lda::inference model(state);
+
+    // Enough documents for several chunks per thread
+    std::vector< std::vector<size_t>> test_docs;
+    for(size_t i = 0; i < 10 * lda::inference::chunk_size + 3; ++i){
+        test_docs.push_back(docs[i % docs.size()]);
+        test_docs.back().resize(1 + i % docs[i % docs.size()].size());
+    }
+    const lda::corpus test_corpus(test_docs);
+    auto expected = model.predict(test_corpus, 20, 1e-8);
+    for(size_t nthreads: {1, 2, 4, 100}){
+        std::vector<float> theta(test_docs.size() * model.ntopics(), -1);
+        model.predict(test_corpus, theta.data(), 20, 1e-8, nthreads);
+        for(size_t eid = 0; eid < test_docs.size(); ++eid){
+            for(size_t k = 0; k < model.ntopics(); ++k){
+                MICROSCOPES_CHECK(theta[eid * model.ntopics() + k] == expected[eid][k],
+                    "threaded predict differs");
+            }
+        }
+    }
+}
+
+int main(void){
+    test_predict();
+    std::cout << "test_predict passed" << std::endl;
+    test_unknown_words();
+    std::cout << "test_unknown_words passed" << std::endl;
+    test_batch_predict();
+    std::cout << "test_batch_predict passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include <microscopes/lda/inference.hpp>
+#include <microscopes/lda/snapshot.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static bool
+assertAlmostEqual(double a, double b, double tol=1e-5){
+    return std::abs(a - b) <= tol * std::max(1.0, std::abs(b));
+}
+
+// Enough documents for several chunks of work
+static std::vector< std::vector<size_t>>
+many_docs(){
+    std::vector< std::vector<size_t>> docs;
+    for(unsigned i = 0; i < 6; ++i)
+        docs.insert(docs.end(), data::random_docs.begin(), data::random_docs.end());
+    return docs;
+}
+
+// log sum_k theta[j][k] phi[k][w] over the dense snapshot
+static double
+reference_log_likelihood(const lda::state &state, const std::vector<size_t> &eids){
+    auto snap = state.snapshot();
+    double ll = 0;
+    for(auto eid: eids){
+        for(auto v: state.get_entity(eid)){
+            double p = 0;
+            for(size_t i = 0; i < snap->ntopics(); ++i)
+                p += snap->theta(eid)[i] * snap->phi(v)[i];
+            ll += std::log((1 - snap->new_dish(eid)) * p);
+        }
+    }
+    return ll;
+}
+
+static void
+test_training_perplexity(lda::count_layout layout){
+    auto docs = many_docs();
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    std::vector<size_t> all(docs.size());
+    size_t N = 0;
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        all[eid] = eid;
+        N += docs[eid].size();
+    }
+    const double ll = state.log_likelihood(all);
+    MICROSCOPES_CHECK(assertAlmostEqual(ll, reference_log_likelihood(state, all)),
+        "log likelihood differs from the snapshot");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.perplexity(), std::exp(-ll / N)), "perplexity is wrong");
+    for(size_t nthreads: {2, 3, 8}){
+        MICROSCOPES_CHECK(state.log_likelihood(all, nthreads) == ll, "result depends on nthreads");
+    }
+
+    // A subset is the sum of its documents
+    std::vector<size_t> subset = {3, 250, 17};
+    double sum = 0;
+    for(auto eid: subset)
+        sum += state.log_likelihood({eid});
+    MICROSCOPES_CHECK(assertAlmostEqual(state.log_likelihood(subset, 2), sum), "subset is wrong");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.log_likelihood(subset), reference_log_likelihood(state, subset)),
+        "subset differs from the snapshot");
+}
+
+// Words at table 0 and at tables of dish 0 stay out of the topics
+static void
+test_explicit_perplexity(){
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4}, {0,1,5,6}};
+    lda::model_definition defn(docs.size(), 7);
+    std::vector<std::vector<size_t>> table_assignments = {{1, 0, 1, 2}, {1, 1, 2}, {3, 3, 0, 1}};
+    std::vector<std::vector<size_t>> dish_assignments = {{0, 1, 2}, {0, 3, 0}, {0, 1, 2, 1}};
+    lda::state state(defn, 0.5, 0.1, 0.5, dish_assignments, table_assignments, docs);
+    const std::vector<size_t> all = {0, 1, 2};
+    MICROSCOPES_CHECK(assertAlmostEqual(state.log_likelihood(all), reference_log_likelihood(state, all)),
+        "explicit state log likelihood differs from the snapshot");
+}
+
+static void
+test_heldout_perplexity(){
+    auto docs = many_docs();
+    std::vector< std::vector<size_t>> train(docs.begin(), docs.begin() + 200);
+    std::vector< std::vector<size_t>> test(docs.begin() + 200, docs.end());
+    size_t V = 5;
+    lda::model_definition defn(train.size(), V);
+    rng_t r(7);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, train, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    lda::inference model(state);
+    lda::corpus heldout(test);
+    const double ll = model.log_likelihood(heldout, 20, 1e-6);
+    double expected = 0;
+    size_t N = 0;
+    lda::inference::workspace ws;
+    std::vector<float> theta(model.ntopics());
+    for(size_t eid = 0; eid < heldout.ndocs(); ++eid){
+        model.predict(heldout.doc(eid), theta.data(), 20, 1e-6, ws);
+        for(auto v: heldout.doc(eid)){
+            double p = 0;
+            for(size_t k = 0; k < model.ntopics(); ++k)
+                p += theta[k] * model.phi_row(v)[k];
+            expected += std::log(p);
+            ++N;
+        }
+    }
+    MICROSCOPES_CHECK(assertAlmostEqual(ll, expected), "held-out log likelihood is wrong");
+    MICROSCOPES_CHECK(model.log_likelihood(heldout, 20, 1e-6, 4) == ll, "result depends on nthreads");
+    MICROSCOPES_CHECK(assertAlmostEqual(model.perplexity(heldout, 20, 1e-6, 3), std::exp(-ll / N)),
+        "held-out perplexity is wrong");
+}
+
+int main(void){
+    for(auto layout: {lda::sparse_layout, lda::topic_major_layout,
+                      lda::word_major_layout, lda::sparse_word_major_layout}){
+        test_training_perplexity(layout);
+    }
+    std::cout << "test_training_perplexity passed" << std::endl;
+    test_explicit_perplexity();
+    std::cout << "test_explicit_perplexity passed" << std::endl;
+    test_heldout_perplexity();
+    std::cout << "test_heldout_perplexity passed" << std::endl;
+    return 0;
+}
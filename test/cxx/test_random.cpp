@@ -5,6 +5,8 @@
 #include <microscopes/models/distributions.hpp>
 #include <microscopes/common/random_fwd.hpp>
 
+#include <cmath>
+#include <numeric>
 #include <random>
 #include <iostream>
 
@@ -53,10 +55,178 @@ test_explicit_initializtion(){
     MICROSCOPES_CHECK(dish_assignments.size() == state.dish_assignments().size(), "table_assignments is wrong length");
 }
 
+// Incrementally maintained counts agree with a full rebuild
+static void
+check_statistics(const lda::state &state){
+    lda::state rebuilt = state;
+    rebuilt.rebuild_dish_statistics();
+    MICROSCOPES_CHECK(rebuilt.dishes() == state.dishes(), "dishes_ differ after rebuild");
+    MICROSCOPES_CHECK(rebuilt.ntables() == state.ntables(), "ntables differ after rebuild");
+    MICROSCOPES_CHECK(state.ntables() == size_t(std::accumulate(state.m_k.begin() + 1, state.m_k.end(), 0)),
+        "ntables differs from the sum of m_k");
+    // A copy keeps the maintained normalizers, a rebuild recomputes them
+    lda::state maintained = state;
+    const auto &inv_n_k = maintained.dish_normalizers();
+    for(auto k: state.dishes()){
+        MICROSCOPES_CHECK(inv_n_k[k] == rebuilt.dish_normalizers()[k], "dish normalizer drifted");
+        MICROSCOPES_CHECK(rebuilt.m_k[k] == state.m_k[k], "m_k differs after rebuild");
+        MICROSCOPES_CHECK(rebuilt.n_k[k] == state.n_k[k], "n_k differs after rebuild");
+        for(size_t v = 0; v < state.nwords(); ++v){
+            MICROSCOPES_CHECK(rebuilt.n_kv.get(k, v) == state.n_kv.get(k, v), "n_kv differs after rebuild");
+        }
+    }
+}
+
+static void
+test_parallel_sweeps(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    for(auto layout: {lda::sparse_layout, lda::word_major_layout}){
+        rng_t r1(42), r2(42);
+        lda::state s1(defn, 0.5, 0.1, 0.5, 3, docs, r1, layout);
+        lda::state s2(defn, 0.5, 0.1, 0.5, 3, docs, r2, layout);
+        for(unsigned i = 0; i < 10; ++i){
+            microscopes::kernels::lda_crp_gibbs(s1, r1, 4);
+            microscopes::kernels::lda_crp_gibbs(s2, r2, 4);
+        }
+        // Same seed and thread count give the same chain
+        MICROSCOPES_CHECK(s1.table_assignments() == s2.table_assignments(), "parallel sweep not reproducible");
+        MICROSCOPES_CHECK(s1.dish_assignments() == s2.dish_assignments(), "parallel sweep not reproducible");
+
+        // Incrementally maintained counts agree with a full rebuild
+        check_statistics(s1);
+        std::cout << "parallel perplexity: " << s1.perplexity() << std::endl;
+    }
+}
+
+// Dishes created by the shards reuse freed ids, so the dish slots follow
+// the number of dishes rather than the number of sweeps
+static void
+test_parallel_slots(){
+    rng_t r(3);
+    std::uniform_int_distribution<size_t> word(0, 99);
+    std::vector< std::vector<size_t>> docs(200, std::vector<size_t>(50));
+    for(auto &doc: docs){
+        for(auto &w: doc)
+            w = word(r);
+    }
+    lda::model_definition defn(docs.size(), 100);
+    lda::state state(defn, 0.5, 0.1, 2, 10, docs, r);
+    size_t most = 0;
+    for(unsigned i = 0; i < 300; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r, 4);
+        most = std::max(most, state.dishes().size());
+    }
+    std::cout << "parallel slots: " << state.dishes_.nslots() << " for at most "
+              << most << " dishes" << std::endl;
+    MICROSCOPES_CHECK(state.dishes_.nslots() <= most + 8, "dish slots leak");
+    MICROSCOPES_CHECK(state.n_kv.ndishes() <= state.dishes_.nslots(), "count slots leak");
+    check_statistics(state);
+}
+
+// A shard that empties a dish must not hand its id out again: a table of
+// another shard may have joined that dish in the meantime
+static void
+test_shard_dish_reuse(){
+    std::vector< std::vector<size_t>> docs {{0, 1}, {2, 3}};
+    lda::model_definition defn(docs.size(), 4);
+    std::vector<std::vector<size_t>> table_assignments = {{1, 1}, {1, 1}};
+    std::vector<std::vector<size_t>> dish_assignments = {{0, 1}, {0, 2}};
+    lda::state state(defn, 0.5, 0.1, 0.5, dish_assignments, table_assignments, docs);
+    auto a = state.detach_shard(0, 1);
+    auto b = state.detach_shard(1, 2);
+    MICROSCOPES_CHECK(a->term_frequency().empty(), "shard counted its terms");
+
+    // Shard a empties dish 1, then opens a dish of its own
+    a->remove_table(0, 0);
+    a->remove_table(0, 1);
+    MICROSCOPES_CHECK(!a->dishes_.contains(1), "dish 1 is still active in the shard");
+    const size_t ta = a->create_table(0, a->create_dish());
+    a->add_table(0, ta, 0);
+    a->add_table(0, ta, 1);
+    // Shard b still sees dish 1 and seats a word there
+    const size_t tb = b->create_table(0, 1);
+    b->remove_table(0, 0);
+    b->add_table(0, tb, 0);
+
+    state.attach_shard(*a, 0);
+    state.attach_shard(*b, 1);
+    state.rebuild_dish_statistics();
+    MICROSCOPES_CHECK(state.dish_assignment(1, tb) == 1, "shard b lost its dish");
+    MICROSCOPES_CHECK(state.dish_assignment(0, ta) != 1, "shard a reused a parent dish id");
+    MICROSCOPES_CHECK(state.m_k[1] == 1 && state.n_k[1] == 1, "dish 1 mixes both shards");
+    check_statistics(state);
+}
+
+static void
+test_alias_table(){
+    rng_t r(7);
+    std::vector<float> weights {0.5, 0.0, 2.0, 1.0, 0.5};
+    microscopes::kernels::lda_crp_mh::alias_table alias;
+    alias.build(weights);
+    MICROSCOPES_CHECK(std::abs(alias.total() - 4.0) < 1e-5, "alias total is wrong");
+    std::vector<size_t> counts(weights.size(), 0);
+    const size_t n = 100000;
+    for(size_t i = 0; i < n; ++i){
+        counts[alias.sample(r)]++;
+    }
+    MICROSCOPES_CHECK(counts[1] == 0, "zero weight entry was drawn");
+    for(size_t i = 0; i < weights.size(); ++i){
+        float expected = weights[i] / alias.total();
+        MICROSCOPES_CHECK(std::abs(float(counts[i]) / n - expected) < 0.01, "alias draws off");
+    }
+}
+
+static void
+test_mh_sweeps(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    for(auto layout: {lda::sparse_layout, lda::word_major_layout}){
+        rng_t r(42);
+        lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+        microscopes::kernels::lda_crp_mh::proposal_cache cache;
+        for(unsigned i = 0; i < 20; ++i){
+            microscopes::kernels::lda_crp_mh_gibbs(state, cache, r);
+        }
+        check_statistics(state);
+        std::cout << "mh perplexity: " << state.perplexity() << std::endl;
+    }
+}
+
+static void
+test_sparse_sweeps(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    for(auto layout: {lda::sparse_layout, lda::sparse_word_major_layout}){
+        rng_t r(42);
+        lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+        for(unsigned i = 0; i < 20; ++i){
+            microscopes::kernels::lda_crp_sparse_gibbs(state, r);
+        }
+        check_statistics(state);
+        std::cout << "sparse perplexity: " << state.perplexity() << std::endl;
+    }
+}
+
 int main(void){
     test_random_sequences();
     std::cout << "test_random_sequences passed" << std::endl;
     test_explicit_initializtion();
     std::cout << "test_explicit_initializtion passed" << std::endl;
+    test_parallel_sweeps();
+    std::cout << "test_parallel_sweeps passed" << std::endl;
+    test_parallel_slots();
+    std::cout << "test_parallel_slots passed" << std::endl;
+    test_shard_dish_reuse();
+    std::cout << "test_shard_dish_reuse passed" << std::endl;
+    test_alias_table();
+    std::cout << "test_alias_table passed" << std::endl;
+    test_mh_sweeps();
+    std::cout << "test_mh_sweeps passed" << std::endl;
+    test_sparse_sweeps();
+    std::cout << "test_sparse_sweeps passed" << std::endl;
     return 0;
 }
\ No newline at end of file
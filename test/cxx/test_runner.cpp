@@ -0,0 +1,241 @@
+#include <microscopes/lda/runner.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static const size_t V = 5;
+
+static std::shared_ptr<lda::state>
+make_state(rng_t &r, const lda::corpus &docs){
+    lda::model_definition defn(docs.ndocs(), V);
+    return lda::state::initialize(defn, 0.5, 0.1, 0.5, 3, docs, r, lda::sparse_layout);
+}
+
+static std::shared_ptr<lda::state>
+make_state(rng_t &r){
+    return make_state(r, lda::corpus(data::random_docs));
+}
+
+static std::vector<lda::kernel_config>
+schedule(){
+    return {
+        lda::kernel_config(lda::crf_kernel),
+        lda::kernel_config(lda::base_dp_hp_kernel, 5, 0.1, 2),
+        lda::kernel_config(lda::second_dp_hp_kernel, 5, 0.1, 3),
+        lda::kernel_config(lda::vocab_hp_kernel),
+    };
+}
+
+static void
+check_same_state(const lda::state &s1, const lda::state &s2){
+    MICROSCOPES_CHECK(s1.alpha_ == s2.alpha_ && s1.beta_ == s2.beta_ && s1.gamma_ == s2.gamma_,
+        "hyperparameters differ");
+    MICROSCOPES_CHECK(s1.table_assignments() == s2.table_assignments(), "table assignments differ");
+    MICROSCOPES_CHECK(s1.dish_assignments() == s2.dish_assignments(), "dish assignments differ");
+}
+
+// The runner has to do exactly what calling the kernels in order does
+static void
+test_schedule(){
+    // Without niters, sample_beta gets the same iteration limit as from Python
+    MICROSCOPES_CHECK(schedule()[3].niters == 1000 && schedule()[0].niters == 10,
+        "wrong default niters");
+    rng_t r1(73), r2(73);
+    auto s1 = make_state(r1);
+    auto s2 = make_state(r2);
+    lda::runner runner(s1, schedule());
+    MICROSCOPES_CHECK(runner.run(r1, 4) == 4, "run stopped early");
+    MICROSCOPES_CHECK(runner.iteration() == 4, "wrong iteration count");
+
+    using namespace microscopes::kernels;
+    for(size_t i = 0; i < 4; ++i){
+        lda_crp_gibbs(*s2, r2);
+        for(size_t j = 0; j < 2; ++j){
+            lda_hyperparameters::sample_gamma(*s2, r2, 5, 0.1);
+        }
+        for(size_t j = 0; j < 3; ++j){
+            lda_hyperparameters::sample_alpha(*s2, r2, 5, 0.1);
+        }
+        MICROSCOPES_CHECK(lda_hyperparameters::sample_beta(*s2, 5, 0.1, 1000),
+            "sample_beta did not converge");
+    }
+    check_same_state(*s1, *s2);
+
+    MICROSCOPES_CHECK(lda::kernel_from_name("crf_alias") == lda::crf_alias_kernel, "wrong kernel");
+    MICROSCOPES_CHECK(lda::kernel_from_name("crf_block") == lda::crf_block_kernel, "wrong kernel");
+    MICROSCOPES_CHECK(lda::kernel_from_name("direct_vocab_hp") == lda::vocab_hp_kernel, "wrong kernel");
+
+    // The blocked kernel passes its block size and threads through
+    lda::runner block_runner(s1, {lda::kernel_config(lda::crf_block_kernel, 5, 0.1, 10, 2, 8)});
+    block_runner.run(r1, 3);
+    for(size_t i = 0; i < 3; ++i){
+        lda_crp_block_gibbs(*s2, r2, 8, 2);
+    }
+    check_same_state(*s1, *s2);
+}
+
+static void
+test_monitor(){
+    rng_t r(12);
+    auto s = make_state(r);
+    lda::runner runner(s, {lda::kernel_config(lda::crf_kernel)});
+    runner.trace_perplexity(true);
+    std::vector<size_t> calls;
+    runner.set_monitor(3, [&](size_t iteration, const lda::state &latent){
+        MICROSCOPES_CHECK(&latent == s.get(), "monitor sees another state");
+        calls.push_back(iteration);
+        return iteration < 6;
+    });
+    MICROSCOPES_CHECK(runner.run(r, 10) == 6, "monitor did not stop the run");
+    MICROSCOPES_CHECK((calls == std::vector<size_t> {3, 6}), "wrong monitor calls");
+    const auto &trace = runner.perplexity_trace();
+    MICROSCOPES_CHECK(trace.size() == 2 && trace[1].first == 6, "wrong perplexity trace");
+    MICROSCOPES_CHECK(trace[1].second == s->perplexity(), "traced perplexity differs");
+
+    // Iterations carry on from where the last run stopped
+    MICROSCOPES_CHECK(runner.run(r, 2) == 2 && runner.iteration() == 8, "wrong iteration count");
+    MICROSCOPES_CHECK(calls.size() == 2, "monitor called off cadence");
+}
+
+static void
+test_checkpoint(){
+    rng_t r(5);
+    auto s = make_state(r);
+    const std::string path = "test_runner.ckpt";
+    std::remove(path.c_str());
+    lda::runner runner(s, {lda::kernel_config(lda::crf_kernel)});
+    runner.set_checkpoint(2, path);
+    runner.run(r, 3);
+    // Written after iteration 2, not 3
+    auto restored = lda::state::load_checkpoint(path);
+    runner.run(r, 1);
+    auto latest = lda::state::load_checkpoint(path);
+    check_same_state(*s, *latest);
+    MICROSCOPES_CHECK(restored->table_assignments() != latest->table_assignments()
+        || restored->dish_assignments() != latest->dish_assignments(),
+        "checkpoint not rewritten");
+    std::remove(path.c_str());
+}
+
+static void
+test_average(){
+    rng_t r(9);
+    auto s = make_state(r);
+    lda::runner runner(s, {lda::kernel_config(lda::crf_kernel)});
+    auto average = std::make_shared<lda::posterior_average>(1, 2);
+    runner.set_average(average);
+    runner.run(r, 5);
+    MICROSCOPES_CHECK(average->nupdates() == 5 && average->nsamples() == 2, "average not fed");
+    runner.set_average(nullptr);
+    runner.run(r, 1);
+    MICROSCOPES_CHECK(average->nupdates() == 5, "average fed after removal");
+}
+
+// Runners of different states do not interfere
+static void
+test_concurrent(){
+    const size_t n = 4;
+    std::vector<std::shared_ptr<lda::state>> states, expected;
+    std::vector<rng_t> rngs;
+    for(size_t i = 0; i < n; ++i){
+        rng_t r1(100 + i), r2(100 + i);
+        states.push_back(make_state(r1));
+        expected.push_back(make_state(r2));
+        lda::runner(expected.back(), schedule()).run(r2, 3);
+        rngs.push_back(r1);
+    }
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < n; ++i){
+        threads.emplace_back([&, i](){
+            lda::runner(states[i], schedule()).run(rngs[i], 3);
+        });
+    }
+    for(auto &t: threads){
+        t.join();
+    }
+    for(size_t i = 0; i < n; ++i){
+        check_same_state(*states[i], *expected[i]);
+    }
+}
+
+// Chains run as they would on their own, whatever the number of threads
+static void
+test_multi_runner(){
+    const size_t n = 3;
+    const lda::corpus docs(data::random_docs);
+    for(size_t nthreads: {1, 2, 0}){
+        std::vector<std::shared_ptr<lda::state>> states;
+        std::vector<rng_t> rngs;
+        for(size_t i = 0; i < n; ++i){
+            rngs.emplace_back(200 + i);
+            states.push_back(make_state(rngs.back(), docs));
+        }
+        lda::multi_runner chains(states, schedule());
+        MICROSCOPES_CHECK(chains.shares_corpus(), "chains copied the corpus");
+        chains.set_trace(2);
+        chains.run(rngs, 4, nthreads);
+
+        for(size_t i = 0; i < n; ++i){
+            rng_t r(200 + i);
+            auto expected = make_state(r, docs);
+            lda::runner(expected, schedule()).run(r, 4);
+            check_same_state(*states[i], *expected);
+
+            const auto &trace = chains.trace(i);
+            MICROSCOPES_CHECK(trace.size() == 2 && trace[0].iteration == 2 && trace[1].iteration == 4,
+                "wrong trace");
+            const auto now = chains.diagnostics()[i];
+            MICROSCOPES_CHECK(now.iteration == 4 && now.ntopics == states[i]->ntopics() &&
+                now.ntables == size_t(states[i]->ntables()) && now.beta == states[i]->beta_,
+                "wrong diagnostics");
+            MICROSCOPES_CHECK(now.perplexity == trace[1].perplexity, "trace and diagnostics differ");
+        }
+    }
+
+    std::vector<std::shared_ptr<lda::state>> copies;
+    for(size_t i = 0; i < 2; ++i){
+        rng_t r(i);
+        copies.push_back(make_state(r));
+    }
+    MICROSCOPES_CHECK(!lda::multi_runner(copies, schedule()).shares_corpus(),
+        "separate corpora reported as shared");
+}
+
+static void
+test_potential_scale_reduction(){
+    // Identical chains have no between-chain variance
+    const std::vector<double> a {1, 2, 3, 4};
+    const double same = lda::multi_runner::potential_scale_reduction({a, a, a});
+    MICROSCOPES_CHECK(std::abs(same - std::sqrt(0.75)) < 1e-12, "wrong R-hat for identical chains");
+    // W = 5/3, B = 4 * 8 = 32: sqrt((3/4 W + B/4) / W)
+    const double apart = lda::multi_runner::potential_scale_reduction({a, {5, 6, 7, 8}});
+    MICROSCOPES_CHECK(std::abs(apart - std::sqrt((1.25 + 8) / (5.0 / 3))) < 1e-12,
+        "wrong R-hat for separated chains");
+}
+
+int main(void){
+    test_schedule();
+    std::cout << "test_schedule passed" << std::endl;
+    test_monitor();
+    std::cout << "test_monitor passed" << std::endl;
+    test_checkpoint();
+    std::cout << "test_checkpoint passed" << std::endl;
+    test_average();
+    std::cout << "test_average passed" << std::endl;
+    test_concurrent();
+    std::cout << "test_concurrent passed" << std::endl;
+    test_multi_runner();
+    std::cout << "test_multi_runner passed" << std::endl;
+    test_potential_scale_reduction();
+    std::cout << "test_potential_scale_reduction passed" << std::endl;
+    return 0;
+}
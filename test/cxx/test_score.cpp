@@ -0,0 +1,117 @@
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+// The CRF prior of the seating, from scratch. Tables are counted as in
+// m_k, which includes the dish of each document's table 0
+static double
+reference_score_assignment(const lda::state &state){
+    double score = 0;
+    size_t M = 0;
+    for(auto k: state.dishes())
+        if(k != 0)
+            M += state.m_k[k];
+    score += M * std::log(state.alpha_);
+    for(size_t eid = 0; eid < state.nentities(); ++eid){
+        const double n_j = state.nterms(eid);
+        for(auto t: state.tables(eid))
+            if(state.tablesize(eid, t) > 0)
+                score += std::lgamma(double(state.tablesize(eid, t)));
+        score += std::lgamma(state.alpha_) - std::lgamma(state.alpha_ + n_j);
+    }
+    const double K = state.ntopics();
+    score += K * std::log(state.gamma_) + std::lgamma(state.gamma_) - std::lgamma(state.gamma_ + M);
+    for(auto k: state.dishes())
+        if(k != 0)
+            score += std::lgamma(double(state.m_k[k]));
+    return score;
+}
+
+// The Dirichlet-multinomial likelihood of the words, from scratch
+static double
+reference_score_data(const lda::state &state){
+    const double beta = state.beta_, V = state.nwords();
+    double score = 0;
+    for(auto k: state.dishes()){
+        if(k == 0)
+            continue;
+        double n_k = 0;
+        for(size_t v = 0; v < state.nwords(); ++v){
+            const double c = state.n_kv.get(k, v);
+            score += std::lgamma(c + beta) - std::lgamma(beta);
+            n_k += c;
+        }
+        score += std::lgamma(V * beta) - std::lgamma(V * beta + n_k);
+    }
+    return score;
+}
+
+static void
+check_scores(lda::state &state, rng_t &r, const char *after){
+    const double a = state.score_assignment(), ea = reference_score_assignment(state);
+    const double d = state.score_data(r), ed = reference_score_data(state);
+    if(std::abs(a - ea) > 1e-4 * std::abs(ea) || std::abs(d - ed) > 1e-4 * std::abs(ed)){
+        std::cout << after << ": score_assignment " << a << " (expected " << ea << "), score_data "
+                  << d << " (expected " << ed << ")" << std::endl;
+        MICROSCOPES_CHECK(false, "running scores are off");
+    }
+}
+
+static void
+test_scores(lda::count_layout layout){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    // Words are only seated by the first sweep
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+
+    microscopes::kernels::lda_crp::workspace ws;
+    microscopes::kernels::lda_crp_mh::proposal_cache cache;
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, ws, r);
+        check_scores(state, r, "lda_crp_gibbs");
+        microscopes::kernels::lda_crp_gibbs(state, r, 3);
+        check_scores(state, r, "parallel lda_crp_gibbs");
+        microscopes::kernels::lda_crp_mh_gibbs(state, cache, r);
+        check_scores(state, r, "lda_crp_mh_gibbs");
+    }
+    if(layout == lda::sparse_word_major_layout){
+        for(unsigned i = 0; i < 5; ++i){
+            microscopes::kernels::lda_crp_sparse_gibbs(state, r);
+            check_scores(state, r, "lda_crp_sparse_gibbs");
+        }
+    }
+
+    // New hyperparameters invalidate the cached sums
+    state.alpha_ = 1.5;
+    state.beta_ = 0.3;
+    state.gamma_ = 2.0;
+    check_scores(state, r, "new hyperparameters");
+    microscopes::kernels::lda_crp_gibbs(state, ws, r);
+    check_scores(state, r, "sweep after new hyperparameters");
+
+    // Explicit seating, as when deserializing
+    lda::state copy(defn, state.alpha_, state.beta_, state.gamma_,
+        state.dish_assignments(), state.table_assignments(), docs, layout);
+    MICROSCOPES_CHECK(std::abs(copy.score_assignment() - state.score_assignment()) < 1e-3, "copy differs");
+    MICROSCOPES_CHECK(std::abs(copy.score_data(r) - state.score_data(r)) < 1e-3, "copy differs");
+}
+
+int main(void){
+    for(auto layout: {lda::sparse_layout, lda::topic_major_layout,
+                      lda::word_major_layout, lda::sparse_word_major_layout}){
+        test_scores(layout);
+    }
+    std::cout << "test_scores passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include <microscopes/lda/snapshot.hpp>
+#include <microscopes/lda/average.hpp>
+#include <microscopes/lda/inference.hpp>
+#include <microscopes/lda/kernels.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/random_fwd.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <map>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::common;
+
+static bool
+assertAlmostEqual(double a, double b){
+    return std::abs(a - b) <= 1e-6 * std::max(1.0, std::abs(b));
+}
+
+static void
+test_snapshot_matches_state(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    auto snap = state.snapshot();
+    MICROSCOPES_CHECK(snap->ntopics() == state.ntopics(), "wrong number of topics");
+    MICROSCOPES_CHECK(snap->nwords() == V, "wrong number of words");
+    MICROSCOPES_CHECK(snap->ndocs() == docs.size(), "wrong number of documents");
+    MICROSCOPES_CHECK(snap->phi_stride() % lda::snapshot::row_align == 0, "phi stride not padded");
+    MICROSCOPES_CHECK(snap->theta_stride() % lda::snapshot::row_align == 0, "theta stride not padded");
+    for(size_t v = 0; v < V; ++v){
+        MICROSCOPES_CHECK(reinterpret_cast<uintptr_t>(snap->phi(v)) % 64 == 0, "phi row not aligned");
+        for(size_t i = 0; i < snap->ntopics(); ++i){
+            const size_t k = snap->dishes()[i];
+            MICROSCOPES_CHECK(assertAlmostEqual(snap->phi(v)[i],
+                state.num_words_at_dish(k, v) / state.num_words_at_dish(k)), "phi is wrong");
+        }
+    }
+
+    // theta follows the tables of each document and the dish prior
+    double sum_m_k = state.gamma_;
+    for(auto k: snap->dishes())
+        sum_m_k += state.m_k[k];
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        MICROSCOPES_CHECK(reinterpret_cast<uintptr_t>(snap->theta(eid)) % 64 == 0, "theta row not aligned");
+        const double total = docs[eid].size() + state.alpha_;
+        MICROSCOPES_CHECK(assertAlmostEqual(snap->new_dish(eid),
+            state.alpha_ * state.gamma_ / sum_m_k / total), "new dish weight is wrong");
+        double sum = 0;
+        for(size_t i = 0; i < snap->ntopics(); ++i){
+            const size_t k = snap->dishes()[i];
+            double p = state.alpha_ * state.m_k[k] / sum_m_k;
+            for(auto t: state.tables(eid))
+                if(t != 0 && state.dish_assignment(eid, t) == k)
+                    p += state.tablesize(eid, t);
+            MICROSCOPES_CHECK(assertAlmostEqual((1 - snap->new_dish(eid)) * snap->theta(eid)[i], p / total),
+                "theta is wrong");
+            sum += snap->theta(eid)[i];
+        }
+        MICROSCOPES_CHECK(assertAlmostEqual(sum, 1), "theta does not sum to one");
+    }
+
+    // Sampling goes on without touching the snapshot
+    std::vector<float> phi0(snap->phi(0), snap->phi(0) + snap->ntopics());
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    for(size_t i = 0; i < phi0.size(); ++i){
+        MICROSCOPES_CHECK(snap->phi(0)[i] == phi0[i], "snapshot changed with the state");
+    }
+}
+
+static void
+test_shared_inference(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(7);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    for(unsigned i = 0; i < 10; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+
+    auto snap = state.snapshot();
+    lda::inference a(snap, 0.1), b(snap, 0.1);
+    lda::inference c(state, 0.1);
+    MICROSCOPES_CHECK(a.model() == b.model(), "snapshot is not shared");
+    lda::inference::workspace ws;
+    std::vector<float> ta(a.ntopics()), tb(b.ntopics()), tc(c.ntopics());
+    for(auto &doc: docs){
+        lda::corpus one(std::vector<std::vector<size_t>>{doc});
+        a.predict(one.doc(0), ta.data(), 20, 1e-6, ws);
+        b.predict(one.doc(0), tb.data(), 20, 1e-6, ws);
+        c.predict(one.doc(0), tc.data(), 20, 1e-6, ws);
+        MICROSCOPES_CHECK(ta == tb && ta == tc, "inference differs between snapshots");
+    }
+}
+
+static void
+test_seating(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    lda::model_definition defn(docs.size(), 5);
+    rng_t r(3);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    const auto seating = state.seating();
+    const auto words = state.assignments();
+    const auto tables = state.table_assignments();
+    const auto &dishes = state.dish_assignments();
+    MICROSCOPES_CHECK(seating->token_offsets.size() == docs.size() + 1 &&
+        seating->table_offsets.size() == docs.size() + 1, "wrong number of offsets");
+    for(size_t eid = 0; eid < docs.size(); ++eid){
+        const size_t first = seating->token_offsets[eid];
+        MICROSCOPES_CHECK(seating->token_offsets[eid + 1] - first == docs[eid].size(), "wrong token offsets");
+        for(size_t i = 0; i < docs[eid].size(); ++i){
+            MICROSCOPES_CHECK(seating->tables[first + i] == tables[eid][i], "wrong table");
+            MICROSCOPES_CHECK(seating->dishes[first + i] == words[eid][i], "wrong dish");
+        }
+        const size_t t0 = seating->table_offsets[eid];
+        MICROSCOPES_CHECK(seating->table_offsets[eid + 1] - t0 == dishes[eid].size(), "wrong table offsets");
+        for(size_t t = 0; t < dishes[eid].size(); ++t)
+            MICROSCOPES_CHECK(seating->table_dishes[t0 + t] == dishes[eid][t], "wrong table dish");
+    }
+}
+
+static void
+test_term_relevance(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    // Word 5 never occurs
+    const size_t V = 6;
+    lda::model_definition defn(docs.size(), V);
+    rng_t r(21);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    for(unsigned i = 0; i < 5; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r);
+    }
+    std::vector<size_t> tf(V, 0);
+    size_t ntokens = 0;
+    for(auto &doc: docs){
+        for(auto v: doc)
+            ++tf[v];
+        ntokens += doc.size();
+    }
+    MICROSCOPES_CHECK(state.term_frequency() == tf, "wrong term frequencies");
+
+    auto snap = state.snapshot();
+    for(float weight: {0.0f, 0.6f, 1.0f}){
+        const auto top = state.term_relevance(weight, 3);
+        const auto all = state.term_relevance(weight, 100, 3);
+        MICROSCOPES_CHECK(top.size() == snap->ntopics() && all.size() == snap->ntopics(), "wrong number of topics");
+        for(size_t i = 0; i < snap->ntopics(); ++i){
+            MICROSCOPES_CHECK(top[i].size() == 3 && all[i].size() == V, "wrong number of words");
+            MICROSCOPES_CHECK(std::equal(top[i].begin(), top[i].end(), all[i].begin()),
+                "top words differ from the full ranking");
+            for(size_t j = 0; j < V; ++j){
+                const size_t v = all[i][j].first;
+                const double phi = snap->phi(v)[i];
+                double expected = std::log(phi);
+                if(weight < 1)
+                    expected = !tf[v] ? -INFINITY :
+                        weight * std::log(phi) + (1 - weight) * std::log(phi * ntokens / tf[v]);
+                MICROSCOPES_CHECK(std::isinf(expected) ? all[i][j].second == expected :
+                    std::abs(all[i][j].second - expected) < 1e-4, "wrong relevance");
+                MICROSCOPES_CHECK(j == 0 || all[i][j - 1].second >= all[i][j].second, "not sorted");
+            }
+        }
+    }
+}
+
+// Snapshots of the samples, summed by dish id
+struct snapshot_sums {
+    size_t n = 0;
+    std::map<size_t, std::vector<double>> phi;
+    std::map<size_t, size_t> phi_samples;
+    std::map<size_t, std::vector<double>> theta;
+
+    void add(const lda::snapshot &snap){
+        ++n;
+        for(size_t i = 0; i < snap.ntopics(); ++i){
+            const size_t k = snap.dishes()[i];
+            auto &phi_k = phi[k];
+            phi_k.resize(snap.nwords());
+            for(size_t v = 0; v < snap.nwords(); ++v)
+                phi_k[v] += snap.phi(v)[i];
+            ++phi_samples[k];
+            auto &theta_k = theta[k];
+            theta_k.resize(snap.ndocs());
+            for(size_t eid = 0; eid < snap.ndocs(); ++eid)
+                theta_k[eid] += snap.theta(eid)[i];
+        }
+    }
+};
+
+static void
+check_average(const lda::posterior_average &avg, const snapshot_sums &sums){
+    MICROSCOPES_CHECK(avg.nsamples() == sums.n, "wrong number of samples");
+    MICROSCOPES_CHECK(avg.ntopics() == sums.phi.size(), "wrong number of topics");
+    const size_t K = avg.ntopics(), V = avg.nwords(), D = avg.ndocs();
+    std::vector<float> phi(K * V), theta(D * K);
+    avg.phi(phi.data());
+    avg.theta(theta.data());
+    for(size_t i = 0; i < K; ++i){
+        const size_t k = avg.dishes()[i];
+        MICROSCOPES_CHECK(sums.phi.count(k), "topic never sampled");
+        for(size_t v = 0; v < V; ++v)
+            MICROSCOPES_CHECK(assertAlmostEqual(phi[i * V + v],
+                sums.phi.at(k)[v] / sums.phi_samples.at(k)), "average phi is wrong");
+        for(size_t eid = 0; eid < D; ++eid)
+            MICROSCOPES_CHECK(std::abs(theta[eid * K + i] - sums.theta.at(k)[eid] / sums.n) < 1e-5,
+                "average theta is wrong");
+    }
+}
+
+static void
+test_posterior_average(){
+    const lda::corpus docs(data::random_docs);
+    size_t V = 5;
+    lda::model_definition defn(docs.ndocs(), V);
+    for(auto layout: {lda::sparse_layout, lda::topic_major_layout}){
+        rng_t r(11);
+        lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+        lda::posterior_average every, thinned(2, 3), pruned(0, 1, 0.05);
+        snapshot_sums all, some;
+        // The first sample still has the words at table 0, so documents
+        // change length after it
+        every.add(state);
+        pruned.add(state);
+        all.add(*state.snapshot());
+        for(size_t i = 1; i <= 12; ++i){
+            microscopes::kernels::lda_crp_gibbs(state, r);
+            microscopes::kernels::lda_hyperparameters::sample_alpha(state, r, 5, 0.1);
+            every.add(state);
+            pruned.add(state);
+            all.add(*state.snapshot());
+            MICROSCOPES_CHECK(thinned.update(state) == (i == 5 || i == 8 || i == 11),
+                "wrong samples kept");
+            if(thinned.nsamples() > some.n)
+                some.add(*state.snapshot());
+        }
+        MICROSCOPES_CHECK(thinned.nupdates() == 12 && thinned.nsamples() == 3, "wrong sample counts");
+        check_average(every, all);
+        check_average(thinned, some);
+
+        // Pruning keeps fewer entries and only loses small ones
+        MICROSCOPES_CHECK(pruned.nentries() < every.nentries(), "nothing pruned");
+        const size_t K = every.ntopics(), D = every.ndocs();
+        std::vector<float> exact(D * K), approx(D * K);
+        every.theta(exact.data());
+        pruned.theta(approx.data());
+        for(size_t j = 0; j < D * K; ++j)
+            MICROSCOPES_CHECK(approx[j] <= exact[j] + 1e-6 && approx[j] > exact[j] - 0.05 - 1e-6,
+                "pruned theta is off");
+
+        every.reset();
+        MICROSCOPES_CHECK(every.nsamples() == 0 && every.ntopics() == 0, "reset kept samples");
+        every.add(state);
+        MICROSCOPES_CHECK(every.nsamples() == 1, "wrong number of samples");
+    }
+}
+
+int main(void){
+    test_snapshot_matches_state();
+    std::cout << "test_snapshot_matches_state passed" << std::endl;
+    test_shared_inference();
+    std::cout << "test_shared_inference passed" << std::endl;
+    test_seating();
+    std::cout << "test_seating passed" << std::endl;
+    test_term_relevance();
+    std::cout << "test_term_relevance passed" << std::endl;
+    test_posterior_average();
+    std::cout << "test_posterior_average passed" << std::endl;
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <microscopes/models/distributions.hpp>
 #include <microscopes/common/random_fwd.hpp>
 
+#include <map>
 #include <random>
 #include <iostream>
 
@@ -41,16 +42,28 @@ bool assertSequenceEqual(const vector<T> &v1, const vector<T> &v2){
 
 }
 
+// Dish posteriors are laid out in the iteration order of dishes(),
+// which is not sorted by id
+static size_t
+dish_pos(const lda::state &state, size_t k){
+    const auto &dishes = state.dishes();
+    return std::find(dishes.begin(), dishes.end(), k) - dishes.begin();
+}
+
+static const lda::count_layout layouts[] = {
+    lda::sparse_layout, lda::topic_major_layout, lda::word_major_layout,
+    lda::sparse_word_major_layout};
+
 // These tests are ported from
 // https://github.com/shuyo/iir/blob/a6203a7523970a4807beba1ce3b9048a16013246/lda/test_hdplda2.py
 
 static void
-sequence4(double alpha, double beta, double gamma){
+sequence4(double alpha, double beta, double gamma, lda::count_layout layout){
     rng_t r(5849343);
     std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}};
     size_t V = 7;
     lda::model_definition defn(3, V);
-    lda::state state(defn, alpha, beta, gamma, 1, docs, r);
+    lda::state state(defn, alpha, beta, gamma, 1, docs, r, layout);
     auto Vbeta = V*beta;
     size_t k1 = state.create_dish();
     size_t k2 = state.create_dish();
@@ -111,9 +124,9 @@ sequence4(double alpha, double beta, double gamma){
     float p0 = gamma / V;
     float p1 = 1 * beta / (V * beta + 1);
     float p2 = 4 * (beta + 2) / (Vbeta + 10);
-    MICROSCOPES_CHECK(assertAlmostEqual(p_k[0], p0 / (p0 + p1 + p2)), "p_k[0] is wrong in section 3");
-    MICROSCOPES_CHECK(assertAlmostEqual(p_k[1], p1 / (p0 + p1 + p2)), "p_k[1] is wrong in section 3");
-    MICROSCOPES_CHECK(assertAlmostEqual(p_k[2], p2 / (p0 + p1 + p2)), "p_k[2] is wrong in section 3");
+    MICROSCOPES_CHECK(assertAlmostEqual(p_k[dish_pos(state, 0)], p0 / (p0 + p1 + p2)), "p_k[0] is wrong in section 3");
+    MICROSCOPES_CHECK(assertAlmostEqual(p_k[dish_pos(state, 1)], p1 / (p0 + p1 + p2)), "p_k[1] is wrong in section 3");
+    MICROSCOPES_CHECK(assertAlmostEqual(p_k[dish_pos(state, 2)], p2 / (p0 + p1 + p2)), "p_k[2] is wrong in section 3");
 
     state.seat_at_dish(j, t, 1);
 
@@ -125,19 +138,19 @@ sequence4(double alpha, double beta, double gamma){
     p0 = gamma * beta * beta * beta / (Vbeta * (Vbeta + 1) * (Vbeta + 2));
     p1 = 2 * (beta + 0) * beta * beta / ((Vbeta + 2) * (Vbeta + 3) * (Vbeta + 4));
     p2 = 3 * (beta + 2) * beta * beta / ((Vbeta + 7) * (Vbeta + 8) * (Vbeta + 9));
-    MICROSCOPES_CHECK(assertAlmostEqual(p_k[0], p0 / (p0 + p1 + p2)), "p_k[0] is wrong in section 4");
-    MICROSCOPES_CHECK(assertAlmostEqual(p_k[1], p1 / (p0 + p1 + p2)), "p_k[1] is wrong in section 4");
-    MICROSCOPES_CHECK(assertAlmostEqual(p_k[2], p2 / (p0 + p1 + p2)), "p_k[2] is wrong in section 4");
+    MICROSCOPES_CHECK(assertAlmostEqual(p_k[dish_pos(state, 0)], p0 / (p0 + p1 + p2)), "p_k[0] is wrong in section 4");
+    MICROSCOPES_CHECK(assertAlmostEqual(p_k[dish_pos(state, 1)], p1 / (p0 + p1 + p2)), "p_k[1] is wrong in section 4");
+    MICROSCOPES_CHECK(assertAlmostEqual(p_k[dish_pos(state, 2)], p2 / (p0 + p1 + p2)), "p_k[2] is wrong in section 4");
 
 }
 
 static void
-sequence3(double alpha, double beta, double gamma){
+sequence3(double alpha, double beta, double gamma, lda::count_layout layout){
     rng_t r(5849343);
     std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}};
     size_t V = 7;
     lda::model_definition defn(3, V);
-    lda::state state(defn, alpha, beta, gamma, 1, docs, r);
+    lda::state state(defn, alpha, beta, gamma, 1, docs, r, layout);
 
     size_t k1 = state.create_dish();
     size_t k2 = state.create_dish();
@@ -247,12 +260,12 @@ sequence3(double alpha, double beta, double gamma){
 }
 
 static void
-sequence2(double alpha, double beta, double gamma){
+sequence2(double alpha, double beta, double gamma, lda::count_layout layout){
     rng_t r(5849343);
     std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}};
     size_t V = 7;
     lda::model_definition defn(3, V);
-    lda::state state(defn, alpha, beta, gamma, 1, docs, r);
+    lda::state state(defn, alpha, beta, gamma, 1, docs, r, layout);
 
     // assign all words to table 1 and all tables to dish 1
     size_t k_new = state.create_dish();
@@ -264,23 +277,23 @@ sequence2(double alpha, double beta, double gamma){
             state.add_table(j, t_new, i);
         }
     }
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_k.get(0), beta*V),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(0), beta*V),
         "n_k[0] is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_k.get(1), beta*V+12),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1), beta*V+12),
         "n_k[1] is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(0), beta + 3),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 0), beta + 3),
         "n_kv[1].get(0) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(1), beta + 3),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 1), beta + 3),
         "n_kv[1].get(1) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(2), beta + 1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 2), beta + 1),
         "n_kv[1].get(2) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(3), beta + 1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 3), beta + 1),
         "n_kv[1].get(3) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(4), beta + 1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 4), beta + 1),
         "n_kv[1].get(4) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(5), beta + 2),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 5), beta + 2),
         "n_kv[1].get(5) is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[1].get(6), beta + 1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(1, 6), beta + 1),
         "n_kv[1].get(6) is wrong");
 
     state.leave_from_dish(0, 1); // decreate m and m_k only
@@ -294,12 +307,12 @@ sequence2(double alpha, double beta, double gamma){
 
 
 static void
-sequence1(double alpha, double beta, double gamma){
+sequence1(double alpha, double beta, double gamma, lda::count_layout layout){
     rng_t r(5849343);
     size_t V = 7;
     std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4,5}, {0,1,5,6}};
     lda::model_definition defn(3, 7);
-    lda::state state(defn, alpha, beta, gamma, 1, docs, r);
+    lda::state state(defn, alpha, beta, gamma, 1, docs, r, layout);
 
     // Section 1
     size_t j = 0;
@@ -323,10 +336,10 @@ sequence1(double alpha, double beta, double gamma){
     MICROSCOPES_CHECK(state.dish_assignments_[j][t_new] == 1, "incorrectly created new table");
 
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.using_t[j], std::vector<size_t> {0, 1}),
+        assertSequenceEqual(state.tables(j), std::vector<size_t> {0, 1}),
         "using_t[j] wrong after sitting at table");
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.dishes_, std::vector<size_t> {0, 1}),
+        assertSequenceEqual(state.dishes(), std::vector<size_t> {0, 1}),
         "dishes_ wrong after sitting at table");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 0,
         "n_jt[j][t_new] wrong after sitting at table");
@@ -336,7 +349,7 @@ sequence1(double alpha, double beta, double gamma){
         "table_assignments()[j][i] wrng after sitting at table");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 1,
         "n_jt[j][t_new] wrong after sitting at table");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(k_new, v), beta+1),
         "n_kv[k_new].get(v) wrong after sitting at table");
 
     // Section 2
@@ -362,7 +375,7 @@ sequence1(double alpha, double beta, double gamma){
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == t_new, "state.table_assignments()[j][i] notset to t_new");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 2, "state.n_jt[j][t_new] incremented");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(k_new, v), beta+1),
         "n_kv[k_new].get(v) correct");
 
     // Section 4
@@ -401,16 +414,16 @@ sequence1(double alpha, double beta, double gamma){
     MICROSCOPES_CHECK(k_new == state.dish_assignments_[j][t_new], "k_new wrong in section 5");
 
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.using_t[j], std::vector<size_t> {0, 1, 2}),
+        assertSequenceEqual(state.tables(j), std::vector<size_t> {0, 1, 2}),
         "using_t[j] wrong after sitting at table in section 5");
     MICROSCOPES_CHECK(
-        assertSequenceEqual(state.dishes_, std::vector<size_t> {0, 1}),
+        assertSequenceEqual(state.dishes(), std::vector<size_t> {0, 1}),
         "dishes_ wrong after sitting at table");
 
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == t_new, "table_assignments() wrong in section 5");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 1, "n_jt wrong in section 5");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(k_new, v), beta+1),
         "n_kv[k_new].get(v) wrong in section 5");
 
     // Section 6
@@ -440,7 +453,7 @@ sequence1(double alpha, double beta, double gamma){
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == t_new, "t_new is wrong");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 3, "n_jt[j][t_new] is wrong");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta + 1),
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(k_new, v), beta + 1),
         "n_kv[k_new].get(v) isn't beta + 1");
 
 
@@ -463,48 +476,448 @@ sequence1(double alpha, double beta, double gamma){
     t_new = state.create_table(j, k_new);
     MICROSCOPES_CHECK(t_new == 1, "create_table failed to set t_new");
 
-    MICROSCOPES_CHECK(assertSequenceEqual(state.using_t[j], std::vector<size_t> {0, 1}),
+    MICROSCOPES_CHECK(assertSequenceEqual(state.tables(j), std::vector<size_t> {0, 1}),
         "using_t[j] set incorrectly");
-    MICROSCOPES_CHECK(assertSequenceEqual(state.dishes_, std::vector<size_t> {0, 1}),
+    MICROSCOPES_CHECK(assertSequenceEqual(state.dishes(), std::vector<size_t> {0, 1}),
         "dishes_ set incorrectly");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 0, "n_jt[j][t_new] set incorrectly");
 
     state.add_table(j, t_new, i);
     MICROSCOPES_CHECK(state.table_assignments()[j][i] == 1, "table_assignments()[j][i] set incorrectly");
     MICROSCOPES_CHECK(state.n_jt[j][t_new] == 1, "n_jt[j][t_new] set incorrectly");
-    MICROSCOPES_CHECK(assertAlmostEqual(state.n_kv[k_new].get(v), beta+2), "n_kv[k_new].get(v)");
+    MICROSCOPES_CHECK(assertAlmostEqual(state.num_words_at_dish(k_new, v), beta+2), "n_kv[k_new].get(v)");
 }
 
 static void
 test1(){
-    sequence1(0.1, 0.1, 0.1);
+    for(auto layout: layouts){
+        sequence1(0.1, 0.1, 0.1, layout);
+    }
 }
 
 static void
 test2(){
-    sequence1(0.2, 0.01, 0.5);
+    for(auto layout: layouts){
+        sequence1(0.2, 0.01, 0.5, layout);
+    }
 }
 
 static void
 test4(){
-    sequence3(0.2, 0.01, 0.5);
+    for(auto layout: layouts){
+        sequence3(0.2, 0.01, 0.5, layout);
+    }
 }
 
 static void
 test5(){
-    sequence4(0.2, 0.01, 0.5);
+    for(auto layout: layouts){
+        sequence4(0.2, 0.01, 0.5, layout);
+    }
 }
 
 static void
 test7(){
-    sequence2(0.01, 0.001, 10);
+    for(auto layout: layouts){
+        sequence2(0.01, 0.001, 10, layout);
+    }
 }
 
 static void
 test8(){
-    sequence2(0.01, 0.001, 0.05);
+    for(auto layout: layouts){
+        sequence2(0.01, 0.001, 0.05, layout);
+    }
+}
+
+
+// The bucketed sampler has to draw from the same posterior as
+// calc_table_posterior followed by calc_dish_posterior_w
+static void
+sequence_buckets(double alpha, double beta, double gamma, lda::count_layout layout){
+    rng_t r(5849343);
+    std::vector< std::vector<size_t>> docs {{0,1,2,3}, {0,1,4}, {0,1,5,6}};
+    size_t V = 7;
+    lda::model_definition defn(3, V);
+    std::vector<std::vector<size_t>> table_assignments = {{1, 2, 1, 2}, {1, 1, 1}, {3, 3, 3, 1}};
+    std::vector<std::vector<size_t>> dish_assignments = {{0, 1, 2}, {0, 3}, {0, 1, 2, 1}};
+    lda::state state(defn, alpha, beta, gamma,
+                     dish_assignments, table_assignments, docs, layout);
+    for(size_t i = 0; i < 2; ++i){
+        state.remove_table(2, i);
+    }
+    size_t v = state.get_word(2, 0);
+
+    std::map<std::pair<size_t, size_t>, float> expected;
+    auto f_k = calc_f_k(state, v, r);
+    auto p_t = calc_table_posterior(state, 2, f_k, r);
+    auto p_k = calc_dish_posterior_w(state, f_k, r);
+    for(size_t p = 1; p < p_t.size(); ++p){
+        auto t = state.using_t[2][p];
+        expected[std::make_pair(t, state.dish_assignment(2, t))] = p_t[p];
+    }
+    for(size_t d = 0; d < p_k.size(); ++d){
+        expected[std::make_pair(0, state.dishes_[d])] = p_t[0] * p_k[d];
+    }
+
+    microscopes::kernels::lda_crp_sparse::buckets buckets;
+    buckets.reset(state);
+    std::map<std::pair<size_t, size_t>, size_t> counts;
+    const size_t n = 200000;
+    for(size_t i = 0; i < n; ++i){
+        counts[microscopes::kernels::lda_crp_sparse::draw(state, buckets, 2, v, r)]++;
+    }
+    for(auto &kv: counts){
+        MICROSCOPES_CHECK(expected.count(kv.first), "bucketed draw outside the posterior's support");
+    }
+    for(auto &kv: expected){
+        float freq = float(counts[kv.first]) / n;
+        MICROSCOPES_CHECK(assertAlmostEqual(freq, kv.second, 0.01), "bucketed draws differ from calc_table_posterior");
+    }
+}
+
+static void
+test9(){
+    for(auto layout: layouts){
+        sequence_buckets(0.2, 0.01, 0.5, layout);
+        sequence_buckets(1.0, 0.5, 2.0, layout);
+    }
+}
+
+// slot_list reuses released ids and keeps the sentinel first
+static void
+test10(){
+    lda::slot_list slots;
+    for(size_t i = 0; i < 5; ++i){
+        MICROSCOPES_CHECK(slots.acquire() == i, "new ids are not consecutive");
+    }
+    slots.release(1);
+    slots.release(3);
+    MICROSCOPES_CHECK(slots.size() == 3 && slots[0] == 0, "sentinel moved");
+    MICROSCOPES_CHECK(!slots.contains(1) && !slots.contains(3) && slots.contains(4), "wrong active ids");
+    MICROSCOPES_CHECK(slots.acquire() == 3, "last released id is not reused first");
+    slots.acquire(1);
+    MICROSCOPES_CHECK(slots.free_ids().empty(), "free list not empty");
+    MICROSCOPES_CHECK(slots.acquire() == 5, "wrong new id");
+    slots.acquire(8);
+    MICROSCOPES_CHECK(slots.nslots() == 9 && slots.free_ids().size() == 2, "skipped ids are not free");
+    slots.release(2);
+    slots.forget_free(12);
+    MICROSCOPES_CHECK(slots.acquire() == 12, "forgotten ids handed out");
+    std::vector<size_t> ids(slots.begin(), slots.end());
+    std::sort(ids.begin(), ids.end());
+    MICROSCOPES_CHECK((ids == std::vector<size_t> {0, 1, 3, 4, 5, 8, 12}), "wrong active ids");
+}
+
+static double
+digamma(double x){
+    double r = 0;
+    for(; x < 20; x += 1){
+        r -= 1 / x;
+    }
+    const double f = 1 / (x * x);
+    return r + std::log(x) - 0.5 / x - f * (1.0 / 12 - f * (1.0 / 120 - f * (1.0 / 252 - f / 240)));
+}
+
+// sample_beta has to stop at a fixed point of Heinrich's update, which
+// sums over every dish and word, zero counts included
+static void
+test11(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    const size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    const float a = 5, b = 0.1;
+    for(auto layout: layouts){
+        rng_t r(3728);
+        lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r, layout);
+        for(size_t i = 0; i < 5; ++i){
+            microscopes::kernels::lda_crp_gibbs(state, r);
+        }
+        MICROSCOPES_CHECK(
+            microscopes::kernels::lda_hyperparameters::sample_beta(state, a, b),
+            "sample_beta did not converge");
+        const double beta = state.beta_;
+        double summk = 0, summ = 0;
+        for(auto k: state.dishes()){
+            if(k == 0)
+                continue;
+            summ += digamma(state.n_k[k] + V * beta) - digamma(V * beta);
+            for(size_t v = 0; v < V; ++v){
+                summk += digamma(state.n_kv.get(k, v) + beta) - digamma(beta);
+            }
+        }
+        const double next = (a - 1 + beta * summk) / (b + V * summ);
+        MICROSCOPES_CHECK(beta > 0 && assertAlmostEqual(next / beta, 1, 1e-3),
+            "beta is not a fixed point");
+    }
 }
 
+// The counts kept up to date by the samplers are those of the seating
+static void
+check_statistics(lda::state &state){
+    const std::vector<size_t> m_k = state.m_k, n_k = state.n_k;
+    std::map<std::pair<size_t, size_t>, size_t> n_kv;
+    state.n_kv.for_each_count([&](size_t k, size_t v, size_t c){
+        if(state.dishes_.contains(k))
+            n_kv[std::make_pair(k, v)] = c;
+    });
+    const auto ntables = state.ntables();
+    const float score = state.score_assignment();
+    state.rebuild_dish_statistics();
+    for(auto k: state.dishes()){
+        MICROSCOPES_CHECK(m_k[k] == state.m_k[k] && n_k[k] == state.n_k[k], "dish counts drifted");
+        for(size_t v = 0; v < state.nwords(); ++v){
+            MICROSCOPES_CHECK(state.n_kv.get(k, v) == n_kv[std::make_pair(k, v)], "word counts drifted");
+        }
+    }
+    MICROSCOPES_CHECK(ntables == state.ntables(), "table count drifted");
+    MICROSCOPES_CHECK(assertAlmostEqual(score, state.score_assignment(), 1e-3), "score drifted");
+    std::vector<size_t> tf(state.nwords(), 0);
+    for(size_t eid = 0; eid < state.nentities(); ++eid){
+        for(auto v: state.get_entity(eid))
+            ++tf[v];
+    }
+    MICROSCOPES_CHECK(tf == state.term_frequency(), "term frequencies drifted");
+}
+
+// Streaming: documents added to a live state are seated by a sweep over
+// them alone, and retired documents leave no counts behind
+static void
+test12(){
+    const std::vector< std::vector<size_t>> docs = data::random_docs;
+    const size_t V = 5, half = docs.size() / 2;
+    for(auto layout: layouts){
+        rng_t r(99);
+        const lda::corpus all(docs);
+        lda::model_definition defn(half, V);
+        lda::state state(defn, 0.5, 0.1, 0.5, 3, all.slice(0, half), r, layout);
+        for(size_t i = 0; i < 3; ++i){
+            microscopes::kernels::lda_crp_gibbs(state, r);
+        }
+        const size_t ndishes = state.m_k.size();
+
+        const size_t first = state.add_documents(all.slice(half, docs.size()));
+        MICROSCOPES_CHECK(first == half && state.nentities() == docs.size(), "wrong document ids");
+        for(size_t i = 0; i < 2; ++i){
+            microscopes::kernels::lda_crp_gibbs_range(state, r, first, state.nentities());
+        }
+        for(size_t eid = 0; eid < docs.size(); ++eid){
+            const auto doc = state.get_entity(eid);
+            MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[eid], "wrong words");
+            for(size_t i = 0; i < docs[eid].size(); ++i){
+                MICROSCOPES_CHECK(state.table_assignment(eid, i) != 0, "word left unseated");
+            }
+        }
+        MICROSCOPES_CHECK(state.m_k.size() >= ndishes, "dish slots shrank");
+        check_statistics(state);
+
+        // Keep a window of the newest documents
+        const size_t ntokens = state.x_ji.ntokens() - state.x_ji.offset(3);
+        state.retire_documents(3);
+        MICROSCOPES_CHECK(state.nentities() == docs.size() - 3, "wrong number of documents");
+        const auto doc = state.get_entity(0);
+        MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[3], "documents not renumbered");
+        size_t seated = 0;
+        for(auto k: state.dishes()){
+            seated += state.n_k[k];
+        }
+        MICROSCOPES_CHECK(seated == ntokens, "retired words still counted");
+        check_statistics(state);
+        microscopes::kernels::lda_crp_gibbs(state, r);
+        state.add_documents(lda::corpus({docs[0]}));
+        microscopes::kernels::lda_crp_gibbs(state, r);
+        check_statistics(state);
+        state.retire_documents(state.nentities());
+        MICROSCOPES_CHECK(state.ntables() == 0 && state.ntopics() == 0, "tables left after retiring all");
+        MICROSCOPES_CHECK(state.term_frequency() == std::vector<size_t>(V, 0), "terms left after retiring all");
+    }
+}
+
+// Instrumentation: event counters agree with the seating they describe,
+// or stay zero when compiled out; the table histogram is always there
+static void
+test13(){
+    const std::vector< std::vector<size_t>> docs = data::random_docs;
+    const size_t V = 5;
+    rng_t r(7);
+    lda::model_definition defn(docs.size(), V);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    const auto &c = state.counters();
+    MICROSCOPES_CHECK(c.tables_created == 0 && c.dishes_created == 0, "initialization counted");
+
+    const size_t nsweeps = 4;
+    for(size_t i = 0; i < nsweeps; ++i){
+        microscopes::kernels::lda_crp_gibbs(state, r, i % 2 ? 2 : 1);
+    }
+    if(lda::instrumentation::enabled){
+        MICROSCOPES_CHECK(c.table_phase.calls == nsweeps && c.dish_phase.calls == nsweeps, "phases not timed");
+        MICROSCOPES_CHECK(c.table_phase.nanoseconds > 0 && c.table_phase.cycles > 0, "no time counted");
+        // Every table but the new ones of the initialization was created
+        // and counted; the same for dishes
+        size_t ntables = 0;
+        for(size_t eid = 0; eid < state.nentities(); ++eid){
+            ntables += state.ntables(eid) - 1;
+        }
+        MICROSCOPES_CHECK(c.tables_created - c.tables_deleted == ntables, "table events do not add up");
+        MICROSCOPES_CHECK(c.dishes_created >= c.dishes_deleted, "more dishes deleted than created");
+        MICROSCOPES_CHECK(c.tables_created > 0, "no tables counted");
+    } else {
+        MICROSCOPES_CHECK(c.table_phase.calls == 0 && c.tables_created == 0 && c.dishes_deleted == 0,
+            "counters not compiled out");
+    }
+    state.reset_counters();
+    MICROSCOPES_CHECK(c.table_phase.calls == 0 && c.tables_deleted == 0, "counters not reset");
+
+    const auto histogram = state.table_count_histogram();
+    std::vector<size_t> expected(histogram.size(), 0);
+    for(size_t eid = 0; eid < state.nentities(); ++eid){
+        const size_t n = state.ntables(eid) - 1;
+        MICROSCOPES_CHECK(n < expected.size(), "histogram too short");
+        expected[n] += 1;
+    }
+    MICROSCOPES_CHECK(histogram == expected, "wrong table histogram");
+    MICROSCOPES_CHECK(!histogram.empty() && histogram.back() > 0, "histogram not trimmed");
+}
+
+// Blocked dish phase: each table's posterior in a block is the exact one
+// of the table alone, and sweeps keep the counts consistent
+static void
+test14(){
+    const std::vector< std::vector<size_t>> docs = data::random_docs;
+    const size_t V = 5;
+    for(auto layout: layouts){
+        rng_t r(21);
+        lda::model_definition defn(docs.size(), V);
+        // Large alpha and gamma leave dishes with a single table
+        lda::state state(defn, 5, 0.1, 5, 4, docs, r, layout);
+        for(size_t i = 0; i < 3; ++i){
+            microscopes::kernels::lda_crp_gibbs(state, r);
+        }
+
+        microscopes::kernels::lda_crp_block::workspace ws;
+        for(size_t eid = 0; eid < state.nentities(); ++eid){
+            for(auto t: state.using_t[eid]){
+                if(t != 0)
+                    ws.tables.emplace_back(eid, t);
+            }
+        }
+        microscopes::kernels::lda_crp_block::calc_dish_posteriors(state, ws, 0, ws.tables.size(), 3);
+        workspace exact_ws;
+        size_t nemptied = 0;
+        for(size_t b = 0; b < ws.tables.size(); ++b){
+            const size_t eid = ws.tables[b].first, t = ws.tables[b].second;
+            lda::state alone(state);
+            alone.leave_from_dish(eid, t);
+            nemptied += alone.dishes().size() < state.dishes().size();
+            calc_dish_posterior_t(alone, eid, t, exact_ws);
+            const auto &p = ws.p_k[b];
+            float seen = 0;
+            for(size_t i = 0; i < alone.dishes().size(); ++i){
+                const size_t k = alone.dishes()[i];
+                MICROSCOPES_CHECK(assertAlmostEqual(p[ws.pos[k]], exact_ws.p_k[i], 1e-5),
+                    "block posterior differs from calc_dish_posterior_t");
+                seen += p[ws.pos[k]];
+            }
+            MICROSCOPES_CHECK(assertAlmostEqual(seen, 1, 1e-5), "emptied dish has mass");
+        }
+        MICROSCOPES_CHECK(nemptied > 0, "no table alone at its dish");
+
+        // The dish draws do not depend on the number of threads
+        lda::state other(state);
+        rng_t r1(5), r2(5);
+        microscopes::kernels::lda_crp_block::workspace ws1, ws2;
+        microscopes::kernels::lda_crp_block::resample_dishes(state, ws1, r1, 7, 1);
+        microscopes::kernels::lda_crp_block::resample_dishes(other, ws2, r2, 7, 3);
+        MICROSCOPES_CHECK(state.dish_assignments() == other.dish_assignments(), "draws depend on nthreads");
+        check_statistics(state);
+
+        for(size_t block_size: {size_t(1), size_t(7), size_t(1000)}){
+            for(size_t i = 0; i < 3; ++i){
+                microscopes::kernels::lda_crp_block_gibbs(state, ws, r, block_size, i + 1);
+            }
+            for(size_t eid = 0; eid < state.nentities(); ++eid){
+                for(auto t: state.using_t[eid]){
+                    MICROSCOPES_CHECK(t == 0 || state.dishes_.contains(state.dish_assignment(eid, t)),
+                        "table seated at an inactive dish");
+                }
+            }
+            check_statistics(state);
+        }
+    }
+}
+
+// The containers handed out by const reference are the state's own and
+// stay valid across calls that do not change the seating
+static void
+test15(){
+    const std::vector< std::vector<size_t>> docs = data::random_docs;
+    rng_t r(17);
+    lda::model_definition defn(docs.size(), 5);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    microscopes::kernels::lda_crp_gibbs(state, r);
+
+    const auto &dishes = state.dishes();
+    const auto &tables = state.tables(0);
+    const auto &dish_assignments = state.dish_assignments();
+    const auto dishes_copy = dishes;
+    const auto tables_copy = tables;
+    const auto dish_assignments_copy = dish_assignments;
+    const auto doc = state.get_entity(0);
+
+    state.perplexity();
+    state.score_assignment();
+    state.snapshot();
+    state.assignments();
+
+    MICROSCOPES_CHECK(&dishes == &state.dishes() && &tables == &state.tables(0) &&
+        &dish_assignments == &state.dish_assignments(), "accessors return copies");
+    MICROSCOPES_CHECK(dishes == dishes_copy && tables == tables_copy &&
+        dish_assignments == dish_assignments_copy, "references changed by a call that does not reseat");
+    MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[0], "document view changed");
+}
+
+// A sliding window of documents: the dropped prefix of the per-document
+// lists is only compacted once it outgrows the live part
+static void
+test16(){
+    lda::window_vector<size_t> w(4, 0);
+    for(size_t i = 0; i < 4; ++i){
+        w[i] = i;
+    }
+    const size_t *live = w.data();
+    w.drop_front(2);
+    MICROSCOPES_CHECK(w.size() == 2 && w[0] == 2 && w.data() == live + 2, "prefix was moved");
+    w.push_back(4);
+    w.drop_front(2);
+    MICROSCOPES_CHECK(w.size() == 1 && w[0] == 4, "compaction lost elements");
+    MICROSCOPES_CHECK(std::vector<size_t>(w) == std::vector<size_t>({4}), "wrong live elements");
+
+    const std::vector< std::vector<size_t>> docs = data::random_docs;
+    const size_t V = 5, window = 6;
+    rng_t r(21);
+    lda::model_definition defn(window, V);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3,
+        std::vector< std::vector<size_t>>(docs.begin(), docs.begin() + window), r);
+    for(size_t i = window; i < 4 * docs.size(); ++i){
+        const size_t first = state.add_documents(lda::corpus({docs[i % docs.size()]}));
+        microscopes::kernels::lda_crp_gibbs_range(state, r, first, state.nentities());
+        state.retire_documents(1);
+        MICROSCOPES_CHECK(state.nentities() == window, "window size changed");
+    }
+    for(size_t eid = 0; eid < window; ++eid){
+        const auto doc = state.get_entity(eid);
+        const size_t i = 4 * docs.size() - window + eid;
+        MICROSCOPES_CHECK(std::vector<size_t>(doc.begin(), doc.end()) == docs[i % docs.size()],
+            "wrong documents in the window");
+        for(size_t j = 0; j < doc.size(); ++j){
+            MICROSCOPES_CHECK(state.using_t[eid].contains(state.table_assignment(eid, j)),
+                "word at a table of another document");
+        }
+    }
+    check_statistics(state);
+    microscopes::kernels::lda_crp_gibbs(state, r);
+    check_statistics(state);
+}
 
 int main(void){
     test1();
@@ -519,6 +932,22 @@ int main(void){
     std::cout << "test7 passed" << std::endl;
     test8();
     std::cout << "test8 passed" << std::endl;
+    test9();
+    std::cout << "test9 passed" << std::endl;
+    test10();
+    std::cout << "test10 passed" << std::endl;
+    test11();
+    std::cout << "test11 passed" << std::endl;
+    test12();
+    std::cout << "test12 passed" << std::endl;
+    test13();
+    std::cout << "test13 passed" << std::endl;
+    test14();
+    std::cout << "test14 passed" << std::endl;
+    test15();
+    std::cout << "test15 passed" << std::endl;
+    test16();
+    std::cout << "test16 passed" << std::endl;
     return 0;
 
 }
\ No newline at end of file
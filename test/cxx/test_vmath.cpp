@@ -0,0 +1,148 @@
+#include <microscopes/lda/vmath.hpp>
+#include <microscopes/lda/model.hpp>
+#include <microscopes/lda/random_docs.hpp>
+#include <microscopes/common/random_fwd.hpp>
+#include <microscopes/common/macros.hpp>
+#include <microscopes/common/assert.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+using namespace microscopes;
+using namespace microscopes::lda;
+
+// The accuracy documented in vmath.hpp
+static const double tolerance = 5e-6;
+
+// Positive test arguments: small counts plus beta, up to large dish sizes,
+// and densely around the zeros of lgamma
+static std::vector<float>
+arguments(){
+    std::vector<float> x;
+    for(float beta: {0.001f, 0.01f, 0.1f, 0.5f, 1.0f}){
+        for(int n = 0; n < 200; ++n){
+            x.push_back(n + beta);
+        }
+    }
+    for(float v = 1e-3f; v < 1e7f; v *= 1.37f){
+        x.push_back(v);
+    }
+    for(float v = 0.5f; v < 4.0f; v += 1e-4f){
+        x.push_back(v);
+    }
+    return x;
+}
+
+static double
+lgamma_ratio(double x, double d){
+    return std::lgamma(x + d) - std::lgamma(x);
+}
+
+// Double precision reference: recurrence up to 20, then the asymptotic series
+static double
+digamma(double x){
+    double r = 0;
+    for(; x < 20; x += 1){
+        r -= 1 / x;
+    }
+    const double f = 1 / (x * x);
+    return r + std::log(x) - 0.5 / x - f * (1.0 / 12 - f * (1.0 / 120 - f * (1.0 / 252 - f / 240)));
+}
+
+static void
+check_close(double got, double expected, double tol, const char *what){
+    if(std::abs(got - expected) > tol * std::max(1.0, std::abs(expected))){
+        std::cout << what << ": got " << got << ", expected " << expected << std::endl;
+        MICROSCOPES_CHECK(false, "vectorized math is off");
+    }
+}
+
+static void
+test_isa(vmath::isa_t isa){
+    MICROSCOPES_CHECK(vmath::set_isa(isa) == isa, "isa not selected");
+    const auto x = arguments();
+
+    // Every length, so each tail size is exercised
+    for(size_t n = 0; n <= 37; ++n){
+        std::vector<float> out(n + 1, -1.0f);
+        vmath::lgamma(out.data(), x.data(), n);
+        for(size_t i = 0; i < n; ++i){
+            check_close(out[i], std::lgamma(double(x[i])), tolerance, "lgamma");
+        }
+        MICROSCOPES_CHECK(out[n] == -1.0f, "wrote past the end");
+    }
+
+    std::vector<float> out(x.size());
+    vmath::lgamma(out.data(), x.data(), x.size());
+    for(size_t i = 0; i < x.size(); ++i){
+        check_close(out[i], std::lgamma(double(x[i])), tolerance, "lgamma");
+    }
+    vmath::digamma(out.data(), x.data(), x.size());
+    for(size_t i = 0; i < x.size(); ++i){
+        check_close(out[i], digamma(x[i]), tolerance, "digamma");
+    }
+    vmath::log(out.data(), x.data(), x.size());
+    for(size_t i = 0; i < x.size(); ++i){
+        check_close(out[i], std::log(double(x[i])), tolerance, "log");
+    }
+
+    std::vector<float> y;
+    for(float v = -100.0f; v <= 0.0f; v += 0.173f){
+        y.push_back(v);
+    }
+    out.resize(y.size());
+    vmath::exp(out.data(), y.data(), y.size());
+    for(size_t i = 0; i < y.size(); ++i){
+        const double expected = y[i] < -87 ? 0 : std::exp(double(y[i]));
+        MICROSCOPES_CHECK(std::abs(out[i] - expected) <= tolerance * expected + 1e-37, "exp is off");
+    }
+
+    // In place, as calc_dish_posterior_t uses it
+    std::vector<float> acc(x.size(), 1.0f);
+    vmath::add_lgamma_ratio(acc.data(), x.data(), 3.0f, -1.0f, x.size());
+    for(size_t i = 0; i < x.size(); ++i){
+        // Both lgamma terms carry their own error, which does not cancel
+        const double tol = 2 * tolerance * std::max(1.0, std::abs(std::lgamma(x[i] + 3.0)));
+        MICROSCOPES_CHECK(std::abs(acc[i] - (1.0 - lgamma_ratio(x[i], 3.0))) <= tol,
+            "lgamma ratio is off");
+    }
+}
+
+static void
+test_lgamma_cache(){
+    std::vector< std::vector<size_t>> docs = data::random_docs;
+    size_t V = 5;
+    lda::model_definition defn(docs.size(), V);
+    microscopes::common::rng_t r(42);
+    lda::state state(defn, 0.5, 0.1, 0.5, 3, docs, r);
+    for(float beta: {0.1f, 0.25f}){
+        state.beta_ = beta;
+        const auto &words = state.lgamma_word_counts();
+        const auto &dishes = state.lgamma_dish_sizes();
+        MICROSCOPES_CHECK(words.size() == lda::state::lgamma_cache_size, "wrong cache size");
+        for(size_t n: {0, 1, 2, 17, 4095}){
+            check_close(words[n], std::lgamma(n + double(beta)), 1e-6, "cached lgamma(n + beta)");
+            check_close(dishes[n], std::lgamma(n + double(beta * V)), 1e-6, "cached lgamma(n + V beta)");
+        }
+    }
+}
+
+int main(void){
+    const auto best = vmath::best_isa();
+    for(auto isa: {vmath::isa_generic, vmath::isa_avx2, vmath::isa_avx512}){
+        if(isa > best){
+            std::cout << vmath::isa_name(isa) << " not supported, skipped" << std::endl;
+            continue;
+        }
+        test_isa(isa);
+        std::cout << "test_isa(" << vmath::isa_name(isa) << ") passed" << std::endl;
+    }
+    // Unsupported requests fall back to the best available
+    MICROSCOPES_CHECK(vmath::set_isa(vmath::isa_avx512) == best, "fallback is wrong");
+    test_lgamma_cache();
+    std::cout << "test_lgamma_cache passed" << std::endl;
+    return 0;
+}
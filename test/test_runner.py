@@ -27,6 +27,55 @@ def test_runner_specify_basic_kernel():
     r.run(prng, 1)
 
 
+def test_runner_parallel_crf():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent,
+                      runner.crf_kernel_config(defn, nthreads=2))
+    r.run(prng, 2)
+    assert latent.ntopics() > 0
+
+
+def test_runner_sparse_crf():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng,
+                              count_layout='sparse_word_major')
+    r = runner.runner(defn, data, latent,
+                      runner.crf_sparse_kernel_config(defn))
+    r.run(prng, 2)
+    assert latent.ntopics() > 0
+
+
+def test_runner_alias_crf():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent,
+                      runner.crf_alias_kernel_config(defn))
+    r.run(prng, 2)
+    assert latent.ntopics() > 0
+
+
+def test_runner_block_crf():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent,
+                      runner.crf_block_kernel_config(defn, block_size=4, nthreads=2))
+    r.run(prng, 2)
+    assert latent.ntopics() > 0
+
+
 def test_runner_specify_hp_kernels():
     N, V = 10, 20
     defn = model_definition(N, V)
@@ -73,3 +122,160 @@ def test_runner_second_dp_valid():
     assert_almost_equals(latent.beta, old_beta)
     assert_almost_equals(latent.gamma, old_gamma)
     assert latent.alpha > 0
+
+
+def test_runner_vocab_hp_valid():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    old_alpha = latent.alpha
+    old_gamma = latent.gamma
+    kernels = ['crf'] + \
+        runner.direct_vocab_hp_kernel_config(defn)
+    r = runner.runner(defn, data, latent, kernels)
+    r.run(prng, 10)
+    assert_almost_equals(latent.alpha, old_alpha)
+    assert_almost_equals(latent.gamma, old_gamma)
+    assert latent.beta > 0
+
+
+def test_runner_monitor():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent)
+    calls = []
+
+    def monitor(iteration):
+        calls.append(iteration)
+        return iteration < 4
+
+    r.set_monitor(monitor, every=2)
+    r.trace_perplexity()
+    assert r.run(prng, 10) == 4
+    assert calls == [2, 4]
+    assert r.iteration == 4
+    trace = r.perplexity_trace()
+    assert [it for it, _ in trace] == [2, 4]
+    assert_almost_equals(trace[-1][1], latent.perplexity(), places=4)
+
+
+def test_runner_monitor_raises():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent)
+
+    def monitor(iteration):
+        raise KeyError(iteration)
+
+    r.set_monitor(monitor)
+    try:
+        r.run(prng, 5)
+        assert False, "monitor exception was swallowed"
+    except KeyError:
+        pass
+    assert r.iteration == 1
+
+
+def test_runner_checkpoint():
+    import os
+    import tempfile
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent)
+    path = os.path.join(tempfile.mkdtemp(), 'state.ckpt')
+    r.set_checkpoint(path, every=2)
+    r.run(prng, 4)
+    restored = model.load_checkpoint(path)
+    assert restored.assignments() == latent.assignments()
+
+
+def test_runner_average():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    latent = model.initialize(defn, data, prng)
+    r = runner.runner(defn, data, latent)
+    average = latent.posterior_average(burnin=2, thin=2)
+    r.set_average(average)
+    r.run(prng, 6)
+    assert average.nupdates() == 6 and average.nsamples() == 2
+    phi = average.topic_word()
+    theta = average.document_topic()
+    assert phi.shape == (len(average.dishes()), V)
+    assert theta.shape == (N, len(average.dishes()))
+    for row in phi:
+        assert_almost_equals(row.sum(), 1, places=5)
+    for row in theta:
+        assert_almost_equals(row.sum(), 1, places=5)
+    r.set_average(None)
+    r.run(prng, 1)
+    assert average.nupdates() == 6
+
+
+def test_runner_threads():
+    import threading
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    kernels = ['crf'] + \
+        runner.second_dp_hp_kernel_config(defn) + \
+        runner.base_dp_hp_kernel_config(defn)
+
+    def chain(seed):
+        prng = rng(seed)
+        latent = model.initialize(defn, data, prng)
+        return runner.runner(defn, data, latent, kernels), latent, prng
+
+    expected = []
+    for seed in xrange(4):
+        r, latent, prng = chain(seed)
+        r.run(prng, 5)
+        expected.append(latent.assignments())
+
+    chains = [chain(seed) for seed in xrange(4)]
+    threads = [threading.Thread(target=r.run, args=(prng, 5))
+               for r, _, prng in chains]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    assert [latent.assignments() for _, latent, _ in chains] == expected
+
+
+def test_multi_runner():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    kernels = ['crf'] + runner.second_dp_hp_kernel_config(defn)
+    latents = model.initialize_chains(defn, data, [rng(s) for s in xrange(3)])
+    chains = runner.multi_runner(defn, data, latents, kernels)
+    assert chains.shares_corpus()
+    chains.set_trace(2)
+    rngs = [rng(10 + s) for s in xrange(3)]
+    chains.run(rngs, 4, nthreads=2)
+
+    for s in xrange(3):
+        expected = model.initialize(defn, data, rng(s))
+        runner.runner(defn, data, expected, kernels).run(rng(10 + s), 4)
+        assert latents[s].assignments() == expected.assignments()
+        assert [d['iteration'] for d in chains.trace(s)] == [2, 4]
+
+    diagnostics = chains.diagnostics()
+    assert len(diagnostics) == 3
+    for latent, d in zip(latents, diagnostics):
+        assert d['iteration'] == 4
+        assert d['ntopics'] == latent.ntopics()
+        assert_almost_equals(d['perplexity'], latent.perplexity(), places=4)
+    assert chains.potential_scale_reduction() > 0
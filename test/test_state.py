@@ -1,10 +1,18 @@
 import itertools
+import math
+import os
+import tempfile
 import pickle
 import cPickle
 
+import numpy as np
+
 from microscopes.common.rng import rng
 from microscopes.lda.definition import model_definition
-from microscopes.lda.model import initialize, deserialize
+from microscopes.lda.model import initialize, deserialize, load_checkpoint
+from microscopes.lda.model import corpus, corpus_from_arrays, inference
+from microscopes.lda.model import load_ldac, save_corpus, map_corpus
+from microscopes.lda import utils
 from microscopes.lda.testutil import toy_dataset
 
 from nose.tools import assert_equals, assert_true, raises
@@ -58,6 +66,10 @@ def test_relevance():
                             key=lambda (_, r): r,
                             reverse=True)
     assert rel[-1][0] < rel[-1][-1]
+    top = s.term_relevance_by_topic(top_n=2, nthreads=2)
+    assert [len(topic) for topic in top] == [2] * s.ntopics()
+    assert top == [topic[:2] for topic in rel]
+    assert_raises(ValueError, s.term_relevance_by_topic, 1.5)
 
 
 def test_single_dish_initialization():
@@ -112,6 +124,65 @@ def test_explicit():
         assert ta1 == ta2
 
 
+def test_scores():
+    N, V = 3, 7
+    defn = model_definition(N, V)
+    data = [[0, 1, 2, 3], [0, 1, 4], [0, 1, 5, 6]]
+    table_assignments = [[1, 2, 1, 2], [1, 1, 1], [3, 3, 3, 1]]
+    dish_assignments = [[0, 1, 2], [0, 3], [0, 1, 2, 1]]
+    s = initialize(defn, data,
+                   table_assignments=table_assignments,
+                   dish_assignments=dish_assignments)
+
+    # Table sizes 2, 2 | 3 | 1, 3 (plus an empty table); 3, 2 and 1
+    # tables at the three dishes
+    a, g = s.alpha, s.gamma
+    expected = 6 * math.log(a) + 3 * math.lgamma(a) \
+        - 2 * math.lgamma(a + 4) - math.lgamma(a + 3) \
+        + 2 * math.lgamma(2) + 2 * math.lgamma(3) + math.lgamma(1) \
+        + 3 * math.log(g) + math.lgamma(g) - math.lgamma(g + 6) \
+        + math.lgamma(3) + math.lgamma(2) + math.lgamma(1)
+    assert_almost_equals(s.score_assignment(), expected, places=3)
+
+    b = s.beta
+    expected = 0
+    for k in s.active_topics():
+        expected += math.lgamma(V * b) - math.lgamma(s.n_k(k))
+        for v in xrange(V):
+            expected += math.lgamma(s.n_kv(k, v)) - math.lgamma(b)
+    assert_almost_equals(s.score_data(), expected, places=3)
+
+
+def test_count_layouts():
+    """Dense and sparse topic-word count storage should agree
+    """
+    N, V = 3, 7
+    defn = model_definition(N, V)
+    data = [[0, 1, 2, 3], [0, 1, 4], [0, 1, 5, 6]]
+
+    table_assignments = [[1, 2, 1, 2], [1, 1, 1], [3, 3, 3, 1]]
+    dish_assignments = [[0, 1, 2], [0, 3], [0, 1, 2, 1]]
+
+    states = [initialize(defn, data,
+                         table_assignments=table_assignments,
+                         dish_assignments=dish_assignments,
+                         count_layout=layout)
+              for layout in ('sparse', 'topic_major', 'word_major',
+                             'sparse_word_major')]
+    for s in states[1:]:
+        for tid in states[0].active_topics():
+            assert_almost_equals(s.n_k(tid), states[0].n_k(tid))
+            for word_id in range(V):
+                assert_almost_equals(s.n_kv(tid, word_id),
+                                     states[0].n_kv(tid, word_id))
+    assert_raises(ValueError,
+                  initialize,
+                  defn, data,
+                  table_assignments=table_assignments,
+                  dish_assignments=dish_assignments,
+                  count_layout='bogus')
+
+
 def test_explicit_exceptions():
     """ValueError should be rasied for bad assignments
     """
@@ -160,6 +231,47 @@ def test_explicit_inception():
                     dish_assignments=s.dish_assignments())
 
 
+def test_corpus_from_arrays():
+    docs = [[0, 1, 2], [], [3, 1]]
+    c = corpus_from_arrays([0, 1, 2, 3, 1], [0, 3, 3, 5])
+    assert_equals(len(c), 3)
+    assert_equals(c.ntokens(), 5)
+    assert_equals(list(c), docs)
+    assert_equals(list(corpus(docs)), docs)
+
+    defn = model_definition(len(docs), 4)
+    prng = rng()
+    s = initialize(defn, c, prng)
+    assert_equals(s.nentities(), len(docs))
+    assert_equals(map(len, s.table_assignments()), map(len, docs))
+
+    assert_raises(ValueError, corpus_from_arrays, [0, 1], [0, 3])
+    assert_raises(ValueError, corpus_from_arrays, [0, 1], [0, 2, 1])
+    assert_raises(ValueError, initialize, model_definition(1, 2),
+                  corpus_from_arrays([0, 2], [0, 2]), prng)
+
+
+def test_corpus_files():
+    test_dir = os.path.dirname(__file__)
+    ldac_fn = os.path.join(test_dir, 'data', 'reuters.ldac')
+    with open(ldac_fn, 'r') as f:
+        docs = utils.docs_from_ldac(f)
+    c = load_ldac(ldac_fn)
+    assert_equals(list(c), docs)
+
+    fd, bin_fn = tempfile.mkstemp()
+    os.close(fd)
+    try:
+        save_corpus(c, bin_fn)
+        mapped = map_corpus(bin_fn)
+        assert_equals(list(mapped), docs)
+        defn = model_definition(len(docs), mapped.max_word() + 1)
+        s = initialize(defn, mapped, rng())
+        assert_equals(s.nentities(), len(docs))
+    finally:
+        os.remove(bin_fn)
+
+
 def test_serialize_simple():
     docs = [list('abcd'), list('cdef')]
     defn = model_definition(len(docs), v=6)
@@ -192,6 +304,208 @@ def test_serialize_pickle():
     assert s2.__class__ == s.__class__
 
 
+def test_checkpoint():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng, vocab_lookup={i: i for i in xrange(V)})
+    fd, fn = tempfile.mkstemp()
+    os.close(fd)
+    try:
+        for include_corpus in (True, False):
+            s.save_checkpoint(fn, include_corpus=include_corpus)
+            docs = None if include_corpus else data
+            s2 = load_checkpoint(defn, fn, data=docs)
+            assert_equals(s2.table_assignments(), s.table_assignments())
+            assert_equals(s2.dish_assignments(), s.dish_assignments())
+            assert_equals(s2.beta, s.beta)
+            assert_almost_equals(s2.perplexity(), s.perplexity(), places=4)
+        assert_raises(ValueError, load_checkpoint, model_definition(N + 1, V), fn, data)
+    finally:
+        os.remove(fn)
+
+
+def test_inference():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng, vocab_lookup={i: i for i in xrange(V)})
+    model = inference(s)
+    assert_equals(model.ntopics(), s.ntopics())
+    assert_equals(model.prior, s.beta)
+
+    theta = model.predict(data)
+    assert_equals(theta.shape, (N, s.ntopics()))
+    for row in theta:
+        assert_almost_equals(row.sum(), 1, places=5)
+    # The same documents as a corpus, one document, and unknown words
+    assert_true((model.predict(corpus(data)) == theta).all())
+    assert_true((model.predict(data[0]) == theta[:1]).all())
+    assert_true((model.predict([data[0] + ['unknown']]) == theta[:1]).all())
+    assert_equals(len(s.predict(data)), N)
+
+    # Batch scoring into a caller's buffer
+    out = np.zeros((N, s.ntopics()), dtype=np.float32)
+    assert_true(model.predict(corpus(data), out=out, nthreads=3) is out)
+    assert_true((out == theta).all())
+    assert_raises(ValueError, model.predict, data, out=out[:1])
+
+
+def test_snapshot():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng, vocab_lookup={i: i for i in xrange(V)})
+    snap = s.snapshot()
+    phi = snap.topic_word()
+    theta = snap.document_topic()
+    assert_equals(phi.shape, (s.ntopics(), V))
+    assert_equals(theta.shape, (N, s.ntopics()))
+    for row in phi:
+        assert_almost_equals(row.sum(), 1, places=5)
+    for row in theta:
+        assert_almost_equals(row.sum(), 1, places=5)
+    for k, dist in enumerate(s.word_distribution_by_topic()):
+        for v in xrange(V):
+            assert_almost_equals(dist[v], phi[k, v], places=6)
+
+    # Inference objects can share one snapshot
+    model = inference(snap)
+    assert_equals(model.prior, s.beta)
+    assert_true((model.predict(data) == inference(s).predict(data)).all())
+
+
+def test_array_views():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng, vocab_lookup={i: i for i in xrange(V)})
+    seating = s.seating()
+    offsets = seating.token_offsets()
+    tables = seating.tables()
+    dishes = seating.dishes()
+    table_offsets = seating.table_offsets()
+    assert_equals(len(offsets), N + 1)
+    for eid in xrange(N):
+        first, last = offsets[eid], offsets[eid + 1]
+        assert_equals(tables[first:last].tolist(), s.table_assignments()[eid])
+        assert_equals(dishes[first:last].tolist(), s.assignments()[eid])
+        first, last = table_offsets[eid], table_offsets[eid + 1]
+        assert_equals(seating.table_dishes()[first:last].tolist(), s.dish_assignments()[eid])
+    assert_raises(ValueError, tables.__setitem__, 0, 1)
+
+    # The views outlive the objects they came from
+    phi = s.topic_term_matrix()
+    theta = s.document_topic_matrix()
+    del seating
+    assert_equals(phi.shape, (s.ntopics(), V))
+    assert_equals(theta.shape, (N, s.ntopics()))
+    for k, dist in enumerate(s.word_distribution_by_topic()):
+        for v in xrange(V):
+            assert_almost_equals(dist[v], phi[k, v], places=6)
+    assert_true(np.allclose(np.ascontiguousarray(phi).sum(axis=1), 1, atol=1e-5))
+    assert_true(np.allclose(theta, s.topic_distribution_by_document(), atol=1e-6))
+
+
+def test_posterior_average():
+    from microscopes.lda.kernels import lda_crp_gibbs
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng, vocab_lookup={i: i for i in xrange(V)})
+    average = s.posterior_average()
+    assert_equals(average.topic_word().shape, (0, V))
+    average.update()
+    snap = s.snapshot()
+    # One sample averages to the snapshot, topics in dish id order
+    order = np.argsort(s.active_topics())
+    assert_true(np.allclose(average.topic_word(), snap.topic_word()[order], atol=1e-6))
+    assert_true(np.allclose(average.document_topic(), snap.document_topic()[:, order], atol=1e-6))
+
+    lda_crp_gibbs(s, prng)
+    average.update()
+    assert_equals(average.nsamples(), 2)
+    for row in average.document_topic():
+        assert_almost_equals(row.sum(), 1, places=5)
+    average.reset()
+    assert_equals(average.nsamples(), 0)
+    assert_raises(ValueError, s.posterior_average, 0, 0)
+
+
+def test_perplexity():
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng, vocab_lookup={i: i for i in xrange(V)})
+    ll = s.log_likelihood()
+    ntokens = sum(len(doc) for doc in data)
+    assert_almost_equals(s.perplexity(), np.exp(-ll / ntokens), places=4)
+    assert_equals(s.log_likelihood(nthreads=3), ll)
+    assert_almost_equals(s.log_likelihood([0, 2]),
+                         s.log_likelihood([0]) + s.log_likelihood([2]), places=4)
+    assert_raises(ValueError, s.perplexity, None, 0)
+
+    # Held-out documents are folded in first
+    assert_true(inference(s).perplexity(data, nthreads=2) > 0)
+
+
+def test_instrumentation():
+    from microscopes.lda.kernels import lda_crp_gibbs
+    N, V = 10, 20
+    defn = model_definition(N, V)
+    data = toy_dataset(defn)
+    prng = rng()
+    s = initialize(defn, data, prng)
+    for _ in xrange(3):
+        lda_crp_gibbs(s, prng)
+    stats = s.instrumentation()
+    calls = stats['table_phase']['calls']
+    if stats['enabled']:
+        assert_equals(calls, 3)
+        assert_true(stats['tables_created'] >= stats['tables_deleted'])
+    else:
+        assert_equals(calls, 0)
+        assert_equals(stats['tables_created'], 0)
+    hist = stats['table_count_histogram']
+    assert_equals(sum(hist), N)
+    s.reset_instrumentation()
+    assert_equals(s.instrumentation()['dish_phase']['calls'], 0)
+
+
+def test_add_documents():
+    from microscopes.lda.kernels import lda_crp_gibbs, lda_crp_gibbs_range
+    docs = [list('abcd'), list('cdef'), list('abef'), list('fedc')]
+    defn = model_definition(2, 6)
+    prng = rng(12)
+    s = initialize(defn, docs[:2], prng)
+    lda_crp_gibbs(s, prng)
+
+    ids = s.add_documents(docs[2:])
+    assert_equals(list(ids), [2, 3])
+    assert_equals(s.nentities(), 4)
+    lda_crp_gibbs_range(s, prng, ids[0], s.nentities())
+    assert_true(all(t != 0 for doc in s.table_assignments() for t in doc))
+    assert_raises(ValueError, s.add_documents, [list('xyz')])
+
+    tf = s.term_frequency()
+    assert_equals(tf.sum(), sum(len(doc) for doc in docs))
+    s.retire_documents(3)
+    assert_equals(s.nentities(), 1)
+    assert_equals(sorted(s._vocab[w] for w in np.flatnonzero(s.term_frequency())),
+                  sorted(set(docs[3])))
+    assert_equals([s._vocab[w] for w in s._data[0]], docs[3])
+    seated = sum(s.n_k(k) - s.nwords() * s.beta for k in s.active_topics())
+    assert_almost_equals(seated, len(docs[3]), places=3)
+    # Pickling goes through the documents that are left
+    assert_equals(pickle.loads(pickle.dumps(s)).nentities(), 1)
+
+
 @raises(ValueError)
 def test_cant_serialize():
     N, V = 10, 20